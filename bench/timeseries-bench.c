@@ -0,0 +1,632 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timeseries.h"
+#include "timeseries_backend_int.h"
+
+/** @file
+ *
+ * @brief Micro-benchmarks for the Key Package API and the backends
+ *
+ * For each backend and number of keys, a fresh process (so that the peak RSS
+ * belongs to that run alone) creates a Key Package and times adding, looking
+ * up, setting and flushing every key, and resolving every key with the
+ * backend. For each operation, the time and number of allocations per key,
+ * and the peak RSS of the process are printed.
+ */
+
+/** Arguments for the backends that are benchmarked if none are given (every
+    other compiled-in backend is benchmarked without arguments, if it can be
+    enabled that way) */
+static const char *default_backend_args[] = {
+  "ascii -f /dev/null",
+};
+
+/** The default smallest number of keys to benchmark with */
+#define DEFAULT_MIN_KEYS 1000
+
+/** The default largest number of keys to benchmark with */
+#define DEFAULT_MAX_KEYS 100000000
+
+/** The default minimum number of operations to time for repeatable
+    operations */
+#define DEFAULT_MIN_OPS 1000000
+
+/** The most backends that can be benchmarked in one run */
+#define MAX_BACKENDS 16
+
+/** The prefix of each generated key */
+#define KEY_PREFIX "bench.key."
+
+/** The number of digits in the numeric part of each generated key */
+#define KEY_DIGITS 10
+
+/** The number of keys resolved in each call to resolve_key_bulk */
+#define RESOLVE_BATCH 1000
+
+/** Holds the state for one benchmark run */
+typedef struct bench {
+  /** libtimeseries instance (with a single backend enabled) */
+  timeseries_t *timeseries;
+
+  /** The backend being benchmarked */
+  timeseries_backend_t *backend;
+
+  /** The Key Package being benchmarked */
+  timeseries_kp_t *kp;
+
+  /** The number of keys to benchmark with */
+  uint32_t keys_cnt;
+
+  /** The minimum number of operations to time */
+  uint64_t min_ops;
+
+  /** The current generated key */
+  char key[sizeof(KEY_PREFIX) + KEY_DIGITS];
+
+} bench_t;
+
+/** Signature of a benchmarked operation
+ *
+ * @param bench         Pointer to the benchmark state
+ * @param[out] ns       Set to the number of nanoseconds spent in the operation
+ * @return the number of operations timed, 0 if an error occurred
+ */
+typedef uint64_t(bench_op_func_t)(bench_t *bench, uint64_t *ns);
+
+#ifdef __GLIBC__
+/* Count allocations by wrapping the glibc allocator (the library and backends
+   call these rather than their own copies). glibc requires a replacement
+   allocator to provide every allocation function (and free), so all of them
+   are wrapped, even though only the allocating ones are counted. */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *ptr);
+
+/** The number of allocations made by this process */
+static uint64_t alloc_cnt = 0;
+
+void *malloc(size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  if ((ptr = __libc_memalign(alignment, size)) == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void *valloc(size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+  __atomic_add_fetch(&alloc_cnt, 1, __ATOMIC_RELAXED);
+  return __libc_pvalloc(size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+#define ALLOC_CNT() (__atomic_load_n(&alloc_cnt, __ATOMIC_RELAXED))
+#else
+#define ALLOC_CNT() (0)
+#endif
+
+/** Get the current (monotonic) time in nanoseconds */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Get the peak RSS of this process in KiB */
+static long peak_rss_kb(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    return -1;
+  }
+  return ru.ru_maxrss;
+}
+
+/** Set the current key to the first generated key */
+static void key_reset(bench_t *bench)
+{
+  memcpy(bench->key, KEY_PREFIX, sizeof(KEY_PREFIX) - 1);
+  memset(bench->key + sizeof(KEY_PREFIX) - 1, '0', KEY_DIGITS);
+  bench->key[sizeof(KEY_PREFIX) - 1 + KEY_DIGITS] = '\0';
+}
+
+/** Advance the current key to the next generated key (in place, so that
+    generating keys costs almost nothing) */
+static void key_next(bench_t *bench)
+{
+  char *c = bench->key + sizeof(KEY_PREFIX) - 2 + KEY_DIGITS;
+  while (*c == '9') {
+    *c-- = '0';
+  }
+  (*c)++;
+}
+
+/** Get the number of rounds needed to time at least min_ops operations */
+static uint64_t rounds(bench_t *bench)
+{
+  return (bench->min_ops + bench->keys_cnt - 1) / bench->keys_cnt;
+}
+
+static uint64_t bench_add_key(bench_t *bench, uint64_t *ns)
+{
+  uint64_t start;
+  uint32_t i;
+
+  key_reset(bench);
+  start = now_ns();
+  for (i = 0; i < bench->keys_cnt; i++) {
+    if ((uint32_t)timeseries_kp_add_key(bench->kp, bench->key) != i) {
+      fprintf(stderr, "ERROR: Could not add key %s\n", bench->key);
+      return 0;
+    }
+    key_next(bench);
+  }
+  *ns = now_ns() - start;
+  return bench->keys_cnt;
+}
+
+static uint64_t bench_get_key(bench_t *bench, uint64_t *ns)
+{
+  uint64_t start;
+  uint64_t r, rounds_cnt = rounds(bench);
+  uint32_t i;
+
+  start = now_ns();
+  for (r = 0; r < rounds_cnt; r++) {
+    key_reset(bench);
+    for (i = 0; i < bench->keys_cnt; i++) {
+      if ((uint32_t)timeseries_kp_get_key(bench->kp, bench->key) != i) {
+        fprintf(stderr, "ERROR: Could not find key %s\n", bench->key);
+        return 0;
+      }
+      key_next(bench);
+    }
+  }
+  *ns = now_ns() - start;
+  return rounds_cnt * bench->keys_cnt;
+}
+
+static uint64_t bench_set(bench_t *bench, uint64_t *ns)
+{
+  uint64_t start;
+  uint64_t r, rounds_cnt = rounds(bench);
+  uint32_t i;
+
+  start = now_ns();
+  for (r = 0; r < rounds_cnt; r++) {
+    for (i = 0; i < bench->keys_cnt; i++) {
+      timeseries_kp_set(bench->kp, i, r + i);
+    }
+  }
+  *ns = now_ns() - start;
+  return rounds_cnt * bench->keys_cnt;
+}
+
+static uint64_t bench_flush(bench_t *bench, uint64_t *ns)
+{
+  uint64_t start;
+  uint64_t r, rounds_cnt = rounds(bench);
+  uint32_t i;
+
+  /* only the flush itself is timed, not setting the values */
+  *ns = 0;
+  for (r = 0; r < rounds_cnt; r++) {
+    for (i = 0; i < bench->keys_cnt; i++) {
+      timeseries_kp_set(bench->kp, i, r + i);
+    }
+    start = now_ns();
+    if (timeseries_kp_flush(bench->kp, r * 60) != 0) {
+      fprintf(stderr, "ERROR: Could not flush Key Package\n");
+      return 0;
+    }
+    *ns += now_ns() - start;
+  }
+  return rounds_cnt * bench->keys_cnt;
+}
+
+static uint64_t bench_resolve_key_bulk(bench_t *bench, uint64_t *ns)
+{
+  char *key_buf = NULL;
+  const char *keys[RESOLVE_BATCH];
+  uint8_t *backend_keys[RESOLVE_BATCH];
+  size_t backend_key_lens[RESOLVE_BATCH];
+  int contig_alloc;
+  uint64_t start;
+  uint32_t i, j, cnt;
+  uint64_t ops = 0;
+
+  if ((key_buf = malloc(sizeof(bench->key) * RESOLVE_BATCH)) == NULL) {
+    goto done;
+  }
+
+  /* only resolving the keys is timed, not generating or freeing them */
+  *ns = 0;
+  key_reset(bench);
+  for (i = 0; i < bench->keys_cnt; i += cnt) {
+    cnt = bench->keys_cnt - i;
+    if (cnt > RESOLVE_BATCH) {
+      cnt = RESOLVE_BATCH;
+    }
+    for (j = 0; j < cnt; j++) {
+      memcpy(key_buf + (sizeof(bench->key) * j), bench->key,
+             sizeof(bench->key));
+      keys[j] = key_buf + (sizeof(bench->key) * j);
+      key_next(bench);
+    }
+
+    start = now_ns();
+    if (bench->backend->resolve_key_bulk(bench->backend, cnt, keys,
+                                         backend_keys, backend_key_lens,
+                                         &contig_alloc) != 0) {
+      fprintf(stderr, "ERROR: Could not resolve keys\n");
+      goto done;
+    }
+    *ns += now_ns() - start;
+
+    if (contig_alloc != 0) {
+      free(backend_keys[0]);
+    } else {
+      for (j = 0; j < cnt; j++) {
+        free(backend_keys[j]);
+      }
+    }
+  }
+  ops = bench->keys_cnt;
+
+done:
+  free(key_buf);
+  return ops;
+}
+
+/** The operations to benchmark, in the order they are run */
+static const struct {
+  const char *name;
+  bench_op_func_t *func;
+} bench_ops[] = {
+  {"kp_add_key", bench_add_key},
+  {"kp_get_key", bench_get_key},
+  {"kp_set", bench_set},
+  {"kp_flush", bench_flush},
+  {"resolve_key_bulk", bench_resolve_key_bulk},
+};
+
+/** Enable the given backend ("<name> [<args>]") */
+static timeseries_backend_t *enable_backend(timeseries_t *timeseries,
+                                            const char *backend_str)
+{
+  timeseries_backend_t *backend = NULL;
+  char *name = NULL;
+  char *args;
+
+  if ((name = strdup(backend_str)) == NULL) {
+    goto err;
+  }
+  if ((args = strchr(name, ' ')) != NULL) {
+    *args = '\0';
+    args++;
+  }
+
+  if ((backend = timeseries_get_backend_by_name(timeseries, name)) == NULL) {
+    fprintf(stderr, "ERROR: Invalid backend name (%s)\n", name);
+    goto err;
+  }
+  if (timeseries_enable_backend(backend, args) != 0) {
+    fprintf(stderr, "ERROR: Failed to initialize backend (%s)\n", name);
+    goto err;
+  }
+
+  free(name);
+  return backend;
+
+err:
+  free(name);
+  return NULL;
+}
+
+/** Run every benchmark for the given backend and number of keys */
+static int run(const char *backend_str, uint32_t keys_cnt, uint64_t min_ops)
+{
+  bench_t bench;
+  uint64_t ns = 0, ops, allocs;
+  size_t i;
+  int rc = -1;
+
+  memset(&bench, 0, sizeof(bench));
+  bench.keys_cnt = keys_cnt;
+  bench.min_ops = min_ops;
+
+  if ((bench.timeseries = timeseries_init()) == NULL) {
+    fprintf(stderr, "ERROR: Could not initialize libtimeseries\n");
+    goto done;
+  }
+  if ((bench.backend = enable_backend(bench.timeseries, backend_str)) ==
+      NULL) {
+    goto done;
+  }
+  if ((bench.kp = timeseries_kp_init(bench.timeseries,
+                                     TIMESERIES_KP_RESET)) == NULL) {
+    fprintf(stderr, "ERROR: Could not create Key Package\n");
+    goto done;
+  }
+
+  for (i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++) {
+    allocs = ALLOC_CNT();
+    if ((ops = bench_ops[i].func(&bench, &ns)) == 0) {
+      goto done;
+    }
+    allocs = ALLOC_CNT() - allocs;
+    printf("%-10s %10" PRIu32 " %-18s %10.1f %10.3f %10ld\n",
+           timeseries_backend_get_name(bench.backend), keys_cnt,
+           bench_ops[i].name, (double)ns / ops, (double)allocs / ops,
+           peak_rss_kb());
+    fflush(stdout);
+  }
+
+  rc = 0;
+
+done:
+  timeseries_kp_free(&bench.kp);
+  timeseries_free(&bench.timeseries);
+  return rc;
+}
+
+/** Add every compiled-in backend that can be enabled with its default
+    arguments to the list of backends to benchmark */
+static int add_default_backends(const char **backends, int *backends_cnt)
+{
+  timeseries_t *timeseries;
+  timeseries_backend_t **all;
+  const char *name;
+  const char *backend_str;
+  size_t j;
+  int i;
+
+  if ((timeseries = timeseries_init()) == NULL) {
+    fprintf(stderr, "ERROR: Could not initialize libtimeseries\n");
+    return -1;
+  }
+  all = timeseries_get_all_backends(timeseries);
+
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (all[i] == NULL) {
+      continue;
+    }
+    backend_str = name = timeseries_backend_get_name(all[i]);
+    for (j = 0; j < sizeof(default_backend_args) /
+                      sizeof(default_backend_args[0]); j++) {
+      if (strncmp(default_backend_args[j], name, strlen(name)) == 0 &&
+          default_backend_args[j][strlen(name)] == ' ') {
+        backend_str = default_backend_args[j];
+      }
+    }
+    if (enable_backend(timeseries, backend_str) == NULL) {
+      fprintf(stderr, "WARN: Skipping %s backend (use -b to give its "
+                      "arguments)\n",
+              name);
+      continue;
+    }
+    backends[(*backends_cnt)++] = backend_str;
+  }
+
+  timeseries_free(&timeseries);
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(
+    stderr,
+    "usage: %s [<options>]\n"
+    "       -b <ts-backend>    Backend (and arguments) to benchmark (may be\n"
+    "                          repeated, default: every compiled-in\n"
+    "                          backend that needs no arguments)\n"
+    "       -m <min-keys>      Smallest number of keys to use (default: %d)\n"
+    "       -n <max-keys>      Largest number of keys to use (default: %d)\n"
+    "       -o <ops>           Minimum number of operations to time for\n"
+    "                          each repeatable operation (default: %d)\n"
+    "The number of keys is multiplied by 10 from min-keys to max-keys.\n"
+#ifndef __GLIBC__
+    "Allocations are only counted when built with glibc.\n"
+#endif
+    ,
+    name, DEFAULT_MIN_KEYS, DEFAULT_MAX_KEYS, DEFAULT_MIN_OPS);
+}
+
+int main(int argc, char **argv)
+{
+  /* for option parsing */
+  int opt;
+  int prevoptind;
+
+  /* to store command line argument values */
+  const char *backends[MAX_BACKENDS];
+  int backends_cnt = 0;
+  uint64_t min_keys = DEFAULT_MIN_KEYS;
+  uint64_t max_keys = DEFAULT_MAX_KEYS;
+  uint64_t min_ops = DEFAULT_MIN_OPS;
+
+  uint64_t keys_cnt;
+  pid_t pid;
+  int status;
+  int i;
+
+  while (prevoptind = optind, (opt = getopt(argc, argv, ":b:m:n:o:?")) >= 0) {
+    if (optind == prevoptind + 2 && (optarg == NULL || *optarg == '-')) {
+      opt = ':';
+      --optind;
+    }
+    switch (opt) {
+    case ':':
+      fprintf(stderr, "ERROR: Missing option argument for -%c\n", optopt);
+      usage(argv[0]);
+      return -1;
+      break;
+
+    case 'b':
+      if (backends_cnt >= MAX_BACKENDS) {
+        fprintf(stderr, "ERROR: At most %d backends can be benchmarked\n",
+                MAX_BACKENDS);
+        usage(argv[0]);
+        return -1;
+      }
+      backends[backends_cnt++] = optarg;
+      break;
+
+    case 'm':
+      min_keys = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'n':
+      max_keys = strtoull(optarg, NULL, 10);
+      break;
+
+    case 'o':
+      min_ops = strtoull(optarg, NULL, 10);
+      break;
+
+    case '?':
+      usage(argv[0]);
+      return 0;
+      break;
+
+    default:
+      usage(argv[0]);
+      return -1;
+      break;
+    }
+  }
+
+  if (min_keys == 0 || min_keys > max_keys || max_keys > UINT32_MAX) {
+    fprintf(stderr, "ERROR: Invalid number of keys (%" PRIu64 "-%" PRIu64
+                    ")\n",
+            min_keys, max_keys);
+    usage(argv[0]);
+    return -1;
+  }
+
+  if (backends_cnt == 0 && add_default_backends(backends, &backends_cnt) != 0) {
+    return -1;
+  }
+
+  printf("%-10s %10s %-18s %10s %10s %10s\n", "backend", "keys", "op",
+         "ns/op", "allocs/op", "rss-kb");
+  fflush(stdout);
+
+  for (i = 0; i < backends_cnt; i++) {
+    for (keys_cnt = min_keys; keys_cnt <= max_keys; keys_cnt *= 10) {
+      /* run each benchmark in its own process, so that the peak RSS (and
+         the state of the allocator) is not affected by earlier runs */
+      if ((pid = fork()) < 0) {
+        fprintf(stderr, "ERROR: Could not fork benchmark process\n");
+        return -1;
+      }
+      if (pid == 0) {
+        exit(run(backends[i], keys_cnt, min_ops) == 0 ? 0 : 1);
+      }
+      if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+          WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: Benchmark failed (%s, %" PRIu64 " keys)\n",
+                backends[i], keys_cnt);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -82,6 +82,10 @@ typedef struct timeseries_backend_ascii_state {
 
 } timeseries_backend_ascii_state_t;
 
+/** Write a span of the changed keys of a KP (registered as kp_flush_span) */
+static int kp_flush_span(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                         const timeseries_kp_span_t *span, uint32_t time);
+
 /** Print usage information to stderr */
 static void usage(timeseries_backend_t *backend)
 {
@@ -149,6 +153,9 @@ int timeseries_backend_ascii_init(timeseries_backend_t *backend, int argc,
   /* set initial default values (that can be overridden on the command line) */
   state->compress_level = DEFAULT_COMPRESS_LEVEL;
 
+  /* ask to be given KPs a span at a time */
+  timeseries_backend_register_kp_flush_span(backend, kp_flush_span);
+
   /* parse the command line args */
   if (parse_args(backend, argc, argv) != 0) {
     return -1;
@@ -206,41 +213,69 @@ void timeseries_backend_ascii_kp_free(timeseries_backend_t *backend,
 }
 
 int timeseries_backend_ascii_kp_ki_update(timeseries_backend_t *backend,
-                                          timeseries_kp_t *kp)
+                                          timeseries_kp_t *kp,
+                                          uint32_t first_id, uint32_t cnt)
 {
   /* we don't need to do anything */
   return 0;
 }
 
-void timeseries_backend_ascii_kp_ki_free(timeseries_backend_t *backend,
-                                         timeseries_kp_t *kp,
-                                         timeseries_kp_ki_t *ki, void *ki_state)
+int timeseries_backend_ascii_kp_ki_compact(timeseries_backend_t *backend,
+                                           timeseries_kp_t *kp,
+                                           const uint32_t *remap,
+                                           uint32_t old_cnt)
 {
-  /* we did not allocate any state */
-  assert(ki_state == NULL);
-  return;
+  /* all our per-key state lives in the KP */
+  return 0;
+}
+
+ssize_t timeseries_backend_ascii_kp_ki_save(timeseries_backend_t *backend,
+                                            timeseries_kp_t *kp, uint32_t id,
+                                            uint8_t *buf, size_t len)
+{
+  /* we have no per-key state */
+  return 0;
 }
 
-#define PRINT_METRIC(func, file, key, value, time)                             \
+int timeseries_backend_ascii_kp_ki_load(timeseries_backend_t *backend,
+                                        timeseries_kp_t *kp, uint32_t id,
+                                        const uint8_t *buf, size_t len)
+{
+  /* we never save any state, so this is never called */
+  return -1;
+}
+
+#define PRINT_METRIC(func, file, fmt, key, value, time)                        \
   do {                                                                         \
-    func(file, "%s %" PRIu64 " %s\n", key, value, time);                       \
+    func(file, "%s %" fmt " %s\n", key, value, time);                          \
   } while (0)
 
-#define DUMP_METRIC(state, key, value, time)                                   \
+#define DUMP_METRIC_FMT(state, fmt, key, value, time)                          \
   do {                                                                         \
     if (state->outfile != NULL) {                                              \
-      PRINT_METRIC(wandio_printf, state->outfile, key, value, time);           \
+      PRINT_METRIC(wandio_printf, state->outfile, fmt, key, value, time);      \
     } else {                                                                   \
-      PRINT_METRIC(fprintf, stdout, key, value, time);                         \
+      PRINT_METRIC(fprintf, stdout, fmt, key, value, time);                    \
     }                                                                          \
   } while (0)
 
-int timeseries_backend_ascii_kp_flush(timeseries_backend_t *backend,
-                                      timeseries_kp_t *kp, uint32_t time)
+#define DUMP_METRIC(state, key, value, time)                                   \
+  DUMP_METRIC_FMT(state, PRIu64, key, value, time)
+
+/* dump all KIs in a span, using the given value type */
+#define DUMP_SPAN(state, span, i, fmt, ctype, time)                            \
+  do {                                                                         \
+    for (i = 0; i < (span)->cnt; i++) {                                        \
+      DUMP_METRIC_FMT(state, fmt, (span)->keys[i],                             \
+                      ((const ctype *)(span)->values)[i], time);               \
+    }                                                                          \
+  } while (0)
+
+static int kp_flush_span(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                         const timeseries_kp_span_t *span, uint32_t time)
 {
   timeseries_backend_ascii_state_t *state = STATE(backend);
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
+  uint32_t i;
 
   /* there are at most 10 digits in a 32bit unix time value, plus the nul */
   char time_buffer[11];
@@ -248,17 +283,31 @@ int timeseries_backend_ascii_kp_flush(timeseries_backend_t *backend,
   /* we really only need to convert the time value to a string once */
   snprintf(time_buffer, 11, "%" PRIu32, time);
 
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
-  {
-    if (timeseries_kp_ki_enabled(ki) != 0) {
-      DUMP_METRIC(state, timeseries_kp_ki_get_key(ki),
-                  timeseries_kp_ki_get_value(ki), time_buffer);
-    }
+  switch (timeseries_kp_get_value_type(kp)) {
+  case TIMESERIES_KP_VALUE_U64:
+    DUMP_SPAN(state, span, i, PRIu64, uint64_t, time_buffer);
+    break;
+  case TIMESERIES_KP_VALUE_U32:
+    DUMP_SPAN(state, span, i, PRIu32, uint32_t, time_buffer);
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    DUMP_SPAN(state, span, i, PRId64, int64_t, time_buffer);
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    DUMP_SPAN(state, span, i, ".15g", double, time_buffer);
+    break;
   }
 
   return 0;
 }
 
+int timeseries_backend_ascii_kp_flush(timeseries_backend_t *backend,
+                                      timeseries_kp_t *kp, uint32_t time)
+{
+  /* we write KPs a span at a time */
+  return timeseries_kp_flush_spans(kp, backend, time);
+}
+
 int timeseries_backend_ascii_set_single(timeseries_backend_t *backend,
                                         const char *key, uint64_t value,
                                         uint32_t time)
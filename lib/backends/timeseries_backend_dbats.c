@@ -89,6 +89,21 @@ typedef struct timeseries_backend_dbats_state {
 
 } timeseries_backend_dbats_state_t;
 
+/** Holds the state for a key in a KP (which the KP holds inline) */
+typedef struct dbats_ki_state {
+  /** The DBATS ID of the key */
+  uint32_t dbats_id;
+
+  /** Has the key been resolved (i.e. is dbats_id set)? */
+  uint32_t resolved;
+
+} dbats_ki_state_t;
+
+/** Get the state of the given key in the given KP */
+#define KI_STATE(kp, id)                                                       \
+  ((dbats_ki_state_t *)timeseries_kp_ki_get_backend_state(                     \
+    kp, id, TIMESERIES_BACKEND_ID_DBATS))
+
 /** Print usage information to stderr */
 static void usage(timeseries_backend_t *backend)
 {
@@ -177,6 +192,9 @@ int timeseries_backend_dbats_init(timeseries_backend_t *backend, int argc,
   }
   timeseries_backend_register_state(backend, state);
 
+  /* KPs hold the DBATS ID of each key for us */
+  timeseries_backend_register_ki_state_size(backend, sizeof(dbats_ki_state_t));
+
   /* parse the command line args */
   if (parse_args(backend, argc, argv) != 0) {
     return -1;
@@ -235,6 +253,17 @@ void timeseries_backend_dbats_free(timeseries_backend_t *backend)
 int timeseries_backend_dbats_kp_init(timeseries_backend_t *backend,
                                      timeseries_kp_t *kp, void **kp_state_p)
 {
+  /* our database stores unsigned 64 bit values, so 32 bit values are widened
+     on flush, but signed and floating point values cannot be stored */
+  switch (timeseries_kp_get_value_type(kp)) {
+  case TIMESERIES_KP_VALUE_U64:
+  case TIMESERIES_KP_VALUE_U32:
+    break;
+  default:
+    timeseries_log(__func__, "only unsigned integer values are supported");
+    return -1;
+  }
+
   /* we do not need any state */
   assert(kp_state_p != NULL);
   *kp_state_p = NULL;
@@ -250,49 +279,145 @@ void timeseries_backend_dbats_kp_free(timeseries_backend_t *backend,
 }
 
 int timeseries_backend_dbats_kp_ki_update(timeseries_backend_t *backend,
-                                          timeseries_kp_t *kp)
+                                          timeseries_kp_t *kp,
+                                          uint32_t first_id, uint32_t cnt)
 {
-  timeseries_backend_dbats_state_t *state = STATE(backend);
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
-  uint32_t *dbats_id;
+  uint32_t id;
+  dbats_ki_state_t *ki_state;
+  const char **keys = NULL;
+  const char *key;
+  char *key_buf = NULL;
+  size_t key_buf_len = 0;
+  size_t key_buf_alloc = 0;
+  size_t *key_offsets = NULL;
+  size_t key_len;
+  void *tmp;
+  uint32_t *ids = NULL;
+  uint8_t **backend_keys = NULL;
+  size_t *backend_key_lens = NULL;
+  int contig_alloc = 0;
+  uint32_t keys_cnt = 0;
+  uint32_t i;
+  int rc = -1;
+
+  if ((keys = malloc(sizeof(char *) * cnt)) == NULL ||
+      (key_offsets = malloc(sizeof(size_t) * cnt)) == NULL ||
+      (ids = malloc(sizeof(uint32_t) * cnt)) == NULL ||
+      (backend_keys = malloc_zero(sizeof(uint8_t *) * cnt)) == NULL ||
+      (backend_key_lens = malloc(sizeof(size_t) * cnt)) == NULL) {
+    timeseries_log(__func__, "Could not allocate key lookup arrays");
+    goto done;
+  }
 
-  /* foreach KI, if the backend state is null, get the key id */
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
-  {
-    if (timeseries_kp_ki_enabled(ki) == 0 ||
-        timeseries_kp_ki_get_backend_state(ki, TIMESERIES_BACKEND_ID_DBATS) !=
-          NULL) {
+  /* foreach new KI, if it has not been resolved, we need the key id */
+  for (id = first_id; id < first_id + cnt; id++) {
+    /* removed keys of shared KPs have no state, so check for them first */
+    if ((key = timeseries_kp_ki_decode_key(kp, id)) == NULL ||
+        KI_STATE(kp, id)->resolved != 0) {
+      /* removed, or already resolved */
       continue;
     }
-
-    if ((dbats_id = malloc(sizeof(uint32_t))) == NULL) {
-      timeseries_log(__func__, "Could not allocate DBATS Key");
-      return -1;
+    /* key strings are only valid until the next key is fetched, so they are
+       copied into one buffer */
+    key_len = strlen(key) + 1;
+    if (key_buf_len + key_len > key_buf_alloc) {
+      key_buf_alloc = (key_buf_alloc == 0) ? 4096 : key_buf_alloc * 2;
+      if (key_buf_alloc < key_buf_len + key_len) {
+        key_buf_alloc = key_buf_len + key_len;
+      }
+      if ((tmp = realloc(key_buf, key_buf_alloc)) == NULL) {
+        timeseries_log(__func__, "Could not allocate key buffer");
+        goto done;
+      }
+      key_buf = tmp;
     }
+    memcpy(&key_buf[key_buf_len], key, key_len);
+    key_offsets[keys_cnt] = key_buf_len;
+    key_buf_len += key_len;
+    ids[keys_cnt] = id;
+    keys_cnt++;
+  }
+  for (i = 0; i < keys_cnt; i++) {
+    keys[i] = &key_buf[key_offsets[i]];
+  }
 
-    /* lookup this key */
-    /** @todo bulk key lookup */
-    if (dbats_get_key_id(state->dbats_handler, NULL,
-                         timeseries_kp_ki_get_key(ki), dbats_id,
-                         DBATS_CREATE) != 0) {
-      timeseries_log(__func__, "Could not resolve DBATS key ID");
-      return -1;
-    }
+  if (keys_cnt == 0) {
+    rc = 0;
+    goto done;
+  }
 
-    timeseries_kp_ki_set_backend_state(ki, TIMESERIES_BACKEND_ID_DBATS,
-                                       dbats_id);
+  /* lookup all the keys at once */
+  if (timeseries_backend_dbats_resolve_key_bulk(
+        backend, keys_cnt, keys, backend_keys, backend_key_lens,
+        &contig_alloc) != 0) {
+    goto done;
+  }
+
+  for (i = 0; i < keys_cnt; i++) {
+    ki_state = KI_STATE(kp, ids[i]);
+    memcpy(&ki_state->dbats_id, backend_keys[i], sizeof(uint32_t));
+    ki_state->resolved = 1;
   }
+
+  rc = 0;
+
+done:
+  if (backend_keys != NULL) {
+    if (contig_alloc != 0) {
+      free(backend_keys[0]);
+    } else {
+      for (i = 0; i < keys_cnt; i++) {
+        free(backend_keys[i]);
+      }
+    }
+  }
+  free(keys);
+  free(key_buf);
+  free(key_offsets);
+  free(ids);
+  free(backend_keys);
+  free(backend_key_lens);
+  return rc;
+}
+
+int timeseries_backend_dbats_kp_ki_compact(timeseries_backend_t *backend,
+                                           timeseries_kp_t *kp,
+                                           const uint32_t *remap,
+                                           uint32_t old_cnt)
+{
+  /* all our per-key state lives in the KP */
   return 0;
 }
 
-void timeseries_backend_dbats_kp_ki_free(timeseries_backend_t *backend,
-                                         timeseries_kp_t *kp,
-                                         timeseries_kp_ki_t *ki, void *ki_state)
+ssize_t timeseries_backend_dbats_kp_ki_save(timeseries_backend_t *backend,
+                                            timeseries_kp_t *kp, uint32_t id,
+                                            uint8_t *buf, size_t len)
 {
-  /* ki_state is a (uint32_t*) */
-  free(ki_state);
-  return;
+  dbats_ki_state_t *ki_state = KI_STATE(kp, id);
+
+  if (ki_state->resolved == 0) {
+    return 0;
+  }
+  if (len < sizeof(uint32_t)) {
+    return -1;
+  }
+  memcpy(buf, &ki_state->dbats_id, sizeof(uint32_t));
+  return sizeof(uint32_t);
+}
+
+int timeseries_backend_dbats_kp_ki_load(timeseries_backend_t *backend,
+                                        timeseries_kp_t *kp, uint32_t id,
+                                        const uint8_t *buf, size_t len)
+{
+  dbats_ki_state_t *ki_state = KI_STATE(kp, id);
+
+  if (len != sizeof(uint32_t)) {
+    timeseries_log(__func__, "invalid DBATS key state");
+    return -1;
+  }
+  memcpy(&ki_state->dbats_id, buf, sizeof(uint32_t));
+  ki_state->resolved = 1;
+  return 0;
 }
 
 int timeseries_backend_dbats_kp_flush(timeseries_backend_t *backend,
@@ -302,9 +427,9 @@ int timeseries_backend_dbats_kp_flush(timeseries_backend_t *backend,
   dbats_snapshot *snapshot;
   dbats_value val;
   int rc;
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
-  uint32_t *dbats_id;
+  uint32_t pos;
+  uint32_t id;
+  dbats_ki_state_t *ki_state;
 
 /* we re-enter here if the set deadlocks */
 retry:
@@ -315,17 +440,16 @@ retry:
     return -1;
   }
 
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
+  /* a missing value is a gap in the series, so we write every enabled key,
+     even if the KP only wants changed values written (dbats_set does not
+     care about the order, so sparse KPs only visit their live keys) */
+  TIMESERIES_KP_FOREACH_LIVE_KI(kp, pos, id)
   {
-    if (timeseries_kp_ki_enabled(ki) == 0) {
-      continue;
-    }
-
-    dbats_id = (uint32_t *)timeseries_kp_ki_get_backend_state(
-      ki, TIMESERIES_BACKEND_ID_DBATS);
+    ki_state = KI_STATE(kp, id);
+    assert(ki_state->resolved != 0);
 
-    val.u64 = timeseries_kp_ki_get_value(ki);
-    if ((rc = dbats_set(snapshot, *dbats_id, &val)) != 0) {
+    val.u64 = timeseries_kp_ki_get_value(kp, id);
+    if ((rc = dbats_set(snapshot, ki_state->dbats_id, &val)) != 0) {
       dbats_abort_snap(snapshot);
       if (rc == DB_LOCK_DEADLOCK) {
         timeseries_log(__func__, "deadlock in dbats_set");
@@ -517,6 +517,25 @@ static int write_ascii(uint8_t *buf, size_t len, const char *key,
   return snprintf((char*)buf, len, "%s %" PRIu64 " %" PRIu32 "\n", key, value, time);
 }
 
+static int write_ascii_ki(uint8_t *buf, size_t len, timeseries_kp_t *kp,
+                          uint32_t id, uint32_t time)
+{
+  const char *key = timeseries_kp_ki_decode_key(kp, id);
+
+  switch (timeseries_kp_get_value_type(kp)) {
+  case TIMESERIES_KP_VALUE_I64:
+    return snprintf((char *)buf, len, "%s %" PRId64 " %" PRIu32 "\n", key,
+                    timeseries_kp_ki_get_value_i64(kp, id), time);
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    return snprintf((char *)buf, len, "%s %.15g %" PRIu32 "\n", key,
+                    timeseries_kp_ki_get_value_double(kp, id), time);
+  default:
+    /* unsigned values are widened to 64 bits */
+    return write_ascii(buf, len, key, timeseries_kp_ki_get_value(kp, id),
+                       time);
+  }
+}
+
 /* ===== PUBLIC FUNCTIONS BELOW THIS POINT ===== */
 
 timeseries_backend_t *timeseries_backend_kafka_alloc()
@@ -609,6 +628,17 @@ void timeseries_backend_kafka_free(timeseries_backend_t *backend)
 int timeseries_backend_kafka_kp_init(timeseries_backend_t *backend,
                                      timeseries_kp_t *kp, void **kp_state_p)
 {
+  timeseries_backend_kafka_state_t *state = STATE(backend);
+
+  /* TSK messages carry 64 bit integer values (signed values are sent as
+     their two's complement bits), so they cannot carry doubles */
+  if (state->format == FORMAT_TSK &&
+      timeseries_kp_get_value_type(kp) == TIMESERIES_KP_VALUE_DOUBLE) {
+    timeseries_log(__func__,
+                   "the TSK format does not support double values");
+    return -1;
+  }
+
   /* we do not need any state */
   assert(kp_state_p != NULL);
   *kp_state_p = NULL;
@@ -624,44 +654,56 @@ void timeseries_backend_kafka_kp_free(timeseries_backend_t *backend,
 }
 
 int timeseries_backend_kafka_kp_ki_update(timeseries_backend_t *backend,
-                                          timeseries_kp_t *kp)
+                                          timeseries_kp_t *kp,
+                                          uint32_t first_id, uint32_t cnt)
 {
   /* we don't need to do anything */
   return 0;
 }
 
-void timeseries_backend_kafka_kp_ki_free(timeseries_backend_t *backend,
-                                         timeseries_kp_t *kp,
-                                         timeseries_kp_ki_t *ki, void *ki_state)
+int timeseries_backend_kafka_kp_ki_compact(timeseries_backend_t *backend,
+                                           timeseries_kp_t *kp,
+                                           const uint32_t *remap,
+                                           uint32_t old_cnt)
 {
-  /* we did not allocate any state */
-  assert(ki_state == NULL);
-  return;
+  /* all our per-key state lives in the KP */
+  return 0;
+}
+
+ssize_t timeseries_backend_kafka_kp_ki_save(timeseries_backend_t *backend,
+                                            timeseries_kp_t *kp, uint32_t id,
+                                            uint8_t *buf, size_t len)
+{
+  /* we have no per-key state */
+  return 0;
+}
+
+int timeseries_backend_kafka_kp_ki_load(timeseries_backend_t *backend,
+                                        timeseries_kp_t *kp, uint32_t id,
+                                        const uint8_t *buf, size_t len)
+{
+  /* we never save any state, so this is never called */
+  return -1;
 }
 
 int timeseries_backend_kafka_kp_flush(timeseries_backend_t *backend,
                                       timeseries_kp_t *kp, uint32_t time)
 {
   timeseries_backend_kafka_state_t *state = STATE(backend);
-  timeseries_kp_ki_t *ki = NULL;
-  int id;
+  uint32_t id;
 
   uint8_t *ptr = state->buffer;
   size_t len = BUFFER_LEN;
   ssize_t s = 0;
   assert(state->buffer_written == 0);
 
-  TIMESERIES_KP_FOREACH_KI(kp, ki, id)
+  /* consumers keep the last value of each key, so only send changes */
+  TIMESERIES_KP_FOREACH_CHANGED_KI(kp, id)
   {
-    if (timeseries_kp_ki_enabled(ki) == 0) {
-      continue;
-    }
-
     switch (state->format) {
     case FORMAT_ASCII:
-      if ((s = write_ascii(ptr, (len - state->buffer_written),
-                           timeseries_kp_ki_get_key(ki),
-                           timeseries_kp_ki_get_value(ki), time)) <= 0) {
+      if ((s = write_ascii_ki(ptr, (len - state->buffer_written), kp, id,
+                              time)) <= 0) {
         goto err;
       }
       break;
@@ -679,8 +721,8 @@ int timeseries_backend_kafka_kp_flush(timeseries_backend_t *backend,
       }
 
       if ((s = write_kv(ptr, (len - state->buffer_written),
-                        timeseries_kp_ki_get_key(ki),
-                        timeseries_kp_ki_get_value(ki))) <= 0) {
+                        timeseries_kp_ki_decode_key(kp, id),
+                        timeseries_kp_ki_get_value(kp, id))) <= 0) {
         goto err;
       }
     }
@@ -0,0 +1,306 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#include "timeseries_backend_int.h"
+#include "timeseries_kp_int.h"
+#include "timeseries_log_int.h"
+#include "timeseries_backend_null.h"
+
+#define BACKEND_NAME "null"
+
+#define STATE(provname) (TIMESERIES_BACKEND_STATE(null, provname))
+
+/** The basic fields that every instance of this backend have in common */
+static timeseries_backend_t timeseries_backend_null = {
+  TIMESERIES_BACKEND_ID_NULL, BACKEND_NAME,
+  TIMESERIES_BACKEND_GENERATE_PTRS(null)};
+
+/** Holds the state for an instance of this backend */
+typedef struct timeseries_backend_null_state {
+  /** Should flushed KPs be walked a span at a time (as a real backend
+      would)? */
+  int walk;
+
+  /** A checksum of the keys and values walked when flushing (so that the
+      walk cannot be optimized away) */
+  uint64_t walk_sum;
+
+  /** The next ID to give to a resolved key */
+  uint32_t next_id;
+
+} timeseries_backend_null_state_t;
+
+/** Walk a span of the changed keys of a KP (registered as kp_flush_span) */
+static int kp_flush_span(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                         const timeseries_kp_span_t *span, uint32_t time);
+
+/** Print usage information to stderr */
+static void usage(timeseries_backend_t *backend)
+{
+  fprintf(stderr,
+          "backend usage: %s [-w]\n"
+          "       -w            walk the changed keys of a KP when it is "
+          "flushed\n",
+          backend->name);
+}
+
+/** Parse the arguments given to the backend */
+static int parse_args(timeseries_backend_t *backend, int argc, char **argv)
+{
+  timeseries_backend_null_state_t *state = STATE(backend);
+  int opt;
+
+  assert(argc > 0 && argv != NULL);
+
+  /* NB: remember to reset optind to 1 before using getopt! */
+  optind = 1;
+
+  /* remember the argv strings DO NOT belong to us */
+
+  while ((opt = getopt(argc, argv, ":w?")) >= 0) {
+    switch (opt) {
+    case 'w':
+      state->walk = 1;
+      break;
+
+    case '?':
+    case ':':
+    default:
+      usage(backend);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* ===== PUBLIC FUNCTIONS BELOW THIS POINT ===== */
+
+timeseries_backend_t *timeseries_backend_null_alloc()
+{
+  return &timeseries_backend_null;
+}
+
+int timeseries_backend_null_init(timeseries_backend_t *backend, int argc,
+                                 char **argv)
+{
+  timeseries_backend_null_state_t *state;
+
+  /* allocate our state */
+  if ((state = malloc_zero(sizeof(timeseries_backend_null_state_t))) == NULL) {
+    timeseries_log(__func__,
+                   "could not malloc timeseries_backend_null_state_t");
+    return -1;
+  }
+  timeseries_backend_register_state(backend, state);
+
+  /* parse the command line args */
+  if (parse_args(backend, argc, argv) != 0) {
+    return -1;
+  }
+
+  if (state->walk != 0) {
+    timeseries_backend_register_kp_flush_span(backend, kp_flush_span);
+  }
+
+  return 0;
+}
+
+void timeseries_backend_null_free(timeseries_backend_t *backend)
+{
+  timeseries_backend_null_state_t *state = STATE(backend);
+  if (state != NULL) {
+    timeseries_backend_free_state(backend);
+  }
+  return;
+}
+
+int timeseries_backend_null_kp_init(timeseries_backend_t *backend,
+                                    timeseries_kp_t *kp, void **kp_state_p)
+{
+  /* we do not need any state */
+  assert(kp_state_p != NULL);
+  *kp_state_p = NULL;
+  return 0;
+}
+
+void timeseries_backend_null_kp_free(timeseries_backend_t *backend,
+                                     timeseries_kp_t *kp, void *kp_state)
+{
+  /* we did not allocate any state */
+  assert(kp_state == NULL);
+  return;
+}
+
+int timeseries_backend_null_kp_ki_update(timeseries_backend_t *backend,
+                                         timeseries_kp_t *kp,
+                                         uint32_t first_id, uint32_t cnt)
+{
+  /* we don't need to do anything */
+  return 0;
+}
+
+int timeseries_backend_null_kp_ki_compact(timeseries_backend_t *backend,
+                                          timeseries_kp_t *kp,
+                                          const uint32_t *remap,
+                                          uint32_t old_cnt)
+{
+  /* we have no per-key state */
+  return 0;
+}
+
+ssize_t timeseries_backend_null_kp_ki_save(timeseries_backend_t *backend,
+                                           timeseries_kp_t *kp, uint32_t id,
+                                           uint8_t *buf, size_t len)
+{
+  /* we have no per-key state */
+  return 0;
+}
+
+int timeseries_backend_null_kp_ki_load(timeseries_backend_t *backend,
+                                       timeseries_kp_t *kp, uint32_t id,
+                                       const uint8_t *buf, size_t len)
+{
+  /* we never save any state, so this is never called */
+  return -1;
+}
+
+static int kp_flush_span(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                         const timeseries_kp_span_t *span, uint32_t time)
+{
+  timeseries_backend_null_state_t *state = STATE(backend);
+  const uint8_t *value = span->values;
+  size_t value_size = (timeseries_kp_get_value_type(kp) ==
+                       TIMESERIES_KP_VALUE_U32) ? sizeof(uint32_t)
+                                                : sizeof(uint64_t);
+  uint32_t i;
+
+  /* touch the first byte of each key and value */
+  for (i = 0; i < span->cnt; i++) {
+    state->walk_sum += (uint8_t)span->keys[i][0] + span->key_lens[i] +
+                       value[i * value_size];
+  }
+
+  return 0;
+}
+
+int timeseries_backend_null_kp_flush(timeseries_backend_t *backend,
+                                     timeseries_kp_t *kp, uint32_t time)
+{
+  /* unless we are walking KPs (a span at a time), there is nothing to do */
+  return 0;
+}
+
+int timeseries_backend_null_set_single(timeseries_backend_t *backend,
+                                       const char *key, uint64_t value,
+                                       uint32_t time)
+{
+  return 0;
+}
+
+int timeseries_backend_null_set_single_by_id(timeseries_backend_t *backend,
+                                             uint8_t *id, size_t id_len,
+                                             uint64_t value, uint32_t time)
+{
+  return 0;
+}
+
+int timeseries_backend_null_set_bulk_init(timeseries_backend_t *backend,
+                                          uint32_t key_cnt, uint32_t time)
+{
+  return 0;
+}
+
+int timeseries_backend_null_set_bulk_by_id(timeseries_backend_t *backend,
+                                           uint8_t *id, size_t id_len,
+                                           uint64_t value)
+{
+  return 0;
+}
+
+size_t timeseries_backend_null_resolve_key(timeseries_backend_t *backend,
+                                           const char *key,
+                                           uint8_t **backend_key)
+{
+  timeseries_backend_null_state_t *state = STATE(backend);
+
+  /* like DBATS, our keys are 32 bit IDs */
+  if ((*backend_key = malloc(sizeof(uint32_t))) == NULL) {
+    return 0;
+  }
+  memcpy(*backend_key, &state->next_id, sizeof(uint32_t));
+  state->next_id++;
+  return sizeof(uint32_t);
+}
+
+int timeseries_backend_null_resolve_key_bulk(
+  timeseries_backend_t *backend, uint32_t keys_cnt, const char *const *keys,
+  uint8_t **backend_keys, size_t *backend_key_lens, int *contig_alloc)
+{
+  timeseries_backend_null_state_t *state = STATE(backend);
+  uint8_t *ids;
+  int i;
+
+  assert(contig_alloc != NULL);
+  *contig_alloc = 0;
+
+  if (keys_cnt == 0) {
+    return 0;
+  }
+
+  /* all of the keys are allocated at once */
+  if ((ids = malloc(sizeof(uint32_t) * keys_cnt)) == NULL) {
+    timeseries_log(__func__, "Could not allocate key ID array");
+    return -1;
+  }
+  *contig_alloc = 1;
+
+  for (i = 0; i < keys_cnt; i++) {
+    backend_keys[i] = ids + (sizeof(uint32_t) * i);
+    backend_key_lens[i] = sizeof(uint32_t);
+    memcpy(backend_keys[i], &state->next_id, sizeof(uint32_t));
+    state->next_id++;
+  }
+
+  return 0;
+}
@@ -34,6 +34,7 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,6 +44,7 @@
 
 #include "timeseries_backend_int.h" /* timeseries_backend_t */
 #include "timeseries_int.h"         /* timeseries_t */
+#include "timeseries_keys_int.h"    /* timeseries_keys_t */
 #include "timeseries_log_int.h"     /* timeseries_log */
 
 /* ========== PRIVATE DATA STRUCTURES/FUNCTIONS ========== */
@@ -51,6 +53,38 @@
 
 #define SEPARATOR "|"
 
+/** State for a thread that makes calls into a single backend */
+typedef struct backend_worker {
+  /** The timeseries instance the worker belongs to */
+  struct timeseries *timeseries;
+
+  /** Index of the backend that the worker calls into */
+  int idx;
+
+  /** The worker thread */
+  pthread_t thread;
+} backend_worker_t;
+
+/** Main function of a backend worker thread
+ *
+ * @param user          pointer to the backend_worker_t for the thread
+ * @return NULL
+ */
+static void *backend_worker_run(void *user);
+
+/** Start a worker thread for each available backend
+ *
+ * @param timeseries    pointer to the timeseries instance
+ * @return 0 if the workers were started, -1 otherwise
+ */
+static int backend_workers_start(timeseries_t *timeseries);
+
+/** Stop all backend worker threads
+ *
+ * @param timeseries    pointer to the timeseries instance
+ */
+static void backend_workers_stop(timeseries_t *timeseries);
+
 /** Structure which holds state for a libtimeseries instance */
 struct timeseries {
 
@@ -58,10 +92,202 @@ struct timeseries {
    * @note index of backend is given by (timeseries_backend_id_t - 1)
    */
   struct timeseries_backend *backends[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Lock that serializes calls into the backends (which are not
+      thread-safe) */
+  pthread_mutex_t backends_lock;
+
+  /** Backend worker threads (only used if concurrent backend calls are
+      enabled) */
+  backend_worker_t workers[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Number of running worker threads */
+  int workers_cnt;
+
+  /** Protects the job fields below */
+  pthread_mutex_t job_mutex;
+
+  /** Signalled when a new job is posted for the workers (or they should
+      exit) */
+  pthread_cond_t job_cond;
+
+  /** Signalled when all workers have finished the current job */
+  pthread_cond_t job_done_cond;
+
+  /** Incremented each time a job is posted */
+  uint64_t job_gen;
+
+  /** Function for the workers to call on their backend */
+  timeseries_backend_fn_t *job_fn;
+
+  /** Argument to pass to the job function */
+  void *job_arg;
+
+  /** Number of workers that have not yet finished the current job */
+  int job_pending;
+
+  /** Result of the current job (-1 if any worker failed) */
+  int job_rc;
+
+  /** Set to tell the workers to exit */
+  int job_shutdown;
+
+  /** Key table shared by the KPs created with TIMESERIES_KP_SHARED */
+  timeseries_keys_t *keys;
 };
 
+static void *backend_worker_run(void *user)
+{
+  backend_worker_t *worker = user;
+  timeseries_t *timeseries = worker->timeseries;
+  timeseries_backend_t *backend = timeseries->backends[worker->idx];
+  timeseries_backend_fn_t *fn;
+  void *arg;
+  uint64_t seen = 0;
+  int rc;
+
+  pthread_mutex_lock(&timeseries->job_mutex);
+  seen = timeseries->job_gen;
+  while (1) {
+    while (timeseries->job_gen == seen && timeseries->job_shutdown == 0) {
+      pthread_cond_wait(&timeseries->job_cond, &timeseries->job_mutex);
+    }
+    if (timeseries->job_shutdown != 0) {
+      break;
+    }
+    seen = timeseries->job_gen;
+    fn = timeseries->job_fn;
+    arg = timeseries->job_arg;
+    pthread_mutex_unlock(&timeseries->job_mutex);
+
+    rc = timeseries_backend_is_enabled(backend) ? fn(backend, arg) : 0;
+
+    pthread_mutex_lock(&timeseries->job_mutex);
+    if (rc != 0) {
+      timeseries->job_rc = -1;
+    }
+    if (--timeseries->job_pending == 0) {
+      pthread_cond_signal(&timeseries->job_done_cond);
+    }
+  }
+  pthread_mutex_unlock(&timeseries->job_mutex);
+
+  return NULL;
+}
+
+static int backend_workers_start(timeseries_t *timeseries)
+{
+  backend_worker_t *worker;
+  int id;
+
+  TIMESERIES_FOREACH_BACKEND_ID(id)
+  {
+    if (timeseries->backends[id - 1] == NULL) {
+      continue;
+    }
+    worker = &timeseries->workers[timeseries->workers_cnt];
+    worker->timeseries = timeseries;
+    worker->idx = id - 1;
+    if (pthread_create(&worker->thread, NULL, backend_worker_run, worker) !=
+        0) {
+      timeseries_log(__func__, "could not start backend worker thread");
+      backend_workers_stop(timeseries);
+      return -1;
+    }
+    timeseries->workers_cnt++;
+  }
+
+  return 0;
+}
+
+static void backend_workers_stop(timeseries_t *timeseries)
+{
+  int i;
+
+  pthread_mutex_lock(&timeseries->job_mutex);
+  timeseries->job_shutdown = 1;
+  pthread_cond_broadcast(&timeseries->job_cond);
+  pthread_mutex_unlock(&timeseries->job_mutex);
+
+  for (i = 0; i < timeseries->workers_cnt; i++) {
+    pthread_join(timeseries->workers[i].thread, NULL);
+  }
+  timeseries->workers_cnt = 0;
+  timeseries->job_shutdown = 0;
+}
+
+/** Arguments for set_single_one */
+typedef struct set_single_args {
+  const char *key;
+  uint64_t value;
+  uint32_t time;
+} set_single_args_t;
+
+/** Write a single value to the given backend (see timeseries_set_single) */
+static int set_single_one(timeseries_backend_t *backend, void *arg)
+{
+  set_single_args_t *args = arg;
+  return backend->set_single(backend, args->key, args->value, args->time);
+}
+
 /* ========== PROTECTED FUNCTIONS ========== */
 
+int timeseries_backends_foreach(timeseries_t *timeseries,
+                                timeseries_backend_fn_t *fn, void *arg)
+{
+  timeseries_backend_t *backend;
+  int enabled_cnt = 0;
+  int rc;
+  int id;
+
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+  {
+    enabled_cnt++;
+  }
+
+  /* there is nothing to gain from the workers unless there are at least two
+     backends to run concurrently */
+  if (timeseries->workers_cnt == 0 || enabled_cnt < 2) {
+    TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+    {
+      if (fn(backend, arg) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  pthread_mutex_lock(&timeseries->job_mutex);
+  timeseries->job_fn = fn;
+  timeseries->job_arg = arg;
+  timeseries->job_rc = 0;
+  timeseries->job_pending = timeseries->workers_cnt;
+  timeseries->job_gen++;
+  pthread_cond_broadcast(&timeseries->job_cond);
+  while (timeseries->job_pending > 0) {
+    pthread_cond_wait(&timeseries->job_done_cond, &timeseries->job_mutex);
+  }
+  rc = timeseries->job_rc;
+  pthread_mutex_unlock(&timeseries->job_mutex);
+
+  return rc;
+}
+
+void timeseries_backends_lock(timeseries_t *timeseries)
+{
+  pthread_mutex_lock(&timeseries->backends_lock);
+}
+
+void timeseries_backends_unlock(timeseries_t *timeseries)
+{
+  pthread_mutex_unlock(&timeseries->backends_lock);
+}
+
+timeseries_keys_t *timeseries_get_keys(timeseries_t *timeseries)
+{
+  return timeseries->keys;
+}
+
 /* ========== PUBLIC FUNCTIONS ========== */
 
 timeseries_t *timeseries_init()
@@ -77,6 +303,16 @@ timeseries_t *timeseries_init()
     return NULL;
   }
 
+  pthread_mutex_init(&timeseries->backends_lock, NULL);
+  pthread_mutex_init(&timeseries->job_mutex, NULL);
+  pthread_cond_init(&timeseries->job_cond, NULL);
+  pthread_cond_init(&timeseries->job_done_cond, NULL);
+
+  if ((timeseries->keys = timeseries_keys_init()) == NULL) {
+    timeseries_free(&timeseries);
+    return NULL;
+  }
+
   /* allocate the backends (some may/will be NULL) */
   TIMESERIES_FOREACH_BACKEND_ID(id)
   {
@@ -93,12 +329,20 @@ void timeseries_free(timeseries_t **timeseries_p)
   *timeseries_p = NULL;
   int id;
 
+  backend_workers_stop(timeseries);
+
   /* loop across all backends and free each one */
   TIMESERIES_FOREACH_BACKEND_ID(id)
   {
     timeseries_backend_free(&timeseries->backends[id - 1]);
   }
 
+  timeseries_keys_free(&timeseries->keys);
+
+  pthread_mutex_destroy(&timeseries->backends_lock);
+  pthread_mutex_destroy(&timeseries->job_mutex);
+  pthread_cond_destroy(&timeseries->job_cond);
+  pthread_cond_destroy(&timeseries->job_done_cond);
   free(timeseries);
   return;
 }
@@ -165,19 +409,33 @@ timeseries_backend_t **timeseries_get_all_backends(timeseries_t *timeseries)
   return timeseries->backends;
 }
 
+int timeseries_set_concurrent_backends(timeseries_t *timeseries, int enabled)
+{
+  int rc = 0;
+  assert(timeseries != NULL);
+
+  /* make sure no backend calls are in progress */
+  timeseries_backends_lock(timeseries);
+  if (enabled != 0 && timeseries->workers_cnt == 0) {
+    rc = backend_workers_start(timeseries);
+  } else if (enabled == 0 && timeseries->workers_cnt != 0) {
+    backend_workers_stop(timeseries);
+  }
+  timeseries_backends_unlock(timeseries);
+
+  return rc;
+}
+
 int timeseries_set_single(timeseries_t *timeseries, const char *key,
                           uint64_t value, uint32_t time)
 {
-  int id;
-  timeseries_backend_t *backend;
+  set_single_args_t args = {key, value, time};
+  int rc;
   assert(timeseries != NULL);
 
-  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
-  {
-    if (backend->set_single(backend, key, value, time) != 0) {
-      return -1;
-    }
-  }
+  timeseries_backends_lock(timeseries);
+  rc = timeseries_backends_foreach(timeseries, set_single_one, &args);
+  timeseries_backends_unlock(timeseries);
 
-  return 0;
+  return rc;
 }
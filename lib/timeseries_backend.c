@@ -59,6 +59,9 @@
 #include "timeseries_backend_kafka.h"
 #endif
 
+/* null */
+#include "timeseries_backend_null.h"
+
 /* ========== PRIVATE DATA STRUCTURES/FUNCTIONS ========== */
 
 /** Convenience typedef for the backend alloc function type */
@@ -89,6 +92,9 @@ static const backend_alloc_func_t backend_alloc_functions[] = {
   NULL,
 #endif
 
+  /** Pointer to null backend alloc function */
+  timeseries_backend_null_alloc,
+
 };
 
 /* ========== PROTECTED FUNCTIONS ========== */
@@ -181,6 +187,24 @@ void timeseries_backend_free_state(timeseries_backend_t *backend)
   backend->state = NULL;
 }
 
+void timeseries_backend_register_ki_state_size(timeseries_backend_t *backend,
+                                               size_t size)
+{
+  assert(backend != NULL);
+  assert(size > 0);
+
+  backend->ki_state_size = size;
+}
+
+void timeseries_backend_register_kp_flush_span(
+  timeseries_backend_t *backend, timeseries_backend_kp_flush_span_func_t *func)
+{
+  assert(backend != NULL);
+  assert(func != NULL);
+
+  backend->kp_flush_span = func;
+}
+
 /* ========== PUBLIC FUNCTIONS ========== */
 
 inline int timeseries_backend_is_enabled(timeseries_backend_t *backend)
@@ -34,6 +34,7 @@
 #define __TIMESERIES_BACKEND_INT_H
 
 #include <inttypes.h>
+#include <sys/types.h>
 
 #include "timeseries_kp_int.h"
 #include "timeseries_backend_pub.h"
@@ -66,10 +67,17 @@
   void timeseries_backend_##provname##_kp_free(                                \
     timeseries_backend_t *backend, timeseries_kp_t *kp, void *kp_state);       \
   int timeseries_backend_##provname##_kp_ki_update(                            \
-    timeseries_backend_t *backend, timeseries_kp_t *kp);                       \
-  void timeseries_backend_##provname##_kp_ki_free(                             \
-    timeseries_backend_t *backend, timeseries_kp_t *kp,                        \
-    timeseries_kp_ki_t *ki, void *ki_state);                                   \
+    timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t first_id,     \
+    uint32_t cnt);                                                             \
+  int timeseries_backend_##provname##_kp_ki_compact(                           \
+    timeseries_backend_t *backend, timeseries_kp_t *kp, const uint32_t *remap, \
+    uint32_t old_cnt);                                                         \
+  ssize_t timeseries_backend_##provname##_kp_ki_save(                          \
+    timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t id,           \
+    uint8_t *buf, size_t len);                                                 \
+  int timeseries_backend_##provname##_kp_ki_load(                              \
+    timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t id,           \
+    const uint8_t *buf, size_t len);                                           \
   int timeseries_backend_##provname##_kp_flush(                                \
     timeseries_backend_t *backend, timeseries_kp_t *kp, uint32_t time);        \
   int timeseries_backend_##provname##_set_single(                              \
@@ -97,14 +105,23 @@
     timeseries_backend_##provname##_kp_init,                                   \
     timeseries_backend_##provname##_kp_free,                                   \
     timeseries_backend_##provname##_kp_ki_update,                              \
-    timeseries_backend_##provname##_kp_ki_free,                                \
+    timeseries_backend_##provname##_kp_ki_compact,                             \
+    timeseries_backend_##provname##_kp_ki_save,                                \
+    timeseries_backend_##provname##_kp_ki_load,                                \
     timeseries_backend_##provname##_kp_flush,                                  \
     timeseries_backend_##provname##_set_single,                                \
     timeseries_backend_##provname##_set_single_by_id,                          \
     timeseries_backend_##provname##_set_bulk_init,                             \
     timeseries_backend_##provname##_set_bulk_by_id,                            \
     timeseries_backend_##provname##_resolve_key,                               \
-    timeseries_backend_##provname##_resolve_key_bulk, 0, NULL
+    timeseries_backend_##provname##_resolve_key_bulk, NULL, 0, NULL, 0
+
+/** Signature of the (optional) function that flushes a span of the keys in a
+ * Key Package to a backend (see the kp_flush_span field of timeseries_backend)
+ */
+typedef int(timeseries_backend_kp_flush_span_func_t)(
+  timeseries_backend_t *backend, timeseries_kp_t *kp,
+  const timeseries_kp_span_t *span, uint32_t time);
 
 /** Structure which represents a metadata backend */
 struct timeseries_backend {
@@ -177,33 +194,81 @@ struct timeseries_backend {
   void (*kp_free)(timeseries_backend_t *backend, timeseries_kp_t *kp,
                   void *kp_state);
 
-  /** Update backend-specific Key Info state in the given Key Package object
+  /** Update backend-specific Key Info state for a range of keys in the given
+   * Key Package object
    *
    * @param      backend     Pointer to a backend instance
    * @param      kp          Pointer to the KP to update
+   * @param      first_id    ID of the first KI to update
+   * @param      cnt         Number of KIs to update
    * @return 0 if state was updated successfully, -1 otherwise
    *
    * For example: the DBATS backend needs to ask DBATS what the internal key id
    * is for the string key.
    *
-   * Backends should use the TIMESERIES_KP_FOREACH_KI macro to iterate over all
-   * KIs in the KP and then use the timeseries_kp_get_ki and
-   * timeseries_kp_ki_get_backend_state functions to get a pointer to the state
-   * to update.
+   * The KP keeps track of which keys have been added since the last successful
+   * update, and only passes that range to the backend, so the cost of an
+   * update is proportional to the number of new keys. If an update fails, the
+   * same range (possibly extended) will be passed again, so backends should
+   * skip KIs that already have state.
+   *
+   * Backends that registered a per-KI state size (see
+   * timeseries_backend_register_ki_state_size) should use the
+   * timeseries_kp_ki_get_backend_state function to access the state to
+   * update.
+   */
+  int (*kp_ki_update)(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                      uint32_t first_id, uint32_t cnt);
+
+  /** Notify the backend that the keys in the given Key Package have been
+   * renumbered
+   *
+   * @param backend    Pointer to a backend instance
+   * @param kp         Pointer to the KP that was compacted
+   * @param remap      Array (indexed by old ID) of new IDs, UINT32_MAX for
+   *                   keys that were removed
+   * @param old_cnt    Number of elements in the remap array
+   * @return 0 if the backend state was updated successfully, -1 otherwise
+   *
+   * Per-KI state held by the KP (see timeseries_kp_ki_get_backend_state) has
+   * already been moved to the new IDs by the KP, so this only needs to update
+   * state that the backend keeps elsewhere that is indexed by key ID.
    */
-  int (*kp_ki_update)(timeseries_backend_t *backend, timeseries_kp_t *kp);
+  int (*kp_ki_compact)(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                       const uint32_t *remap, uint32_t old_cnt);
 
-  /** Free the backend-specific state in the given Key Info object.
+  /** Serialize the backend-specific state of the given Key Info object (for
+   * a KP checkpoint)
    *
    * @param backend    Pointer to a backend instance
    * @param kp         Pointer to the KP the KI is a member of
-   * @param kv         Pointer to the KI to free state for
-   * @param ki_state   Pointer to the state to free
+   * @param id         ID of the KI to serialize state for
+   * @param buf        Buffer to write the state to
+   * @param len        Length of the buffer
+   * @return the number of bytes written (0 if the KI has no state), -1 if an
+   * error occurred (e.g. the buffer is too small)
    *
-   * @note This function should free the state created by kp_kv_add.
+   * The serialized state is only ever loaded by the same backend, on a host
+   * with the same byte order.
    */
-  void (*kp_ki_free)(timeseries_backend_t *backend, timeseries_kp_t *kp,
-                     timeseries_kp_ki_t *ki, void *ki_state);
+  ssize_t (*kp_ki_save)(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                        uint32_t id, uint8_t *buf, size_t len);
+
+  /** Restore the backend-specific state of the given Key Info object from a
+   * KP checkpoint
+   *
+   * @param backend    Pointer to a backend instance
+   * @param kp         Pointer to the KP the KI is a member of
+   * @param id         ID of the KI to restore state for
+   * @param buf        State written by kp_ki_save
+   * @param len        Length of the state (never 0)
+   * @return 0 if the state was restored successfully, -1 otherwise
+   *
+   * The buffer may be part of a read-only mapping of the checkpoint file, so
+   * backends must copy anything they want to keep.
+   */
+  int (*kp_ki_load)(timeseries_backend_t *backend, timeseries_kp_t *kp,
+                    uint32_t id, const uint8_t *buf, size_t len);
 
   /** Flush the current values in the given Key Package to the database
    *
@@ -311,6 +376,25 @@ struct timeseries_backend {
                           const char *const *keys, uint8_t **backend_keys,
                           size_t *backend_key_lens, int *contig_alloc);
 
+  /** Flush a span of the changed keys in the given Key Package (optional)
+   *
+   * @param backend       Pointer to a backend instance to flush to
+   * @param kp            Pointer to the KP being flushed
+   * @param span          Pointer to the span of keys to write
+   * @param time          The timestamp to associate the values with in the DB
+   * @return 0 if the data was written successfully, -1 otherwise.
+   *
+   * Backends that write the keys and values of the changed keys (rather than
+   * per-key backend state) can register this using
+   * timeseries_backend_register_kp_flush_span, in which case the KP calls it
+   * (using timeseries_kp_flush_spans) rather than kp_flush. Each call is
+   * given the next span of keys, and any buffered data must be written when
+   * the span is the last one.
+   *
+   * This is NULL unless registered.
+   */
+  timeseries_backend_kp_flush_span_func_t *kp_flush_span;
+
   /** }@ */
 
   /**
@@ -328,6 +412,10 @@ struct timeseries_backend {
   /** An opaque pointer to backend-specific state if needed by the backend */
   void *state;
 
+  /** Size of the state that the KP holds for each KI (0 if the backend does
+      not need any per-KI state) */
+  size_t ki_state_size;
+
   /** }@ */
 };
 
@@ -390,6 +478,33 @@ void timeseries_backend_register_state(timeseries_backend_t *backend,
  */
 void timeseries_backend_free_state(timeseries_backend_t *backend);
 
+/** Register the size of the state that Key Packages hold for each KI
+ *
+ * @param backend       The backend to register the size for
+ * @param size          Size of the per-KI state (in bytes)
+ *
+ * Each KP holds the per-KI state of the backend inline, in a dense column
+ * indexed by key ID, so backends do not allocate (or free) anything per key.
+ * The state of a new KI is zeroed, so backends should be able to tell an
+ * unused state from a used one. Backends that do not register a size have no
+ * per-KI state.
+ *
+ * This should be called by the backend init function.
+ */
+void timeseries_backend_register_ki_state_size(timeseries_backend_t *backend,
+                                               size_t size);
+
+/** Register the function that flushes a span of a Key Package to a backend
+ *
+ * @param backend       The backend to register the function for
+ * @param func          Pointer to the function (see the kp_flush_span field
+ *                      of timeseries_backend)
+ *
+ * This should be called by the backend init function.
+ */
+void timeseries_backend_register_kp_flush_span(
+  timeseries_backend_t *backend, timeseries_backend_kp_flush_span_func_t *func);
+
 /** }@ */
 
 #endif /* __TIMESERIES_BACKEND_H */
@@ -80,10 +80,13 @@ typedef enum timeseries_backend_id {
   /** Write timeseries metrics to an Apache Kafka cluster */
   TIMESERIES_BACKEND_ID_KAFKA = 3,
 
+  /** Discards all timeseries metrics (used for benchmarking) */
+  TIMESERIES_BACKEND_ID_NULL = 4,
+
   /** Lowest numbered timeseries backend ID */
   TIMESERIES_BACKEND_ID_FIRST = TIMESERIES_BACKEND_ID_ASCII,
   /** Highest numbered timeseries backend ID */
-  TIMESERIES_BACKEND_ID_LAST = TIMESERIES_BACKEND_ID_KAFKA,
+  TIMESERIES_BACKEND_ID_LAST = TIMESERIES_BACKEND_ID_NULL,
 
 } timeseries_backend_id_t;
 
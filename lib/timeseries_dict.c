@@ -0,0 +1,1548 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+
+#include "timeseries_dict_int.h"
+#include "timeseries_log_int.h"
+
+/* ========== PRIVATE DATA STRUCTURES/FUNCTIONS ========== */
+
+/** The number of keys in each front-coded block (must be a power of two) */
+#define DICT_BLOCK_KEYS 16
+
+/** Index of the block that holds the given key */
+#define DICT_BLOCK(id) ((id) / DICT_BLOCK_KEYS)
+
+/** Number of blocks needed for the given number of keys */
+#define DICT_BLOCKS(cnt)                                                       \
+  (((uint64_t)(cnt) + DICT_BLOCK_KEYS - 1) / DICT_BLOCK_KEYS)
+
+/** The minimum number of keys to allocate column space for */
+#define DICT_MIN_ALLOC 64
+
+/** The minimum number of slots in the lookup table (must be a power of two) */
+#define DICT_HASH_MIN_SLOTS 64
+
+/** Does a lookup table with the given number of slots need to grow to hold
+    the given number of keys? (the table is kept at most 3/4 full) */
+#define DICT_HASH_FULL(slots, cnt) ((uint64_t)(cnt)*4 > (uint64_t)(slots)*3)
+
+/** Constants for the key hash function (from MurmurHash3) */
+#define DICT_HASH_C1 UINT64_C(0x87c37b91114253d5)
+#define DICT_HASH_C2 UINT64_C(0x4cf5ad432745937f)
+
+/** Rotate a 64 bit word left by r bits */
+#define DICT_HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/** The average number of keys in each bucket of a minimal perfect hash */
+#define DICT_MPH_BUCKET_KEYS 4
+
+/** Number of positions that the keys of a minimal perfect hash are placed
+    in (about 3% more than the number of keys, so that the last keys can be
+    placed quickly) */
+#define DICT_MPH_POSITIONS(cnt) ((cnt) + (cnt) / 32 + 1)
+
+/** The largest pilot that is tried for a bucket */
+#define DICT_MPH_PILOT_MAX UINT16_MAX
+
+/** Number of seeds to try before giving up on building a perfect hash */
+#define DICT_MPH_SEEDS 8
+
+/** Bucket of a key hash in a minimal perfect hash with the given number of
+    buckets (from the high bits of the hash) */
+#define DICT_MPH_BUCKET(hash, cnt)                                             \
+  ((uint32_t)((((hash) >> 32) * (uint64_t)(cnt)) >> 32))
+
+/** Number of 64 bit words needed for a bitmap of the given number of keys */
+#define DICT_BM_WORDS(cnt) (((uint64_t)(cnt) + 63) / 64)
+
+/** Index of the word in a bitmap that holds the bit for the given key */
+#define DICT_BM_WORD(id) ((id) >> 6)
+
+/** Mask of the bit for the given key within its bitmap word */
+#define DICT_BM_BIT(id) (UINT64_C(1) << ((id)&63))
+
+/** The size of each chunk of key storage (blocks longer than this are given a
+    chunk of their own) */
+#define DICT_ARENA_CHUNK_LEN (1024 * 1024)
+
+/** Round a length up to a multiple of 8 bytes */
+#define DICT_ALIGN(len) (((uint64_t)(len) + 7) & ~(uint64_t)7)
+
+/** A chunk of append-only storage for front-coded blocks */
+typedef struct dict_arena_chunk {
+  /** The previously filled chunk */
+  struct dict_arena_chunk *prev;
+
+  /** Number of bytes of data in use */
+  size_t used;
+
+  /** Number of bytes of data allocated */
+  size_t size;
+
+  /** Block data */
+  uint8_t data[];
+} dict_arena_chunk_t;
+
+/** A slot in the key lookup table */
+typedef struct dict_hash_slot {
+  /** Upper 32 bits of the hash of the key (to avoid most key compares) */
+  uint32_t tag;
+
+  /** ID of the key + 1 (0 if the slot is empty) */
+  uint32_t id1;
+} dict_hash_slot_t;
+
+/** A buffer that keys are decoded into
+ *
+ * The buffer remembers where the decoded key was in its block, so that
+ * getting the following key only needs to decode one more entry.
+ */
+typedef struct dict_buf {
+  /** The decoded key (NUL-terminated) */
+  char *key;
+
+  /** Length of the decoded key */
+  size_t len;
+
+  /** Number of bytes allocated for the key */
+  size_t alloc;
+
+  /** UID of the dictionary the key was decoded from (0 if none) */
+  uint64_t uid;
+
+  /** The block the key was decoded from */
+  const uint8_t *block;
+
+  /** ID of the decoded key */
+  uint32_t id;
+
+  /** The entry following the decoded key */
+  const uint8_t *next;
+} dict_buf_t;
+
+/** Header of a dictionary written to a checkpoint
+ *
+ * The header is followed by:
+ *
+ *   uint64_t   hashes[key_cnt]
+ *   uint64_t   removed[(key_cnt + 63) / 64] (bitmap)
+ *   uint64_t   block_offsets[(key_cnt + 15) / 16] (into data)
+ *   uint8_t    data[data_len] (front-coded blocks, padded to 8 bytes)
+ */
+typedef struct dict_image_hdr {
+  uint32_t key_cnt;
+  uint32_t removed_cnt;
+  uint64_t data_len;
+} dict_image_hdr_t;
+
+struct timeseries_dict {
+  /** Unique ID of the current contents of the dictionary (so that decode
+      buffers can tell if the blocks they point to are still valid) */
+  uint64_t uid;
+
+  /** Column of pointers to the start of each block
+   *
+   * Each entry in a block is the length of the prefix shared with the
+   * previous key (as a varint, always 0 for the first key in a block), the
+   * length of the rest of the key (as a varint), and the rest of the key.
+   */
+  const uint8_t **blocks;
+
+  /** Number of bytes in the last block */
+  size_t tail_len;
+
+  /** Column of key hashes, so the lookup table can be resized (and keys
+      deleted) without decoding keys */
+  uint64_t *hashes;
+
+  /** Bitmap of removed keys */
+  uint64_t *removed;
+
+  /** Number of keys that the columns have space for */
+  uint32_t alloc;
+
+  /** Number of keys (including removed keys) */
+  uint32_t cnt;
+
+  /** Number of removed keys */
+  uint32_t removed_cnt;
+
+  /** Open-addressed (linear probing) lookup table of key hash -> key ID */
+  dict_hash_slot_t *slots;
+
+  /** Number of slots in the lookup table (always a power of two) */
+  uint32_t slots_cnt;
+
+  /** Has the dictionary been frozen? (if so, keys are found using the
+      minimal perfect hash below, and there is no lookup table) */
+  int frozen;
+
+  /** Pilot of each bucket of the minimal perfect hash (the seed that places
+      all of the keys of the bucket in free positions) */
+  uint16_t *mph_pilots;
+
+  /** Number of buckets in the minimal perfect hash */
+  uint32_t mph_buckets_cnt;
+
+  /** Seed of the minimal perfect hash */
+  uint64_t mph_seed;
+
+  /** Slots of the minimal perfect hash, holding the ID (+ 1) of each live
+      key, and the low 32 bits of its hash (as a fingerprint) */
+  dict_hash_slot_t *mph_slots;
+
+  /** Number of slots in the minimal perfect hash (one per live key) */
+  uint32_t mph_cnt;
+
+  /** Slot of the key placed in each position at or beyond mph_cnt */
+  uint32_t *mph_remap;
+
+  /** The last key that was added (the next key is front-coded against it) */
+  char *last_key;
+
+  /** Length of the last key */
+  size_t last_key_len;
+
+  /** Number of bytes allocated for the last key */
+  size_t last_key_alloc;
+
+  /** Chunk of block storage currently being filled */
+  dict_arena_chunk_t *arena;
+
+  /** Mapping of the checkpoint the blocks were loaded from (if any) */
+  void *image;
+
+  /** Length of the checkpoint mapping */
+  size_t image_len;
+
+  /** Lock to hold while moving the columns (may be NULL) */
+  pthread_mutex_t *grow_lock;
+};
+
+/** Source of dictionary UIDs */
+static uint64_t dict_uid_next = 0;
+
+/** Thread-specific key decode buffers */
+static pthread_once_t dict_buf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dict_buf_key;
+
+/** Get a new dictionary UID */
+static uint64_t dict_new_uid(void)
+{
+  return __sync_add_and_fetch(&dict_uid_next, 1);
+}
+
+static void dict_buf_destroy(void *user)
+{
+  dict_buf_t *buf = user;
+  free(buf->key);
+  free(buf);
+}
+
+static void dict_buf_key_init(void)
+{
+  pthread_key_create(&dict_buf_key, dict_buf_destroy);
+}
+
+/** Get the decode buffer of the calling thread */
+static dict_buf_t *dict_thread_buf(void)
+{
+  dict_buf_t *buf;
+
+  pthread_once(&dict_buf_once, dict_buf_key_init);
+  if ((buf = pthread_getspecific(dict_buf_key)) == NULL) {
+    if ((buf = malloc_zero(sizeof(dict_buf_t))) == NULL) {
+      return NULL;
+    }
+    if (pthread_setspecific(dict_buf_key, buf) != 0) {
+      free(buf);
+      return NULL;
+    }
+  }
+  return buf;
+}
+
+/** Make sure a buffer of the given size has space for len bytes */
+static int dict_buf_reserve(char **buf, size_t *alloc, size_t len)
+{
+  size_t new_alloc = (*alloc == 0) ? 64 : *alloc;
+  char *tmp;
+
+  if (len <= *alloc) {
+    return 0;
+  }
+  while (new_alloc < len) {
+    new_alloc *= 2;
+  }
+  if ((tmp = realloc(*buf, new_alloc)) == NULL) {
+    return -1;
+  }
+  *buf = tmp;
+  *alloc = new_alloc;
+  return 0;
+}
+
+/** Number of bytes needed to encode the given value as a varint */
+static size_t dict_varint_len(uint64_t v)
+{
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/** Encode a value as a (LEB128) varint, returning the number of bytes
+    written */
+static size_t dict_varint_put(uint8_t *p, uint64_t v)
+{
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/** Decode a varint that ends before end, returning a pointer to the byte
+    after it (NULL if the varint is not valid) */
+static const uint8_t *dict_varint_get(const uint8_t *p, const uint8_t *end,
+                                      uint64_t *v)
+{
+  int shift = 0;
+
+  *v = 0;
+  while (p < end && shift < 64) {
+    *v |= (uint64_t)(*p & 0x7f) << shift;
+    if ((*p++ & 0x80) == 0) {
+      return p;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+/** Decode the key with the given ID into a buffer */
+static const char *dict_decode(timeseries_dict_t *dict, uint32_t id,
+                               dict_buf_t *buf)
+{
+  const uint8_t *block = dict->blocks[DICT_BLOCK(id)];
+  const uint8_t *p;
+  uint64_t lcp, slen;
+  uint32_t i;
+
+  if (buf->uid == dict->uid && buf->block == block && buf->id <= id &&
+      DICT_BLOCK(buf->id) == DICT_BLOCK(id)) {
+    /* carry on from the key already in the buffer */
+    if (buf->id == id) {
+      return buf->key;
+    }
+    i = buf->id + 1;
+    p = buf->next;
+  } else {
+    i = id & ~(uint32_t)(DICT_BLOCK_KEYS - 1);
+    p = block;
+  }
+
+  /* entries are only written by us, so they are known to be valid */
+  for (;; i++) {
+    p = dict_varint_get(p, p + 10, &lcp);
+    p = dict_varint_get(p, p + 10, &slen);
+    if (dict_buf_reserve(&buf->key, &buf->alloc, lcp + slen + 1) != 0) {
+      buf->uid = 0;
+      timeseries_log(__func__, "could not realloc key buffer");
+      return NULL;
+    }
+    memcpy(&buf->key[lcp], p, slen);
+    p += slen;
+    buf->len = lcp + slen;
+    if (i == id) {
+      break;
+    }
+  }
+
+  buf->key[buf->len] = '\0';
+  buf->uid = dict->uid;
+  buf->block = block;
+  buf->id = id;
+  buf->next = p;
+  return buf->key;
+}
+
+/** Is the key with the given ID equal to the given key string?
+ *
+ * The key is compared against the entries of its block as they are walked,
+ * rather than being decoded into a buffer, so that lookups do not write any
+ * state (and can be made from several threads at once).
+ */
+static int dict_key_equal(timeseries_dict_t *dict, uint32_t id,
+                          const char *key, size_t len)
+{
+  const uint8_t *p = dict->blocks[DICT_BLOCK(id)];
+  uint64_t lcp, slen, n;
+  uint64_t match = 0;
+  uint32_t i;
+
+  /* match is the length of the prefix the current entry shares with the
+     key. An entry that keeps more of the previous entry than that still
+     differs from the key at the same byte, so only entries that keep at most
+     match bytes need their suffix compared */
+  for (i = id & ~(uint32_t)(DICT_BLOCK_KEYS - 1);; i++) {
+    p = dict_varint_get(p, p + 10, &lcp);
+    p = dict_varint_get(p, p + 10, &slen);
+    if (lcp <= match) {
+      n = 0;
+      while (n < slen && lcp + n < len && p[n] == (uint8_t)key[lcp + n]) {
+        n++;
+      }
+      match = lcp + n;
+    }
+    if (i == id) {
+      return match == len && lcp + slen == len;
+    }
+    p += slen;
+  }
+}
+
+/** Get the length of the given block (by walking its entries) */
+static size_t dict_block_len(timeseries_dict_t *dict, uint64_t b)
+{
+  const uint8_t *p = dict->blocks[b];
+  uint64_t lcp, slen;
+  int i;
+
+  if (b == DICT_BLOCKS(dict->cnt) - 1) {
+    return dict->tail_len;
+  }
+  for (i = 0; i < DICT_BLOCK_KEYS; i++) {
+    p = dict_varint_get(p, p + 10, &lcp);
+    p = dict_varint_get(p, p + 10, &slen);
+    p += slen;
+  }
+  return p - dict->blocks[b];
+}
+
+static int dict_grow(timeseries_dict_t *dict, uint32_t cnt)
+{
+  uint64_t old_words = DICT_BM_WORDS(dict->alloc);
+  void *tmp;
+  int rc = -1;
+
+  /* other threads may be reading the block column */
+  if (dict->grow_lock != NULL) {
+    pthread_mutex_lock(dict->grow_lock);
+  }
+
+  if ((tmp = realloc(dict->blocks, sizeof(uint8_t *) * DICT_BLOCKS(cnt))) ==
+      NULL) {
+    goto done;
+  }
+  dict->blocks = tmp;
+  if ((tmp = realloc(dict->hashes, sizeof(uint64_t) * cnt)) == NULL) {
+    goto done;
+  }
+  dict->hashes = tmp;
+  if ((tmp = realloc(dict->removed, sizeof(uint64_t) * DICT_BM_WORDS(cnt))) ==
+      NULL) {
+    goto done;
+  }
+  dict->removed = tmp;
+  if (DICT_BM_WORDS(cnt) > old_words) {
+    memset(&dict->removed[old_words], 0,
+           sizeof(uint64_t) * (DICT_BM_WORDS(cnt) - old_words));
+  }
+
+  dict->alloc = cnt;
+  rc = 0;
+
+done:
+  if (dict->grow_lock != NULL) {
+    pthread_mutex_unlock(dict->grow_lock);
+  }
+  return rc;
+}
+
+static int dict_ensure(timeseries_dict_t *dict, uint32_t cnt)
+{
+  uint64_t alloc;
+
+  if (cnt <= dict->alloc) {
+    return 0;
+  }
+
+  /* double the columns (so that adding N keys costs O(N) copies) */
+  alloc = (uint64_t)dict->alloc * 2;
+  if (alloc < DICT_MIN_ALLOC) {
+    alloc = DICT_MIN_ALLOC;
+  }
+  if (alloc < cnt) {
+    alloc = cnt;
+  }
+  if (alloc > UINT32_MAX) {
+    alloc = UINT32_MAX;
+  }
+
+  return dict_grow(dict, alloc);
+}
+
+static void dict_hash_insert(timeseries_dict_t *dict, uint32_t id)
+{
+  uint32_t mask = dict->slots_cnt - 1;
+  uint64_t hash = dict->hashes[id];
+  uint32_t i;
+
+  for (i = hash & mask; dict->slots[i].id1 != 0; i = (i + 1) & mask)
+    ;
+  dict->slots[i].tag = hash >> 32;
+  dict->slots[i].id1 = id + 1;
+}
+
+static void dict_hash_delete(timeseries_dict_t *dict, uint32_t id)
+{
+  uint32_t mask = dict->slots_cnt - 1;
+  uint32_t i, j, home;
+
+  for (i = dict->hashes[id] & mask; dict->slots[i].id1 != id + 1;
+       i = (i + 1) & mask) {
+    assert(dict->slots[i].id1 != 0);
+  }
+
+  /* shift back any following keys that would otherwise become unreachable
+     (so that we do not need tombstones) */
+  for (j = (i + 1) & mask; dict->slots[j].id1 != 0; j = (j + 1) & mask) {
+    home = dict->hashes[dict->slots[j].id1 - 1] & mask;
+    /* the key in slot j can fill the hole if its home slot is not cyclically
+       within (i, j] */
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      dict->slots[i] = dict->slots[j];
+      i = j;
+    }
+  }
+  dict->slots[i].tag = 0;
+  dict->slots[i].id1 = 0;
+}
+
+/** Rebuild the lookup table with the given number of slots (or the current
+    number, if 0) */
+static int dict_hash_rebuild(timeseries_dict_t *dict, uint32_t slots_cnt)
+{
+  dict_hash_slot_t *slots;
+  uint32_t id;
+
+  if (slots_cnt == 0) {
+    memset(dict->slots, 0, sizeof(dict_hash_slot_t) * dict->slots_cnt);
+  } else {
+    if ((slots = calloc(slots_cnt, sizeof(dict_hash_slot_t))) == NULL) {
+      return -1;
+    }
+    free(dict->slots);
+    dict->slots = slots;
+    dict->slots_cnt = slots_cnt;
+  }
+
+  /* the hashes are stored, so this does not touch the keys */
+  for (id = 0; id < dict->cnt; id++) {
+    if ((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) == 0) {
+      dict_hash_insert(dict, id);
+    }
+  }
+  return 0;
+}
+
+static int dict_hash_ensure(timeseries_dict_t *dict, uint32_t cnt)
+{
+  uint64_t slots_cnt = dict->slots_cnt;
+
+  if (slots_cnt != 0 && !DICT_HASH_FULL(slots_cnt, cnt)) {
+    return 0;
+  }
+
+  if (slots_cnt < DICT_HASH_MIN_SLOTS) {
+    slots_cnt = DICT_HASH_MIN_SLOTS;
+  }
+  while (DICT_HASH_FULL(slots_cnt, cnt)) {
+    slots_cnt *= 2;
+  }
+  if (slots_cnt > (UINT64_C(1) << 31)) {
+    return -1;
+  }
+
+  return dict_hash_rebuild(dict, slots_cnt);
+}
+
+/** Get space for the next entry of the block that holds the given (new) key
+ *
+ * Each block must be contiguous, so if the last block does not end at the
+ * end of the current arena chunk (or the chunk is full), it is copied to a new
+ * chunk.
+ */
+static uint8_t *dict_arena_append(timeseries_dict_t *dict, uint32_t id,
+                                  size_t need)
+{
+  dict_arena_chunk_t *chunk = dict->arena;
+  uint64_t b = DICT_BLOCK(id);
+  size_t keep = ((id % DICT_BLOCK_KEYS) == 0) ? 0 : dict->tail_len;
+  size_t size;
+  uint8_t *p;
+
+  if (chunk != NULL && chunk->size - chunk->used >= need &&
+      (keep == 0 || dict->blocks[b] + keep == &chunk->data[chunk->used])) {
+    p = &chunk->data[chunk->used];
+    chunk->used += need;
+    if (keep == 0) {
+      dict->blocks[b] = p;
+    }
+    return p;
+  }
+
+  size = (keep + need > DICT_ARENA_CHUNK_LEN) ? keep + need
+                                              : DICT_ARENA_CHUNK_LEN;
+  if ((chunk = malloc(sizeof(dict_arena_chunk_t) + size)) == NULL) {
+    return NULL;
+  }
+  chunk->prev = dict->arena;
+  chunk->size = size;
+  chunk->used = keep + need;
+  dict->arena = chunk;
+
+  /* the old copy of a moved block stays where it is (until the next
+     compaction), since other threads may be reading it */
+  if (keep != 0) {
+    memcpy(chunk->data, dict->blocks[b], keep);
+    if (dict->grow_lock != NULL) {
+      pthread_mutex_lock(dict->grow_lock);
+    }
+    dict->blocks[b] = chunk->data;
+    if (dict->grow_lock != NULL) {
+      pthread_mutex_unlock(dict->grow_lock);
+    }
+  } else {
+    dict->blocks[b] = chunk->data;
+  }
+  return &chunk->data[keep];
+}
+
+static void dict_storage_free(dict_arena_chunk_t *arena, void *image,
+                              size_t image_len)
+{
+  dict_arena_chunk_t *chunk;
+
+  while ((chunk = arena) != NULL) {
+    arena = chunk->prev;
+    free(chunk);
+  }
+  if (image != NULL) {
+    munmap(image, image_len);
+  }
+}
+
+/** Position of a key hash in a minimal perfect hash with the given number of
+    positions, given the seed of the hash and the pilot of its bucket */
+static inline uint32_t dict_mph_pos(uint64_t hash, uint64_t seed,
+                                    uint32_t pilot, uint32_t cnt)
+{
+  uint64_t h = hash ^ seed ^ ((uint64_t)pilot * UINT64_C(0x9e3779b97f4a7c15));
+
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  return (uint32_t)(((h >> 32) * (uint64_t)cnt) >> 32);
+}
+
+/** Try to find a pilot for each bucket of a minimal perfect hash with the
+ * given seed
+ *
+ * Buckets are placed largest first: for each bucket, pilots are tried in
+ * turn until one sends all of its keys to free positions. There are a few
+ * more positions than keys, so that the last (single key) buckets do not
+ * need long searches.
+ *
+ * @return 0 if every bucket was placed, -1 otherwise
+ */
+static int dict_mph_place(uint64_t seed, uint32_t positions_cnt,
+                          const uint32_t *offsets, const uint32_t *sizes,
+                          const uint64_t *hashes, const uint32_t *order,
+                          uint32_t buckets_cnt, uint16_t *pilots,
+                          uint32_t *positions, uint64_t *taken)
+{
+  uint32_t i, b, k, l, p, size, pilot;
+
+  memset(taken, 0, sizeof(uint64_t) * DICT_BM_WORDS(positions_cnt));
+
+  for (i = 0; i < buckets_cnt && (size = sizes[b = order[i]]) > 0; i++) {
+    for (pilot = 0;; pilot++) {
+      if (pilot > DICT_MPH_PILOT_MAX) {
+        return -1;
+      }
+      for (k = 0; k < size; k++) {
+        p = dict_mph_pos(hashes[offsets[b] + k], seed, pilot, positions_cnt);
+        if ((taken[DICT_BM_WORD(p)] & DICT_BM_BIT(p)) != 0) {
+          break;
+        }
+        for (l = 0; l < k && positions[offsets[b] + l] != p; l++)
+          ;
+        if (l < k) {
+          break;
+        }
+        positions[offsets[b] + k] = p;
+      }
+      if (k == size) {
+        break;
+      }
+    }
+    for (k = 0; k < size; k++) {
+      p = positions[offsets[b] + k];
+      taken[DICT_BM_WORD(p)] |= DICT_BM_BIT(p);
+    }
+    pilots[b] = pilot;
+  }
+
+  return 0;
+}
+
+/** Build a minimal perfect hash of the live keys of a dictionary
+ *
+ * Keys are hashed into buckets (of DICT_MPH_BUCKET_KEYS keys on average),
+ * and each bucket is given a pilot that places its keys in distinct
+ * positions (see dict_mph_place). Keys placed beyond the last slot are moved
+ * to the slots left free below it (through the remap column), so that there
+ * is exactly one slot per key. If the same key was added more than once,
+ * only the first copy (which is the one found by the lookup table) is kept.
+ */
+static int dict_mph_build(timeseries_dict_t *dict)
+{
+  uint32_t live_cnt = dict->cnt - dict->removed_cnt;
+  uint32_t buckets_cnt = live_cnt / DICT_MPH_BUCKET_KEYS + 1;
+  uint32_t *offsets = NULL;
+  uint32_t *sizes = NULL;
+  uint32_t *keys = NULL;
+  uint32_t *order = NULL;
+  uint32_t *size_offsets = NULL;
+  uint32_t *positions = NULL;
+  uint64_t *hashes = NULL;
+  uint16_t *pilots = NULL;
+  dict_hash_slot_t *slots = NULL;
+  uint32_t *remap = NULL;
+  uint64_t *taken = NULL;
+  dict_buf_t buf_a, buf_b;
+  uint32_t cnt = 0, positions_cnt, max_size = 0;
+  uint32_t id, b, i, j, k, p, s, size;
+  uint64_t seed = 0;
+  int rc = -1;
+
+  memset(&buf_a, 0, sizeof(buf_a));
+  memset(&buf_b, 0, sizeof(buf_b));
+
+  if ((uint64_t)DICT_MPH_POSITIONS((uint64_t)live_cnt) > UINT32_MAX) {
+    timeseries_log(__func__, "too many keys to freeze");
+    return -1;
+  }
+
+  if ((offsets = calloc(buckets_cnt + 1, sizeof(uint32_t))) == NULL ||
+      (sizes = malloc(sizeof(uint32_t) * buckets_cnt)) == NULL ||
+      (keys = malloc(sizeof(uint32_t) * (live_cnt + 1))) == NULL ||
+      (positions = malloc(sizeof(uint32_t) * (live_cnt + 1))) == NULL ||
+      (hashes = malloc(sizeof(uint64_t) * (live_cnt + 1))) == NULL ||
+      (order = malloc(sizeof(uint32_t) * buckets_cnt)) == NULL ||
+      (pilots = calloc(buckets_cnt, sizeof(uint16_t))) == NULL) {
+    goto nomem;
+  }
+
+  /* group the live keys by bucket (in ID order within each bucket) */
+  for (id = 0; id < dict->cnt; id++) {
+    if ((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) == 0) {
+      offsets[DICT_MPH_BUCKET(dict->hashes[id], buckets_cnt) + 1]++;
+    }
+  }
+  for (b = 0; b < buckets_cnt; b++) {
+    offsets[b + 1] += offsets[b];
+  }
+  for (id = 0; id < dict->cnt; id++) {
+    if ((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) == 0) {
+      keys[offsets[DICT_MPH_BUCKET(dict->hashes[id], buckets_cnt)]++] = id;
+    }
+  }
+  for (b = buckets_cnt; b > 0; b--) {
+    offsets[b] = offsets[b - 1];
+  }
+  offsets[0] = 0;
+
+  /* drop repeated keys (which would always land in the same position) */
+  for (b = 0; b < buckets_cnt; b++) {
+    size = offsets[b + 1] - offsets[b];
+    for (j = 1; j < size; j++) {
+      for (i = 0; i < j; i++) {
+        if (dict->hashes[keys[offsets[b] + i]] !=
+            dict->hashes[keys[offsets[b] + j]]) {
+          continue;
+        }
+        if (dict_decode(dict, keys[offsets[b] + i], &buf_a) == NULL ||
+            dict_decode(dict, keys[offsets[b] + j], &buf_b) == NULL) {
+          goto nomem;
+        }
+        if (buf_a.len != buf_b.len ||
+            memcmp(buf_a.key, buf_b.key, buf_a.len) != 0) {
+          timeseries_log(__func__, "could not freeze dictionary: keys '%s' "
+                                   "and '%s' have the same hash",
+                         buf_a.key, buf_b.key);
+          goto done;
+        }
+        memmove(&keys[offsets[b] + j], &keys[offsets[b] + j + 1],
+                sizeof(uint32_t) * (size - j - 1));
+        size--;
+        j--;
+        break;
+      }
+    }
+    sizes[b] = size;
+    cnt += size;
+    /* keep the hashes of each bucket together while pilots are searched */
+    for (k = 0; k < size; k++) {
+      hashes[offsets[b] + k] = dict->hashes[keys[offsets[b] + k]];
+    }
+    if (size > max_size) {
+      max_size = size;
+    }
+  }
+  positions_cnt = DICT_MPH_POSITIONS(cnt);
+
+  /* sort the buckets by decreasing size */
+  if ((size_offsets = calloc(max_size + 2, sizeof(uint32_t))) == NULL ||
+      (slots = malloc(sizeof(dict_hash_slot_t) * (cnt + 1))) == NULL ||
+      (remap = calloc(positions_cnt - cnt, sizeof(uint32_t))) == NULL ||
+      (taken = malloc(sizeof(uint64_t) * DICT_BM_WORDS(positions_cnt))) ==
+        NULL) {
+    goto nomem;
+  }
+  for (b = 0; b < buckets_cnt; b++) {
+    size_offsets[max_size - sizes[b] + 1]++;
+  }
+  for (s = 0; s < max_size; s++) {
+    size_offsets[s + 1] += size_offsets[s];
+  }
+  for (b = 0; b < buckets_cnt; b++) {
+    order[size_offsets[max_size - sizes[b]]++] = b;
+  }
+
+  /* a seed only fails if some bucket needs an unusually large pilot */
+  while (dict_mph_place(seed, positions_cnt, offsets, sizes, hashes, order,
+                        buckets_cnt, pilots, positions, taken) != 0) {
+    if (++seed == DICT_MPH_SEEDS) {
+      timeseries_log(__func__, "could not find a perfect hash of the keys");
+      goto done;
+    }
+  }
+
+  /* fill the slots, moving the keys placed beyond the last slot into the
+     free slots */
+  for (b = 0; b < buckets_cnt; b++) {
+    for (k = 0; k < sizes[b]; k++) {
+      id = keys[offsets[b] + k];
+      if ((p = positions[offsets[b] + k]) < cnt) {
+        slots[p].tag = (uint32_t)hashes[offsets[b] + k];
+        slots[p].id1 = id + 1;
+      }
+    }
+  }
+  for (p = cnt, s = 0; p < positions_cnt; p++) {
+    if ((taken[DICT_BM_WORD(p)] & DICT_BM_BIT(p)) == 0) {
+      continue;
+    }
+    while ((taken[DICT_BM_WORD(s)] & DICT_BM_BIT(s)) != 0) {
+      s++;
+    }
+    taken[DICT_BM_WORD(s)] |= DICT_BM_BIT(s);
+    remap[p - cnt] = s;
+  }
+  for (b = 0; b < buckets_cnt; b++) {
+    for (k = 0; k < sizes[b]; k++) {
+      id = keys[offsets[b] + k];
+      if ((p = positions[offsets[b] + k]) >= cnt) {
+        slots[remap[p - cnt]].tag = (uint32_t)hashes[offsets[b] + k];
+        slots[remap[p - cnt]].id1 = id + 1;
+      }
+    }
+  }
+
+  dict->mph_pilots = pilots;
+  dict->mph_buckets_cnt = buckets_cnt;
+  dict->mph_seed = seed;
+  dict->mph_slots = slots;
+  dict->mph_cnt = cnt;
+  dict->mph_remap = remap;
+  pilots = NULL;
+  slots = NULL;
+  remap = NULL;
+  rc = 0;
+  goto done;
+
+nomem:
+  timeseries_log(__func__, "could not malloc perfect hash");
+done:
+  free(buf_a.key);
+  free(buf_b.key);
+  free(offsets);
+  free(sizes);
+  free(keys);
+  free(positions);
+  free(hashes);
+  free(order);
+  free(size_offsets);
+  free(pilots);
+  free(slots);
+  free(remap);
+  free(taken);
+  return rc;
+}
+
+/** Find the ID of a key in a frozen dictionary */
+static int dict_mph_find(timeseries_dict_t *dict, const char *key, size_t len,
+                         uint64_t hash)
+{
+  dict_hash_slot_t *slot;
+  uint32_t pilot, p;
+
+  if (dict->mph_cnt == 0) {
+    return -1;
+  }
+
+  pilot = dict->mph_pilots[DICT_MPH_BUCKET(hash, dict->mph_buckets_cnt)];
+  p = dict_mph_pos(hash, dict->mph_seed, pilot,
+                   DICT_MPH_POSITIONS(dict->mph_cnt));
+  if (p >= dict->mph_cnt) {
+    p = dict->mph_remap[p - dict->mph_cnt];
+  }
+
+  /* keys that are not in the dictionary land in some slot too */
+  slot = &dict->mph_slots[p];
+  if (slot->tag != (uint32_t)hash ||
+      dict_key_equal(dict, slot->id1 - 1, key, len) == 0) {
+    return -1;
+  }
+  return slot->id1 - 1;
+}
+
+/** Save the given key as the last key added */
+static int dict_set_last_key(timeseries_dict_t *dict, const char *key,
+                             size_t len)
+{
+  if (dict_buf_reserve(&dict->last_key, &dict->last_key_alloc, len + 1) !=
+      0) {
+    return -1;
+  }
+  memcpy(dict->last_key, key, len);
+  dict->last_key_len = len;
+  return 0;
+}
+
+/** Write the given buffer to a checkpoint, padded to a multiple of 8 bytes
+    (if buf is NULL, only the padding is written) */
+static int dict_write_buf(FILE *fh, const void *buf, size_t len)
+{
+  static const uint8_t zeros[8] = {0};
+  size_t pad = DICT_ALIGN(len) - len;
+
+  if ((buf != NULL && len > 0 && fwrite(buf, len, 1, fh) != 1) ||
+      (pad > 0 && fwrite(zeros, pad, 1, fh) != 1)) {
+    return -1;
+  }
+  return 0;
+}
+
+/** Write the hash of each key to a checkpoint (frozen dictionaries do not
+    keep their hashes, so they are computed again) */
+static int dict_write_hashes(timeseries_dict_t *dict, FILE *fh)
+{
+  uint64_t hashes[512];
+  dict_buf_t buf;
+  uint32_t id, n = 0;
+  int rc = -1;
+
+  if (dict->hashes != NULL) {
+    return dict_write_buf(fh, dict->hashes, sizeof(uint64_t) * dict->cnt);
+  }
+
+  memset(&buf, 0, sizeof(buf));
+  for (id = 0; id < dict->cnt; id++) {
+    if (dict_decode(dict, id, &buf) == NULL) {
+      goto done;
+    }
+    hashes[n++] = timeseries_dict_hash(buf.key, buf.len);
+    if (n == 512 || id + 1 == dict->cnt) {
+      if (fwrite(hashes, sizeof(uint64_t) * n, 1, fh) != 1) {
+        goto done;
+      }
+      n = 0;
+    }
+  }
+  rc = 0;
+
+done:
+  free(buf.key);
+  return rc;
+}
+
+/* ========== PROTECTED FUNCTIONS ========== */
+
+timeseries_dict_t *timeseries_dict_init(void)
+{
+  timeseries_dict_t *dict;
+
+  if ((dict = malloc_zero(sizeof(timeseries_dict_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc key dictionary");
+    return NULL;
+  }
+  dict->uid = dict_new_uid();
+
+  return dict;
+}
+
+void timeseries_dict_free(timeseries_dict_t **dict_p)
+{
+  timeseries_dict_t *dict;
+
+  assert(dict_p != NULL);
+  if ((dict = *dict_p) == NULL) {
+    return;
+  }
+  *dict_p = NULL;
+
+  dict_storage_free(dict->arena, dict->image, dict->image_len);
+  free(dict->blocks);
+  free(dict->hashes);
+  free(dict->removed);
+  free(dict->slots);
+  free(dict->mph_pilots);
+  free(dict->mph_slots);
+  free(dict->mph_remap);
+  free(dict->last_key);
+  free(dict);
+}
+
+void timeseries_dict_set_lock(timeseries_dict_t *dict, pthread_mutex_t *lock)
+{
+  dict->grow_lock = lock;
+}
+
+uint32_t timeseries_dict_size(timeseries_dict_t *dict)
+{
+  return dict->cnt;
+}
+
+int timeseries_dict_reserve(timeseries_dict_t *dict, uint32_t cnt)
+{
+  if (dict->frozen != 0) {
+    return (cnt > dict->cnt) ? -1 : 0;
+  }
+  if (cnt > dict->alloc && dict_grow(dict, cnt) != 0) {
+    return -1;
+  }
+  return dict_hash_ensure(dict, cnt - dict->removed_cnt);
+}
+
+uint64_t timeseries_dict_hash(const char *key, size_t len)
+{
+  const char *p = key;
+  uint64_t h = len * DICT_HASH_C2;
+  uint64_t w;
+
+  /* mix in 8 bytes at a time, then avalanche so that the low bits (used to
+     index the lookup table) and high bits (used as a tag) are both well
+     distributed */
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    w *= DICT_HASH_C1;
+    w = DICT_HASH_ROTL(w, 31);
+    w *= DICT_HASH_C2;
+    h ^= w;
+    h = DICT_HASH_ROTL(h, 27) * 5 + 0x52dce729;
+  }
+  if (len > 0) {
+    w = 0;
+    memcpy(&w, p, len);
+    w *= DICT_HASH_C1;
+    w = DICT_HASH_ROTL(w, 31);
+    w *= DICT_HASH_C2;
+    h ^= w;
+  }
+
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+int timeseries_dict_add(timeseries_dict_t *dict, const char *key, size_t len,
+                        uint64_t hash)
+{
+  uint32_t id = dict->cnt;
+  size_t lcp = 0;
+  size_t max, need;
+  uint8_t *p;
+
+  if (dict->frozen != 0) {
+    timeseries_log(__func__, "cannot add keys to a frozen dictionary");
+    return -1;
+  }
+
+  if (dict_ensure(dict, id + 1) != 0 ||
+      dict_hash_ensure(dict, id + 1 - dict->removed_cnt) != 0 ||
+      dict_buf_reserve(&dict->last_key, &dict->last_key_alloc, len + 1) != 0) {
+    timeseries_log(__func__, "could not grow key dictionary");
+    return -1;
+  }
+
+  /* front-code the key against the previous key (unless it is the first key
+     in a block) */
+  if ((id % DICT_BLOCK_KEYS) != 0) {
+    max = (len < dict->last_key_len) ? len : dict->last_key_len;
+    while (lcp < max && dict->last_key[lcp] == key[lcp]) {
+      lcp++;
+    }
+  }
+
+  need = dict_varint_len(lcp) + dict_varint_len(len - lcp) + (len - lcp);
+  if ((p = dict_arena_append(dict, id, need)) == NULL) {
+    timeseries_log(__func__, "could not malloc key storage");
+    return -1;
+  }
+  p += dict_varint_put(p, lcp);
+  p += dict_varint_put(p, len - lcp);
+  memcpy(p, &key[lcp], len - lcp);
+  dict->tail_len = ((id % DICT_BLOCK_KEYS) == 0) ? need : dict->tail_len + need;
+
+  /* cannot fail, since the buffer was reserved above */
+  dict_set_last_key(dict, key, len);
+
+  /* the removed bit is already clear (bits beyond the last key always are) */
+  dict->hashes[id] = hash;
+  dict->cnt++;
+  dict_hash_insert(dict, id);
+
+  return id;
+}
+
+int timeseries_dict_find(timeseries_dict_t *dict, const char *key, size_t len,
+                         uint64_t hash)
+{
+  uint32_t mask = dict->slots_cnt - 1;
+  uint32_t tag = hash >> 32;
+  uint32_t i;
+  dict_hash_slot_t *slot;
+
+  if (dict->frozen != 0) {
+    return dict_mph_find(dict, key, len, hash);
+  }
+  if (dict->slots_cnt == 0) {
+    return -1;
+  }
+
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &dict->slots[i];
+    if (slot->id1 == 0) {
+      return -1;
+    }
+    if (slot->tag == tag && dict_key_equal(dict, slot->id1 - 1, key, len)) {
+      return slot->id1 - 1;
+    }
+  }
+}
+
+const char *timeseries_dict_get(timeseries_dict_t *dict, uint32_t id)
+{
+  dict_buf_t *buf;
+
+  /* the ID is not checked against cnt, which may be growing in another
+     thread (see timeseries_dict_set_lock) */
+  if ((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) != 0 ||
+      (buf = dict_thread_buf()) == NULL) {
+    return NULL;
+  }
+  return dict_decode(dict, id, buf);
+}
+
+void timeseries_dict_remove(timeseries_dict_t *dict, uint32_t id)
+{
+  assert(id < dict->cnt);
+  assert((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) == 0);
+  assert(dict->frozen == 0);
+
+  dict_hash_delete(dict, id);
+
+  /* readers check the removed bits of the other keys in the same word */
+  if (dict->grow_lock != NULL) {
+    pthread_mutex_lock(dict->grow_lock);
+  }
+  dict->removed[DICT_BM_WORD(id)] |= DICT_BM_BIT(id);
+  if (dict->grow_lock != NULL) {
+    pthread_mutex_unlock(dict->grow_lock);
+  }
+  dict->removed_cnt++;
+}
+
+int timeseries_dict_is_removed(timeseries_dict_t *dict, uint32_t id)
+{
+  assert(id < dict->cnt);
+  return (dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) != 0;
+}
+
+int timeseries_dict_compact(timeseries_dict_t *dict, uint32_t *remap)
+{
+  timeseries_dict_t new_dict;
+  dict_arena_chunk_t *chunk = NULL;
+  dict_buf_t buf;
+  const char *key;
+  uint64_t data_len = 0;
+  uint32_t new_cnt = 0;
+  uint32_t id;
+  size_t lcp, max, tail_len = 0;
+  uint8_t *p;
+
+  assert(dict->frozen == 0);
+  memset(&buf, 0, sizeof(buf));
+  memset(&new_dict, 0, sizeof(new_dict));
+
+  /* size the new storage exactly (by encoding the live keys twice), so that
+     nothing can fail once the old storage starts being replaced */
+  for (id = 0; id < dict->cnt; id++) {
+    if ((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) != 0) {
+      continue;
+    }
+    if ((key = dict_decode(dict, id, &buf)) == NULL) {
+      goto err;
+    }
+    lcp = 0;
+    if ((new_cnt % DICT_BLOCK_KEYS) != 0) {
+      max = (buf.len < new_dict.last_key_len) ? buf.len
+                                              : new_dict.last_key_len;
+      while (lcp < max && new_dict.last_key[lcp] == key[lcp]) {
+        lcp++;
+      }
+    }
+    data_len += dict_varint_len(lcp) + dict_varint_len(buf.len - lcp) +
+                (buf.len - lcp);
+    if (dict_set_last_key(&new_dict, key, buf.len) != 0) {
+      goto err;
+    }
+    new_cnt++;
+  }
+
+  new_dict.alloc = (new_cnt > DICT_MIN_ALLOC) ? new_cnt : DICT_MIN_ALLOC;
+  if ((chunk = malloc(sizeof(dict_arena_chunk_t) + data_len)) == NULL ||
+      (new_dict.blocks = malloc(sizeof(uint8_t *) *
+                                DICT_BLOCKS(new_dict.alloc))) == NULL ||
+      (new_dict.hashes = malloc(sizeof(uint64_t) * new_dict.alloc)) == NULL ||
+      (new_dict.removed = calloc(DICT_BM_WORDS(new_dict.alloc),
+                                 sizeof(uint64_t))) == NULL) {
+    goto err;
+  }
+  chunk->prev = NULL;
+  chunk->size = data_len;
+  chunk->used = data_len;
+
+  /* now re-encode the live keys into the new storage */
+  p = chunk->data;
+  new_dict.last_key_len = 0;
+  new_cnt = 0;
+  for (id = 0; id < dict->cnt; id++) {
+    if ((dict->removed[DICT_BM_WORD(id)] & DICT_BM_BIT(id)) != 0) {
+      remap[id] = UINT32_MAX;
+      continue;
+    }
+    key = dict_decode(dict, id, &buf);
+    assert(key != NULL);
+    lcp = 0;
+    if ((new_cnt % DICT_BLOCK_KEYS) == 0) {
+      new_dict.blocks[DICT_BLOCK(new_cnt)] = p;
+      tail_len = 0;
+    } else {
+      max = (buf.len < new_dict.last_key_len) ? buf.len
+                                              : new_dict.last_key_len;
+      while (lcp < max && new_dict.last_key[lcp] == key[lcp]) {
+        lcp++;
+      }
+    }
+    tail_len += dict_varint_put(p + tail_len, lcp);
+    tail_len += dict_varint_put(p + tail_len, buf.len - lcp);
+    memcpy(p + tail_len, &key[lcp], buf.len - lcp);
+    tail_len += buf.len - lcp;
+    if ((new_cnt % DICT_BLOCK_KEYS) == DICT_BLOCK_KEYS - 1) {
+      p += tail_len;
+    }
+    /* the buffer is already big enough for the longest key */
+    dict_set_last_key(&new_dict, key, buf.len);
+    new_dict.hashes[new_cnt] = dict->hashes[id];
+    remap[id] = new_cnt++;
+  }
+  free(buf.key);
+
+  if (dict->grow_lock != NULL) {
+    pthread_mutex_lock(dict->grow_lock);
+  }
+  dict_storage_free(dict->arena, dict->image, dict->image_len);
+  free(dict->blocks);
+  free(dict->hashes);
+  free(dict->removed);
+  free(dict->last_key);
+  dict->arena = chunk;
+  dict->image = NULL;
+  dict->image_len = 0;
+  dict->blocks = new_dict.blocks;
+  dict->hashes = new_dict.hashes;
+  dict->removed = new_dict.removed;
+  dict->alloc = new_dict.alloc;
+  dict->cnt = new_cnt;
+  dict->removed_cnt = 0;
+  dict->tail_len = tail_len;
+  dict->last_key = new_dict.last_key;
+  dict->last_key_len = new_dict.last_key_len;
+  dict->last_key_alloc = new_dict.last_key_alloc;
+  /* any keys decoded from the old blocks are no longer valid */
+  dict->uid = dict_new_uid();
+  if (dict->grow_lock != NULL) {
+    pthread_mutex_unlock(dict->grow_lock);
+  }
+
+  /* the table is at least as big as it needs to be */
+  dict_hash_rebuild(dict, 0);
+  return 0;
+
+err:
+  timeseries_log(__func__, "could not malloc compacted key dictionary");
+  free(buf.key);
+  free(chunk);
+  free(new_dict.blocks);
+  free(new_dict.hashes);
+  free(new_dict.removed);
+  free(new_dict.last_key);
+  return -1;
+}
+
+int timeseries_dict_freeze(timeseries_dict_t *dict)
+{
+  if (dict->frozen != 0) {
+    return 0;
+  }
+
+  if (dict_mph_build(dict) != 0) {
+    return -1;
+  }
+  dict->frozen = 1;
+
+  /* the lookup table (and spare column space) is no longer needed, since no
+     more keys can be added */
+  free(dict->slots);
+  dict->slots = NULL;
+  dict->slots_cnt = 0;
+  if (dict->cnt > 0 && dict->cnt < dict->alloc) {
+    /* a failed shrink leaves a column larger than alloc, which is harmless */
+    dict_grow(dict, dict->cnt);
+  }
+
+  /* nor are the hashes, which are only used to rebuild the lookup table (the
+     perfect hash keeps a fingerprint of each key) */
+  free(dict->hashes);
+  dict->hashes = NULL;
+
+  return 0;
+}
+
+int timeseries_dict_write(timeseries_dict_t *dict, FILE *fh)
+{
+  dict_image_hdr_t hdr;
+  uint64_t blocks_cnt = DICT_BLOCKS(dict->cnt);
+  uint64_t *offsets = NULL;
+  uint64_t b;
+
+  if ((offsets = malloc(sizeof(uint64_t) * (blocks_cnt + 1))) == NULL) {
+    timeseries_log(__func__, "could not malloc block offsets");
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.key_cnt = dict->cnt;
+  hdr.removed_cnt = dict->removed_cnt;
+  for (b = 0; b < blocks_cnt; b++) {
+    offsets[b] = hdr.data_len;
+    hdr.data_len += dict_block_len(dict, b);
+  }
+
+  if (dict_write_buf(fh, &hdr, sizeof(hdr)) != 0 ||
+      dict_write_hashes(dict, fh) != 0 ||
+      dict_write_buf(fh, dict->removed,
+                     sizeof(uint64_t) * DICT_BM_WORDS(dict->cnt)) != 0 ||
+      dict_write_buf(fh, offsets, sizeof(uint64_t) * blocks_cnt) != 0) {
+    goto err;
+  }
+  for (b = 0; b < blocks_cnt; b++) {
+    if (fwrite(dict->blocks[b], (b + 1 < blocks_cnt ? offsets[b + 1]
+                                                    : hdr.data_len) -
+                                  offsets[b],
+               1, fh) != 1) {
+      goto err;
+    }
+  }
+  if (dict_write_buf(fh, NULL, hdr.data_len) != 0) {
+    goto err;
+  }
+
+  free(offsets);
+  return 0;
+
+err:
+  timeseries_log(__func__, "could not write key dictionary");
+  free(offsets);
+  return -1;
+}
+
+ssize_t timeseries_dict_map(timeseries_dict_t *dict, void *image,
+                            size_t image_len, size_t offset)
+{
+  const uint8_t *base = image;
+  const dict_image_hdr_t *hdr;
+  const uint64_t *hashes, *removed, *offsets;
+  const uint8_t *data, *p, *end;
+  uint64_t blocks_cnt, words, pos, b, lcp, slen, prev_len;
+  uint32_t id, removed_cnt = 0;
+  dict_buf_t buf;
+
+  memset(&buf, 0, sizeof(buf));
+
+  /* only an empty dictionary can be mapped */
+  if (dict->cnt != 0 || dict->image != NULL || dict->frozen != 0 ||
+      offset + sizeof(dict_image_hdr_t) > image_len) {
+    return -1;
+  }
+  hdr = (const dict_image_hdr_t *)(base + offset);
+  blocks_cnt = DICT_BLOCKS(hdr->key_cnt);
+  words = DICT_BM_WORDS(hdr->key_cnt);
+  hashes = (const uint64_t *)(hdr + 1);
+  removed = hashes + hdr->key_cnt;
+  offsets = removed + words;
+  data = (const uint8_t *)(offsets + blocks_cnt);
+  pos = offset + sizeof(dict_image_hdr_t) +
+        sizeof(uint64_t) * (hdr->key_cnt + words + blocks_cnt);
+  if (pos > image_len || hdr->data_len > image_len - pos ||
+      pos + DICT_ALIGN(hdr->data_len) > image_len) {
+    return -1;
+  }
+  pos += DICT_ALIGN(hdr->data_len);
+
+  /* check every entry, so that keys can be decoded without checks later */
+  for (b = 0; b < blocks_cnt; b++) {
+    if (offsets[b] > hdr->data_len) {
+      return -1;
+    }
+    p = data + offsets[b];
+    end = data + hdr->data_len;
+    prev_len = 0;
+    for (id = b * DICT_BLOCK_KEYS;
+         id < hdr->key_cnt && id < (b + 1) * DICT_BLOCK_KEYS; id++) {
+      if ((p = dict_varint_get(p, end, &lcp)) == NULL ||
+          (p = dict_varint_get(p, end, &slen)) == NULL || lcp > prev_len ||
+          slen > (uint64_t)(end - p)) {
+        return -1;
+      }
+      p += slen;
+      prev_len = lcp + slen;
+    }
+    if (b == blocks_cnt - 1) {
+      dict->tail_len = p - (data + offsets[b]);
+    }
+  }
+  for (b = 0; b < words; b++) {
+    removed_cnt += __builtin_popcountll(removed[b]);
+  }
+  if (removed_cnt != hdr->removed_cnt ||
+      (words > 0 && (hdr->key_cnt & 63) != 0 &&
+       (removed[words - 1] >> (hdr->key_cnt & 63)) != 0)) {
+    return -1;
+  }
+
+  /* the blocks are used in place, but the other columns are copied so that
+     keys can be added and removed */
+  if (hdr->key_cnt > 0) {
+    if (dict_grow(dict, hdr->key_cnt) != 0) {
+      goto err;
+    }
+    memcpy(dict->hashes, hashes, sizeof(uint64_t) * hdr->key_cnt);
+    memcpy(dict->removed, removed, sizeof(uint64_t) * words);
+  }
+  for (b = 0; b < blocks_cnt; b++) {
+    dict->blocks[b] = data + offsets[b];
+  }
+  dict->cnt = hdr->key_cnt;
+  dict->removed_cnt = hdr->removed_cnt;
+
+  /* the next key added is front-coded against the last key */
+  if (dict->cnt > 0) {
+    if (dict_decode(dict, dict->cnt - 1, &buf) == NULL ||
+        dict_set_last_key(dict, buf.key, buf.len) != 0) {
+      goto err;
+    }
+  }
+  free(buf.key);
+
+  if (dict_hash_ensure(dict, dict->cnt - dict->removed_cnt) != 0) {
+    dict->cnt = 0;
+    dict->removed_cnt = 0;
+    return -1;
+  }
+  if (dict->slots_cnt > 0) {
+    dict_hash_rebuild(dict, 0);
+  }
+
+  dict->image = image;
+  dict->image_len = image_len;
+  return pos;
+
+err:
+  free(buf.key);
+  dict->cnt = 0;
+  dict->removed_cnt = 0;
+  return -1;
+}
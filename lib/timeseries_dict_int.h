@@ -0,0 +1,238 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __TIMESERIES_DICT_INT_H
+#define __TIMESERIES_DICT_INT_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/** @file
+ *
+ * @brief Header file that contains the protected interface to a key
+ * dictionary
+ *
+ * A key dictionary assigns dense IDs (in insertion order) to key strings, and
+ * maps key strings back to their IDs. It is used by Key Packages to store
+ * their keys.
+ *
+ * Keys are front-coded: they are stored in blocks of consecutive IDs, where
+ * the first key of each block is stored in full, and each following key is
+ * stored as the length of the prefix it shares with the previous key, plus
+ * the rest of the key. Hierarchical (e.g. Graphite) keys that are added in
+ * roughly sorted order share long prefixes, so this uses a fraction of the
+ * memory of storing each key separately. Keys are found by an open-addressed
+ * hash table of key IDs.
+ *
+ * The strings returned by timeseries_dict_get are decoded into a per-thread
+ * buffer.
+ *
+ * @author Alistair King
+ *
+ */
+
+/**
+ * @name Protected Opaque Data Structures
+ *
+ * @{ */
+
+/** Opaque struct holding the state of a key dictionary */
+typedef struct timeseries_dict timeseries_dict_t;
+
+/** @} */
+
+/** Create a new (empty) key dictionary
+ *
+ * @return a pointer to a dictionary, NULL if an error occurred
+ */
+timeseries_dict_t *timeseries_dict_init(void);
+
+/** Free a key dictionary
+ *
+ * @param dict_p        Double pointer to the dictionary to free
+ */
+void timeseries_dict_free(timeseries_dict_t **dict_p);
+
+/** Set a lock to hold while moving the dictionary columns
+ *
+ * @param dict          Pointer to a dictionary
+ * @param lock          Pointer to a mutex, or NULL to not use a lock
+ *
+ * Threads other than the owner may get keys from the dictionary while the
+ * owner adds keys, as long as they hold the given lock while doing so.
+ * The lock is only taken by the owner when it needs to move the dictionary
+ * columns (or removes a key), and not for every key that is added.
+ */
+void timeseries_dict_set_lock(timeseries_dict_t *dict, pthread_mutex_t *lock);
+
+/** Get the number of keys in the dictionary (including removed keys)
+ *
+ * @param dict          Pointer to a dictionary
+ * @return the number of keys in the dictionary
+ */
+uint32_t timeseries_dict_size(timeseries_dict_t *dict);
+
+/** Make space for the given number of keys in the dictionary
+ *
+ * @param dict          Pointer to a dictionary
+ * @param cnt           Total number of keys to make space for
+ * @return 0 if the space was allocated, -1 otherwise
+ */
+int timeseries_dict_reserve(timeseries_dict_t *dict, uint32_t cnt);
+
+/** Hash a key string
+ *
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @return the 64 bit hash of the key
+ */
+uint64_t timeseries_dict_hash(const char *key, size_t len);
+
+/** Add a key to the dictionary
+ *
+ * @param dict          Pointer to a dictionary
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @param hash          Hash of the key (as returned by timeseries_dict_hash)
+ * @return the ID of the key, -1 if an error occurred
+ *
+ * The key is always added (with the next ID), even if it is already in the
+ * dictionary.
+ */
+int timeseries_dict_add(timeseries_dict_t *dict, const char *key, size_t len,
+                        uint64_t hash);
+
+/** Find the ID of a key in the dictionary
+ *
+ * @param dict          Pointer to a dictionary
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @param hash          Hash of the key (as returned by timeseries_dict_hash)
+ * @return the ID of the key, -1 if it is not in the dictionary
+ *
+ * Finding a key does not write to the dictionary, so several threads may find
+ * keys at once (as long as no keys are being added or removed).
+ */
+int timeseries_dict_find(timeseries_dict_t *dict, const char *key, size_t len,
+                         uint64_t hash);
+
+/** Get the key string with the given ID
+ *
+ * @param dict          Pointer to a dictionary
+ * @param id            ID of the key
+ * @return a pointer to the NUL-terminated key, NULL if the key has been
+ * removed (or an error occurred)
+ *
+ * The key is decoded into a buffer that belongs to the calling thread, and
+ * is only valid until the next call to timeseries_dict_get in the same
+ * thread. Getting keys in increasing ID order is the fastest.
+ */
+const char *timeseries_dict_get(timeseries_dict_t *dict, uint32_t id);
+
+/** Remove a key from the dictionary
+ *
+ * @param dict          Pointer to a dictionary
+ * @param id            ID of the key to remove
+ *
+ * The ID of a removed key is not reused, and its string is kept until the
+ * dictionary is compacted.
+ */
+void timeseries_dict_remove(timeseries_dict_t *dict, uint32_t id);
+
+/** Has the key with the given ID been removed?
+ *
+ * @param dict          Pointer to a dictionary
+ * @param id            ID of the key
+ * @return 1 if the key has been removed, 0 otherwise
+ */
+int timeseries_dict_is_removed(timeseries_dict_t *dict, uint32_t id);
+
+/** Drop the removed keys from the dictionary, renumbering the live keys
+ *
+ * @param dict          Pointer to a dictionary
+ * @param[out] remap    Array (indexed by old ID) filled with the new ID of
+ *                      each key (UINT32_MAX for removed keys)
+ * @return 0 if the dictionary was compacted, -1 if an error occurred (in
+ * which case the dictionary is unchanged)
+ *
+ * Live keys keep their relative order.
+ */
+int timeseries_dict_compact(timeseries_dict_t *dict, uint32_t *remap);
+
+/** Freeze the dictionary, so that no more keys can be added or removed
+ *
+ * @param dict          Pointer to a dictionary
+ * @return 0 if the dictionary was frozen, -1 if an error occurred (in which
+ * case the dictionary is unchanged)
+ *
+ * The lookup table is replaced by a minimal perfect hash of the live keys,
+ * so that finding a key takes one hash, one fingerprint compare and one key
+ * compare, with no probing. The perfect hash uses about 8.6 bytes per key,
+ * rather than the 11 to 21 bytes used by the lookup table, plus the 8 bytes
+ * per key of stored hashes (which are no longer needed).
+ *
+ * Once frozen, keys cannot be added (timeseries_dict_add fails) or removed,
+ * the dictionary cannot be compacted, and it cannot be unfrozen.
+ */
+int timeseries_dict_freeze(timeseries_dict_t *dict);
+
+/** Write the dictionary to a checkpoint file
+ *
+ * @param dict          Pointer to a dictionary
+ * @param fh            File to write to (at an offset that is a multiple of
+ *                      8 bytes)
+ * @return 0 if the dictionary was written, -1 otherwise
+ *
+ * The dictionary is written in host byte order, and padded to a multiple of
+ * 8 bytes.
+ */
+int timeseries_dict_write(timeseries_dict_t *dict, FILE *fh);
+
+/** Use a dictionary written by timeseries_dict_write in place
+ *
+ * @param dict          Pointer to an empty dictionary
+ * @param image         Pointer to a (read-only) mapping of a checkpoint file
+ * @param image_len     Length of the mapping
+ * @param offset        Offset of the dictionary within the mapping
+ * @return the offset of the end of the dictionary within the mapping, -1 if
+ * the dictionary is not valid
+ *
+ * If the dictionary is valid, the keys are used in place and the dictionary
+ * takes ownership of the mapping (which is unmapped when the dictionary is
+ * compacted or freed). Otherwise the caller still owns the mapping.
+ */
+ssize_t timeseries_dict_map(timeseries_dict_t *dict, void *image,
+                            size_t image_len, size_t offset);
+
+#endif /* __TIMESERIES_DICT_INT_H */
@@ -36,6 +36,8 @@
 #include <inttypes.h>
 
 #include "timeseries_pub.h"
+#include "timeseries_backend_pub.h"
+#include "timeseries_keys_int.h"
 
 /** @file
  *
@@ -66,6 +68,58 @@
  *
  * @{ */
 
+/** Function to call on a backend (see timeseries_backends_foreach)
+ *
+ * @param backend       Pointer to the (enabled) backend to operate on
+ * @param arg           User argument passed to timeseries_backends_foreach
+ * @return 0 if the call succeeded, -1 otherwise
+ */
+typedef int(timeseries_backend_fn_t)(timeseries_backend_t *backend,
+                                     void *arg);
+
 /** @} */
 
+/** Take exclusive use of the backends of the given timeseries instance
+ *
+ * @param timeseries    pointer to a timeseries instance
+ *
+ * Backends are not thread-safe, so this must be held while calling into a
+ * backend (e.g. kp_flush or set_single), since Key Packages may flush to the
+ * backends from their own writer threads.
+ */
+void timeseries_backends_lock(timeseries_t *timeseries);
+
+/** Release the lock taken by timeseries_backends_lock
+ *
+ * @param timeseries    pointer to a timeseries instance
+ */
+void timeseries_backends_unlock(timeseries_t *timeseries);
+
+/** Call the given function on each enabled backend
+ *
+ * @param timeseries    pointer to a timeseries instance
+ * @param fn            function to call for each backend
+ * @param arg           user argument to pass to fn
+ * @return 0 if all calls succeeded, -1 if any failed
+ *
+ * If concurrent backends are enabled (see
+ * timeseries_set_concurrent_backends), each call is made on the worker thread
+ * of the backend, and this returns once all calls have completed. Otherwise
+ * the calls are made in turn on the calling thread, stopping at the first
+ * failure.
+ *
+ * @note the caller must hold the lock taken by timeseries_backends_lock
+ */
+int timeseries_backends_foreach(timeseries_t *timeseries,
+                                timeseries_backend_fn_t *fn, void *arg);
+
+/** Get the key table shared by the Key Packages of a timeseries instance
+ *
+ * @param timeseries    pointer to a timeseries instance
+ * @return a pointer to the shared key table
+ *
+ * Only KPs created with TIMESERIES_KP_SHARED use the table.
+ */
+timeseries_keys_t *timeseries_get_keys(timeseries_t *timeseries);
+
 #endif /* __TIMESERIES_INT_H */
@@ -0,0 +1,452 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#include "timeseries_dict_int.h"
+#include "timeseries_keys_int.h"
+#include "timeseries_log_int.h"
+
+/* ========== PRIVATE DATA STRUCTURES/FUNCTIONS ========== */
+
+/** The minimum number of keys to allocate state column space for */
+#define KEYS_MIN_ALLOC 64
+
+/** The dictionary is compacted once this fraction (1/N) of its keys are no
+    longer used by any KP */
+#define KEYS_COMPACT_FRAC 4
+
+/** Get a pointer to the state of the key with the given ID in the state
+    column with the given index */
+#define KEYS_STATE_PTR(keys, idx, id)                                          \
+  ((keys)->state[idx] + (size_t)(id) * (keys)->state_size[idx])
+
+struct timeseries_keys {
+  /** Dictionary of key strings */
+  timeseries_dict_t *dict;
+
+  /** Column holding the dictionary ID of each global ID (or, for free global
+      IDs, the next free global ID) */
+  uint32_t *dict_ids;
+
+  /** Column holding the number of KPs that use each global ID (0 if it is
+      free) */
+  uint32_t *refs;
+
+  /** Global ID of each dictionary ID (indexed by dictionary ID) */
+  uint32_t *gids;
+
+  /** Number of entries allocated for the gids column */
+  uint32_t gids_alloc;
+
+  /** Number of global IDs that have been handed out (including free IDs) */
+  uint32_t cnt;
+
+  /** First free global ID (UINT32_MAX if none) */
+  uint32_t free_head;
+
+  /** Number of keys that have been removed from the dictionary since it was
+      last compacted */
+  uint32_t dead_cnt;
+
+  /** Per-backend columns of per-key state
+   * @note index of backend is given by (timeseries_backend_id_t - 1)
+   */
+  uint8_t *state[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Size of the per-key state of each backend (0 if it has no column) */
+  size_t state_size[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Number of keys that the state columns have space for */
+  uint32_t state_alloc;
+
+  /** Lock that protects the table */
+  pthread_rwlock_t lock;
+
+  /** Number of times the calling thread has taken the write lock (so that it
+      can take the lock again while it holds it) */
+  pthread_key_t depth;
+};
+
+/** Grow the state columns to hold the given number of keys, zeroing the state
+    of the new keys */
+static int keys_state_grow(timeseries_keys_t *keys, uint32_t cnt)
+{
+  uint8_t *tmp;
+  uint32_t *col;
+  int i;
+
+  if ((col = realloc(keys->dict_ids, sizeof(uint32_t) * cnt)) == NULL) {
+    timeseries_log(__func__, "could not realloc key ID column");
+    return -1;
+  }
+  keys->dict_ids = col;
+  if ((col = realloc(keys->refs, sizeof(uint32_t) * cnt)) == NULL) {
+    timeseries_log(__func__, "could not realloc key reference column");
+    return -1;
+  }
+  keys->refs = col;
+
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (keys->state[i] == NULL) {
+      continue;
+    }
+    if ((tmp = realloc(keys->state[i], keys->state_size[i] * cnt)) == NULL) {
+      timeseries_log(__func__, "could not realloc key state column");
+      return -1;
+    }
+    memset(tmp + keys->state_size[i] * keys->state_alloc, 0,
+           keys->state_size[i] * (cnt - keys->state_alloc));
+    keys->state[i] = tmp;
+  }
+
+  keys->state_alloc = cnt;
+  return 0;
+}
+
+/** Make sure the state columns have space for the given number of keys */
+static int keys_state_ensure(timeseries_keys_t *keys, uint32_t cnt)
+{
+  uint64_t alloc;
+
+  if (cnt <= keys->state_alloc) {
+    return 0;
+  }
+
+  /* double the columns (so that adding N keys costs O(N) copies) */
+  alloc = (uint64_t)keys->state_alloc * 2;
+  if (alloc < KEYS_MIN_ALLOC) {
+    alloc = KEYS_MIN_ALLOC;
+  }
+  if (alloc < cnt) {
+    alloc = cnt;
+  }
+  if (alloc > UINT32_MAX) {
+    alloc = UINT32_MAX;
+  }
+
+  return keys_state_grow(keys, alloc);
+}
+
+/** Make sure the gids column has space for the given number of dictionary
+    IDs */
+static int keys_gids_ensure(timeseries_keys_t *keys, uint32_t cnt)
+{
+  uint64_t alloc;
+  uint32_t *tmp;
+
+  if (cnt <= keys->gids_alloc) {
+    return 0;
+  }
+  alloc = (uint64_t)keys->gids_alloc * 2;
+  if (alloc < KEYS_MIN_ALLOC) {
+    alloc = KEYS_MIN_ALLOC;
+  }
+  if (alloc < cnt) {
+    alloc = cnt;
+  }
+  if (alloc > UINT32_MAX) {
+    alloc = UINT32_MAX;
+  }
+  if ((tmp = realloc(keys->gids, sizeof(uint32_t) * alloc)) == NULL) {
+    timeseries_log(__func__, "could not realloc global ID column");
+    return -1;
+  }
+  keys->gids = tmp;
+  keys->gids_alloc = alloc;
+  return 0;
+}
+
+/** Drop the removed keys from the dictionary, once enough of them have been
+    removed, and update the dictionary IDs of the live keys */
+static void keys_compact(timeseries_keys_t *keys)
+{
+  uint32_t size = timeseries_dict_size(keys->dict);
+  uint32_t *remap;
+  uint32_t gid;
+
+  if (keys->dead_cnt < KEYS_MIN_ALLOC ||
+      keys->dead_cnt < size / KEYS_COMPACT_FRAC) {
+    return;
+  }
+
+  /* the removed keys are only wasted space, so they are simply kept if the
+     dictionary cannot be compacted now */
+  if ((remap = malloc(sizeof(uint32_t) * size)) == NULL) {
+    return;
+  }
+  if (timeseries_dict_compact(keys->dict, remap) != 0) {
+    free(remap);
+    return;
+  }
+  for (gid = 0; gid < keys->cnt; gid++) {
+    if (keys->refs[gid] != 0) {
+      keys->dict_ids[gid] = remap[keys->dict_ids[gid]];
+      keys->gids[keys->dict_ids[gid]] = gid;
+    }
+  }
+  keys->dead_cnt = 0;
+  free(remap);
+}
+
+/** Get the number of times the calling thread holds the write lock */
+static uintptr_t keys_depth(timeseries_keys_t *keys)
+{
+  return (uintptr_t)pthread_getspecific(keys->depth);
+}
+
+/* ========== PROTECTED FUNCTIONS ========== */
+
+timeseries_keys_t *timeseries_keys_init(void)
+{
+  timeseries_keys_t *keys;
+
+  if ((keys = malloc_zero(sizeof(timeseries_keys_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc shared key table");
+    return NULL;
+  }
+
+  if ((keys->dict = timeseries_dict_init()) == NULL) {
+    free(keys);
+    return NULL;
+  }
+  if (pthread_key_create(&keys->depth, NULL) != 0) {
+    timeseries_log(__func__, "could not create shared key table lock");
+    timeseries_dict_free(&keys->dict);
+    free(keys);
+    return NULL;
+  }
+  keys->free_head = UINT32_MAX;
+
+  /* KPs get keys while other KPs flush, so readers share the lock */
+  pthread_rwlock_init(&keys->lock, NULL);
+
+  return keys;
+}
+
+void timeseries_keys_free(timeseries_keys_t **keys_p)
+{
+  timeseries_keys_t *keys;
+  int i;
+
+  assert(keys_p != NULL);
+  if ((keys = *keys_p) == NULL) {
+    return;
+  }
+  *keys_p = NULL;
+
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    free(keys->state[i]);
+  }
+  free(keys->dict_ids);
+  free(keys->refs);
+  free(keys->gids);
+  timeseries_dict_free(&keys->dict);
+  pthread_rwlock_destroy(&keys->lock);
+  pthread_key_delete(keys->depth);
+  free(keys);
+}
+
+void timeseries_keys_lock(timeseries_keys_t *keys)
+{
+  uintptr_t depth = keys_depth(keys);
+
+  /* KPs call back into the table from their backends while they hold the
+     lock */
+  if (depth == 0) {
+    pthread_rwlock_wrlock(&keys->lock);
+  }
+  pthread_setspecific(keys->depth, (void *)(depth + 1));
+}
+
+void timeseries_keys_rdlock(timeseries_keys_t *keys)
+{
+  uintptr_t depth = keys_depth(keys);
+
+  if (depth != 0) {
+    pthread_setspecific(keys->depth, (void *)(depth + 1));
+  } else {
+    pthread_rwlock_rdlock(&keys->lock);
+  }
+}
+
+void timeseries_keys_unlock(timeseries_keys_t *keys)
+{
+  uintptr_t depth = keys_depth(keys);
+
+  if (depth > 1) {
+    pthread_setspecific(keys->depth, (void *)(depth - 1));
+    return;
+  }
+  if (depth == 1) {
+    pthread_setspecific(keys->depth, NULL);
+  }
+  pthread_rwlock_unlock(&keys->lock);
+}
+
+uint32_t timeseries_keys_size(timeseries_keys_t *keys)
+{
+  return keys->cnt;
+}
+
+int timeseries_keys_reserve(timeseries_keys_t *keys, uint32_t cnt)
+{
+  uint32_t dict_cnt = timeseries_dict_size(keys->dict);
+
+  /* the dictionary also holds the removed keys until it is compacted */
+  if (cnt > keys->cnt) {
+    dict_cnt += cnt - keys->cnt;
+  }
+  if (timeseries_dict_reserve(keys->dict, dict_cnt) != 0 ||
+      keys_gids_ensure(keys, dict_cnt) != 0) {
+    return -1;
+  }
+  if (cnt > keys->state_alloc && keys_state_grow(keys, cnt) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int timeseries_keys_add_state(timeseries_keys_t *keys,
+                              timeseries_backend_id_t backend_id, size_t size)
+{
+  int idx = backend_id - 1;
+
+  assert(size != 0);
+  if (keys->state[idx] != NULL) {
+    assert(keys->state_size[idx] == size);
+    return 0;
+  }
+
+  /* always allocate something, so that the column exists */
+  if ((keys->state[idx] = calloc(
+         keys->state_alloc != 0 ? keys->state_alloc : 1, size)) == NULL) {
+    timeseries_log(__func__, "could not malloc key state column");
+    return -1;
+  }
+  keys->state_size[idx] = size;
+  return 0;
+}
+
+int timeseries_keys_has_state(timeseries_keys_t *keys,
+                              timeseries_backend_id_t backend_id)
+{
+  return keys->state[backend_id - 1] != NULL;
+}
+
+int timeseries_keys_intern(timeseries_keys_t *keys, const char *key,
+                           size_t len, uint64_t hash)
+{
+  uint32_t gid;
+  int id;
+
+  if ((id = timeseries_dict_find(keys->dict, key, len, hash)) >= 0) {
+    gid = keys->gids[id];
+    keys->refs[gid]++;
+    return gid;
+  }
+
+  /* make space first, so that a failure leaves no key behind */
+  if ((keys->free_head == UINT32_MAX &&
+       keys_state_ensure(keys, keys->cnt + 1) != 0) ||
+      keys_gids_ensure(keys, timeseries_dict_size(keys->dict) + 1) != 0 ||
+      (id = timeseries_dict_add(keys->dict, key, len, hash)) < 0) {
+    return -1;
+  }
+
+  /* the state of free global IDs was zeroed when they were released */
+  if (keys->free_head != UINT32_MAX) {
+    gid = keys->free_head;
+    keys->free_head = keys->dict_ids[gid];
+  } else {
+    gid = keys->cnt++;
+  }
+  keys->dict_ids[gid] = id;
+  keys->refs[gid] = 1;
+  keys->gids[id] = gid;
+  return gid;
+}
+
+void timeseries_keys_release(timeseries_keys_t *keys, uint32_t id)
+{
+  int i;
+
+  assert(id < keys->cnt && keys->refs[id] != 0);
+  if (--keys->refs[id] != 0) {
+    return;
+  }
+
+  timeseries_dict_remove(keys->dict, keys->dict_ids[id]);
+  keys->dead_cnt++;
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (keys->state[i] != NULL) {
+      memset(KEYS_STATE_PTR(keys, i, id), 0, keys->state_size[i]);
+    }
+  }
+  keys->dict_ids[id] = keys->free_head;
+  keys->free_head = id;
+
+  keys_compact(keys);
+}
+
+int timeseries_keys_find(timeseries_keys_t *keys, const char *key, size_t len,
+                         uint64_t hash)
+{
+  int id;
+
+  if ((id = timeseries_dict_find(keys->dict, key, len, hash)) < 0) {
+    return -1;
+  }
+  return keys->gids[id];
+}
+
+const char *timeseries_keys_get(timeseries_keys_t *keys, uint32_t id)
+{
+  assert(id < keys->cnt && keys->refs[id] != 0);
+  return timeseries_dict_get(keys->dict, keys->dict_ids[id]);
+}
+
+void *timeseries_keys_get_state(timeseries_keys_t *keys, uint32_t id,
+                                timeseries_backend_id_t backend_id)
+{
+  assert(id < keys->cnt);
+  assert(keys->state[backend_id - 1] != NULL);
+  return KEYS_STATE_PTR(keys, backend_id - 1, id);
+}
@@ -0,0 +1,212 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef __TIMESERIES_KEYS_INT_H
+#define __TIMESERIES_KEYS_INT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "timeseries_backend_pub.h"
+
+/** @file
+ *
+ * @brief Header file that contains the protected interface to the shared key
+ * table of a timeseries instance
+ *
+ * The shared key table interns the keys of all Key Packages created with
+ * TIMESERIES_KP_SHARED, so that each key string is stored once (in a key
+ * dictionary), and is resolved once by each backend, no matter how many KPs
+ * use it. Keys are given dense global IDs, and each KP that uses a key holds
+ * a reference to it. Once no KP uses a key, its string is removed from the
+ * dictionary (which is compacted once a quarter of its keys have been
+ * removed), and its global ID is reused for the next new key.
+ *
+ * The per-key backend state of shared keys is held inline in per-backend
+ * columns indexed by global ID (in the same way as the KI state columns of a
+ * KP).
+ *
+ * KPs may be used from different threads, so every function here must be
+ * called with the table lock held (see timeseries_keys_lock), either by the
+ * calling thread, or by a thread that is waiting for the calling thread
+ * (e.g. a KP flushing to concurrent backend workers). Functions that only
+ * read the table (finding and getting keys, and reading their state) may be
+ * called with the read lock (see timeseries_keys_rdlock), so that KPs can
+ * flush at the same time. A thread that holds the write lock may take either
+ * lock again.
+ *
+ * @author Alistair King
+ *
+ */
+
+/**
+ * @name Protected Opaque Data Structures
+ *
+ * @{ */
+
+/** Opaque struct holding the state of a shared key table */
+typedef struct timeseries_keys timeseries_keys_t;
+
+/** @} */
+
+/** Create a new (empty) shared key table
+ *
+ * @return a pointer to a key table, NULL if an error occurred
+ */
+timeseries_keys_t *timeseries_keys_init(void);
+
+/** Free a shared key table
+ *
+ * @param keys_p        Double pointer to the key table to free
+ */
+void timeseries_keys_free(timeseries_keys_t **keys_p);
+
+/** Take the (write) lock of a shared key table
+ *
+ * @param keys          Pointer to a key table
+ */
+void timeseries_keys_lock(timeseries_keys_t *keys);
+
+/** Take the read lock of a shared key table
+ *
+ * @param keys          Pointer to a key table
+ *
+ * Several threads may hold the read lock at once. A thread that holds the
+ * read lock must not take the write lock.
+ */
+void timeseries_keys_rdlock(timeseries_keys_t *keys);
+
+/** Release the lock taken by timeseries_keys_lock or timeseries_keys_rdlock
+ *
+ * @param keys          Pointer to a key table
+ */
+void timeseries_keys_unlock(timeseries_keys_t *keys);
+
+/** Get the number of global IDs in the shared key table
+ *
+ * @param keys          Pointer to a key table
+ * @return the number of global IDs (including IDs that are free to be reused)
+ */
+uint32_t timeseries_keys_size(timeseries_keys_t *keys);
+
+/** Make space for the given number of keys in the shared key table
+ *
+ * @param keys          Pointer to a key table
+ * @param cnt           Total number of keys to make space for
+ * @return 0 if the space was allocated, -1 otherwise
+ */
+int timeseries_keys_reserve(timeseries_keys_t *keys, uint32_t cnt);
+
+/** Give a backend a column of per-key state in the shared key table
+ *
+ * @param keys          Pointer to a key table
+ * @param backend_id    ID of the backend
+ * @param size          Size of the per-key state of the backend
+ * @return 0 if the backend has a column, -1 otherwise
+ *
+ * The state of every key (including keys that are already in the table)
+ * starts zeroed. If the backend already has a column, this does nothing.
+ */
+int timeseries_keys_add_state(timeseries_keys_t *keys,
+                              timeseries_backend_id_t backend_id, size_t size);
+
+/** Does a backend have a column of per-key state in the shared key table?
+ *
+ * @param keys          Pointer to a key table
+ * @param backend_id    ID of the backend
+ * @return 1 if the backend has a column, 0 otherwise
+ */
+int timeseries_keys_has_state(timeseries_keys_t *keys,
+                              timeseries_backend_id_t backend_id);
+
+/** Get the global ID of a key, adding it to the shared key table if needed,
+ * and take a reference to it
+ *
+ * @param keys          Pointer to a key table
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @param hash          Hash of the key (as returned by timeseries_dict_hash)
+ * @return the global ID of the key, -1 if an error occurred
+ *
+ * The caller must hold the write lock.
+ */
+int timeseries_keys_intern(timeseries_keys_t *keys, const char *key,
+                           size_t len, uint64_t hash);
+
+/** Drop a reference to a key taken by timeseries_keys_intern
+ *
+ * @param keys          Pointer to a key table
+ * @param id            Global ID of the key
+ *
+ * Once the last reference is dropped, the key is removed from the table, its
+ * state is zeroed, and its global ID may be given to a new key. The caller
+ * must hold the write lock.
+ */
+void timeseries_keys_release(timeseries_keys_t *keys, uint32_t id);
+
+/** Find the global ID of a key in the shared key table
+ *
+ * @param keys          Pointer to a key table
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @param hash          Hash of the key (as returned by timeseries_dict_hash)
+ * @return the global ID of the key, -1 if it is not in the table
+ */
+int timeseries_keys_find(timeseries_keys_t *keys, const char *key, size_t len,
+                         uint64_t hash);
+
+/** Get the key string with the given global ID
+ *
+ * @param keys          Pointer to a key table
+ * @param id            Global ID of the key
+ * @return a pointer to the NUL-terminated key
+ *
+ * As with timeseries_dict_get, the key is decoded into a buffer that belongs
+ * to the calling thread (so it stays valid once the lock is released).
+ */
+const char *timeseries_keys_get(timeseries_keys_t *keys, uint32_t id);
+
+/** Get a pointer to the per-key state of a backend for the given key
+ *
+ * @param keys          Pointer to a key table
+ * @param id            Global ID of the key
+ * @param backend_id    ID of the backend (which must have a column)
+ * @return a pointer to the state of the key
+ *
+ * The pointer is only valid while the table lock is held, since adding keys
+ * may move the state columns.
+ */
+void *timeseries_keys_get_state(timeseries_keys_t *keys, uint32_t id,
+                                timeseries_backend_id_t backend_id);
+
+#endif /* __TIMESERIES_KEYS_INT_H */
@@ -33,54 +33,670 @@
 #include "config.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include "khash.h"
 #include "utils.h"
 
 #include "timeseries_kp_int.h"
 
 #include "timeseries_backend_int.h"
+#include "timeseries_dict_int.h"
 #include "timeseries_int.h"
+#include "timeseries_keys_int.h"
 #include "timeseries_log_int.h"
 
 /* ========== PRIVATE DATA STRUCTURES/FUNCTIONS ========== */
 
-KHASH_MAP_INIT_STR(strint, int);
+/** The minimum number of keys to allocate KI column space for */
+#define KP_KI_MIN_ALLOC 64
 
-struct timeseries_kp_ki {
-  /** Key string */
-  char *key;
+/** Size of the chunks that copies of key names are stored in */
+#define KP_NAMES_CHUNK_LEN (64 * 1024)
 
-  /** Value */
-  uint64_t value;
+/** Number of 64 bit words needed for a bitmap of the given number of keys */
+#define KP_BM_WORDS(cnt) (((uint64_t)(cnt) + 63) / 64)
 
-  /** Backend-specific state
-   * @note index of backend is given by (timeseries_backend_id_t - 1)
-   */
-  void *backend_state[TIMESERIES_BACKEND_ID_LAST];
+/** Index of the word in a bitmap that holds the bit for the given key */
+#define KP_BM_WORD(id) ((id) >> 6)
+
+/** Mask of the bit for the given key within its bitmap word */
+#define KP_BM_BIT(id) (UINT64_C(1) << ((id)&63))
+
+/** The minimum number of slots in the global ID lookup table of a shared KP
+    (must be a power of two) */
+#define KP_GID_HASH_MIN_SLOTS 64
+
+/** Does a global ID lookup table with the given number of slots need to grow
+    to hold the given number of keys? (the table is kept at most 3/4 full) */
+#define KP_GID_HASH_FULL(slots, cnt) ((uint64_t)(cnt)*4 > (uint64_t)(slots)*3)
+
+/** Home slot of a global key ID in a lookup table with the given mask
+    (Fibonacci hashing, so consecutive IDs land in different slots) */
+#define KP_GID_HASH(gid, mask) (((uint32_t)(gid)*UINT32_C(2654435761)) & (mask))
+
+/** Offsets of the fields of an encoded tag set (see kp_tags_t) */
+#define KP_TAGSET_NAME 0
+#define KP_TAGSET_METRIC 1
+#define KP_TAGSET_CNT 2
+#define KP_TAGSET_TAGS 3
+
+/** Number of words in an encoded tag set with the given number of tags */
+#define KP_TAGSET_LEN(cnt) (KP_TAGSET_TAGS + (cnt)*2)
+
+/** The minimum number of words allocated for the encoded tag sets */
+#define KP_TAGSET_MIN_ALLOC 256
+
+/** Checkpoint file format
+ *
+ * A checkpoint is written in host byte order, with every section aligned to 8
+ * bytes, so that it can be mapped and used in place:
+ *
+ *   kp_ckpt_hdr_t        header
+ *   (key dictionary)     as written by timeseries_dict_write
+ *   backend_cnt x {
+ *     kp_ckpt_section_t  section header
+ *     uint8_t            state[state_len] (as written by kp_ki_save)
+ *     uint64_t           state_offsets[resolved_cnt + 1] (into state)
+ *   }
+ */
+#define KP_CKPT_MAGIC "TSKPCKPT"
+/* the key dictionary (including its hashes) is stored as-is, so this must
+   change if the dictionary layout or hash function does */
+#define KP_CKPT_VERSION 2
+#define KP_CKPT_BYTE_ORDER 0x01020304
+#define KP_CKPT_ALIGN(len) (((uint64_t)(len) + 7) & ~(uint64_t)7)
+
+/** The largest per-key state that a backend may save */
+#define KP_CKPT_KI_STATE_MAX 1024
+
+typedef struct kp_ckpt_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t key_cnt;
+  uint32_t removed_cnt;
+  uint32_t resolved_cnt;
+  uint32_t backend_cnt;
+} kp_ckpt_hdr_t;
+
+typedef struct kp_ckpt_section {
+  uint32_t backend_id;
+  uint32_t reserved;
+  uint64_t state_len;
+} kp_ckpt_section_t;
+
+/** A column of values (of the value type of the KP that owns it) */
+typedef union kp_values {
+  void *raw;
+  uint64_t *u64;
+  uint32_t *u32;
+  int64_t *i64;
+  double *d;
+} kp_values_t;
+
+/** Get a pointer to the state of the KI with the given ID in the KI state
+    column with the given index */
+#define KP_KI_STATE_PTR(kp, idx, id)                                           \
+  ((kp)->ki_backend_state[idx] +                                               \
+   (size_t)(id) * (kp)->ki_backend_state_size[idx])
+
+/** Get a pointer to the value with the given ID in a column of values */
+#define KP_VAL_PTR(vals, size, id) ((char *)(vals).raw + (size_t)(id) * (size))
+
+/** Load the value with the given ID from a column, converted to a uint64_t */
+static inline uint64_t kp_val_load(kp_values_t vals,
+                                   timeseries_kp_value_type_t type, uint32_t id)
+{
+  switch (type) {
+  case TIMESERIES_KP_VALUE_U32:
+    return vals.u32[id];
+  case TIMESERIES_KP_VALUE_I64:
+    return (uint64_t)vals.i64[id];
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    /* clamp to the range of a uint64_t */
+    if (!(vals.d[id] > 0)) {
+      return 0;
+    }
+    if (vals.d[id] >= 18446744073709551616.0) {
+      return UINT64_MAX;
+    }
+    return (uint64_t)vals.d[id];
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    return vals.u64[id];
+  }
+}
+
+/** Store (or add) a uint64_t value to the given ID in a column, converting
+    it to the type of the column */
+static inline void kp_val_store(kp_values_t vals,
+                                timeseries_kp_value_type_t type, uint32_t id,
+                                uint64_t value, int add)
+{
+  switch (type) {
+  case TIMESERIES_KP_VALUE_U32:
+    vals.u32[id] = (add ? vals.u32[id] : 0) + (uint32_t)value;
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    vals.i64[id] = (int64_t)((add ? (uint64_t)vals.i64[id] : 0) + value);
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    vals.d[id] = (add ? vals.d[id] : 0) + (double)value;
+    break;
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    vals.u64[id] = (add ? vals.u64[id] : 0) + value;
+    break;
+  }
+}
+
+/* store (or add) n uint64_t values to a column of ctype values (see
+   kp_val_store_many) */
+#define KP_VAL_STORE_MANY(ctype, col, ids, first, values, n, add)              \
+  do {                                                                         \
+    ctype *restrict dst_ = (col);                                              \
+    const uint64_t *restrict src_ = (values);                                  \
+    uint32_t i_;                                                               \
+    if ((ids) != NULL) {                                                       \
+      for (i_ = 0; i_ < (n); i_++) {                                           \
+        dst_[(ids)[i_]] =                                                      \
+          (ctype)((add) ? dst_[(ids)[i_]] : 0) + (ctype)src_[i_];              \
+      }                                                                        \
+    } else {                                                                   \
+      dst_ += (first);                                                         \
+      for (i_ = 0; i_ < (n); i_++) {                                           \
+        dst_[i_] = (ctype)((add) ? dst_[i_] : 0) + (ctype)src_[i_];            \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+/** Store (or add) n uint64_t values to a column, converting them to the type
+ * of the column
+ *
+ * The values are stored at the given IDs, or at the consecutive IDs starting
+ * from first if ids is NULL. The type switch is outside of the loops, so each
+ * loop is a simple conversion that the compiler can vectorize.
+ */
+static inline void kp_val_store_many(kp_values_t vals,
+                                     timeseries_kp_value_type_t type,
+                                     const uint32_t *ids, uint32_t first,
+                                     const uint64_t *values, uint32_t n,
+                                     int add)
+{
+  switch (type) {
+  case TIMESERIES_KP_VALUE_U32:
+    KP_VAL_STORE_MANY(uint32_t, vals.u32, ids, first, values, n, add);
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    /* the sum is done on unsigned values, so overflow wraps (like set) */
+    KP_VAL_STORE_MANY(uint64_t, (uint64_t *)vals.i64, ids, first, values, n,
+                      add);
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    KP_VAL_STORE_MANY(double, vals.d, ids, first, values, n, add);
+    break;
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    if (ids == NULL && add == 0) {
+      memcpy(&vals.u64[first], values, sizeof(uint64_t) * n);
+    } else {
+      KP_VAL_STORE_MANY(uint64_t, vals.u64, ids, first, values, n, add);
+    }
+    break;
+  }
+}
+
+/* aggregate a new value v into the current value cur of a key, both of type
+   ctype (sums are done in utype, so that signed overflow wraps) */
+#define KP_AGG_APPLY(ctype, utype, cur, v, agg)                                \
+  do {                                                                         \
+    switch (agg) {                                                             \
+    case TIMESERIES_KP_AGG_SUM:                                                \
+      (cur) = (ctype)((utype)(cur) + (utype)(v));                              \
+      break;                                                                   \
+    case TIMESERIES_KP_AGG_MIN:                                                \
+      if ((v) < (cur)) {                                                       \
+        (cur) = (v);                                                           \
+      }                                                                        \
+      break;                                                                   \
+    case TIMESERIES_KP_AGG_MAX:                                                \
+      if ((v) > (cur)) {                                                       \
+        (cur) = (v);                                                           \
+      }                                                                        \
+      break;                                                                   \
+    case TIMESERIES_KP_AGG_COUNT:                                              \
+      (cur) = (ctype)((utype)(cur) + 1);                                       \
+      break;                                                                   \
+    case TIMESERIES_KP_AGG_LAST:                                               \
+    default:                                                                   \
+      (cur) = (v);                                                             \
+      break;                                                                   \
+    }                                                                          \
+  } while (0)
+
+/* does the given aggregation mode keep one of the values set (rather than
+   accumulating them)? values added to such keys are aggregated as if they
+   were set, since adding to the identity of the mode would wrap */
+#define KP_AGG_EXTREMUM(agg)                                                   \
+  ((agg) == TIMESERIES_KP_AGG_MIN || (agg) == TIMESERIES_KP_AGG_MAX)
+
+/** Aggregate a uint64_t value into the value with the given ID in a column,
+    converting it to the type of the column (as kp_val_store does) */
+static inline void kp_agg_store(kp_values_t vals,
+                                timeseries_kp_value_type_t type, uint32_t id,
+                                uint64_t value, timeseries_kp_agg_t agg)
+{
+  switch (type) {
+  case TIMESERIES_KP_VALUE_U32:
+    KP_AGG_APPLY(uint32_t, uint32_t, vals.u32[id], (uint32_t)value, agg);
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    KP_AGG_APPLY(int64_t, uint64_t, vals.i64[id], (int64_t)value, agg);
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    KP_AGG_APPLY(double, double, vals.d[id], (double)value, agg);
+    break;
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    KP_AGG_APPLY(uint64_t, uint64_t, vals.u64[id], value, agg);
+    break;
+  }
+}
+
+/** Get the size (in bytes) of a value of the given type */
+static size_t kp_value_type_size(timeseries_kp_value_type_t type)
+{
+  switch (type) {
+  case TIMESERIES_KP_VALUE_U64:
+    return sizeof(uint64_t);
+  case TIMESERIES_KP_VALUE_U32:
+    return sizeof(uint32_t);
+  case TIMESERIES_KP_VALUE_I64:
+    return sizeof(int64_t);
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    return sizeof(double);
+  }
+  return 0;
+}
+
+/** Structure which holds the values written by a single thread to a Key
+ * Package
+ *
+ * A shard only holds values, the key dictionary (and everything else) is
+ * owned by the KP. Shards are merged into the KP values when it is flushed.
+ */
+struct timeseries_kp_shard {
+  /** Key Package that this shard writes to */
+  timeseries_kp_t *kp;
+
+  /** Next shard of the KP (shards are merged in creation order) */
+  struct timeseries_kp_shard *next;
+
+  /** How values in this shard are merged into the KP */
+  timeseries_kp_merge_t merge;
+
+  /** Column of values written since the last merge (zero for untouched
+      keys) */
+  kp_values_t values;
 
-  /** Should this KI be skipped? */
-  uint8_t disabled;
+  /** Bitmap of keys written since the last merge */
+  uint64_t *touched;
+
+  /** Number of keys that the shard columns have space for */
+  uint32_t alloc;
 };
 
-/** Structure which holds state for a Key Package */
+/** State for the asynchronous flushing of a Key Package */
+typedef struct kp_async kp_async_t;
+
+/** The per-interval columns of a Key Package (see kp_slot_swap) */
+typedef struct kp_slot_cols {
+  /** Column of key values */
+  kp_values_t values;
+
+  /** Bitmap of enabled keys */
+  uint64_t *enabled;
+
+  /** Number of enabled keys */
+  uint32_t enabled_cnt;
+
+  /** Live list (only allocated for sparse KPs) */
+  uint32_t *live;
+
+  /** Number of IDs in the live list */
+  uint32_t live_cnt;
+
+  /** Bitmap of listed keys (only allocated for sparse KPs) */
+  uint64_t *listed;
+} kp_slot_cols_t;
+
+/** A time slot of a windowed Key Package */
+typedef struct kp_slot {
+  /** The time of the values in the slot */
+  uint32_t time;
+
+  /** Does the slot hold values that have not yet been flushed? */
+  int used;
+
+  /** The columns of the slot (unused for the current slot, whose columns are
+      in the KP) */
+  kp_slot_cols_t cols;
+} kp_slot_t;
+
+/** State for the time window of a Key Package */
+typedef struct kp_window {
+  /** Array of time slots */
+  kp_slot_t *slots;
+
+  /** Number of time slots */
+  uint32_t slots_cnt;
+
+  /** Index of the slot that is written to (whose columns are in the KP) */
+  uint32_t cur;
+
+  /** How far the watermark trails the newest time (0 if there is no
+      watermark) */
+  uint32_t lag;
+
+  /** The newest time that has been selected */
+  uint32_t newest;
+
+  /** Times before the watermark have been flushed, and are late */
+  uint32_t watermark;
+
+  /** Function to call before a slot is flushed (may be NULL) */
+  timeseries_kp_window_cb_t *cb;
+
+  /** User pointer to pass to the callback */
+  void *cb_user;
+} kp_window_t;
+
+/** State of the tagged keys of a Key Package (see
+ * timeseries_kp_add_tagged_key)
+ *
+ * This is shared with the snapshot views of the KP. The async writer reads
+ * the tag sets (and renders key names) while holding the growth lock, so the
+ * owner also holds that lock while moving the tag sets.
+ */
+typedef struct kp_tags {
+  /** Dictionary of the interned tag strings (metric names, tag keys and tag
+      values) */
+  timeseries_dict_t *strs;
+
+  /** The encoded tag set of each tagged key (in key ID order)
+   *
+   * Each tag set is KP_TAGSET_LEN(cnt) words:
+   *
+   *   name         ID of the rendered key name in names (UINT32_MAX until
+   *                the name is first needed)
+   *   metric       ID of the metric name in strs
+   *   cnt          Number of tags
+   *   cnt x {      (sorted by tag key ID)
+   *     key        ID of the tag key in strs
+   *     value      ID of the tag value in strs
+   *   }
+   */
+  uint32_t *sets;
+
+  /** Number of words used by the tag sets */
+  uint32_t sets_len;
+
+  /** Number of words allocated for the tag sets */
+  uint32_t sets_alloc;
+
+  /** Open-addressed (linear probing) lookup table of tag set -> key ID
+   * (UINT32_MAX for empty slots)
+   *
+   * The entries of removed keys are left in the table (and skipped by
+   * lookups) until the KP is compacted.
+   */
+  uint32_t *slots;
+
+  /** Number of slots in the lookup table (a power of two) */
+  uint32_t slots_cnt;
+
+  /** Number of keys in the lookup table (including removed keys) */
+  uint32_t slots_used;
+
+  /** Dictionary of the rendered key names, in the order they were first
+      needed (NULL until a name is rendered) */
+  timeseries_dict_t *names;
+
+  /** Buffer that key names are rendered into */
+  char *buf;
+
+  /** Number of bytes allocated for the render buffer */
+  size_t buf_alloc;
+} kp_tags_t;
+
+/** A chunk of append-only storage for copies of key names */
+typedef struct kp_names_chunk {
+  /** The previously filled chunk */
+  struct kp_names_chunk *prev;
+
+  /** Number of bytes of data in use */
+  size_t used;
+
+  /** Number of bytes of data allocated */
+  size_t size;
+
+  /** Key names (NUL-terminated) */
+  char data[];
+} kp_names_chunk_t;
+
+/** Copies of the key names returned by timeseries_kp_get_key_name and
+ * timeseries_kp_ki_get_key
+ *
+ * Keys are stored prefix-compressed, so a name is only copied the first time
+ * it is asked for, and the copy is kept until the key is removed or the KP
+ * is compacted. The copies are appended to chunks, which are all freed when
+ * the KP is compacted (the copy of a removed key stays in its chunk until
+ * then). This is shared with the snapshot views of the KP, so the copies are
+ * made while holding the lock.
+ */
+typedef struct kp_names {
+  /** Lock to hold while using the copies */
+  pthread_mutex_t lock;
+
+  /** Column of the copy of each key name (NULL until it is first asked for) */
+  char **col;
+
+  /** Number of entries allocated for the column */
+  uint32_t alloc;
+
+  /** The chunk that copies are currently appended to */
+  kp_names_chunk_t *arena;
+} kp_names_t;
+
+/** The keys that were last set in one flush interval
+ *
+ * A KP with an idle TTL keeps a ring of these (one per interval in the TTL,
+ * plus the current one), with each key in the bucket of the interval it was
+ * last set in. Keys that go idle all do so at once when their interval falls
+ * out of the TTL, so expiring them only visits that bucket.
+ */
+typedef struct kp_idle_bucket {
+  /** Flush count of the interval (buckets are re-used every TTL + 1
+      intervals) */
+  uint32_t flush;
+
+  /** IDs of the keys in the bucket (in no particular order) */
+  uint32_t *ids;
+
+  /** Number of keys in the bucket */
+  uint32_t cnt;
+
+  /** Number of IDs allocated */
+  uint32_t alloc;
+} kp_idle_bucket_t;
+
+/** Idle bucket position of an expiring key that was enabled when it went
+    idle */
+#define KP_IDLE_EXPIRING UINT32_MAX
+
+/** Idle bucket position of an expiring key that was disabled when it went
+    idle */
+#define KP_IDLE_EXPIRING_OFF (UINT32_MAX - 1)
+
+/** Structure which holds state for a Key Package
+ *
+ * Key Info (KI) state is stored as a set of parallel columns, all indexed by
+ * key ID. This keeps the values (which are touched on every set and every
+ * flush) contiguous in memory, separate from the rarely-used key strings and
+ * backend state.
+ */
 struct timeseries_kp {
   /** Timeseries instance that this key package is associated with */
   timeseries_t *timeseries;
 
-  /** Dynamically allocated array of Key Info objects */
-  timeseries_kp_ki_t *key_infos;
+  /** Column of key values (of type value_type) */
+  kp_values_t values;
+
+  /** The type of the values in the KP */
+  timeseries_kp_value_type_t value_type;
+
+  /** The size of each value (in bytes) */
+  size_t value_size;
+
+  /** Bitmap of enabled KIs (a set bit means the KI should be flushed)
+   *
+   * Bits beyond the last key are always zero, so backends can iterate over
+   * the enabled keys one word at a time (see timeseries_kp_ki_next_enabled).
+   */
+  uint64_t *enabled;
+
+  /** Column of the values last handed to the backends (only allocated if
+      the KP was created with TIMESERIES_KP_CHANGED) */
+  kp_values_t prev_values;
+
+  /** Bitmap of KIs whose value differs from the value last handed to the
+   * backends (only allocated if the KP was created with TIMESERIES_KP_CHANGED)
+   *
+   * Bits are set for new keys (so their first value is always written), and
+   * for enabled keys whose value changed when the KP is flushed. Bits of
+   * flushed (enabled) keys are cleared once the backends have been called.
+   */
+  uint64_t *changed;
+
+  /** List of the IDs of the keys enabled since the last flush, in the order
+   * they were enabled (only allocated if the KP was created with
+   * TIMESERIES_KP_SPARSE)
+   *
+   * Each key is listed at most once, so the list never holds more than
+   * key_infos_alloc IDs. Keys that were disabled (or removed) after being
+   * listed stay in the list until the next flush.
+   */
+  uint32_t *live;
+
+  /** Number of IDs in the live list */
+  uint32_t live_cnt;
+
+  /** Bitmap of the keys that are in the live list */
+  uint64_t *listed;
+
+  /** Dictionary of key strings (key IDs are dictionary IDs, NULL if the KP
+      uses the shared key table) */
+  timeseries_dict_t *dict;
+
+  /** Key table shared with other KPs (only used if the KP was created with
+      TIMESERIES_KP_SHARED, in which case dict is NULL) */
+  timeseries_keys_t *keys;
 
-  /** Hash of key names -> key ids */
-  khash_t(strint) * key_id_hash;
+  /** Column of the global ID of each key in the shared key table
+      (UINT32_MAX for removed keys, only allocated for shared KPs) */
+  uint32_t *gids;
 
-  /** Number of keys in the Key Package */
+  /** Open-addressed (linear probing) lookup table of global key ID -> key ID
+   * (UINT32_MAX for empty slots, only allocated for shared KPs)
+   *
+   * The entries of removed keys are left in the table (and skipped by
+   * lookups) until the KP is compacted.
+   */
+  uint32_t *gid_slots;
+
+  /** Number of slots in the global ID lookup table (a power of two) */
+  uint32_t gid_slots_cnt;
+
+  /** Tagged key state (NULL until a tag string is interned) */
+  kp_tags_t *tags;
+
+  /** Column of the offset of the tag set of each key in tags->sets
+      (UINT32_MAX for plain and removed keys, only allocated once a tagged
+      key is added) */
+  uint32_t *tagsets;
+
+  /** Copies of the key names that have been returned to callers */
+  kp_names_t *names;
+
+  /** Column holding the flush count at which each key was last set (only
+      allocated if an idle TTL is set) */
+  uint32_t *last_set;
+
+  /** Ring of idle_ttl + 1 buckets of the keys last set in each interval (only
+      allocated if an idle TTL is set) */
+  kp_idle_bucket_t *idle;
+
+  /** Column holding the position of each key in its idle bucket (only
+      allocated if an idle TTL is set) */
+  uint32_t *idle_pos;
+
+  /** Set if a key could not be added to its idle bucket, so that the buckets
+      must be rebuilt from the last-set column before the next expiry */
+  int idle_rescan;
+
+  /** Keys that went idle while snapshots that may use them were waiting to
+      be written (they are disabled, and removed once the snapshots have been
+      written, unless they are set or enabled again first) */
+  uint32_t *expiring;
+
+  /** Number of expiring keys */
+  uint32_t expiring_cnt;
+
+  /** Number of entries allocated for the expiring keys */
+  uint32_t expiring_alloc;
+
+  /** Number of snapshots that must have been written before the expiring
+      keys can be removed */
+  uint64_t expiring_seq;
+
+  /** Column of per-key aggregation modes (timeseries_kp_agg_t values, only
+      allocated once a mode other than TIMESERIES_KP_AGG_LAST is used) */
+  uint8_t *agg;
+
+  /** Aggregation mode given to new keys */
+  timeseries_kp_agg_t default_agg;
+
+  /** Per-backend columns of Key Info state
+   *
+   * Only backends that were enabled when the KP was created, and that
+   * registered a per-KI state size, have a column. The state of each KI is
+   * held inline (see KP_KI_STATE_PTR). Shared KPs have no columns: the
+   * state of their keys is held by the shared key table.
+   * @note index of backend is given by (timeseries_backend_id_t - 1)
+   */
+  uint8_t *ki_backend_state[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Size of the per-KI state of each backend (0 if it has no KI state) */
+  size_t ki_backend_state_size[TIMESERIES_BACKEND_ID_LAST];
+
+  /** Number of keys in the Key Package (including removed keys) */
   uint32_t key_infos_cnt;
 
+  /** Number of keys that have been removed since the last compaction */
+  uint32_t key_infos_removed_cnt;
+
+  /** Number of keys that the KI columns have space for */
+  uint32_t key_infos_alloc;
+
   /** Number of enabled keys in the Key Package */
   uint32_t key_infos_enabled_cnt;
 
@@ -97,8 +713,153 @@ struct timeseries_kp {
   /** Should the the keys be disabled after a flush? */
   int disable;
 
-  /** Have keys been added since the last call to [backend]->kp_ki_update? */
-  int dirty;
+  /** Should only changed values be given to the backends that support it? */
+  int changed_only;
+
+  /** Should only the keys in the live list be reset/disabled after a flush? */
+  int sparse;
+
+  /** Should each key be rolled up into a key for its prefix? */
+  int rollup;
+
+  /** Column of the ID of the key that each key is rolled up into (UINT32_MAX
+   * for none, only allocated if the KP was created with TIMESERIES_KP_ROLLUP)
+   *
+   * A key's parent is always added before it, so parents have lower IDs than
+   * their children. Removed keys keep their parent, so that their children
+   * can be moved up to it (see rollup_stale).
+   */
+  uint32_t *rollup_parent;
+
+  /** Bitmap of the keys that other keys are rolled up into (only allocated
+      if the KP was created with TIMESERIES_KP_ROLLUP) */
+  uint64_t *rollup_keys;
+
+  /** Set if a key that other keys are rolled up into has been removed, so
+      the parent column must be fixed before it is next used */
+  int rollup_stale;
+
+  /** Has the set of keys been frozen (see timeseries_kp_freeze)? */
+  int frozen;
+
+  /** Number of keys (starting from ID 0) that have been resolved by all
+   * backends
+   *
+   * Keys with IDs in [key_infos_resolved_cnt, key_infos_cnt) have been added
+   * since the last successful call to [backend]->kp_ki_update.
+   */
+  uint32_t key_infos_resolved_cnt;
+
+  /** Number of flushes that a key may go without being set before it is
+      removed (0 if keys never expire) */
+  uint32_t idle_ttl;
+
+  /** Number of times the KP has been flushed */
+  uint32_t flush_cnt;
+
+  /** List of per-thread value shards (in creation order) */
+  timeseries_kp_shard_t *shards;
+
+  /** Maximum number of snapshots waiting to be written by the async writer
+      thread */
+  uint32_t max_snapshots;
+
+  /** Async flush state (NULL until timeseries_kp_flush_async is first
+      called) */
+  kp_async_t *async;
+
+  /** Lock to hold while reading a key of this KP (the growth lock of the
+      owner for snapshot views, NULL for the KP itself) */
+  pthread_mutex_t *view_lock;
+
+  /** Time window state (NULL unless timeseries_kp_set_window has been
+      called) */
+  kp_window_t *window;
+};
+
+/** The default maximum number of outstanding async flush snapshots */
+#define KP_MAX_SNAPSHOTS_DEFAULT 2
+
+/** A snapshot of the values of a Key Package, waiting to be written to the
+ * backends by the async writer thread */
+typedef struct kp_snapshot {
+  /** A copy of the KP, with the snapshot value and enabled columns (and live
+   * list, for sparse KPs), that is passed to the backends
+   *
+   * The key dictionary and backend state are shared with the real KP, so the
+   * writer thread refreshes the backend state (and global ID) column pointers
+   * under the growth lock before flushing. It then only takes the lock while
+   * it reads each key (see view_lock), since the owner moves the dictionary
+   * columns while holding it, and the columns it replaces are kept until the
+   * writer has moved on to the next snapshot.
+   */
+  timeseries_kp_t view;
+
+  /** Number of keys that the snapshot columns have space for */
+  uint32_t alloc;
+
+  /** The time to flush the snapshot with */
+  uint32_t time;
+
+  /** Function to call once the snapshot has been written (may be NULL) */
+  timeseries_kp_flush_cb_t *cb;
+
+  /** User pointer to pass to the callback */
+  void *cb_user;
+
+  /** The next snapshot in the queue */
+  struct kp_snapshot *next;
+} kp_snapshot_t;
+
+struct kp_async {
+  /** The writer thread */
+  pthread_t writer;
+
+  /** Protects all of the fields below */
+  pthread_mutex_t mutex;
+
+  /** Held by the KP owner while growing the shared KI columns (and the key
+      dictionary and tag sets), and by the writer while it refreshes its
+      column pointers or reads a key */
+  pthread_mutex_t grow_lock;
+
+  /** Signalled when a snapshot is queued (or the writer should exit) */
+  pthread_cond_t work_cond;
+
+  /** Signalled when a snapshot has been written */
+  pthread_cond_t done_cond;
+
+  /** Queue of snapshots to write (the head is the one being written) */
+  kp_snapshot_t *head;
+  kp_snapshot_t *tail;
+
+  /** Number of snapshots in the queue */
+  uint32_t outstanding;
+
+  /** Number of snapshots queued since the writer was started (so
+      queued - outstanding snapshots have been written) */
+  uint64_t queued;
+
+  /** A written snapshot whose columns can be re-used */
+  kp_snapshot_t *spare;
+
+  /** Set if any snapshot failed to be written since the last
+      timeseries_kp_flush_wait */
+  int failed;
+
+  /** Set to tell the writer thread to exit once the queue is empty */
+  int shutdown;
+
+  /** KI columns that have been replaced while the writer may have been
+      reading them (protected by the growth lock, and freed by the writer
+      when it next refreshes its column pointers) */
+  void **retired;
+
+  /** Number of retired columns */
+  uint32_t retired_cnt;
+
+  /** Number of entries allocated for the retired columns */
+  uint32_t retired_alloc;
 };
 
 /** Get the timeseries object associated with the given Key Package
@@ -115,370 +876,4622 @@ static timeseries_t *kp_get_timeseries(timeseries_kp_t *kp);
  */
 static void kp_reset_disable(timeseries_kp_t *kp);
 
-/** Initialize the given Key Info object
+/** Set the value of the key with the given ID to the identity of its
+ * aggregation mode
  *
- * @param ki            Pointer to the Key Info object to initialize
- * @param kp            Pointer to the Key Package this KI is associated with
- * @param key           Pointer to a key string
- * @return 0 if the KI was initialized successfully, -1 otherwise
+ * @param kp            pointer to a Key Package (with an aggregation column)
+ * @param values        column of values to update
+ * @param id            ID of the key to reset
  */
-static int kp_ki_init(timeseries_kp_ki_t *ki, timeseries_kp_t *kp,
-                      const char *key);
+static void kp_agg_identity(timeseries_kp_t *kp, kp_values_t values,
+                            uint32_t id);
 
-/** Free the given Key Info object
+/** Reset all the values in the given column to the identity of their key's
+ * aggregation mode (i.e. 0 for keys without a mode)
  *
- * @param ki_p          Pointer to a KI object to free
- * @param kp            Pointer to the KP object this KI is associated with
+ * @param kp            pointer to a Key Package
+ * @param values        column of values to reset (the KP's or a snapshot's)
+ */
+static void kp_values_reset(timeseries_kp_t *kp, kp_values_t values);
+
+/** Reset the value of the key with the given ID to the identity of its
+ * aggregation mode (i.e. 0 for keys without a mode)
  *
- * @note does NOT free the memory for the actual KI structure
+ * @param kp            pointer to a Key Package
+ * @param values        column of values to update
+ * @param id            ID of the key to reset
  */
-static void kp_ki_free(timeseries_kp_ki_t *ki, timeseries_kp_t *kp);
+static void kp_value_reset(timeseries_kp_t *kp, kp_values_t values,
+                           uint32_t id);
 
-/** Set the value of the given KI to the given value
+/** Add the key with the given ID to the live list (if it is not already
+ * listed)
  *
- * @param ki            Pointer to the KI object to set the value of
- * @param value         Value to set
+ * @param kp            pointer to a sparse Key Package
+ * @param id            ID of the key that has been enabled
  */
-static void kp_ki_set(timeseries_kp_ki_t *ki, uint64_t value);
+static void kp_live_add(timeseries_kp_t *kp, uint32_t id);
 
-static timeseries_t *kp_get_timeseries(timeseries_kp_t *kp)
-{
-  assert(kp != NULL);
-  return kp->timeseries;
-}
+/** Add the key with the given ID to the idle bucket of the interval it was
+ * last set in
+ *
+ * @param kp            pointer to a Key Package with an idle TTL
+ * @param id            ID of the key
+ *
+ * If the bucket cannot grow, the buckets are rebuilt before the next expiry.
+ */
+static void kp_idle_push(timeseries_kp_t *kp, uint32_t id);
 
-static void kp_reset_disable(timeseries_kp_t *kp)
-{
-  int i;
-  if (kp->reset == 0 && kp->disable == 0) {
-    return;
+/** Rebuild the idle buckets from the last-set column
+ *
+ * @param kp            pointer to a Key Package with an idle TTL
+ * @param oldest        flush count of the oldest interval that has not been
+ *                      expired yet (keys last set before it are moved to it)
+ */
+static void kp_idle_rebuild(timeseries_kp_t *kp, uint32_t oldest);
+
+/** Mark the enabled keys whose value has changed since they were last
+ * flushed, and remember their current values (if kp.changed_only is true)
+ *
+ * @param kp            pointer to a Key Package to update
+ */
+static void kp_changed_update(timeseries_kp_t *kp);
+
+/** Clear the changed bits of the enabled (i.e. just flushed) keys
+ *
+ * @param kp            pointer to a Key Package
+ */
+static void kp_changed_clear(timeseries_kp_t *kp);
+
+/** Find (or add) the key that the given key is rolled up into
+ *
+ * @param kp            Pointer to a Key Package created with
+ *                      TIMESERIES_KP_ROLLUP
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @param add           Add the parent key (and its own parents) if it does
+ *                      not exist
+ * @param[out] parent   Set to the ID of the parent key (UINT32_MAX if the key
+ *                      has no parent, or it does not exist and add is 0)
+ * @return 0 if the parent was found (or added), -1 if an error occurred
+ *
+ * The parent of a key is the key up to (but not including) its last '.'.
+ */
+static int kp_rollup_parent(timeseries_kp_t *kp, const char *key, size_t len,
+                            int add, uint32_t *parent);
+
+/** Move the children of removed keys up to the nearest live ancestor */
+static void kp_rollup_fix(timeseries_kp_t *kp);
+
+/** Set the value of each key that other keys are rolled up into to the sum
+ * of the enabled keys below it, enabling it if any of them are enabled
+ *
+ * @param kp            Pointer to a Key Package
+ */
+static void kp_rollup_update(timeseries_kp_t *kp);
+
+/** Flush the values in the given Key Package to each enabled backend
+ *
+ * @param kp            pointer to a Key Package (or snapshot view)
+ * @param time          The timestamp to associate the values with
+ * @return 0 if all backends flushed successfully, -1 otherwise
+ */
+static int kp_backends_flush(timeseries_kp_t *kp, uint32_t time);
+
+/** Start the async writer thread for the given Key Package
+ *
+ * @param kp            pointer to a Key Package
+ * @return 0 if the writer was started successfully, -1 otherwise
+ */
+static int kp_async_init(timeseries_kp_t *kp);
+
+/** Wait for the writer thread to finish, and free the async state
+ *
+ * @param kp            pointer to a Key Package
+ */
+static void kp_async_free(timeseries_kp_t *kp);
+
+/** Main function of the async writer thread
+ *
+ * @param user          pointer to the Key Package to write snapshots of
+ * @return NULL
+ */
+static void *kp_async_writer(void *user);
+
+/** Free a snapshot and its columns
+ *
+ * @param snap          pointer to the snapshot to free
+ */
+static void kp_snapshot_free(kp_snapshot_t *snap);
+
+/** Free the KI columns that were replaced while snapshots were being written
+ *
+ * @param async         pointer to the async flush state of a Key Package
+ *
+ * The caller must hold the growth lock (or be the only thread left).
+ */
+static void kp_async_retired_free(kp_async_t *async);
+
+/** Have the given number of snapshots been written?
+ *
+ * @param kp            pointer to a Key Package
+ * @param seq           number of snapshots (counted from the first one
+ *                      queued)
+ * @return 1 if at least that many snapshots have been written (or the KP has
+ * never been flushed asynchronously), 0 otherwise
+ */
+static int kp_async_written(timeseries_kp_t *kp, uint64_t seq);
+
+/** Wait until all outstanding snapshots have been written (and remove the
+ * keys that were waiting for them to expire)
+ *
+ * @param kp            pointer to a Key Package
+ *
+ * This must be called before doing anything that changes the key strings or
+ * backend state of existing keys (which snapshots share with the KP).
+ */
+static void kp_async_wait(timeseries_kp_t *kp);
+
+/** Grow the KI columns of the given Key Package to hold exactly the given
+ * number of keys
+ *
+ * @param kp            Pointer to the Key Package to grow
+ * @param cnt           Number of keys that the columns must hold
+ * @return 0 if the columns were grown successfully, -1 otherwise
+ */
+static int kp_ki_grow(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Ensure that the KI columns of the given Key Package can hold at least the
+ * given number of keys, growing them geometrically if needed
+ *
+ * @param kp            Pointer to the Key Package to check
+ * @param cnt           Number of keys that the columns must hold
+ * @return 0 if the columns are large enough, -1 if they could not be grown
+ */
+static int kp_ki_ensure(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Grow the per-interval (i.e. slot) columns of the given Key Package to hold
+ * exactly the given number of keys
+ *
+ * @param kp            Pointer to the Key Package to grow
+ * @param cnt           Number of keys that the columns must hold
+ * @return 0 if the columns were grown successfully, -1 otherwise
+ */
+static int kp_slot_grow(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Move the per-interval columns of the live keys of the given Key Package to
+ * their new IDs after a compaction
+ *
+ * @param kp            Pointer to the Key Package to update
+ * @param remap         Array (indexed by old ID) of new IDs
+ * @param old_cnt       Number of keys before the compaction
+ * @param new_cnt       Number of keys after the compaction
+ */
+static void kp_slot_compact(timeseries_kp_t *kp, const uint32_t *remap,
+                            uint32_t old_cnt, uint32_t new_cnt);
+
+/** Exchange the per-interval columns of the given Key Package with the given
+ * columns
+ *
+ * @param kp            Pointer to the Key Package
+ * @param cols          Pointer to the columns to swap into the KP
+ *
+ * The KP columns always belong to the current slot of the window, so the
+ * slot columns are swapped in to operate on another slot.
+ */
+static void kp_slot_swap(timeseries_kp_t *kp, kp_slot_cols_t *cols);
+
+/** Make the slot with the given index the current slot of the window
+ *
+ * @param kp            Pointer to a windowed Key Package
+ * @param idx           Index of the slot to select
+ */
+static void kp_window_select(timeseries_kp_t *kp, uint32_t idx);
+
+/** Flush the slot with the given index
+ *
+ * @param kp            Pointer to a windowed Key Package
+ * @param idx           Index of the slot to flush
+ * @return 0 if the slot was flushed successfully, -1 otherwise
+ */
+static int kp_window_flush_slot(timeseries_kp_t *kp, uint32_t idx);
+
+/** Free the window of the given Key Package (and the columns of all slots
+ * other than the current slot)
+ *
+ * @param kp            Pointer to a Key Package
+ */
+static void kp_window_free(timeseries_kp_t *kp);
+
+/** Reset all of the columns (other than the key) of the KI with the given ID
+ *
+ * @param kp            Pointer to the Key Package the KI is part of
+ * @param id            ID of the KI to reset
+ */
+static void kp_ki_zero(timeseries_kp_t *kp, uint32_t id);
+
+/** Clear the backend state of the Key Info with the given ID
+ *
+ * @param kp            Pointer to the KP the KI is part of
+ * @param id            ID of the KI to clear the backend state for
+ */
+static void kp_ki_clear_backend_state(timeseries_kp_t *kp, uint32_t id);
+
+/** Take the (write) lock of the shared key table (if the KP uses it)
+ *
+ * @param kp            Pointer to a Key Package
+ *
+ * This must be held while calling into the backends to resolve keys, since
+ * they write the state of shared keys.
+ */
+static void kp_keys_lock(timeseries_kp_t *kp);
+
+/** Take the read lock of the shared key table (if the KP uses it)
+ *
+ * @param kp            Pointer to a Key Package
+ *
+ * This must be held while calling into the backends to write values, since
+ * they get the key strings and state of shared keys.
+ */
+static void kp_keys_rdlock(timeseries_kp_t *kp);
+
+/** Release the lock taken by kp_keys_lock or kp_keys_rdlock
+ *
+ * @param kp            Pointer to a Key Package
+ */
+static void kp_keys_unlock(timeseries_kp_t *kp);
+
+/** Take the lock that must be held while reading one key of the KP: the
+ * growth lock for snapshot views, and for KPs with tagged keys and an async
+ * writer (since the names of tagged keys are rendered as they are got)
+ *
+ * @param kp            Pointer to a Key Package (or snapshot view)
+ *
+ * This is taken after kp_keys_lock and the backends lock, and only for as
+ * long as it takes to get the key, so that the owner can grow the KI columns
+ * while the writer is in the backends.
+ */
+static void kp_view_lock(timeseries_kp_t *kp);
+
+/** Release the lock taken by kp_view_lock
+ *
+ * @param kp            Pointer to a Key Package (or snapshot view)
+ */
+static void kp_view_unlock(timeseries_kp_t *kp);
+
+/** Make sure the global ID lookup table of a shared KP can hold the given
+ * number of keys
+ *
+ * @param kp            Pointer to a shared Key Package
+ * @param cnt           Number of keys (including removed keys)
+ * @return 0 if the table is large enough, -1 otherwise
+ */
+static int kp_gid_hash_ensure(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Rebuild the global ID lookup table of a shared KP from the given number
+ * of keys, dropping the entries of removed keys
+ *
+ * @param kp            Pointer to a shared Key Package
+ * @param cnt           Number of keys to insert
+ */
+static void kp_gid_hash_fill(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Add the given key string with the given (next) ID to the KP's keys
+ *
+ * @param kp            Pointer to a Key Package
+ * @param id            ID to give the key
+ * @param key           Pointer to a key string (need not be NUL-terminated)
+ * @param len           Length of the key string
+ * @param hash          Hash of the key (as returned by timeseries_dict_hash)
+ * @return 0 if the key was added, -1 otherwise
+ */
+static int kp_key_add(timeseries_kp_t *kp, uint32_t id, const char *key,
+                      size_t len, uint64_t hash);
+
+/** Find the ID of a key string in the KP's keys
+ *
+ * @return the ID of the key, -1 if it is not in the KP
+ */
+static int kp_key_find(timeseries_kp_t *kp, const char *key, size_t len,
+                       uint64_t hash);
+
+/** Get the key string with the given ID (see timeseries_dict_get)
+ *
+ * @note the caller must hold kp_keys_lock and kp_view_lock
+ */
+static const char *kp_key_get(timeseries_kp_t *kp, uint32_t id);
+
+/** Has the key with the given ID been removed? */
+static int kp_key_is_removed(timeseries_kp_t *kp, uint32_t id);
+
+/** Hash a tag set (with its tags sorted by tag key ID)
+ *
+ * @param metric        ID of the metric name
+ * @param tags          Array of tags_cnt tag key/value ID pairs
+ * @param tags_cnt      Number of tags
+ * @return the 64 bit hash of the tag set
+ */
+static uint64_t kp_tagset_hash(uint32_t metric, const uint32_t *tags,
+                               uint32_t tags_cnt);
+
+/** Check the IDs of a tag set, and sort its tags by tag key ID
+ *
+ * @param kp            Pointer to a Key Package
+ * @param metric        ID of the metric name
+ * @param tags          Array of tags_cnt tag key/value ID pairs
+ * @param tags_cnt      Number of tags
+ * @param[out] sorted   Array of tags_cnt pairs to write the sorted tags to
+ * @return 0 if the tag set is valid, -1 otherwise
+ */
+static int kp_tags_sort(timeseries_kp_t *kp, uint32_t metric,
+                        const uint32_t *tags, uint32_t tags_cnt,
+                        uint32_t *sorted);
+
+/** Find the ID of the key with the given (sorted) tag set
+ *
+ * @return the ID of the key, -1 if it is not in the KP
+ */
+static int kp_tags_find(timeseries_kp_t *kp, uint32_t metric,
+                        const uint32_t *tags, uint32_t tags_cnt,
+                        uint64_t hash);
+
+/** Make sure the tag set lookup table can hold the given number of keys
+ *
+ * @param kp            Pointer to a Key Package with tagged keys
+ * @param cnt           Number of tagged keys (including removed keys)
+ * @return 0 if the table is large enough, -1 otherwise
+ */
+static int kp_tags_hash_ensure(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Rebuild the tag set lookup table from the given number of keys, dropping
+ * the entries of removed keys
+ *
+ * @param kp            Pointer to a Key Package with tagged keys
+ * @param cnt           Number of keys to insert
+ */
+static void kp_tags_hash_fill(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Get the name of the tagged key with the given ID, rendering it the first
+ * time it is needed
+ *
+ * @param kp            Pointer to a Key Package (or snapshot view)
+ * @param id            ID of a tagged key
+ * @return a pointer to the name (see timeseries_dict_get), NULL if an error
+ * occurred
+ *
+ * @note the caller must hold kp_view_lock
+ */
+static const char *kp_tagged_key_get(timeseries_kp_t *kp, uint32_t id);
+
+/** Drop the tag sets of removed keys, and the rendered key names
+ *
+ * @param kp            Pointer to a Key Package with tagged keys
+ * @param cnt           Number of keys (after the key IDs have been
+ *                      compacted)
+ */
+static void kp_tags_compact(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Free the tagged key state of a Key Package
+ *
+ * @param kp            Pointer to a Key Package
+ */
+static void kp_tags_free(timeseries_kp_t *kp);
+
+/** Get a copy of the name of the given key, which stays valid until the key
+ * is removed or the KP is compacted
+ *
+ * @param kp            Pointer to a Key Package (or snapshot view)
+ * @param id            ID of the key
+ * @return a pointer to the copy of the key name, NULL if the key has been
+ * removed (or an error occurred)
+ *
+ * The caller must hold kp_keys_lock and kp_view_lock.
+ */
+static const char *kp_names_get(timeseries_kp_t *kp, uint32_t id);
+
+/** Forget the copy of the name of the given key (if there is one), which
+ * stays in its chunk until kp_names_clear is called
+ *
+ * @param kp            Pointer to a Key Package
+ * @param id            ID of the key
+ */
+static void kp_names_drop(timeseries_kp_t *kp, uint32_t id);
+
+/** Free all of the copies of key names
+ *
+ * @param kp            Pointer to a Key Package
+ */
+static void kp_names_clear(timeseries_kp_t *kp);
+
+/** Remove all keys that have not been set within the idle TTL
+ *
+ * @param kp            Pointer to the KP to expire keys in
+ */
+static void kp_expire_idle(timeseries_kp_t *kp);
+
+/** Make sure the list of expiring keys can hold the given number of keys
+ *
+ * @param kp            Pointer to a Key Package with an idle TTL
+ * @param cnt           Number of keys that the list must hold
+ * @return 0 if the list is large enough, -1 otherwise
+ */
+static int kp_expiring_ensure(timeseries_kp_t *kp, uint32_t cnt);
+
+/** Remove the keys that expired while snapshots were waiting to be written,
+ * if those snapshots have now been written
+ *
+ * @param kp            Pointer to a Key Package
+ */
+static void kp_expiring_remove(timeseries_kp_t *kp);
+
+/** Remove the (live) key with the given ID, without waiting for snapshots
+ *
+ * @param kp            Pointer to a Key Package
+ * @param key           ID of the key to remove
+ */
+static void kp_key_remove(timeseries_kp_t *kp, uint32_t key);
+
+/** Grow the columns of the given shard to hold at least the given number of
+ * keys
+ *
+ * @param shard         Pointer to the shard to grow
+ * @param cnt           Number of keys that the columns must hold
+ * @return 0 if the columns were grown successfully, -1 otherwise
+ */
+static int kp_shard_grow(timeseries_kp_shard_t *shard, uint32_t cnt);
+
+/** Merge the values written to all shards into the given Key Package, and
+ * reset the shards
+ *
+ * @param kp            Pointer to the KP to merge shards into
+ */
+static void kp_shards_merge(timeseries_kp_t *kp);
+
+/** Move the values in the given shard to their new key IDs after a
+ * compaction
+ *
+ * @param shard         Pointer to the shard to update
+ * @param remap         Array (indexed by old ID) of new IDs
+ * @param old_cnt       Number of elements in the remap array
+ */
+static void kp_shard_remap(timeseries_kp_shard_t *shard, const uint32_t *remap,
+                           uint32_t old_cnt);
+
+
+/** Write the given buffer to a checkpoint file, followed by zero padding up
+ * to the next multiple of 8 bytes
+ *
+ * @param fh            Checkpoint file to write to
+ * @param buf           Buffer to write (NULL if the buffer has already been
+ *                      written, and only the padding should be written)
+ * @param len           Length of the buffer
+ * @return 0 if the buffer was written successfully, -1 otherwise
+ */
+static int kp_ckpt_write(FILE *fh, const void *buf, size_t len);
+
+/** Copy the keys of a shared KP into a new dictionary (in key ID order), so
+ * that they can be checkpointed in the same way as the keys of other KPs
+ *
+ * @param kp            Pointer to a shared Key Package
+ * @return a pointer to the new dictionary, NULL if an error occurred
+ */
+static timeseries_dict_t *kp_keys_export(timeseries_kp_t *kp);
+
+static timeseries_t *kp_get_timeseries(timeseries_kp_t *kp)
+{
+  assert(kp != NULL);
+  return kp->timeseries;
+}
+
+static void kp_agg_identity(timeseries_kp_t *kp, kp_values_t values,
+                            uint32_t id)
+{
+  int min = (kp->agg[id] == TIMESERIES_KP_AGG_MIN);
+
+  if (!min && kp->agg[id] != TIMESERIES_KP_AGG_MAX) {
+    memset(KP_VAL_PTR(values, kp->value_size, id), 0, kp->value_size);
+    return;
+  }
+
+  switch (kp->value_type) {
+  case TIMESERIES_KP_VALUE_U32:
+    values.u32[id] = min ? UINT32_MAX : 0;
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    values.i64[id] = min ? INT64_MAX : INT64_MIN;
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    values.d[id] = min ? INFINITY : -INFINITY;
+    break;
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    values.u64[id] = min ? UINT64_MAX : 0;
+    break;
+  }
+}
+
+static void kp_values_reset(timeseries_kp_t *kp, kp_values_t values)
+{
+  uint32_t id;
+
+  memset(values.raw, 0, kp->value_size * kp->key_infos_cnt);
+  /* 0 is the identity of every mode other than min and max */
+  if (kp->agg != NULL) {
+    for (id = 0; id < kp->key_infos_cnt; id++) {
+      if (KP_AGG_EXTREMUM(kp->agg[id])) {
+        kp_agg_identity(kp, values, id);
+      }
+    }
+  }
+}
+
+static void kp_value_reset(timeseries_kp_t *kp, kp_values_t values,
+                           uint32_t id)
+{
+  if (kp->agg != NULL) {
+    kp_agg_identity(kp, values, id);
+  } else {
+    memset(KP_VAL_PTR(values, kp->value_size, id), 0, kp->value_size);
+  }
+}
+
+static void kp_live_add(timeseries_kp_t *kp, uint32_t id)
+{
+  if ((kp->listed[KP_BM_WORD(id)] & KP_BM_BIT(id)) == 0) {
+    kp->listed[KP_BM_WORD(id)] |= KP_BM_BIT(id);
+    kp->live[kp->live_cnt++] = id;
+  }
+}
+
+static void kp_idle_push(timeseries_kp_t *kp, uint32_t id)
+{
+  kp_idle_bucket_t *b = &kp->idle[kp->last_set[id] % (kp->idle_ttl + 1)];
+  uint32_t *tmp;
+  uint32_t alloc;
+
+  /* the keys that were in the bucket have all been expired (or moved) */
+  if (b->flush != kp->last_set[id]) {
+    b->flush = kp->last_set[id];
+    b->cnt = 0;
+  }
+  if (b->cnt == b->alloc) {
+    alloc = (b->alloc < KP_KI_MIN_ALLOC) ? KP_KI_MIN_ALLOC : b->alloc * 2;
+    if ((tmp = realloc(b->ids, sizeof(uint32_t) * alloc)) == NULL) {
+      kp->idle_pos[id] = 0;
+      kp->idle_rescan = 1;
+      return;
+    }
+    b->ids = tmp;
+    b->alloc = alloc;
+  }
+  kp->idle_pos[id] = b->cnt;
+  b->ids[b->cnt++] = id;
+}
+
+/** Note that the key with the given ID has been set in the current interval,
+    moving it to the bucket of the interval (if it is not already there) */
+static inline void kp_idle_touch(timeseries_kp_t *kp, uint32_t id)
+{
+  kp_idle_bucket_t *b;
+  uint32_t pos;
+
+  if (kp->last_set == NULL || kp->last_set[id] == kp->flush_cnt) {
+    return;
+  }
+
+  /* swap the key out of its old bucket (unless it never made it in, or has
+     already been taken out to expire, in which case it is kept) */
+  b = &kp->idle[kp->last_set[id] % (kp->idle_ttl + 1)];
+  pos = kp->idle_pos[id];
+  if (pos >= KP_IDLE_EXPIRING_OFF) {
+    kp->idle_pos[id] = 0;
+    if (pos == KP_IDLE_EXPIRING) {
+      timeseries_kp_enable_key(kp, id);
+    }
+  } else if (b->flush == kp->last_set[id] && pos < b->cnt &&
+             b->ids[pos] == id) {
+    b->ids[pos] = b->ids[--b->cnt];
+    kp->idle_pos[b->ids[pos]] = pos;
+  }
+
+  kp->last_set[id] = kp->flush_cnt;
+  kp_idle_push(kp, id);
+}
+
+static void kp_idle_rebuild(timeseries_kp_t *kp, uint32_t oldest)
+{
+  uint32_t i, id;
+
+  kp->idle_rescan = 0;
+  for (i = 0; i <= kp->idle_ttl; i++) {
+    kp->idle[i].cnt = 0;
+  }
+  for (id = 0; id < kp->key_infos_cnt; id++) {
+    if (kp_key_is_removed(kp, id) || kp->idle_pos[id] >= KP_IDLE_EXPIRING_OFF) {
+      continue;
+    }
+    if (kp->flush_cnt - kp->last_set[id] > kp->flush_cnt - oldest) {
+      kp->last_set[id] = oldest;
+    }
+    kp_idle_push(kp, id);
+  }
+}
+
+static void kp_idle_free(timeseries_kp_t *kp)
+{
+  uint32_t i;
+
+  for (i = 0; kp->idle != NULL && i <= kp->idle_ttl; i++) {
+    free(kp->idle[i].ids);
+  }
+  free(kp->idle);
+  kp->idle = NULL;
+}
+
+static void kp_reset_disable(timeseries_kp_t *kp)
+{
+  uint32_t i, id;
+
+  /* sparse KPs are always disabled, so only the listed keys can have been
+     enabled (and set) since the last flush */
+  if (kp->sparse != 0) {
+    for (i = 0; i < kp->live_cnt; i++) {
+      id = kp->live[i];
+      if (kp->reset != 0) {
+        kp_value_reset(kp, kp->values, id);
+      }
+      kp->enabled[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+      kp->listed[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+    }
+    kp->live_cnt = 0;
+    kp->key_infos_enabled_cnt = 0;
+    return;
+  }
+
+  if (kp->reset != 0) {
+    kp_values_reset(kp, kp->values);
+  }
+  if (kp->disable != 0) {
+    memset(kp->enabled, 0, sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_cnt));
+    kp->key_infos_enabled_cnt = 0;
+  }
+}
+
+/* Mark the enabled keys in one bitmap word whose value differs from the
+   previous value (using the given member of the value columns) */
+#define KP_CHANGED_WORD(kp, w, m)                                              \
+  do {                                                                         \
+    uint64_t b_ = (kp)->enabled[w];                                            \
+    uint64_t diff_ = 0;                                                        \
+    uint32_t i_;                                                               \
+    while (b_ != 0) {                                                          \
+      i_ = ((w) * 64) + __builtin_ctzll(b_);                                   \
+      if ((kp)->values.m[i_] != (kp)->prev_values.m[i_]) {                     \
+        (kp)->prev_values.m[i_] = (kp)->values.m[i_];                          \
+        diff_ |= b_ & -b_;                                                     \
+      }                                                                        \
+      b_ &= b_ - 1;                                                            \
+    }                                                                          \
+    (kp)->changed[w] |= diff_;                                                 \
+  } while (0)
+
+static void kp_changed_update(timeseries_kp_t *kp)
+{
+  uint64_t words = KP_BM_WORDS(kp->key_infos_cnt);
+  uint64_t w;
+
+  if (kp->changed_only == 0) {
+    return;
+  }
+
+  /* values are compared bit-wise, so a double column is compared as u64 */
+  for (w = 0; w < words; w++) {
+    if (kp->value_size == sizeof(uint32_t)) {
+      KP_CHANGED_WORD(kp, w, u32);
+    } else {
+      KP_CHANGED_WORD(kp, w, u64);
+    }
+  }
+}
+
+static void kp_changed_clear(timeseries_kp_t *kp)
+{
+  uint64_t words = KP_BM_WORDS(kp->key_infos_cnt);
+  uint64_t w;
+
+  if (kp->changed_only == 0) {
+    return;
+  }
+
+  /* disabled keys keep their bits until they are next flushed */
+  for (w = 0; w < words; w++) {
+    kp->changed[w] &= ~kp->enabled[w];
+  }
+}
+
+static int kp_rollup_parent(timeseries_kp_t *kp, const char *key, size_t len,
+                            int add, uint32_t *parent)
+{
+  size_t plen = len;
+  int id;
+
+  *parent = UINT32_MAX;
+  while (plen > 0 && key[plen - 1] != '.') {
+    plen--;
+  }
+  /* keys without a '.' (other than a leading one) are not rolled up */
+  if (plen <= 1) {
+    return 0;
+  }
+  plen--;
+
+  if ((id = kp_key_find(kp, key, plen, timeseries_dict_hash(key, plen))) <
+      0) {
+    if (add == 0) {
+      return 0;
+    }
+    if ((id = timeseries_kp_add_key_n(kp, key, plen)) < 0) {
+      return -1;
+    }
+  }
+  if (add != 0) {
+    kp->rollup_keys[KP_BM_WORD(id)] |= KP_BM_BIT(id);
+  }
+  *parent = id;
+  return 0;
+}
+
+static void kp_rollup_fix(timeseries_kp_t *kp)
+{
+  uint32_t id, p;
+
+  if (kp->rollup_stale == 0) {
+    return;
+  }
+
+  /* parents are fixed before their children, so a removed parent's own
+     parent is always live (or none) by the time it is needed */
+  for (id = 0; id < kp->key_infos_cnt; id++) {
+    if ((p = kp->rollup_parent[id]) != UINT32_MAX && kp_key_is_removed(kp, p)) {
+      kp->rollup_parent[id] = kp->rollup_parent[p];
+    }
+  }
+  kp->rollup_stale = 0;
+}
+
+/** Add the value of the given key to the value of its parent, and enable
+    the parent */
+static void kp_rollup_add(timeseries_kp_t *kp, uint32_t parent, uint32_t id)
+{
+  switch (kp->value_type) {
+  case TIMESERIES_KP_VALUE_U32:
+    kp->values.u32[parent] += kp->values.u32[id];
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    kp->values.i64[parent] = (int64_t)((uint64_t)kp->values.i64[parent] +
+                                       (uint64_t)kp->values.i64[id]);
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    kp->values.d[parent] += kp->values.d[id];
+    break;
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    kp->values.u64[parent] += kp->values.u64[id];
+    break;
+  }
+
+  if ((kp->enabled[KP_BM_WORD(parent)] & KP_BM_BIT(parent)) == 0) {
+    kp->enabled[KP_BM_WORD(parent)] |= KP_BM_BIT(parent);
+    kp->key_infos_enabled_cnt++;
+    if (kp->sparse != 0) {
+      kp_live_add(kp, parent);
+    }
+  }
+  /* a rollup key is idle once all of the keys below it are */
+  kp_idle_touch(kp, parent);
+}
+
+static void kp_rollup_update(timeseries_kp_t *kp)
+{
+  uint64_t words = KP_BM_WORDS(kp->key_infos_cnt);
+  uint64_t w, b;
+  uint32_t i, id, p, bit, live_cnt;
+
+  if (kp->rollup == 0) {
+    return;
+  }
+  kp_rollup_fix(kp);
+
+  /* rollup keys only hold the sum of the keys below them */
+  for (w = 0; w < words; w++) {
+    for (b = kp->rollup_keys[w]; b != 0; b &= b - 1) {
+      id = (w * 64) + __builtin_ctzll(b);
+      memset(KP_VAL_PTR(kp->values, kp->value_size, id), 0, kp->value_size);
+    }
+  }
+
+  if (kp->sparse != 0) {
+    /* only the listed keys can be enabled, so add each of them to all of its
+       ancestors (the rollup keys are listed as they are enabled, and are
+       skipped) */
+    live_cnt = kp->live_cnt;
+    for (i = 0; i < live_cnt; i++) {
+      id = kp->live[i];
+      if ((kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) == 0 ||
+          (kp->rollup_keys[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+        continue;
+      }
+      for (p = kp->rollup_parent[id]; p != UINT32_MAX;
+           p = kp->rollup_parent[p]) {
+        kp_rollup_add(kp, p, id);
+      }
+    }
+    return;
+  }
+
+  /* children have higher IDs than their parents, so a single pass over the
+     enabled keys in reverse ID order adds the total of each key to its
+     parent. The rest of the word is re-read after each key, since adding it
+     may have enabled its parent in the same word. */
+  for (w = words; w-- > 0;) {
+    for (b = kp->enabled[w]; b != 0;
+         b = kp->enabled[w] & (KP_BM_BIT(bit) - 1)) {
+      bit = 63 - __builtin_clzll(b);
+      id = (w * 64) + bit;
+      if ((p = kp->rollup_parent[id]) != UINT32_MAX) {
+        kp_rollup_add(kp, p, id);
+      }
+    }
+  }
+}
+
+/* realloc the given column to hold cnt elements of size elem */
+#define GROW_COL(col, cnt, elem)                                               \
+  do {                                                                         \
+    void *tmp;                                                                 \
+    if ((tmp = realloc((col), (elem) * (cnt))) == NULL) {                      \
+      return -1;                                                               \
+    }                                                                          \
+    (col) = tmp;                                                               \
+  } while (0)
+
+/** Move a KI column that the async writer may be reading to a new column of
+    the given size, keeping the old one until the writer has moved on */
+static int kp_col_replace(timeseries_kp_t *kp, void **col, size_t old_size,
+                          size_t new_size)
+{
+  kp_async_t *async = kp->async;
+  uint32_t alloc;
+  void *tmp;
+
+  if (async->retired_cnt == async->retired_alloc) {
+    alloc = (async->retired_alloc == 0) ? 8 : async->retired_alloc * 2;
+    if ((tmp = realloc(async->retired, sizeof(void *) * alloc)) == NULL) {
+      return -1;
+    }
+    async->retired = tmp;
+    async->retired_alloc = alloc;
+  }
+  if ((tmp = malloc(new_size)) == NULL) {
+    return -1;
+  }
+  if (*col != NULL) {
+    memcpy(tmp, *col, (old_size < new_size) ? old_size : new_size);
+  }
+  async->retired[async->retired_cnt++] = *col;
+  *col = tmp;
+  return 0;
+}
+
+/* Grow a KI column that snapshot views share with the KP (the caller holds
+   the growth lock) */
+#define GROW_VIEW_COL(kp, col, cnt, elem)                                      \
+  do {                                                                         \
+    void *col_ = (col);                                                        \
+    if ((kp)->async == NULL) {                                                 \
+      GROW_COL(col, cnt, elem);                                                \
+    } else if (kp_col_replace((kp), &col_, (elem) * (kp)->key_infos_alloc,     \
+                              (elem) * (cnt)) != 0) {                          \
+      return -1;                                                               \
+    } else {                                                                   \
+      (col) = col_;                                                            \
+    }                                                                          \
+  } while (0)
+
+static int kp_slot_grow(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint64_t old_words = KP_BM_WORDS(kp->key_infos_alloc);
+
+  GROW_COL(kp->values.raw, cnt, kp->value_size);
+  GROW_COL(kp->enabled, KP_BM_WORDS(cnt), sizeof(uint64_t));
+  if (KP_BM_WORDS(cnt) > old_words) {
+    memset(&kp->enabled[old_words], 0,
+           sizeof(uint64_t) * (KP_BM_WORDS(cnt) - old_words));
+  }
+  if (kp->sparse != 0) {
+    GROW_COL(kp->live, cnt, sizeof(uint32_t));
+    GROW_COL(kp->listed, KP_BM_WORDS(cnt), sizeof(uint64_t));
+    if (KP_BM_WORDS(cnt) > old_words) {
+      memset(&kp->listed[old_words], 0,
+             sizeof(uint64_t) * (KP_BM_WORDS(cnt) - old_words));
+    }
+  }
+  return 0;
+}
+
+static int kp_ki_grow_cols(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint64_t old_words = KP_BM_WORDS(kp->key_infos_alloc);
+  uint32_t s;
+  int rc;
+  int i;
+
+  if (kp_slot_grow(kp, cnt) != 0) {
+    return -1;
+  }
+  for (s = 0; kp->window != NULL && s < kp->window->slots_cnt; s++) {
+    if (s == kp->window->cur) {
+      continue;
+    }
+    kp_slot_swap(kp, &kp->window->slots[s].cols);
+    rc = kp_slot_grow(kp, cnt);
+    kp_slot_swap(kp, &kp->window->slots[s].cols);
+    if (rc != 0) {
+      return -1;
+    }
+  }
+
+  if (kp->changed_only != 0) {
+    GROW_COL(kp->prev_values.raw, cnt, kp->value_size);
+    GROW_COL(kp->changed, KP_BM_WORDS(cnt), sizeof(uint64_t));
+    if (KP_BM_WORDS(cnt) > old_words) {
+      memset(&kp->changed[old_words], 0,
+             sizeof(uint64_t) * (KP_BM_WORDS(cnt) - old_words));
+    }
+  }
+  if (kp->last_set != NULL) {
+    GROW_COL(kp->last_set, cnt, sizeof(uint32_t));
+    GROW_COL(kp->idle_pos, cnt, sizeof(uint32_t));
+  }
+  if (kp->agg != NULL) {
+    GROW_COL(kp->agg, cnt, sizeof(uint8_t));
+  }
+
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (kp->ki_backend_state[i] != NULL) {
+      GROW_VIEW_COL(kp, kp->ki_backend_state[i], cnt,
+                    kp->ki_backend_state_size[i]);
+    }
+  }
+  if (kp->keys != NULL) {
+    GROW_VIEW_COL(kp, kp->gids, cnt, sizeof(uint32_t));
+  }
+  if (kp->tagsets != NULL) {
+    GROW_VIEW_COL(kp, kp->tagsets, cnt, sizeof(uint32_t));
+  }
+  if (kp->rollup != 0) {
+    GROW_COL(kp->rollup_parent, cnt, sizeof(uint32_t));
+    GROW_COL(kp->rollup_keys, KP_BM_WORDS(cnt), sizeof(uint64_t));
+    if (KP_BM_WORDS(cnt) > old_words) {
+      memset(&kp->rollup_keys[old_words], 0,
+             sizeof(uint64_t) * (KP_BM_WORDS(cnt) - old_words));
+    }
+  }
+
+  kp->key_infos_alloc = cnt;
+  return 0;
+}
+
+static int kp_ki_grow(timeseries_kp_t *kp, uint32_t cnt)
+{
+  int rc;
+
+  /* snapshots being written share the key and backend state columns */
+  if (kp->async != NULL) {
+    pthread_mutex_lock(&kp->async->grow_lock);
+  }
+  rc = kp_ki_grow_cols(kp, cnt);
+  if (kp->async != NULL) {
+    pthread_mutex_unlock(&kp->async->grow_lock);
+  }
+  return rc;
+}
+
+static int kp_ki_ensure(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint64_t alloc;
+
+  if (cnt <= kp->key_infos_alloc) {
+    return 0;
+  }
+
+  /* double the columns (so that adding N keys costs O(N) copies) */
+  alloc = (uint64_t)kp->key_infos_alloc * 2;
+  if (alloc < KP_KI_MIN_ALLOC) {
+    alloc = KP_KI_MIN_ALLOC;
+  }
+  if (alloc < cnt) {
+    alloc = cnt;
+  }
+  if (alloc > UINT32_MAX) {
+    alloc = UINT32_MAX;
+  }
+
+  return kp_ki_grow(kp, alloc);
+}
+
+static void kp_ki_zero(timeseries_kp_t *kp, uint32_t id)
+{
+  kp_slot_cols_t *cols;
+  uint32_t s;
+
+  memset(KP_VAL_PTR(kp->values, kp->value_size, id), 0, kp->value_size);
+  if (kp->agg != NULL) {
+    kp->agg[id] = kp->default_agg;
+    kp_agg_identity(kp, kp->values, id);
+  }
+  kp->enabled[KP_BM_WORD(id)] |= KP_BM_BIT(id);
+  if (kp->sparse != 0) {
+    kp_live_add(kp, id);
+  }
+  /* new keys are only enabled in the other slots if keys are never
+     disabled */
+  for (s = 0; kp->window != NULL && s < kp->window->slots_cnt; s++) {
+    if (s == kp->window->cur) {
+      continue;
+    }
+    cols = &kp->window->slots[s].cols;
+    kp_value_reset(kp, cols->values, id);
+    if (kp->disable == 0) {
+      cols->enabled[KP_BM_WORD(id)] |= KP_BM_BIT(id);
+      cols->enabled_cnt++;
+    }
+  }
+  if (kp->changed_only != 0) {
+    /* the first value of a key is always written */
+    memset(KP_VAL_PTR(kp->prev_values, kp->value_size, id), 0,
+           kp->value_size);
+    kp->changed[KP_BM_WORD(id)] |= KP_BM_BIT(id);
+  }
+  if (kp->last_set != NULL) {
+    kp->last_set[id] = kp->flush_cnt;
+    kp_idle_push(kp, id);
+  }
+  if (kp->tagsets != NULL) {
+    kp->tagsets[id] = UINT32_MAX;
+  }
+  if (kp->rollup != 0) {
+    kp->rollup_parent[id] = UINT32_MAX;
+  }
+  kp_ki_clear_backend_state(kp, id);
+}
+
+static int kp_shard_grow(timeseries_kp_shard_t *shard, uint32_t cnt)
+{
+  uint64_t old_words = KP_BM_WORDS(shard->alloc);
+
+  /* size the shard like the KP so that it does not grow key by key */
+  if (cnt < shard->kp->key_infos_alloc) {
+    cnt = shard->kp->key_infos_alloc;
+  }
+
+  GROW_COL(shard->values.raw, cnt, shard->kp->value_size);
+  memset(KP_VAL_PTR(shard->values, shard->kp->value_size, shard->alloc), 0,
+         shard->kp->value_size * (cnt - shard->alloc));
+  GROW_COL(shard->touched, KP_BM_WORDS(cnt), sizeof(uint64_t));
+  memset(&shard->touched[old_words], 0,
+         sizeof(uint64_t) * (KP_BM_WORDS(cnt) - old_words));
+
+  shard->alloc = cnt;
+  return 0;
+}
+
+/** Merge the value of a key with an aggregation mode (other than last) from
+    a shard into the KP: sums and counts are added, and minimums and maximums
+    are aggregated as if they had been set (whatever the merge mode of the
+    shard) */
+static void kp_shard_merge_agg(timeseries_kp_t *kp,
+                               timeseries_kp_shard_t *shard, uint32_t id)
+{
+  timeseries_kp_agg_t agg = KP_AGG_EXTREMUM(kp->agg[id])
+                              ? (timeseries_kp_agg_t)kp->agg[id]
+                              : TIMESERIES_KP_AGG_SUM;
+
+  switch (kp->value_type) {
+  case TIMESERIES_KP_VALUE_U32:
+    KP_AGG_APPLY(uint32_t, uint32_t, kp->values.u32[id],
+                 shard->values.u32[id], agg);
+    break;
+  case TIMESERIES_KP_VALUE_I64:
+    KP_AGG_APPLY(int64_t, uint64_t, kp->values.i64[id], shard->values.i64[id],
+                 agg);
+    break;
+  case TIMESERIES_KP_VALUE_DOUBLE:
+    KP_AGG_APPLY(double, double, kp->values.d[id], shard->values.d[id], agg);
+    break;
+  case TIMESERIES_KP_VALUE_U64:
+  default:
+    KP_AGG_APPLY(uint64_t, uint64_t, kp->values.u64[id],
+                 shard->values.u64[id], agg);
+    break;
+  }
+  memset(KP_VAL_PTR(shard->values, kp->value_size, id), 0, kp->value_size);
+}
+
+/* Merge the values of the keys in one bitmap word of a shard into the KP
+   (using the given member of the value columns) */
+#define KP_SHARD_MERGE_WORD(kp, shard, base, bits, m)                          \
+  do {                                                                         \
+    uint64_t b_ = (bits);                                                      \
+    uint32_t i_;                                                               \
+    if (b_ == ~UINT64_C(0)) {                                                  \
+      /* dense block: straight-line loops that the compiler can vectorize */  \
+      if ((shard)->merge == TIMESERIES_KP_MERGE_SUM) {                         \
+        for (i_ = (base); i_ < (base) + 64; i_++) {                            \
+          (kp)->values.m[i_] += (shard)->values.m[i_];                         \
+        }                                                                      \
+      } else {                                                                 \
+        memcpy(&(kp)->values.m[base], &(shard)->values.m[base],                \
+               sizeof((kp)->values.m[0]) * 64);                                \
+      }                                                                        \
+      memset(&(shard)->values.m[base], 0, sizeof((kp)->values.m[0]) * 64);     \
+      break;                                                                   \
+    }                                                                          \
+    while (b_ != 0) {                                                          \
+      i_ = (base) + __builtin_ctzll(b_);                                       \
+      b_ &= b_ - 1;                                                            \
+      if ((shard)->merge == TIMESERIES_KP_MERGE_SUM) {                         \
+        (kp)->values.m[i_] += (shard)->values.m[i_];                           \
+      } else {                                                                 \
+        (kp)->values.m[i_] = (shard)->values.m[i_];                            \
+      }                                                                        \
+      (shard)->values.m[i_] = 0;                                               \
+    }                                                                          \
+  } while (0)
+
+static void kp_shards_merge(timeseries_kp_t *kp)
+{
+  timeseries_kp_shard_t *shard;
+  uint64_t words, w, bits, b, merge;
+  uint32_t base, id;
+
+  for (shard = kp->shards; shard != NULL; shard = shard->next) {
+    words = KP_BM_WORDS(shard->alloc < kp->key_infos_cnt ? shard->alloc
+                                                         : kp->key_infos_cnt);
+    for (w = 0; w < words; w++) {
+      if ((bits = shard->touched[w]) == 0) {
+        continue;
+      }
+      shard->touched[w] = 0;
+      base = w * 64;
+
+      /* keys written through a shard are enabled, just like a key that is
+         explicitly enabled after being set */
+      if (kp->disable != 0) {
+        kp->key_infos_enabled_cnt +=
+          __builtin_popcountll(bits & ~kp->enabled[w]);
+        if (kp->sparse != 0) {
+          for (b = bits & ~kp->enabled[w]; b != 0; b &= b - 1) {
+            kp_live_add(kp, base + __builtin_ctzll(b));
+          }
+        }
+        kp->enabled[w] |= bits;
+      }
+
+      /* keys with an aggregation mode merge by their mode instead */
+      merge = bits;
+      for (b = (kp->agg != NULL) ? bits : 0; b != 0; b &= b - 1) {
+        id = base + __builtin_ctzll(b);
+        if (kp->agg[id] != TIMESERIES_KP_AGG_LAST) {
+          kp_shard_merge_agg(kp, shard, id);
+          merge &= ~(b & -b);
+        }
+      }
+
+      switch (kp->value_type) {
+      case TIMESERIES_KP_VALUE_U64:
+        KP_SHARD_MERGE_WORD(kp, shard, base, merge, u64);
+        break;
+      case TIMESERIES_KP_VALUE_U32:
+        KP_SHARD_MERGE_WORD(kp, shard, base, merge, u32);
+        break;
+      case TIMESERIES_KP_VALUE_I64:
+        KP_SHARD_MERGE_WORD(kp, shard, base, merge, i64);
+        break;
+      case TIMESERIES_KP_VALUE_DOUBLE:
+        KP_SHARD_MERGE_WORD(kp, shard, base, merge, d);
+        break;
+      }
+
+      if (kp->last_set != NULL) {
+        for (b = bits; b != 0; b &= b - 1) {
+          kp_idle_touch(kp, base + __builtin_ctzll(b));
+        }
+      }
+    }
+  }
+}
+
+static void kp_shard_remap(timeseries_kp_shard_t *shard, const uint32_t *remap,
+                           uint32_t old_cnt)
+{
+  uint32_t cnt = (shard->alloc < old_cnt) ? shard->alloc : old_cnt;
+  size_t size = shard->kp->value_size;
+  uint32_t id, new_id;
+
+  /* new IDs are never greater than old IDs, so this can be done in place */
+  for (id = 0; id < cnt; id++) {
+    if ((new_id = remap[id]) == UINT32_MAX || new_id == id) {
+      continue;
+    }
+    memcpy(KP_VAL_PTR(shard->values, size, new_id),
+           KP_VAL_PTR(shard->values, size, id), size);
+    memset(KP_VAL_PTR(shard->values, size, id), 0, size);
+    shard->touched[KP_BM_WORD(new_id)] &= ~KP_BM_BIT(new_id);
+    if ((shard->touched[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+      shard->touched[KP_BM_WORD(new_id)] |= KP_BM_BIT(new_id);
+      shard->touched[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+    }
+  }
+}
+
+static void kp_slot_compact(timeseries_kp_t *kp, const uint32_t *remap,
+                            uint32_t old_cnt, uint32_t new_cnt)
+{
+  uint32_t id, new_id, live_cnt;
+
+  for (id = 0; id < old_cnt; id++) {
+    if ((new_id = remap[id]) == UINT32_MAX) {
+      continue;
+    }
+    memcpy(KP_VAL_PTR(kp->values, kp->value_size, new_id),
+           KP_VAL_PTR(kp->values, kp->value_size, id), kp->value_size);
+    /* read the bit first: new_id == id until the first removed key */
+    if ((kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+      kp->enabled[KP_BM_WORD(new_id)] |= KP_BM_BIT(new_id);
+    } else {
+      kp->enabled[KP_BM_WORD(new_id)] &= ~KP_BM_BIT(new_id);
+    }
+  }
+
+  /* renumber the live list, dropping removed keys (the listed bits are
+     cleared first, since a new ID may be the old ID of another listed key) */
+  if (kp->sparse != 0) {
+    for (id = 0; id < kp->live_cnt; id++) {
+      kp->listed[KP_BM_WORD(kp->live[id])] &= ~KP_BM_BIT(kp->live[id]);
+    }
+    for (id = 0, live_cnt = 0; id < kp->live_cnt; id++) {
+      if ((new_id = remap[kp->live[id]]) == UINT32_MAX) {
+        continue;
+      }
+      kp->live[live_cnt++] = new_id;
+      kp->listed[KP_BM_WORD(new_id)] |= KP_BM_BIT(new_id);
+    }
+    kp->live_cnt = live_cnt;
+  }
+
+  /* keep the bitmap invariant: no bits set beyond the last key */
+  for (id = new_cnt; id < old_cnt && (id & 63) != 0; id++) {
+    kp->enabled[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+  }
+  if (KP_BM_WORDS(old_cnt) > KP_BM_WORDS(new_cnt)) {
+    memset(&kp->enabled[KP_BM_WORDS(new_cnt)], 0,
+           sizeof(uint64_t) * (KP_BM_WORDS(old_cnt) - KP_BM_WORDS(new_cnt)));
+  }
+}
+
+static void kp_slot_swap(timeseries_kp_t *kp, kp_slot_cols_t *cols)
+{
+  kp_slot_cols_t tmp = *cols;
+
+  cols->values = kp->values;
+  cols->enabled = kp->enabled;
+  cols->enabled_cnt = kp->key_infos_enabled_cnt;
+  cols->live = kp->live;
+  cols->live_cnt = kp->live_cnt;
+  cols->listed = kp->listed;
+
+  kp->values = tmp.values;
+  kp->enabled = tmp.enabled;
+  kp->key_infos_enabled_cnt = tmp.enabled_cnt;
+  kp->live = tmp.live;
+  kp->live_cnt = tmp.live_cnt;
+  kp->listed = tmp.listed;
+}
+
+static void kp_window_select(timeseries_kp_t *kp, uint32_t idx)
+{
+  kp_window_t *window = kp->window;
+  kp_slot_t *slot = &window->slots[idx];
+
+  if (idx == window->cur) {
+    return;
+  }
+
+  /* the KP takes the columns of the slot, and the slot is left holding the
+     columns of the previous current slot, which are moved there */
+  kp_slot_swap(kp, &slot->cols);
+  window->slots[window->cur].cols = slot->cols;
+  memset(&slot->cols, 0, sizeof(kp_slot_cols_t));
+  window->cur = idx;
+}
+
+static int kp_window_flush_slot(timeseries_kp_t *kp, uint32_t idx)
+{
+  kp_window_t *window = kp->window;
+  kp_slot_t *slot = &window->slots[idx];
+  uint32_t prev = window->cur;
+  int rc;
+
+  kp_window_select(kp, idx);
+  /* there is nothing to write for a slot without any enabled keys (but
+     values may have been set for disabled keys) */
+  if (kp->key_infos_enabled_cnt == 0) {
+    kp_reset_disable(kp);
+    slot->used = 0;
+    kp_window_select(kp, prev);
+    return 0;
+  }
+  if (window->cb != NULL) {
+    window->cb(kp, slot->time, window->cb_user);
+  }
+  /* the flush resets/disables the slot columns for the next time it is
+     used */
+  if ((rc = timeseries_kp_flush(kp, slot->time)) == 0) {
+    slot->used = 0;
+  }
+  kp_window_select(kp, prev);
+
+  return rc;
+}
+
+static void kp_window_free(timeseries_kp_t *kp)
+{
+  kp_window_t *window = kp->window;
+  uint32_t s;
+
+  if (window == NULL) {
+    return;
+  }
+
+  for (s = 0; s < window->slots_cnt; s++) {
+    if (s == window->cur) {
+      continue;
+    }
+    free(window->slots[s].cols.values.raw);
+    free(window->slots[s].cols.enabled);
+    free(window->slots[s].cols.live);
+    free(window->slots[s].cols.listed);
+  }
+  free(window->slots);
+  free(window);
+  kp->window = NULL;
+}
+
+/** Arguments for kp_backend_flush */
+typedef struct kp_flush_args {
+  timeseries_kp_t *kp;
+  uint32_t time;
+} kp_flush_args_t;
+
+/** Flush a Key Package to a single backend (see kp_backends_flush) */
+static int kp_backend_flush(timeseries_backend_t *backend, void *arg)
+{
+  kp_flush_args_t *args = arg;
+  if (backend->kp_flush_span != NULL) {
+    return timeseries_kp_flush_spans(args->kp, backend, args->time);
+  }
+  return backend->kp_flush(backend, args->kp, args->time);
+}
+
+/** Get the ID of the next key to put in a span (i.e. the next key that
+ * TIMESERIES_KP_FOREACH_CHANGED_KI would visit)
+ *
+ * @param kp            Pointer to a Key Package
+ * @param pos[in,out]   Iteration position (start at 0)
+ * @return the ID of the next key, or the number of keys in the KP if there
+ * are no more keys
+ *
+ * For sparse KPs, this walks the live list rather than the enabled bitmap.
+ */
+static uint32_t kp_span_next(timeseries_kp_t *kp, uint32_t *pos)
+{
+  uint32_t id;
+
+  if (kp->sparse == 0) {
+    id = timeseries_kp_ki_next_changed(kp, *pos);
+    *pos = id + 1;
+    return id;
+  }
+
+  while (*pos < kp->live_cnt) {
+    id = kp->live[(*pos)++];
+    if ((kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0 &&
+        (kp->changed_only == 0 ||
+         (kp->changed[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0)) {
+      return id;
+    }
+  }
+
+  return kp->key_infos_cnt;
+}
+
+static int kp_backends_flush(timeseries_kp_t *kp, uint32_t time)
+{
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  assert(timeseries != NULL);
+  kp_flush_args_t args = {kp, time};
+  int rc;
+
+  kp_keys_rdlock(kp);
+  timeseries_backends_lock(timeseries);
+  rc = timeseries_backends_foreach(timeseries, kp_backend_flush, &args);
+  timeseries_backends_unlock(timeseries);
+  kp_keys_unlock(kp);
+
+  return rc;
+}
+
+static int kp_async_init(timeseries_kp_t *kp)
+{
+  kp_async_t *async;
+
+  if ((async = malloc_zero(sizeof(kp_async_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc async flush state");
+    return -1;
+  }
+  pthread_mutex_init(&async->mutex, NULL);
+  pthread_mutex_init(&async->grow_lock, NULL);
+  pthread_cond_init(&async->work_cond, NULL);
+  pthread_cond_init(&async->done_cond, NULL);
+  kp->async = async;
+  /* the writer gets key strings while the owner adds keys (shared keys are
+     protected by the shared key table lock instead) */
+  if (kp->dict != NULL) {
+    timeseries_dict_set_lock(kp->dict, &async->grow_lock);
+  }
+  if (kp->tags != NULL) {
+    timeseries_dict_set_lock(kp->tags->strs, &async->grow_lock);
+  }
+
+  if (pthread_create(&async->writer, NULL, kp_async_writer, kp) != 0) {
+    timeseries_log(__func__, "could not start async writer thread");
+    if (kp->dict != NULL) {
+      timeseries_dict_set_lock(kp->dict, NULL);
+    }
+    if (kp->tags != NULL) {
+      timeseries_dict_set_lock(kp->tags->strs, NULL);
+    }
+    kp->async = NULL;
+    pthread_mutex_destroy(&async->mutex);
+    pthread_mutex_destroy(&async->grow_lock);
+    pthread_cond_destroy(&async->work_cond);
+    pthread_cond_destroy(&async->done_cond);
+    free(async);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void kp_async_free(timeseries_kp_t *kp)
+{
+  kp_async_t *async = kp->async;
+
+  if (async == NULL) {
+    return;
+  }
+
+  /* the writer drains the queue before exiting */
+  pthread_mutex_lock(&async->mutex);
+  async->shutdown = 1;
+  pthread_cond_signal(&async->work_cond);
+  pthread_mutex_unlock(&async->mutex);
+  pthread_join(async->writer, NULL);
+  if (kp->dict != NULL) {
+    timeseries_dict_set_lock(kp->dict, NULL);
+  }
+  if (kp->tags != NULL) {
+    timeseries_dict_set_lock(kp->tags->strs, NULL);
+  }
+
+  if (async->spare != NULL) {
+    kp_snapshot_free(async->spare);
+  }
+  kp_async_retired_free(async);
+  free(async->retired);
+  pthread_mutex_destroy(&async->mutex);
+  pthread_mutex_destroy(&async->grow_lock);
+  pthread_cond_destroy(&async->work_cond);
+  pthread_cond_destroy(&async->done_cond);
+  free(async);
+  kp->async = NULL;
+}
+
+static void *kp_async_writer(void *user)
+{
+  timeseries_kp_t *kp = user;
+  kp_async_t *async = kp->async;
+  kp_snapshot_t *snap;
+  int rc;
+  int i;
+
+  pthread_mutex_lock(&async->mutex);
+  while (1) {
+    while (async->head == NULL && async->shutdown == 0) {
+      pthread_cond_wait(&async->work_cond, &async->mutex);
+    }
+    if ((snap = async->head) == NULL) {
+      break;
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    /* the backend state (and global ID and tag set) columns may have been
+       moved since the snapshot was taken, and the columns they replaced are
+       no longer used by anyone once the new ones have been picked up */
+    pthread_mutex_lock(&async->grow_lock);
+    for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+      snap->view.ki_backend_state[i] = kp->ki_backend_state[i];
+    }
+    snap->view.gids = kp->gids;
+    snap->view.tags = kp->tags;
+    snap->view.tagsets = kp->tagsets;
+    kp_async_retired_free(async);
+    pthread_mutex_unlock(&async->grow_lock);
+
+    /* the owner can add keys while the backends write */
+    rc = kp_backends_flush(&snap->view, snap->time);
+
+    if (snap->cb != NULL) {
+      snap->cb(kp, snap->time, rc, snap->cb_user);
+    }
+
+    pthread_mutex_lock(&async->mutex);
+    if ((async->head = snap->next) == NULL) {
+      async->tail = NULL;
+    }
+    async->outstanding--;
+    if (rc != 0) {
+      async->failed = 1;
+    }
+    /* keep one snapshot around so its columns can be re-used */
+    if (async->spare == NULL) {
+      async->spare = snap;
+    } else {
+      kp_snapshot_free(snap);
+    }
+    pthread_cond_broadcast(&async->done_cond);
+  }
+  pthread_mutex_unlock(&async->mutex);
+
+  return NULL;
+}
+
+static void kp_async_retired_free(kp_async_t *async)
+{
+  uint32_t i;
+
+  for (i = 0; i < async->retired_cnt; i++) {
+    free(async->retired[i]);
+  }
+  async->retired_cnt = 0;
+}
+
+static int kp_async_written(timeseries_kp_t *kp, uint64_t seq)
+{
+  kp_async_t *async = kp->async;
+  int written;
+
+  if (async == NULL) {
+    return 1;
+  }
+  pthread_mutex_lock(&async->mutex);
+  written = (async->queued - async->outstanding) >= seq;
+  pthread_mutex_unlock(&async->mutex);
+  return written;
+}
+
+static void kp_snapshot_free(kp_snapshot_t *snap)
+{
+  free(snap->view.values.raw);
+  free(snap->view.enabled);
+  free(snap->view.changed);
+  free(snap->view.live);
+  free(snap);
+}
+
+static void kp_async_wait(timeseries_kp_t *kp)
+{
+  kp_async_t *async = kp->async;
+
+  if (async == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&async->mutex);
+  while (async->outstanding > 0) {
+    pthread_cond_wait(&async->done_cond, &async->mutex);
+  }
+  pthread_mutex_unlock(&async->mutex);
+
+  /* no snapshot can use the expiring keys now */
+  kp_expiring_remove(kp);
+}
+
+static void kp_ki_clear_backend_state(timeseries_kp_t *kp, uint32_t id)
+{
+  int i;
+
+  /* shared KPs have no columns: the state of a shared key is kept, since
+     other KPs may use it */
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (kp->ki_backend_state[i] != NULL) {
+      memset(KP_KI_STATE_PTR(kp, i, id), 0, kp->ki_backend_state_size[i]);
+    }
+  }
+}
+
+static void kp_keys_lock(timeseries_kp_t *kp)
+{
+  if (kp->keys != NULL) {
+    timeseries_keys_lock(kp->keys);
+  }
+}
+
+static void kp_keys_rdlock(timeseries_kp_t *kp)
+{
+  if (kp->keys != NULL) {
+    timeseries_keys_rdlock(kp->keys);
+  }
+}
+
+static void kp_keys_unlock(timeseries_kp_t *kp)
+{
+  if (kp->keys != NULL) {
+    timeseries_keys_unlock(kp->keys);
+  }
+}
+
+static void kp_view_lock(timeseries_kp_t *kp)
+{
+  if (kp->view_lock != NULL) {
+    pthread_mutex_lock(kp->view_lock);
+  } else if (kp->tagsets != NULL && kp->async != NULL) {
+    pthread_mutex_lock(&kp->async->grow_lock);
+  }
+}
+
+static void kp_view_unlock(timeseries_kp_t *kp)
+{
+  if (kp->view_lock != NULL) {
+    pthread_mutex_unlock(kp->view_lock);
+  } else if (kp->tagsets != NULL && kp->async != NULL) {
+    pthread_mutex_unlock(&kp->async->grow_lock);
+  }
+}
+
+static void kp_gid_hash_insert(timeseries_kp_t *kp, uint32_t id)
+{
+  uint32_t mask = kp->gid_slots_cnt - 1;
+  uint32_t i;
+
+  for (i = KP_GID_HASH(kp->gids[id], mask); kp->gid_slots[i] != UINT32_MAX;
+       i = (i + 1) & mask)
+    ;
+  kp->gid_slots[i] = id;
+}
+
+static void kp_gid_hash_fill(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint32_t id;
+
+  memset(kp->gid_slots, 0xff, sizeof(uint32_t) * kp->gid_slots_cnt);
+  for (id = 0; id < cnt; id++) {
+    if (kp->gids[id] != UINT32_MAX) {
+      kp_gid_hash_insert(kp, id);
+    }
+  }
+}
+
+static int kp_gid_hash_ensure(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint64_t slots_cnt = kp->gid_slots_cnt;
+  uint32_t *slots;
+
+  if (slots_cnt != 0 && !KP_GID_HASH_FULL(slots_cnt, cnt)) {
+    return 0;
+  }
+
+  if (slots_cnt < KP_GID_HASH_MIN_SLOTS) {
+    slots_cnt = KP_GID_HASH_MIN_SLOTS;
+  }
+  while (KP_GID_HASH_FULL(slots_cnt, cnt)) {
+    slots_cnt *= 2;
+  }
+  if (slots_cnt > (UINT64_C(1) << 31) ||
+      (slots = malloc(sizeof(uint32_t) * slots_cnt)) == NULL) {
+    timeseries_log(__func__, "could not grow global ID lookup table");
+    return -1;
+  }
+  free(kp->gid_slots);
+  kp->gid_slots = slots;
+  kp->gid_slots_cnt = slots_cnt;
+
+  /* the global IDs are stored, so this does not touch the shared keys */
+  kp_gid_hash_fill(kp, kp->key_infos_cnt);
+  return 0;
+}
+
+static int kp_key_add(timeseries_kp_t *kp, uint32_t id, const char *key,
+                      size_t len, uint64_t hash)
+{
+  int gid;
+
+  /* the dictionary assigns IDs in the same order as the KP */
+  if (kp->keys == NULL) {
+    return (timeseries_dict_add(kp->dict, key, len, hash) < 0) ? -1 : 0;
+  }
+
+  if (kp_gid_hash_ensure(kp, id + 1) != 0) {
+    return -1;
+  }
+  timeseries_keys_lock(kp->keys);
+  gid = timeseries_keys_intern(kp->keys, key, len, hash);
+  timeseries_keys_unlock(kp->keys);
+  if (gid < 0) {
+    return -1;
+  }
+  kp->gids[id] = gid;
+  kp_gid_hash_insert(kp, id);
+  return 0;
+}
+
+static int kp_key_find(timeseries_kp_t *kp, const char *key, size_t len,
+                       uint64_t hash)
+{
+  uint32_t mask = kp->gid_slots_cnt - 1;
+  uint32_t i, id;
+  int gid, found;
+
+  if (kp->keys == NULL) {
+    found = timeseries_dict_find(kp->dict, key, len, hash);
+    /* tagged keys are only found by their tag sets (their dictionary entries
+       are empty placeholders) */
+    if (found >= 0 && kp->tagsets != NULL && kp->tagsets[found] != UINT32_MAX) {
+      return -1;
+    }
+    return found;
+  }
+
+  timeseries_keys_rdlock(kp->keys);
+  gid = timeseries_keys_find(kp->keys, key, len, hash);
+  timeseries_keys_unlock(kp->keys);
+  if (gid < 0 || kp->gid_slots_cnt == 0) {
+    return -1;
+  }
+
+  /* the key may be in the shared table without being in this KP */
+  for (i = KP_GID_HASH(gid, mask); (id = kp->gid_slots[i]) != UINT32_MAX;
+       i = (i + 1) & mask) {
+    if (kp->gids[id] == (uint32_t)gid) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+static const char *kp_key_get(timeseries_kp_t *kp, uint32_t id)
+{
+  if (kp->keys == NULL) {
+    if (kp->tagsets != NULL && kp->tagsets[id] != UINT32_MAX) {
+      return kp_tagged_key_get(kp, id);
+    }
+    return timeseries_dict_get(kp->dict, id);
+  }
+  if (kp->gids[id] == UINT32_MAX) {
+    return NULL;
+  }
+  return timeseries_keys_get(kp->keys, kp->gids[id]);
+}
+
+static int kp_key_is_removed(timeseries_kp_t *kp, uint32_t id)
+{
+  if (kp->keys == NULL) {
+    return timeseries_dict_is_removed(kp->dict, id);
+  }
+  return kp->gids[id] == UINT32_MAX;
+}
+
+static uint64_t kp_tagset_hash(uint32_t metric, const uint32_t *tags,
+                               uint32_t tags_cnt)
+{
+  uint64_t hash = ((uint64_t)tags_cnt << 32) | metric;
+  uint32_t i;
+
+  /* mix in one ID at a time (multiply, then fold the high bits down) */
+  hash *= UINT64_C(0x9e3779b97f4a7c15);
+  for (i = 0; i < tags_cnt * 2; i++) {
+    hash = (hash ^ (hash >> 32) ^ tags[i]) * UINT64_C(0x9e3779b97f4a7c15);
+  }
+  return hash ^ (hash >> 29);
+}
+
+static int kp_tags_sort(timeseries_kp_t *kp, uint32_t metric,
+                        const uint32_t *tags, uint32_t tags_cnt,
+                        uint32_t *sorted)
+{
+  uint32_t strs_cnt;
+  uint32_t i, j, key;
+
+  if (kp->tags == NULL) {
+    timeseries_log(__func__, "no tag strings have been interned");
+    return -1;
+  }
+  if (tags_cnt > TIMESERIES_KP_TAGS_MAX) {
+    timeseries_log(__func__, "too many tags (%" PRIu32 ")", tags_cnt);
+    return -1;
+  }
+  strs_cnt = timeseries_dict_size(kp->tags->strs);
+  if (metric >= strs_cnt) {
+    timeseries_log(__func__, "no such tag string (%" PRIu32 ")", metric);
+    return -1;
+  }
+
+  /* there are only a few tags, so an insertion sort will do */
+  for (i = 0; i < tags_cnt; i++) {
+    key = tags[i * 2];
+    if (key >= strs_cnt || tags[i * 2 + 1] >= strs_cnt) {
+      timeseries_log(__func__, "no such tag string (%" PRIu32 ")",
+                     (key >= strs_cnt) ? key : tags[i * 2 + 1]);
+      return -1;
+    }
+    for (j = i; j > 0 && sorted[(j - 1) * 2] > key; j--) {
+      sorted[j * 2] = sorted[(j - 1) * 2];
+      sorted[j * 2 + 1] = sorted[(j - 1) * 2 + 1];
+    }
+    if (j > 0 && sorted[(j - 1) * 2] == key) {
+      timeseries_log(__func__, "duplicate tag key (%" PRIu32 ")", key);
+      return -1;
+    }
+    sorted[j * 2] = key;
+    sorted[j * 2 + 1] = tags[i * 2 + 1];
+  }
+
+  return 0;
+}
+
+static int kp_tags_find(timeseries_kp_t *kp, uint32_t metric,
+                        const uint32_t *tags, uint32_t tags_cnt,
+                        uint64_t hash)
+{
+  kp_tags_t *kt = kp->tags;
+  uint32_t mask = kt->slots_cnt - 1;
+  const uint32_t *set;
+  uint32_t i, id, off;
+
+  if (kt->slots_cnt == 0) {
+    return -1;
+  }
+
+  for (i = hash & mask; (id = kt->slots[i]) != UINT32_MAX;
+       i = (i + 1) & mask) {
+    /* removed keys have no tag set */
+    if ((off = kp->tagsets[id]) == UINT32_MAX) {
+      continue;
+    }
+    set = &kt->sets[off];
+    if (set[KP_TAGSET_METRIC] == metric && set[KP_TAGSET_CNT] == tags_cnt &&
+        memcmp(&set[KP_TAGSET_TAGS], tags, sizeof(uint32_t) * tags_cnt * 2) ==
+          0) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+static void kp_tags_hash_insert(timeseries_kp_t *kp, uint32_t id)
+{
+  kp_tags_t *kt = kp->tags;
+  const uint32_t *set = &kt->sets[kp->tagsets[id]];
+  uint32_t mask = kt->slots_cnt - 1;
+  uint32_t i;
+
+  for (i = kp_tagset_hash(set[KP_TAGSET_METRIC], &set[KP_TAGSET_TAGS],
+                          set[KP_TAGSET_CNT]) &
+           mask;
+       kt->slots[i] != UINT32_MAX; i = (i + 1) & mask)
+    ;
+  kt->slots[i] = id;
+  kt->slots_used++;
+}
+
+static void kp_tags_hash_fill(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint32_t id;
+
+  memset(kp->tags->slots, 0xff, sizeof(uint32_t) * kp->tags->slots_cnt);
+  kp->tags->slots_used = 0;
+  for (id = 0; id < cnt; id++) {
+    if (kp->tagsets[id] != UINT32_MAX) {
+      kp_tags_hash_insert(kp, id);
+    }
+  }
+}
+
+static int kp_tags_hash_ensure(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint64_t slots_cnt = kp->tags->slots_cnt;
+  uint32_t *slots;
+
+  /* sized like the global ID lookup table */
+  if (slots_cnt != 0 && !KP_GID_HASH_FULL(slots_cnt, cnt)) {
+    return 0;
+  }
+
+  if (slots_cnt < KP_GID_HASH_MIN_SLOTS) {
+    slots_cnt = KP_GID_HASH_MIN_SLOTS;
+  }
+  while (KP_GID_HASH_FULL(slots_cnt, cnt)) {
+    slots_cnt *= 2;
+  }
+  if (slots_cnt > (UINT64_C(1) << 31) ||
+      (slots = malloc(sizeof(uint32_t) * slots_cnt)) == NULL) {
+    timeseries_log(__func__, "could not grow tag set lookup table");
+    return -1;
+  }
+  free(kp->tags->slots);
+  kp->tags->slots = slots;
+  kp->tags->slots_cnt = slots_cnt;
+
+  kp_tags_hash_fill(kp, kp->key_infos_cnt);
+  return 0;
+}
+
+/** Make sure there is space for a tag set of the given length */
+static int kp_tags_sets_ensure(timeseries_kp_t *kp, uint32_t len)
+{
+  kp_tags_t *kt = kp->tags;
+  uint64_t alloc = kt->sets_alloc;
+  uint32_t *sets;
+
+  if ((uint64_t)kt->sets_len + len <= alloc) {
+    return 0;
+  }
+
+  alloc = (alloc < KP_TAGSET_MIN_ALLOC) ? KP_TAGSET_MIN_ALLOC : alloc * 2;
+  while (alloc < (uint64_t)kt->sets_len + len) {
+    alloc *= 2;
+  }
+  if (alloc > UINT32_MAX) {
+    alloc = UINT32_MAX;
+    if ((uint64_t)kt->sets_len + len > alloc) {
+      timeseries_log(__func__, "too many tag sets");
+      return -1;
+    }
+  }
+
+  /* the async writer may be reading the tag sets */
+  if (kp->async != NULL) {
+    pthread_mutex_lock(&kp->async->grow_lock);
+  }
+  sets = realloc(kt->sets, sizeof(uint32_t) * alloc);
+  if (sets != NULL) {
+    kt->sets = sets;
+    kt->sets_alloc = alloc;
+  }
+  if (kp->async != NULL) {
+    pthread_mutex_unlock(&kp->async->grow_lock);
+  }
+  if (sets == NULL) {
+    timeseries_log(__func__, "could not realloc tag sets");
+    return -1;
+  }
+  return 0;
+}
+
+/** Make sure the render buffer has space for the given number of bytes */
+static int kp_tags_reserve(kp_tags_t *kt, size_t len)
+{
+  size_t alloc = (kt->buf_alloc == 0) ? 256 : kt->buf_alloc;
+  char *buf;
+
+  if (len <= kt->buf_alloc) {
+    return 0;
+  }
+  while (alloc < len) {
+    alloc *= 2;
+  }
+  if ((buf = realloc(kt->buf, alloc)) == NULL) {
+    timeseries_log(__func__, "could not realloc tag render buffer");
+    return -1;
+  }
+  kt->buf = buf;
+  kt->buf_alloc = alloc;
+  return 0;
+}
+
+/** Append the tag string with the given ID (and a separator) to the render
+    buffer */
+static int kp_tags_append(kp_tags_t *kt, size_t *len, uint32_t str_id,
+                          char sep)
+{
+  const char *str;
+  size_t str_len;
+
+  if ((str = timeseries_dict_get(kt->strs, str_id)) == NULL) {
+    return -1;
+  }
+  str_len = strlen(str);
+  if (kp_tags_reserve(kt, *len + str_len + 1) != 0) {
+    return -1;
+  }
+  memcpy(&kt->buf[*len], str, str_len);
+  kt->buf[*len + str_len] = sep;
+  *len += str_len + 1;
+  return 0;
+}
+
+/** Render the name of a tag set as "metric;key=value;key=value" (the
+    Graphite tagged series format) */
+static const char *kp_tags_render(kp_tags_t *kt, uint32_t *set)
+{
+  uint32_t cnt = set[KP_TAGSET_CNT];
+  size_t pos[TIMESERIES_KP_TAGS_MAX];
+  size_t len = 0, start, p, n;
+  uint32_t i, j;
+  int id;
+
+  if (kt->names == NULL && (kt->names = timeseries_dict_init()) == NULL) {
+    return NULL;
+  }
+
+  /* render each tag as "key=value", and sort them by string, so that the
+     name does not depend on the order the tag strings were interned in */
+  for (i = 0; i < cnt; i++) {
+    p = len;
+    if (kp_tags_append(kt, &len, set[KP_TAGSET_TAGS + i * 2], '=') != 0 ||
+        kp_tags_append(kt, &len, set[KP_TAGSET_TAGS + i * 2 + 1], '\0') != 0) {
+      return NULL;
+    }
+    for (j = i; j > 0 && strcmp(&kt->buf[pos[j - 1]], &kt->buf[p]) > 0; j--) {
+      pos[j] = pos[j - 1];
+    }
+    pos[j] = p;
+  }
+
+  start = len;
+  if (kp_tags_append(kt, &len, set[KP_TAGSET_METRIC], ';') != 0) {
+    return NULL;
+  }
+  for (i = 0; i < cnt; i++) {
+    n = strlen(&kt->buf[pos[i]]);
+    if (kp_tags_reserve(kt, len + n + 1) != 0) {
+      return NULL;
+    }
+    memcpy(&kt->buf[len], &kt->buf[pos[i]], n);
+    kt->buf[len + n] = ';';
+    len += n + 1;
+  }
+  /* drop the trailing separator */
+  len--;
+
+  if ((id = timeseries_dict_add(kt->names, &kt->buf[start], len - start,
+                                timeseries_dict_hash(&kt->buf[start],
+                                                     len - start))) < 0) {
+    return NULL;
+  }
+  set[KP_TAGSET_NAME] = id;
+  return timeseries_dict_get(kt->names, id);
+}
+
+static const char *kp_tagged_key_get(timeseries_kp_t *kp, uint32_t id)
+{
+  uint32_t *set = &kp->tags->sets[kp->tagsets[id]];
+
+  if (set[KP_TAGSET_NAME] != UINT32_MAX) {
+    return timeseries_dict_get(kp->tags->names, set[KP_TAGSET_NAME]);
+  }
+  return kp_tags_render(kp->tags, set);
+}
+
+static void kp_tags_compact(timeseries_kp_t *kp, uint32_t cnt)
+{
+  kp_tags_t *kt = kp->tags;
+  uint32_t len = 0;
+  uint32_t id, off, n;
+
+  /* the tag sets are in key ID order, so the live sets can be moved down in
+     place */
+  for (id = 0; id < cnt; id++) {
+    if ((off = kp->tagsets[id]) == UINT32_MAX) {
+      continue;
+    }
+    n = KP_TAGSET_LEN(kt->sets[off + KP_TAGSET_CNT]);
+    memmove(&kt->sets[len], &kt->sets[off], sizeof(uint32_t) * n);
+    kt->sets[len + KP_TAGSET_NAME] = UINT32_MAX;
+    kp->tagsets[id] = len;
+    len += n;
+  }
+  kt->sets_len = len;
+
+  /* the rendered names are cheap to render again, and the names of removed
+     keys would otherwise be kept for good */
+  timeseries_dict_free(&kt->names);
+  kp_tags_hash_fill(kp, cnt);
+}
+
+static void kp_tags_free(timeseries_kp_t *kp)
+{
+  if (kp->tags == NULL) {
+    return;
+  }
+  timeseries_dict_free(&kp->tags->strs);
+  timeseries_dict_free(&kp->tags->names);
+  free(kp->tags->sets);
+  free(kp->tags->slots);
+  free(kp->tags->buf);
+  free(kp->tags);
+  kp->tags = NULL;
+  free(kp->tagsets);
+  kp->tagsets = NULL;
+}
+
+/** Make space for a copy of a key name of the given length (including the
+    NUL) at the end of the name chunks */
+static char *kp_names_append(kp_names_t *kn, size_t len)
+{
+  kp_names_chunk_t *chunk = kn->arena;
+  size_t size;
+  char *p;
+
+  if (chunk == NULL || chunk->size - chunk->used < len) {
+    size = (len > KP_NAMES_CHUNK_LEN) ? len : KP_NAMES_CHUNK_LEN;
+    if ((chunk = malloc(sizeof(kp_names_chunk_t) + size)) == NULL) {
+      return NULL;
+    }
+    chunk->prev = kn->arena;
+    chunk->size = size;
+    chunk->used = 0;
+    kn->arena = chunk;
+  }
+  p = &chunk->data[chunk->used];
+  chunk->used += len;
+  return p;
+}
+
+static const char *kp_names_get(timeseries_kp_t *kp, uint32_t id)
+{
+  kp_names_t *kn = kp->names;
+  const char *key;
+  char *name = NULL;
+  char **tmp;
+  uint32_t alloc;
+  size_t len;
+
+  pthread_mutex_lock(&kn->lock);
+  if (id >= kn->alloc) {
+    /* the column is grown geometrically, since snapshot views ask for the
+       names of keys up to their own (older) key count */
+    alloc = (kn->alloc < KP_KI_MIN_ALLOC) ? KP_KI_MIN_ALLOC : kn->alloc;
+    while (alloc <= id) {
+      alloc = (alloc > UINT32_MAX / 2) ? UINT32_MAX : alloc * 2;
+    }
+    if ((tmp = realloc(kn->col, sizeof(char *) * alloc)) == NULL) {
+      timeseries_log(__func__, "could not realloc key name column");
+      goto done;
+    }
+    memset(&tmp[kn->alloc], 0, sizeof(char *) * (alloc - kn->alloc));
+    kn->col = tmp;
+    kn->alloc = alloc;
+  }
+  if (kn->col[id] == NULL && (key = kp_key_get(kp, id)) != NULL) {
+    len = strlen(key) + 1;
+    if ((kn->col[id] = kp_names_append(kn, len)) == NULL) {
+      timeseries_log(__func__, "could not copy key name");
+    } else {
+      memcpy(kn->col[id], key, len);
+    }
+  }
+  name = kn->col[id];
+
+done:
+  pthread_mutex_unlock(&kn->lock);
+  return name;
+}
+
+static void kp_names_drop(timeseries_kp_t *kp, uint32_t id)
+{
+  kp_names_t *kn = kp->names;
+
+  pthread_mutex_lock(&kn->lock);
+  if (id < kn->alloc) {
+    kn->col[id] = NULL;
+  }
+  pthread_mutex_unlock(&kn->lock);
+}
+
+static void kp_names_clear(timeseries_kp_t *kp)
+{
+  kp_names_t *kn = kp->names;
+  kp_names_chunk_t *chunk;
+
+  pthread_mutex_lock(&kn->lock);
+  while ((chunk = kn->arena) != NULL) {
+    kn->arena = chunk->prev;
+    free(chunk);
+  }
+  free(kn->col);
+  kn->col = NULL;
+  kn->alloc = 0;
+  pthread_mutex_unlock(&kn->lock);
+}
+
+static void kp_expire_idle(timeseries_kp_t *kp)
+{
+  uint32_t oldest = kp->flush_cnt - kp->idle_ttl;
+  kp_idle_bucket_t *b;
+  uint32_t i, id;
+
+  /* keys cannot be removed from frozen KPs */
+  if (kp->frozen != 0) {
+    return;
+  }
+
+  if (kp->idle_rescan != 0) {
+    kp_idle_rebuild(kp, oldest);
+  }
+
+  /* only the keys last set in the interval that has just left the TTL can
+     have gone idle (keys set since then have moved to a newer bucket) */
+  b = &kp->idle[oldest % (kp->idle_ttl + 1)];
+  if (b->flush != oldest) {
+    return;
+  }
+  /* snapshots that are waiting to be written may use the keys, so they are
+     disabled now, and removed once the snapshots have been written */
+  if (kp_async_written(kp, kp->async != NULL ? kp->async->queued : 0) == 0) {
+    if (kp_expiring_ensure(kp, kp->expiring_cnt + b->cnt) != 0) {
+      /* the keys are put back into the oldest bucket and tried again at the
+         next flush */
+      kp->idle_rescan = 1;
+      return;
+    }
+    for (i = 0; i < b->cnt; i++) {
+      id = b->ids[i];
+      if (kp_key_is_removed(kp, id) || kp->last_set[id] != oldest) {
+        continue;
+      }
+      if ((kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+        timeseries_kp_disable_key(kp, id);
+        kp->idle_pos[id] = KP_IDLE_EXPIRING;
+      } else {
+        kp->idle_pos[id] = KP_IDLE_EXPIRING_OFF;
+      }
+      kp->expiring[kp->expiring_cnt++] = id;
+    }
+    kp->expiring_seq = kp->async->queued;
+    b->cnt = 0;
+    return;
+  }
+
+  for (i = 0; i < b->cnt; i++) {
+    id = b->ids[i];
+    if (kp_key_is_removed(kp, id) == 0 && kp->last_set[id] == oldest) {
+      kp_key_remove(kp, id);
+    }
+  }
+  b->cnt = 0;
+}
+
+static int kp_expiring_ensure(timeseries_kp_t *kp, uint32_t cnt)
+{
+  uint32_t *tmp;
+  uint32_t alloc;
+
+  if (cnt <= kp->expiring_alloc) {
+    return 0;
+  }
+  alloc = (kp->expiring_alloc < KP_KI_MIN_ALLOC) ? KP_KI_MIN_ALLOC
+                                                 : kp->expiring_alloc;
+  while (alloc < cnt) {
+    alloc *= 2;
+  }
+  if ((tmp = realloc(kp->expiring, sizeof(uint32_t) * alloc)) == NULL) {
+    timeseries_log(__func__, "could not realloc expiring keys");
+    return -1;
+  }
+  kp->expiring = tmp;
+  kp->expiring_alloc = alloc;
+  return 0;
+}
+
+static void kp_expiring_remove(timeseries_kp_t *kp)
+{
+  uint32_t i, id;
+
+  if (kp->expiring_cnt == 0 || kp_async_written(kp, kp->expiring_seq) == 0) {
+    return;
+  }
+  for (i = 0; i < kp->expiring_cnt; i++) {
+    id = kp->expiring[i];
+    /* keys that were set or enabled again are no longer marked */
+    if (kp_key_is_removed(kp, id) == 0 && kp->last_set != NULL &&
+        kp->idle_pos[id] >= KP_IDLE_EXPIRING_OFF) {
+      kp_key_remove(kp, id);
+    }
+  }
+  kp->expiring_cnt = 0;
+}
+
+static int kp_ckpt_write(FILE *fh, const void *buf, size_t len)
+{
+  static const uint8_t zeros[8] = {0};
+  size_t pad = KP_CKPT_ALIGN(len) - len;
+
+  if ((buf != NULL && len > 0 && fwrite(buf, len, 1, fh) != 1) ||
+      (pad > 0 && fwrite(zeros, pad, 1, fh) != 1)) {
+    return -1;
+  }
+  return 0;
+}
+
+static timeseries_dict_t *kp_keys_export(timeseries_kp_t *kp)
+{
+  timeseries_dict_t *dict;
+  const char *key;
+  size_t len;
+  uint32_t id;
+
+  if ((dict = timeseries_dict_init()) == NULL ||
+      timeseries_dict_reserve(dict, kp->key_infos_cnt) != 0) {
+    timeseries_dict_free(&dict);
+    return NULL;
+  }
+
+  timeseries_keys_rdlock(kp->keys);
+  for (id = 0; id < kp->key_infos_cnt; id++) {
+    /* removed keys are kept as (empty) tombstones so that the key IDs are
+       unchanged */
+    key = kp_key_get(kp, id);
+    if (key == NULL) {
+      key = "";
+    }
+    len = strlen(key);
+    if (timeseries_dict_add(dict, key, len, timeseries_dict_hash(key, len)) <
+        0) {
+      timeseries_keys_unlock(kp->keys);
+      timeseries_dict_free(&dict);
+      return NULL;
+    }
+    if (kp_key_is_removed(kp, id)) {
+      timeseries_dict_remove(dict, id);
+    }
+  }
+  timeseries_keys_unlock(kp->keys);
+
+  return dict;
+}
+
+/* ========== PROTECTED FUNCTIONS ========== */
+
+int timeseries_kp_size(timeseries_kp_t *kp)
+{
+  assert(kp != NULL);
+  return kp->key_infos_cnt;
+}
+
+int timeseries_kp_enabled_size(timeseries_kp_t *kp)
+{
+  return kp->key_infos_enabled_cnt;
+}
+
+const char *timeseries_kp_ki_get_key(timeseries_kp_t *kp, uint32_t id)
+{
+  const char *name;
+
+  assert(id < kp->key_infos_cnt);
+  kp_view_lock(kp);
+  name = kp_names_get(kp, id);
+  kp_view_unlock(kp);
+  return name;
+}
+
+const char *timeseries_kp_ki_decode_key(timeseries_kp_t *kp, uint32_t id)
+{
+  const char *key;
+
+  assert(id < kp->key_infos_cnt);
+  kp_view_lock(kp);
+  key = kp_key_get(kp, id);
+  kp_view_unlock(kp);
+  return key;
+}
+
+uint64_t timeseries_kp_ki_get_value(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(id < kp->key_infos_cnt);
+  return kp_val_load(kp->values, kp->value_type, id);
+}
+
+uint32_t timeseries_kp_ki_get_value_u32(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(id < kp->key_infos_cnt);
+  assert(kp->value_type == TIMESERIES_KP_VALUE_U32);
+  return kp->values.u32[id];
+}
+
+int64_t timeseries_kp_ki_get_value_i64(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(id < kp->key_infos_cnt);
+  assert(kp->value_type == TIMESERIES_KP_VALUE_I64);
+  return kp->values.i64[id];
+}
+
+double timeseries_kp_ki_get_value_double(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(id < kp->key_infos_cnt);
+  assert(kp->value_type == TIMESERIES_KP_VALUE_DOUBLE);
+  return kp->values.d[id];
+}
+
+int timeseries_kp_ki_enabled(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(id < kp->key_infos_cnt);
+  return (kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0;
+}
+
+uint32_t timeseries_kp_ki_next_enabled(timeseries_kp_t *kp, uint32_t id)
+{
+  uint64_t words = KP_BM_WORDS(kp->key_infos_cnt);
+  uint64_t w = KP_BM_WORD(id);
+  uint64_t bits;
+
+  if (id >= kp->key_infos_cnt) {
+    return kp->key_infos_cnt;
+  }
+
+  /* mask off the bits for keys before id in the first word */
+  bits = kp->enabled[w] & (~UINT64_C(0) << (id & 63));
+  while (bits == 0) {
+    if (++w == words) {
+      return kp->key_infos_cnt;
+    }
+    bits = kp->enabled[w];
+  }
+
+  return (w * 64) + __builtin_ctzll(bits);
+}
+
+uint32_t timeseries_kp_ki_next_live(timeseries_kp_t *kp, uint32_t *pos)
+{
+  uint32_t id;
+
+  if (kp->sparse == 0) {
+    id = timeseries_kp_ki_next_enabled(kp, *pos);
+    *pos = id + 1;
+    return id;
+  }
+
+  /* skip keys that were disabled after being listed */
+  while (*pos < kp->live_cnt) {
+    id = kp->live[(*pos)++];
+    if ((kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+      return id;
+    }
+  }
+
+  return kp->key_infos_cnt;
+}
+
+int timeseries_kp_ki_changed(timeseries_kp_t *kp, uint32_t id)
+{
+  assert(id < kp->key_infos_cnt);
+  if (kp->changed_only == 0) {
+    return timeseries_kp_ki_enabled(kp, id);
+  }
+  return (kp->enabled[KP_BM_WORD(id)] & kp->changed[KP_BM_WORD(id)] &
+          KP_BM_BIT(id)) != 0;
+}
+
+uint32_t timeseries_kp_ki_next_changed(timeseries_kp_t *kp, uint32_t id)
+{
+  uint64_t words = KP_BM_WORDS(kp->key_infos_cnt);
+  uint64_t w = KP_BM_WORD(id);
+  uint64_t bits;
+
+  if (kp->changed_only == 0) {
+    return timeseries_kp_ki_next_enabled(kp, id);
+  }
+
+  if (id >= kp->key_infos_cnt) {
+    return kp->key_infos_cnt;
+  }
+
+  bits = kp->enabled[w] & kp->changed[w] & (~UINT64_C(0) << (id & 63));
+  while (bits == 0) {
+    if (++w == words) {
+      return kp->key_infos_cnt;
+    }
+    bits = kp->enabled[w] & kp->changed[w];
+  }
+
+  return (w * 64) + __builtin_ctzll(bits);
+}
+
+int timeseries_kp_flush_spans(timeseries_kp_t *kp,
+                              timeseries_backend_t *backend, uint32_t time)
+{
+  uint32_t *ids = NULL;
+  const char **keys = NULL;
+  uint32_t *key_lens = NULL;
+  char *values = NULL;
+  char *key_buf = NULL;
+  char *tmp;
+  size_t key_buf_alloc = 0;
+  size_t key_buf_len;
+  timeseries_kp_span_t span = {0};
+  const char *key;
+  size_t len;
+  uint32_t pos = 0;
+  uint32_t id = 0;
+  uint32_t i;
+  int rc = -1;
+
+  assert(backend->kp_flush_span != NULL);
+
+  if ((ids = malloc(sizeof(uint32_t) * TIMESERIES_KP_SPAN_KEYS)) == NULL ||
+      (keys = malloc(sizeof(char *) * TIMESERIES_KP_SPAN_KEYS)) == NULL ||
+      (key_lens = malloc(sizeof(uint32_t) * TIMESERIES_KP_SPAN_KEYS)) ==
+        NULL ||
+      (values = malloc(kp->value_size * TIMESERIES_KP_SPAN_KEYS)) == NULL) {
+    timeseries_log(__func__, "could not malloc span arrays");
+    goto done;
+  }
+
+  span.ids = ids;
+  span.keys = keys;
+  span.key_lens = key_lens;
+  span.values = values;
+
+  while (span.last == 0) {
+    span.cnt = 0;
+    key_buf_len = 0;
+    while (span.cnt < TIMESERIES_KP_SPAN_KEYS &&
+           (id = kp_span_next(kp, &pos)) < kp->key_infos_cnt) {
+      /* copy the key, since the dictionary decodes it into a buffer that is
+         reused for the next key */
+      key = timeseries_kp_ki_decode_key(kp, id);
+      assert(key != NULL);
+      len = strlen(key);
+      if (key_buf_len + len + 1 > key_buf_alloc) {
+        if ((tmp = realloc(key_buf, (key_buf_len + len + 1) * 2)) == NULL) {
+          timeseries_log(__func__, "could not realloc span key buffer");
+          goto done;
+        }
+        key_buf = tmp;
+        key_buf_alloc = (key_buf_len + len + 1) * 2;
+      }
+      memcpy(key_buf + key_buf_len, key, len + 1);
+      key_buf_len += len + 1;
+
+      ids[span.cnt] = id;
+      key_lens[span.cnt] = len;
+      memcpy(values + (kp->value_size * span.cnt),
+             KP_VAL_PTR(kp->values, kp->value_size, id), kp->value_size);
+      span.cnt++;
+    }
+    span.last = (span.cnt < TIMESERIES_KP_SPAN_KEYS);
+
+    /* only point at the keys once the buffer has stopped moving */
+    for (i = 0; i < span.cnt; i++) {
+      keys[i] = (i == 0) ? key_buf : keys[i - 1] + key_lens[i - 1] + 1;
+    }
+
+    if (backend->kp_flush_span(backend, kp, &span, time) != 0) {
+      goto done;
+    }
+  }
+
+  rc = 0;
+
+done:
+  free(ids);
+  free(keys);
+  free(key_lens);
+  free(values);
+  free(key_buf);
+  return rc;
+}
+
+void *timeseries_kp_ki_get_backend_state(timeseries_kp_t *kp, uint32_t id,
+                                         timeseries_backend_id_t backend_id)
+{
+  assert(id < kp->key_infos_cnt);
+  assert(kp->ki_backend_state_size[backend_id - 1] != 0);
+  if (kp->keys != NULL) {
+    /* the caller holds the shared key table lock (see kp_keys_lock) */
+    assert(kp->gids[id] != UINT32_MAX);
+    return timeseries_keys_get_state(kp->keys, kp->gids[id], backend_id);
+  }
+  return KP_KI_STATE_PTR(kp, backend_id - 1, id);
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags)
+{
+  return timeseries_kp_init_typed(timeseries, flags, TIMESERIES_KP_VALUE_U64);
+}
+
+timeseries_kp_t *timeseries_kp_init_typed(timeseries_t *timeseries, int flags,
+                                          timeseries_kp_value_type_t type)
+{
+  assert(timeseries != NULL);
+  timeseries_kp_t *kp = NULL;
+  int id;
+  timeseries_backend_t *backend;
+
+  if (kp_value_type_size(type) == 0) {
+    timeseries_log(__func__, "invalid value type %d", type);
+    return NULL;
+  }
+
+  /* we only need to malloc the Package, keys will be malloc'd on the fly */
+  if ((kp = malloc_zero(sizeof(timeseries_kp_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc key package");
+    return NULL;
+  }
+
+  /* save the timeseries pointer */
+  kp->timeseries = timeseries;
+
+  /* check the flags */
+  kp->reset = flags & TIMESERIES_KP_RESET;
+  kp->disable = flags & TIMESERIES_KP_DISABLE;
+  kp->changed_only = flags & TIMESERIES_KP_CHANGED;
+  kp->sparse = flags & TIMESERIES_KP_SPARSE;
+  kp->rollup = flags & TIMESERIES_KP_ROLLUP;
+  if ((flags & TIMESERIES_KP_SHARED) != 0) {
+    kp->keys = timeseries_get_keys(timeseries);
+  }
+
+  /* keys only leave the live list when they are disabled by a flush */
+  if (kp->sparse != 0 && kp->disable == 0) {
+    timeseries_log(__func__, "sparse KPs must be created with "
+                             "TIMESERIES_KP_DISABLE");
+    free(kp);
+    return NULL;
+  }
+
+  kp->max_snapshots = KP_MAX_SNAPSHOTS_DEFAULT;
+
+  if (kp->keys == NULL && (kp->dict = timeseries_dict_init()) == NULL) {
+    free(kp);
+    return NULL;
+  }
+
+  if ((kp->names = malloc_zero(sizeof(kp_names_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc key name state");
+    timeseries_dict_free(&kp->dict);
+    free(kp);
+    return NULL;
+  }
+  pthread_mutex_init(&kp->names->lock, NULL);
+
+  /* the value type must be known before the backends see the KP */
+  kp->value_type = type;
+  kp->value_size = kp_value_type_size(type);
+
+  /* let each backend store some state about this kp, if they like */
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+  {
+    /* give the backend a (currently empty) column of KI state, if it wants
+       one (shared keys keep their state in the shared key table) */
+    if (backend->ki_state_size != 0) {
+      kp->ki_backend_state_size[id - 1] = backend->ki_state_size;
+      if (kp->keys != NULL) {
+        timeseries_keys_lock(kp->keys);
+        if (timeseries_keys_add_state(kp->keys, id,
+                                      backend->ki_state_size) != 0) {
+          timeseries_keys_unlock(kp->keys);
+          return NULL;
+        }
+        timeseries_keys_unlock(kp->keys);
+      } else if ((kp->ki_backend_state[id - 1] =
+                    malloc(backend->ki_state_size)) == NULL) {
+        timeseries_log(__func__, "could not malloc KI state column");
+        return NULL;
+      }
+    }
+
+    if (backend->kp_init(backend, kp, &kp->backend_state[id - 1]) != 0) {
+      return NULL;
+    }
+  }
+
+  return kp;
+}
+
+void timeseries_kp_free(timeseries_kp_t **kp_p)
+{
+  timeseries_kp_t *kp;
+  timeseries_t *timeseries;
+  timeseries_backend_t *backend;
+  int i, id;
+
+  assert(kp_p != NULL);
+  kp = *kp_p;
+  if (kp == NULL) {
+    return;
+  }
+  *kp_p = NULL;
+
+  /* write any outstanding snapshots and stop the writer thread */
+  kp_async_free(kp);
+
+  while (kp->shards != NULL) {
+    timeseries_kp_shard_t *shard = kp->shards;
+    timeseries_kp_shard_free(&shard);
+  }
+
+  kp_window_free(kp);
+  free(kp->values.raw);
+  kp->values.raw = NULL;
+  free(kp->enabled);
+  kp->enabled = NULL;
+  free(kp->prev_values.raw);
+  kp->prev_values.raw = NULL;
+  free(kp->changed);
+  kp->changed = NULL;
+  free(kp->live);
+  kp->live = NULL;
+  free(kp->listed);
+  kp->listed = NULL;
+  free(kp->last_set);
+  kp->last_set = NULL;
+  kp_idle_free(kp);
+  free(kp->idle_pos);
+  kp->idle_pos = NULL;
+  free(kp->expiring);
+  kp->expiring = NULL;
+  free(kp->agg);
+  kp->agg = NULL;
+  free(kp->rollup_parent);
+  kp->rollup_parent = NULL;
+  free(kp->rollup_keys);
+  kp->rollup_keys = NULL;
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    free(kp->ki_backend_state[i]);
+    kp->ki_backend_state[i] = NULL;
+  }
+  if (kp->keys != NULL && kp->gids != NULL) {
+    timeseries_keys_lock(kp->keys);
+    for (id = 0; id < (int)kp->key_infos_cnt; id++) {
+      if (kp->gids[id] != UINT32_MAX) {
+        timeseries_keys_release(kp->keys, kp->gids[id]);
+      }
+    }
+    timeseries_keys_unlock(kp->keys);
+  }
+  free(kp->gids);
+  kp->gids = NULL;
+  free(kp->gid_slots);
+  kp->gid_slots = NULL;
+  kp_tags_free(kp);
+  if (kp->names != NULL) {
+    kp_names_clear(kp);
+    pthread_mutex_destroy(&kp->names->lock);
+    free(kp->names);
+    kp->names = NULL;
+  }
+  kp->key_infos_cnt = 0;
+
+  timeseries = kp_get_timeseries(kp);
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
+  {
+    backend->kp_free(backend, kp, kp->backend_state[id - 1]);
+    kp->backend_state[id - 1] = NULL;
+  }
+
+  timeseries_dict_free(&kp->dict);
+
+  /* free the actual key package structure */
+  free(kp);
+
+  return;
+}
+
+int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key)
+{
+  assert(key != NULL);
+  return timeseries_kp_add_key_n(kp, key, strlen(key));
+}
+
+int timeseries_kp_add_key_n(timeseries_kp_t *kp, const char *key, size_t len)
+{
+  assert(kp != NULL);
+  assert(key != NULL);
+  uint32_t this_id = kp->key_infos_cnt;
+  uint32_t parent = UINT32_MAX;
+  uint64_t hash = timeseries_dict_hash(key, len);
+  int id;
+
+  if (kp->frozen != 0) {
+    timeseries_log(__func__, "cannot add keys to a frozen KP");
+    return -1;
+  }
+
+  if (kp->rollup != 0) {
+    /* a key that other keys are already rolled up into is not added again */
+    if ((id = kp_key_find(kp, key, len, hash)) >= 0 &&
+        (kp->rollup_keys[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+      return id;
+    }
+    /* the parent is added first, so that it has a lower ID */
+    if (kp_rollup_parent(kp, key, len, 1, &parent) != 0) {
+      return -1;
+    }
+    this_id = kp->key_infos_cnt;
+  }
+
+  /* first we need to make sure there is space in the KI columns */
+  if (kp_ki_ensure(kp, this_id + 1) != 0) {
+    timeseries_log(__func__, "could not realloc KP KI columns");
+    return -1;
+  }
+
+  if (kp_key_add(kp, this_id, key, len, hash) != 0) {
+    return -1;
+  }
+  kp_ki_zero(kp, this_id);
+  if (kp->rollup != 0) {
+    kp->rollup_parent[this_id] = parent;
+  }
+
+  kp->key_infos_cnt++;
+  kp->key_infos_enabled_cnt++;
+
+  return this_id;
+}
+
+int timeseries_kp_add_keys(timeseries_kp_t *kp, const char *const *keys,
+                           uint32_t keys_cnt, uint32_t *ids)
+{
+  assert(kp != NULL);
+  assert(keys != NULL);
+  uint32_t i;
+  int id;
+
+  /* size the columns and hash for the full set of keys up front */
+  if (timeseries_kp_reserve(kp, kp->key_infos_cnt + keys_cnt) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < keys_cnt; i++) {
+    if ((id = timeseries_kp_add_key(kp, keys[i])) < 0) {
+      return -1;
+    }
+    if (ids != NULL) {
+      ids[i] = id;
+    }
+  }
+
+  return 0;
+}
+
+int timeseries_kp_reserve(timeseries_kp_t *kp, uint32_t keys_cnt)
+{
+  assert(kp != NULL);
+  int rc;
+
+  if (kp->frozen != 0 && keys_cnt > kp->key_infos_cnt) {
+    timeseries_log(__func__, "cannot add keys to a frozen KP");
+    return -1;
+  }
+
+  if (keys_cnt > kp->key_infos_alloc && kp_ki_grow(kp, keys_cnt) != 0) {
+    timeseries_log(__func__, "could not realloc KP KI columns");
+    return -1;
+  }
+
+  if (kp->keys == NULL) {
+    if (timeseries_dict_reserve(kp->dict, keys_cnt) != 0) {
+      timeseries_log(__func__, "could not grow key dictionary");
+      return -1;
+    }
+    return 0;
+  }
+
+  /* in the worst case, all of the new keys are new to the shared table */
+  if (keys_cnt > kp->key_infos_cnt) {
+    timeseries_keys_lock(kp->keys);
+    rc = timeseries_keys_reserve(kp->keys, timeseries_keys_size(kp->keys) +
+                                             (keys_cnt - kp->key_infos_cnt));
+    timeseries_keys_unlock(kp->keys);
+    if (rc != 0) {
+      timeseries_log(__func__, "could not grow shared key table");
+      return -1;
+    }
+  }
+  return kp_gid_hash_ensure(kp, keys_cnt);
+}
+
+int timeseries_kp_get_key(timeseries_kp_t *kp, const char *key)
+{
+  assert(key != NULL);
+  return timeseries_kp_get_key_n(kp, key, strlen(key));
+}
+
+int timeseries_kp_get_key_n(timeseries_kp_t *kp, const char *key, size_t len)
+{
+  return kp_key_find(kp, key, len, timeseries_dict_hash(key, len));
+}
+
+int timeseries_kp_get_key_hashed(timeseries_kp_t *kp, const char *key,
+                                 size_t len, uint64_t hash)
+{
+  assert(kp != NULL);
+  return kp_key_find(kp, key, len, hash);
+}
+
+uint64_t timeseries_kp_hash_key(const char *key, size_t len)
+{
+  return timeseries_dict_hash(key, len);
+}
+
+int timeseries_kp_intern_tag(timeseries_kp_t *kp, const char *str)
+{
+  assert(kp != NULL);
+  assert(str != NULL);
+  kp_tags_t *kt;
+  size_t len = strlen(str);
+  uint64_t hash;
+  int id;
+
+  if (kp->keys != NULL) {
+    timeseries_log(__func__, "shared KPs cannot have tagged keys");
+    return -1;
+  }
+  if (len == 0 || strpbrk(str, ";=") != NULL) {
+    timeseries_log(__func__, "invalid tag string '%s'", str);
+    return -1;
+  }
+
+  if (kp->tags == NULL) {
+    if ((kt = malloc_zero(sizeof(kp_tags_t))) == NULL ||
+        (kt->strs = timeseries_dict_init()) == NULL) {
+      timeseries_log(__func__, "could not malloc tagged key state");
+      free(kt);
+      return -1;
+    }
+    /* snapshot views pick up the tag state under the growth lock */
+    if (kp->async != NULL) {
+      timeseries_dict_set_lock(kt->strs, &kp->async->grow_lock);
+      pthread_mutex_lock(&kp->async->grow_lock);
+    }
+    kp->tags = kt;
+    if (kp->async != NULL) {
+      pthread_mutex_unlock(&kp->async->grow_lock);
+    }
+  }
+
+  hash = timeseries_dict_hash(str, len);
+  if ((id = timeseries_dict_find(kp->tags->strs, str, len, hash)) < 0) {
+    id = timeseries_dict_add(kp->tags->strs, str, len, hash);
+  }
+  return id;
+}
+
+int timeseries_kp_add_tagged_key(timeseries_kp_t *kp, uint32_t metric,
+                                 const uint32_t *tags, uint32_t tags_cnt)
+{
+  assert(kp != NULL);
+  assert(tags != NULL || tags_cnt == 0);
+  uint32_t sorted[TIMESERIES_KP_TAGS_MAX * 2];
+  uint32_t this_id = kp->key_infos_cnt;
+  uint32_t *set, *tagsets;
+  uint64_t hash;
+
+  if (kp->frozen != 0) {
+    timeseries_log(__func__, "cannot add keys to a frozen KP");
+    return -1;
+  }
+  if (kp->keys != NULL) {
+    timeseries_log(__func__, "shared KPs cannot have tagged keys");
+    return -1;
+  }
+  if (kp_tags_sort(kp, metric, tags, tags_cnt, sorted) != 0) {
+    return -1;
+  }
+  hash = kp_tagset_hash(metric, sorted, tags_cnt);
+
+  if (kp_ki_ensure(kp, this_id + 1) != 0) {
+    timeseries_log(__func__, "could not realloc KP KI columns");
+    return -1;
+  }
+  if (kp->tagsets == NULL) {
+    if ((tagsets = malloc(sizeof(uint32_t) * kp->key_infos_alloc)) == NULL) {
+      timeseries_log(__func__, "could not malloc tag set column");
+      return -1;
+    }
+    /* all of the existing keys are plain keys */
+    memset(tagsets, 0xff, sizeof(uint32_t) * kp->key_infos_alloc);
+    if (kp->async != NULL) {
+      pthread_mutex_lock(&kp->async->grow_lock);
+    }
+    kp->tagsets = tagsets;
+    if (kp->async != NULL) {
+      pthread_mutex_unlock(&kp->async->grow_lock);
+    }
+  }
+  if (kp_tags_sets_ensure(kp, KP_TAGSET_LEN(tags_cnt)) != 0 ||
+      kp_tags_hash_ensure(kp, kp->tags->slots_used + 1) != 0) {
+    return -1;
+  }
+
+  /* the dictionary entry of a tagged key is an empty placeholder that keeps
+     the dictionary IDs in step with the KP (hashed by tag set, so that the
+     placeholders do not all share one probe sequence) */
+  if (timeseries_dict_add(kp->dict, "", 0, hash) < 0) {
+    return -1;
+  }
+  kp_ki_zero(kp, this_id);
+
+  set = &kp->tags->sets[kp->tags->sets_len];
+  set[KP_TAGSET_NAME] = UINT32_MAX;
+  set[KP_TAGSET_METRIC] = metric;
+  set[KP_TAGSET_CNT] = tags_cnt;
+  memcpy(&set[KP_TAGSET_TAGS], sorted, sizeof(uint32_t) * tags_cnt * 2);
+  kp->tagsets[this_id] = kp->tags->sets_len;
+  kp->tags->sets_len += KP_TAGSET_LEN(tags_cnt);
+  kp_tags_hash_insert(kp, this_id);
+
+  kp->key_infos_cnt++;
+  kp->key_infos_enabled_cnt++;
+
+  return this_id;
+}
+
+int timeseries_kp_get_tagged_key(timeseries_kp_t *kp, uint32_t metric,
+                                 const uint32_t *tags, uint32_t tags_cnt)
+{
+  assert(kp != NULL);
+  assert(tags != NULL || tags_cnt == 0);
+  uint32_t sorted[TIMESERIES_KP_TAGS_MAX * 2];
+
+  if (kp->tagsets == NULL ||
+      kp_tags_sort(kp, metric, tags, tags_cnt, sorted) != 0) {
+    return -1;
+  }
+  return kp_tags_find(kp, metric, sorted, tags_cnt,
+                      kp_tagset_hash(metric, sorted, tags_cnt));
+}
+
+int timeseries_kp_remove_key(timeseries_kp_t *kp, uint32_t key)
+{
+  assert(kp != NULL);
+
+  if (key >= kp->key_infos_cnt || kp_key_is_removed(kp, key)) {
+    timeseries_log(__func__, "no such key (%" PRIu32 ")", key);
+    return -1;
+  }
+  if (kp->frozen != 0) {
+    timeseries_log(__func__, "cannot remove keys from a frozen KP");
+    return -1;
+  }
+
+  /* outstanding snapshots may still use the backend state of this key */
+  kp_async_wait(kp);
+
+  /* the wait may have removed the key, if it was waiting to expire */
+  if (kp_key_is_removed(kp, key) == 0) {
+    kp_key_remove(kp, key);
+  }
+  return 0;
+}
+
+static void kp_key_remove(timeseries_kp_t *kp, uint32_t key)
+{
+  timeseries_kp_shard_t *shard;
+  kp_slot_cols_t *cols;
+  uint32_t s;
+
+  kp_names_drop(kp, key);
+
+  /* the key string stays in the dictionary until the next compaction (and
+     shared keys stay in the shared table while other KPs use them) */
+  if (kp->keys != NULL) {
+    timeseries_keys_lock(kp->keys);
+    timeseries_keys_release(kp->keys, kp->gids[key]);
+    timeseries_keys_unlock(kp->keys);
+    kp->gids[key] = UINT32_MAX;
+  } else {
+    timeseries_dict_remove(kp->dict, key);
+  }
+  /* the tag set stays until the next compaction too */
+  if (kp->tagsets != NULL) {
+    kp->tagsets[key] = UINT32_MAX;
+  }
+  /* the keys below this one are moved up to its parent before the next
+     rollup */
+  if (kp->rollup != 0 &&
+      (kp->rollup_keys[KP_BM_WORD(key)] & KP_BM_BIT(key)) != 0) {
+    kp->rollup_keys[KP_BM_WORD(key)] &= ~KP_BM_BIT(key);
+    kp->rollup_stale = 1;
+  }
+
+  timeseries_kp_disable_key(kp, key);
+  kp_ki_clear_backend_state(kp, key);
+
+  /* drop any value that has been written to a shard for this key */
+  for (shard = kp->shards; shard != NULL; shard = shard->next) {
+    if (key < shard->alloc) {
+      memset(KP_VAL_PTR(shard->values, kp->value_size, key), 0,
+             kp->value_size);
+      shard->touched[KP_BM_WORD(key)] &= ~KP_BM_BIT(key);
+    }
+  }
+
+  memset(KP_VAL_PTR(kp->values, kp->value_size, key), 0, kp->value_size);
+  if (kp->changed_only != 0) {
+    kp->changed[KP_BM_WORD(key)] &= ~KP_BM_BIT(key);
+  }
+  for (s = 0; kp->window != NULL && s < kp->window->slots_cnt; s++) {
+    if (s == kp->window->cur) {
+      continue;
+    }
+    cols = &kp->window->slots[s].cols;
+    memset(KP_VAL_PTR(cols->values, kp->value_size, key), 0, kp->value_size);
+    if ((cols->enabled[KP_BM_WORD(key)] & KP_BM_BIT(key)) != 0) {
+      cols->enabled[KP_BM_WORD(key)] &= ~KP_BM_BIT(key);
+      cols->enabled_cnt--;
+    }
+  }
+  kp->key_infos_removed_cnt++;
+}
+
+int timeseries_kp_set_idle_ttl(timeseries_kp_t *kp, uint32_t flushes)
+{
+  assert(kp != NULL);
+  kp_idle_bucket_t *idle;
+  uint32_t id;
+
+  /* the buckets are rebuilt below, so keys that are waiting to expire are
+     removed first */
+  kp_async_wait(kp);
+
+  if (flushes == 0) {
+    kp_idle_free(kp);
+    free(kp->last_set);
+    kp->last_set = NULL;
+    free(kp->idle_pos);
+    kp->idle_pos = NULL;
+    kp->idle_ttl = 0;
+    return 0;
+  }
+
+  if ((idle = calloc((size_t)flushes + 1, sizeof(kp_idle_bucket_t))) ==
+      NULL) {
+    timeseries_log(__func__, "could not malloc idle key buckets");
+    return -1;
+  }
+  if (kp->last_set == NULL) {
+    if (((kp->last_set = malloc(sizeof(uint32_t) * kp->key_infos_alloc)) ==
+           NULL ||
+         (kp->idle_pos = malloc(sizeof(uint32_t) * kp->key_infos_alloc)) ==
+           NULL) &&
+        kp->key_infos_alloc != 0) {
+      timeseries_log(__func__, "could not malloc last-set column");
+      free(kp->last_set);
+      kp->last_set = NULL;
+      free(idle);
+      return -1;
+    }
+    /* existing keys start their TTL now */
+    for (id = 0; id < kp->key_infos_cnt; id++) {
+      kp->last_set[id] = kp->flush_cnt;
+    }
+  }
+
+  /* the ring has one bucket per interval, so it is rebuilt for the new TTL
+     (keys that are already idle are expired by the next flush) */
+  kp_idle_free(kp);
+  kp->idle = idle;
+  kp->idle_ttl = flushes;
+  kp_idle_rebuild(kp, kp->flush_cnt + 1 - flushes);
+  return 0;
+}
+
+int timeseries_kp_compact(timeseries_kp_t *kp)
+{
+  assert(kp != NULL);
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  assert(timeseries != NULL);
+  timeseries_backend_t *backend;
+  timeseries_kp_shard_t *shard;
+  uint32_t *remap = NULL;
+  uint32_t old_cnt = kp->key_infos_cnt;
+  uint32_t new_cnt;
+  uint32_t resolved_cnt = 0;
+  uint32_t new_id;
+  uint32_t alloc;
+  uint32_t id;
+  uint32_t s;
+  int i;
+
+  if (kp->key_infos_removed_cnt == 0 && kp->expiring_cnt == 0) {
+    return 0;
+  }
+
+  /* outstanding snapshots use the current key IDs (and keys that are
+     waiting to expire are removed once they have been written) */
+  kp_async_wait(kp);
+  if (kp->key_infos_removed_cnt == 0) {
+    return 0;
+  }
+
+  /* key names handed out before compaction are not kept */
+  kp_names_clear(kp);
+
+  /* the parents of live keys must be live to be renumbered */
+  if (kp->rollup != 0) {
+    kp_rollup_fix(kp);
+  }
+
+  if ((remap = malloc(sizeof(uint32_t) * old_cnt)) == NULL) {
+    timeseries_log(__func__, "could not malloc compaction state");
+    return -1;
+  }
+
+  /* the dictionary drops the removed key strings and renumbers the live keys,
+     keeping their order (so the resolved keys are still a prefix of the ID
+     space) */
+  if (kp->keys != NULL) {
+    /* shared keys stay in the shared table, so only the global IDs move */
+    new_cnt = 0;
+    for (id = 0; id < old_cnt; id++) {
+      if (kp->gids[id] == UINT32_MAX) {
+        remap[id] = UINT32_MAX;
+      } else {
+        kp->gids[new_cnt] = kp->gids[id];
+        remap[id] = new_cnt++;
+      }
+    }
+    kp_gid_hash_fill(kp, new_cnt);
+  } else {
+    if (timeseries_dict_compact(kp->dict, remap) != 0) {
+      free(remap);
+      return -1;
+    }
+    new_cnt = timeseries_dict_size(kp->dict);
+  }
+
+  /* move the value and enabled columns of every slot */
+  kp_slot_compact(kp, remap, old_cnt, new_cnt);
+  for (s = 0; kp->window != NULL && s < kp->window->slots_cnt; s++) {
+    if (s != kp->window->cur) {
+      kp_slot_swap(kp, &kp->window->slots[s].cols);
+      kp_slot_compact(kp, remap, old_cnt, new_cnt);
+      kp_slot_swap(kp, &kp->window->slots[s].cols);
+    }
+  }
+
+  /* move the other KI columns of the live keys down over the removed ones */
+  for (id = 0; id < old_cnt; id++) {
+    if ((new_id = remap[id]) == UINT32_MAX) {
+      continue;
+    }
+    if (id < kp->key_infos_resolved_cnt) {
+      resolved_cnt++;
+    }
+
+    if (kp->changed_only != 0) {
+      memcpy(KP_VAL_PTR(kp->prev_values, kp->value_size, new_id),
+             KP_VAL_PTR(kp->prev_values, kp->value_size, id), kp->value_size);
+      if ((kp->changed[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+        kp->changed[KP_BM_WORD(new_id)] |= KP_BM_BIT(new_id);
+      } else {
+        kp->changed[KP_BM_WORD(new_id)] &= ~KP_BM_BIT(new_id);
+      }
+    }
+    if (kp->last_set != NULL) {
+      kp->last_set[new_id] = kp->last_set[id];
+    }
+    if (kp->agg != NULL) {
+      kp->agg[new_id] = kp->agg[id];
+    }
+    if (kp->tagsets != NULL) {
+      kp->tagsets[new_id] = kp->tagsets[id];
+    }
+    if (kp->rollup != 0) {
+      /* parents have lower IDs, so they have already been renumbered */
+      if (kp->rollup_parent[id] != UINT32_MAX) {
+        kp->rollup_parent[new_id] = remap[kp->rollup_parent[id]];
+      } else {
+        kp->rollup_parent[new_id] = UINT32_MAX;
+      }
+      if ((kp->rollup_keys[KP_BM_WORD(id)] & KP_BM_BIT(id)) != 0) {
+        kp->rollup_keys[KP_BM_WORD(new_id)] |= KP_BM_BIT(new_id);
+      } else {
+        kp->rollup_keys[KP_BM_WORD(new_id)] &= ~KP_BM_BIT(new_id);
+      }
+    }
+    for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+      if (kp->ki_backend_state[i] != NULL) {
+        memcpy(KP_KI_STATE_PTR(kp, i, new_id), KP_KI_STATE_PTR(kp, i, id),
+               kp->ki_backend_state_size[i]);
+      }
+    }
+  }
+  if (kp->tagsets != NULL) {
+    kp_tags_compact(kp, new_cnt);
+  }
+
+  /* keep the bitmap invariant: no bits set beyond the last key */
+  if (kp->changed_only != 0) {
+    for (id = new_cnt; id < old_cnt && (id & 63) != 0; id++) {
+      kp->changed[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+    }
+    if (KP_BM_WORDS(old_cnt) > KP_BM_WORDS(new_cnt)) {
+      memset(&kp->changed[KP_BM_WORDS(new_cnt)], 0,
+             sizeof(uint64_t) * (KP_BM_WORDS(old_cnt) - KP_BM_WORDS(new_cnt)));
+    }
+  }
+  if (kp->rollup != 0) {
+    for (id = new_cnt; id < old_cnt && (id & 63) != 0; id++) {
+      kp->rollup_keys[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+    }
+    if (KP_BM_WORDS(old_cnt) > KP_BM_WORDS(new_cnt)) {
+      memset(&kp->rollup_keys[KP_BM_WORDS(new_cnt)], 0,
+             sizeof(uint64_t) * (KP_BM_WORDS(old_cnt) - KP_BM_WORDS(new_cnt)));
+    }
+  }
+
+  kp->key_infos_cnt = new_cnt;
+  kp->key_infos_removed_cnt = 0;
+  kp->key_infos_resolved_cnt = resolved_cnt;
+
+  /* the idle buckets hold the old IDs */
+  if (kp->last_set != NULL) {
+    kp_idle_rebuild(kp, kp->flush_cnt + 1 - kp->idle_ttl);
+  }
+
+  /* give memory back if the KP has shrunk significantly */
+  if (kp->key_infos_alloc > KP_KI_MIN_ALLOC &&
+      new_cnt < kp->key_infos_alloc / 4) {
+    alloc = (new_cnt * 2 > KP_KI_MIN_ALLOC) ? new_cnt * 2 : KP_KI_MIN_ALLOC;
+    /* a failed shrink leaves a column larger than alloc, which is harmless */
+    kp_ki_grow(kp, alloc);
+    kp->key_infos_alloc = alloc;
+  }
+
+  for (shard = kp->shards; shard != NULL; shard = shard->next) {
+    kp_shard_remap(shard, remap, old_cnt);
+  }
+
+  /* let the backends update any state they keep outside the KI columns */
+  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, i)
+  {
+    if (backend->kp_ki_compact(backend, kp, remap, old_cnt) != 0) {
+      free(remap);
+      return -1;
+    }
+  }
+
+  free(remap);
+  return 0;
+}
+
+int timeseries_kp_freeze(timeseries_kp_t *kp)
+{
+  assert(kp != NULL);
+
+  if (kp->frozen != 0) {
+    return 0;
+  }
+  if (kp->keys != NULL) {
+    timeseries_log(__func__, "shared KPs cannot be frozen");
+    return -1;
+  }
+  if (kp->key_infos_removed_cnt != 0) {
+    timeseries_log(__func__, "KPs must be compacted before they are frozen");
+    return -1;
+  }
+
+  if (timeseries_dict_freeze(kp->dict) != 0) {
+    return -1;
+  }
+  kp->frozen = 1;
+
+  /* no more keys will be added, so drop the spare space in the KI columns (a
+     failed shrink leaves a column larger than alloc, which is harmless) */
+  if (kp->key_infos_cnt > 0 && kp->key_infos_cnt < kp->key_infos_alloc) {
+    kp_ki_grow(kp, kp->key_infos_cnt);
+    kp->key_infos_alloc = kp->key_infos_cnt;
+  }
+
+  return 0;
+}
+
+int timeseries_kp_save(timeseries_kp_t *kp, const char *filename)
+{
+  assert(kp != NULL);
+  assert(filename != NULL);
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  timeseries_backend_t *backend;
+  timeseries_dict_t *dict = kp->dict;
+  kp_ckpt_hdr_t hdr;
+  kp_ckpt_section_t sec;
+  uint8_t state[KP_CKPT_KI_STATE_MAX];
+  uint64_t *offsets = NULL;
+  uint64_t off;
+  ssize_t state_len;
+  char *tmp_name = NULL;
+  FILE *fh = NULL;
+  off_t sec_pos;
+  uint32_t id;
+  int i;
+
+  /* the dictionary only holds placeholders for tagged keys */
+  if (kp->tagsets != NULL) {
+    timeseries_log(__func__, "KPs with tagged keys cannot be saved");
+    return -1;
+  }
+
+  /* save the resolved state of every key */
+  kp_async_wait(kp);
+  if (timeseries_kp_resolve(kp) != 0) {
+    return -1;
+  }
+
+  /* the backends get the state of shared keys until the file is written */
+  kp_keys_rdlock(kp);
+  if (kp->keys != NULL && (dict = kp_keys_export(kp)) == NULL) {
+    timeseries_log(__func__, "could not copy shared keys");
+    goto err;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, KP_CKPT_MAGIC, sizeof(hdr.magic));
+  hdr.version = KP_CKPT_VERSION;
+  hdr.byte_order = KP_CKPT_BYTE_ORDER;
+  hdr.key_cnt = kp->key_infos_cnt;
+  hdr.removed_cnt = kp->key_infos_removed_cnt;
+  hdr.resolved_cnt = kp->key_infos_resolved_cnt;
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (kp->ki_backend_state_size[i] != 0) {
+      hdr.backend_cnt++;
+    }
+  }
+
+  if ((offsets = malloc(sizeof(uint64_t) *
+                        ((uint64_t)kp->key_infos_resolved_cnt + 1))) == NULL) {
+    timeseries_log(__func__, "could not malloc checkpoint offsets");
+    goto err;
+  }
+
+  /* write to a temporary file so an existing checkpoint is only replaced by
+     a complete one */
+  if ((tmp_name = malloc(strlen(filename) + 5)) == NULL) {
+    timeseries_log(__func__, "could not malloc temporary file name");
+    goto err;
+  }
+  sprintf(tmp_name, "%s.tmp", filename);
+  if ((fh = fopen(tmp_name, "wb")) == NULL) {
+    timeseries_log(__func__, "could not open '%s' for writing", tmp_name);
+    goto err;
+  }
+
+  if (kp_ckpt_write(fh, &hdr, sizeof(hdr)) != 0 ||
+      timeseries_dict_write(dict, fh) != 0) {
+    goto write_err;
+  }
+
+  /* one section of per-key state for each backend with KI state */
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (kp->ki_backend_state_size[i] == 0) {
+      continue;
+    }
+    backend = timeseries_get_backend_by_id(timeseries, i + 1);
+    assert(backend != NULL);
+
+    memset(&sec, 0, sizeof(sec));
+    sec.backend_id = i + 1;
+    if ((sec_pos = ftello(fh)) < 0 ||
+        kp_ckpt_write(fh, &sec, sizeof(sec)) != 0) {
+      goto write_err;
+    }
+
+    off = 0;
+    for (id = 0; id < kp->key_infos_resolved_cnt; id++) {
+      offsets[id] = off;
+      if (kp_key_is_removed(kp, id)) {
+        continue;
+      }
+      if ((state_len = backend->kp_ki_save(backend, kp, id, state,
+                                           sizeof(state))) < 0) {
+        timeseries_log(__func__, "%s backend could not save key state",
+                       backend->name);
+        goto err;
+      }
+      if (state_len > 0 && fwrite(state, state_len, 1, fh) != 1) {
+        goto write_err;
+      }
+      off += state_len;
+    }
+    offsets[kp->key_infos_resolved_cnt] = off;
+    sec.state_len = off;
+
+    /* now that the length of the state is known, patch the section header */
+    if (kp_ckpt_write(fh, NULL, sec.state_len) != 0 ||
+        kp_ckpt_write(fh, offsets,
+                      sizeof(uint64_t) *
+                        ((uint64_t)kp->key_infos_resolved_cnt + 1)) != 0 ||
+        fseeko(fh, sec_pos, SEEK_SET) != 0 ||
+        kp_ckpt_write(fh, &sec, sizeof(sec)) != 0 ||
+        fseeko(fh, 0, SEEK_END) != 0) {
+      goto write_err;
+    }
+  }
+
+  if (fclose(fh) != 0) {
+    fh = NULL;
+    goto write_err;
+  }
+  fh = NULL;
+
+  if (rename(tmp_name, filename) != 0) {
+    timeseries_log(__func__, "could not rename '%s' to '%s'", tmp_name,
+                   filename);
+    goto err;
+  }
+
+  kp_keys_unlock(kp);
+  if (dict != kp->dict) {
+    timeseries_dict_free(&dict);
+  }
+  free(tmp_name);
+  free(offsets);
+  return 0;
+
+write_err:
+  timeseries_log(__func__, "could not write checkpoint to '%s'", tmp_name);
+err:
+  if (fh != NULL) {
+    fclose(fh);
+  }
+  if (tmp_name != NULL) {
+    unlink(tmp_name);
+  }
+  kp_keys_unlock(kp);
+  if (dict != kp->dict) {
+    timeseries_dict_free(&dict);
+  }
+  free(tmp_name);
+  free(offsets);
+  return -1;
+}
+
+int timeseries_kp_load(timeseries_kp_t *kp, const char *filename)
+{
+  assert(kp != NULL);
+  assert(filename != NULL);
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  timeseries_backend_t *backend;
+  timeseries_dict_t *dict = kp->dict;
+  const kp_ckpt_hdr_t *hdr;
+  const kp_ckpt_section_t *sec;
+  const uint64_t *state_offsets;
+  const uint8_t *state;
+  const char *key;
+  size_t key_len;
+  uint8_t *image;
+  struct stat st;
+  ssize_t dict_end;
+  uint64_t pos, len;
+  uint32_t id, parent, cols = 0, loaded = 0;
+  int fd, i, gid;
+  int rc = -1;
+
+  if (kp->key_infos_cnt != 0 || kp->frozen != 0) {
+    timeseries_log(__func__, "checkpoints can only be loaded into empty "
+                             "(unfrozen) KPs");
+    return -1;
+  }
+  if (kp->window != NULL) {
+    timeseries_log(__func__,
+                   "checkpoints must be loaded before a window is set");
+    return -1;
+  }
+  if (kp->tagsets != NULL) {
+    timeseries_log(__func__,
+                   "checkpoints cannot be loaded into KPs with tagged keys");
+    return -1;
+  }
+
+  /* outstanding snapshots use the current keys and backend state */
+  kp_async_wait(kp);
+
+  /* the keys of a shared KP are read into a temporary dictionary, and then
+     interned */
+  if (kp->keys != NULL && (dict = timeseries_dict_init()) == NULL) {
+    return -1;
+  }
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    timeseries_log(__func__, "could not open '%s'", filename);
+    if (dict != kp->dict) {
+      timeseries_dict_free(&dict);
+    }
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(kp_ckpt_hdr_t) ||
+      (image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+        MAP_FAILED) {
+    timeseries_log(__func__, "could not map '%s'", filename);
+    close(fd);
+    if (dict != kp->dict) {
+      timeseries_dict_free(&dict);
+    }
+    return -1;
+  }
+  close(fd);
+
+  hdr = (const kp_ckpt_hdr_t *)image;
+  if (memcmp(hdr->magic, KP_CKPT_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != KP_CKPT_VERSION ||
+      hdr->byte_order != KP_CKPT_BYTE_ORDER ||
+      (dict_end = timeseries_dict_map(dict, image, st.st_size,
+                                      sizeof(kp_ckpt_hdr_t))) < 0) {
+    timeseries_log(__func__, "'%s' is not a valid checkpoint", filename);
+    munmap(image, st.st_size);
+    if (dict != kp->dict) {
+      timeseries_dict_free(&dict);
+    }
+    return -1;
+  }
+
+  /* from here on the mapping belongs to the dictionary, and the keys are used
+     in place until the next compaction (or, for shared KPs, until they have
+     been interned) */
+  kp_keys_lock(kp);
+  pos = dict_end;
+  if (timeseries_dict_size(dict) != hdr->key_cnt ||
+      hdr->resolved_cnt > hdr->key_cnt) {
+    goto corrupt;
+  }
+
+  if (kp_ki_ensure(kp, hdr->key_cnt) != 0 ||
+      (kp->keys != NULL && kp_gid_hash_ensure(kp, hdr->key_cnt) != 0)) {
+    timeseries_log(__func__, "could not realloc KP KI columns");
+    goto done;
+  }
+
+  for (id = 0; id < hdr->key_cnt; id++) {
+    if (kp->keys != NULL) {
+      if (timeseries_dict_is_removed(dict, id)) {
+        kp->gids[id] = UINT32_MAX;
+      } else {
+        key = timeseries_dict_get(dict, id);
+        key_len = strlen(key);
+        if ((gid = timeseries_keys_intern(
+               kp->keys, key, key_len, timeseries_dict_hash(key, key_len))) <
+            0) {
+          goto done;
+        }
+        kp->gids[id] = gid;
+        kp_gid_hash_insert(kp, id);
+      }
+    }
+    kp_ki_zero(kp, id);
+    kp->key_infos_cnt++;
+    if (timeseries_dict_is_removed(dict, id)) {
+      /* keep removed keys as tombstones so that the key IDs are unchanged */
+      kp->enabled[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+      if (kp->changed_only != 0) {
+        kp->changed[KP_BM_WORD(id)] &= ~KP_BM_BIT(id);
+      }
+      kp->key_infos_removed_cnt++;
+    }
+  }
+  kp->key_infos_enabled_cnt = kp->key_infos_cnt - kp->key_infos_removed_cnt;
+
+  /* link each key to the key it is rolled up into (which was saved with a
+     lower ID, unless the checkpoint was not saved from a rollup KP) */
+  for (id = 0; kp->rollup != 0 && id < hdr->key_cnt; id++) {
+    if (kp_key_is_removed(kp, id) || (key = kp_key_get(kp, id)) == NULL ||
+        kp_rollup_parent(kp, key, strlen(key), 0, &parent) != 0) {
+      continue;
+    }
+    if (parent < id) {
+      kp->rollup_parent[id] = parent;
+      kp->rollup_keys[KP_BM_WORD(parent)] |= KP_BM_BIT(parent);
+    }
+  }
+
+  /* restore the state of the backends that this KP has KI state for */
+  for (i = 0; i < hdr->backend_cnt; i++) {
+    sec = (const kp_ckpt_section_t *)(image + pos);
+    if (pos + sizeof(kp_ckpt_section_t) > (uint64_t)st.st_size ||
+        sec->state_len > (uint64_t)st.st_size) {
+      goto corrupt;
+    }
+    state = image + pos + sizeof(kp_ckpt_section_t);
+    state_offsets = (const uint64_t *)(state + KP_CKPT_ALIGN(sec->state_len));
+    pos += sizeof(kp_ckpt_section_t) + KP_CKPT_ALIGN(sec->state_len) +
+           sizeof(uint64_t) * ((uint64_t)hdr->resolved_cnt + 1);
+    if (pos > (uint64_t)st.st_size || sec->backend_id == 0 ||
+        sec->backend_id > TIMESERIES_BACKEND_ID_LAST) {
+      goto corrupt;
+    }
+
+    /* skip backends that were not enabled when this KP was created */
+    if (kp->ki_backend_state_size[sec->backend_id - 1] == 0) {
+      continue;
+    }
+    backend = timeseries_get_backend_by_id(timeseries, sec->backend_id);
+    assert(backend != NULL);
+
+    for (id = 0; id < hdr->resolved_cnt; id++) {
+      if (state_offsets[id] > state_offsets[id + 1] ||
+          state_offsets[id + 1] > sec->state_len) {
+        goto corrupt;
+      }
+      len = state_offsets[id + 1] - state_offsets[id];
+      if (len == 0 || timeseries_dict_is_removed(dict, id)) {
+        continue;
+      }
+      if (backend->kp_ki_load(backend, kp, id, state + state_offsets[id],
+                              len) != 0) {
+        timeseries_log(__func__, "%s backend could not load key state",
+                       backend->name);
+        goto done;
+      }
+    }
+    loaded++;
+  }
+
+  /* if any backend is missing from the checkpoint, all keys are re-resolved
+     (backends skip the keys they already have state for) */
+  for (i = 0; i < TIMESERIES_BACKEND_ID_LAST; i++) {
+    if (kp->ki_backend_state_size[i] != 0) {
+      cols++;
+    }
+  }
+  kp->key_infos_resolved_cnt = (loaded == cols) ? hdr->resolved_cnt : 0;
+  rc = 0;
+
+done:
+  kp_keys_unlock(kp);
+  if (dict != kp->dict) {
+    /* the shared keys have been interned, so the mapping can go */
+    timeseries_dict_free(&dict);
+  }
+  return rc;
+
+corrupt:
+  timeseries_log(__func__, "'%s' is not a valid checkpoint", filename);
+  goto done;
+}
+
+int timeseries_kp_removed_size(timeseries_kp_t *kp)
+{
+  assert(kp != NULL);
+  return kp->key_infos_removed_cnt;
+}
+
+const char *timeseries_kp_get_key_name(timeseries_kp_t *kp, uint32_t key)
+{
+  const char *name;
+
+  if (key >= kp->key_infos_cnt) {
+    return NULL;
+  }
+  kp_keys_rdlock(kp);
+  kp_view_lock(kp);
+  name = kp_names_get(kp, key);
+  kp_view_unlock(kp);
+  kp_keys_unlock(kp);
+  return name;
+}
+
+void timeseries_kp_disable_key(timeseries_kp_t *kp, uint32_t key)
+{
+  if ((kp->enabled[KP_BM_WORD(key)] & KP_BM_BIT(key)) != 0) {
+    kp->enabled[KP_BM_WORD(key)] &= ~KP_BM_BIT(key);
+    kp->key_infos_enabled_cnt--;
+  }
+}
+
+void timeseries_kp_enable_key(timeseries_kp_t *kp, uint32_t key)
+{
+  if (kp_key_is_removed(kp, key)) {
+    /* removed keys cannot be re-enabled */
+    return;
+  }
+  /* a key that is waiting to expire is kept */
+  if (kp->last_set != NULL && kp->idle_pos[key] >= KP_IDLE_EXPIRING_OFF) {
+    kp_idle_touch(kp, key);
+  }
+  if ((kp->enabled[KP_BM_WORD(key)] & KP_BM_BIT(key)) == 0) {
+    kp->enabled[KP_BM_WORD(key)] |= KP_BM_BIT(key);
+    kp->key_infos_enabled_cnt++;
+    if (kp->sparse != 0) {
+      kp_live_add(kp, key);
+    }
+  }
+}
+
+uint64_t timeseries_kp_get(timeseries_kp_t *kp, uint32_t key)
+{
+  return kp_val_load(kp->values, kp->value_type, key);
+}
+
+void timeseries_kp_set(timeseries_kp_t *kp, uint32_t key, uint64_t value)
+{
+  assert(kp != NULL);
+  assert(key < kp->key_infos_cnt);
+
+  if (kp->agg != NULL) {
+    kp_agg_store(kp->values, kp->value_type, key, value, kp->agg[key]);
+  } else {
+    kp_val_store(kp->values, kp->value_type, key, value, 0);
+  }
+  kp_idle_touch(kp, key);
+}
+
+/** Allocate the aggregation column of the given KP (if needed)
+ *
+ * @param kp            Pointer to the KP
+ * @return 0 if the column is allocated, -1 otherwise
+ */
+static int kp_agg_alloc(timeseries_kp_t *kp)
+{
+  if (kp->agg != NULL) {
+    return 0;
+  }
+  /* existing keys keep the default mode (TIMESERIES_KP_AGG_LAST == 0) */
+  if ((kp->agg = calloc(kp->key_infos_alloc > 0 ? kp->key_infos_alloc : 1,
+                        sizeof(uint8_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc aggregation column");
+    return -1;
+  }
+  return 0;
+}
+
+/** Check that the given aggregation mode can be used by the given KP
+ *
+ * @param kp            Pointer to the KP
+ * @param agg           Aggregation mode to check
+ * @return 0 if the mode can be used, -1 otherwise
+ */
+static int kp_agg_check(timeseries_kp_t *kp, timeseries_kp_agg_t agg)
+{
+  /* the identity of min and max is not a real value, so it must not be
+     written for keys that were not set */
+  if (KP_AGG_EXTREMUM(agg) && kp->disable == 0) {
+    timeseries_log(__func__, "min and max aggregation modes can only be used "
+                             "by KPs created with TIMESERIES_KP_DISABLE");
+    return -1;
+  }
+  return 0;
+}
+
+int timeseries_kp_set_agg(timeseries_kp_t *kp, uint32_t key,
+                          timeseries_kp_agg_t agg)
+{
+  assert(kp != NULL);
+  uint32_t s;
+
+  if (key >= kp->key_infos_cnt || agg > TIMESERIES_KP_AGG_COUNT) {
+    timeseries_log(__func__, "invalid key (%" PRIu32 ") or mode (%d)", key,
+                   agg);
+    return -1;
+  }
+  if (kp_agg_check(kp, agg) != 0) {
+    return -1;
+  }
+  if (agg == TIMESERIES_KP_AGG_LAST && kp->agg == NULL) {
+    return 0;
+  }
+  if (kp_agg_alloc(kp) != 0) {
+    return -1;
   }
 
-  for (i = 0; i < kp->key_infos_cnt; i++) {
-    if (kp->reset != 0) {
-      kp_ki_set(&kp->key_infos[i], 0);
-    }
-    if (kp->disable != 0) {
-      timeseries_kp_disable_key(kp, i);
+  kp->agg[key] = agg;
+  kp_agg_identity(kp, kp->values, key);
+  for (s = 0; kp->window != NULL && s < kp->window->slots_cnt; s++) {
+    if (s != kp->window->cur) {
+      kp_agg_identity(kp, kp->window->slots[s].cols.values, key);
     }
   }
+  return 0;
+}
+
+timeseries_kp_agg_t timeseries_kp_get_agg(timeseries_kp_t *kp, uint32_t key)
+{
+  assert(kp != NULL);
+  assert(key < kp->key_infos_cnt);
+  return (kp->agg != NULL) ? kp->agg[key] : TIMESERIES_KP_AGG_LAST;
 }
 
-static int kp_ki_init(timeseries_kp_ki_t *ki, timeseries_kp_t *kp,
-                      const char *key)
+int timeseries_kp_set_default_agg(timeseries_kp_t *kp,
+                                  timeseries_kp_agg_t agg)
 {
-  assert(ki != NULL);
+  assert(kp != NULL);
 
-  if ((ki->key = strdup(key)) == NULL) {
-    kp_ki_free(ki, kp);
+  if (agg > TIMESERIES_KP_AGG_COUNT) {
+    timeseries_log(__func__, "invalid aggregation mode (%d)", agg);
+    return -1;
+  }
+  if (kp_agg_check(kp, agg) != 0) {
+    return -1;
+  }
+  if (agg != TIMESERIES_KP_AGG_LAST && kp_agg_alloc(kp) != 0) {
     return -1;
   }
 
-  /* zero out the structure */
-  ki->value = 0;
-  ki->disabled = 0;
-  memset(&ki->backend_state, 0, sizeof(void *) * TIMESERIES_BACKEND_ID_LAST);
-
+  kp->default_agg = agg;
   return 0;
 }
 
-static void kp_ki_free(timeseries_kp_ki_t *ki, timeseries_kp_t *kp)
+void timeseries_kp_add(timeseries_kp_t *kp, uint32_t key, uint64_t value)
 {
-  timeseries_t *timeseries = kp_get_timeseries(kp);
-  assert(timeseries != NULL);
-  timeseries_backend_t *backend;
-  int id;
+  assert(kp != NULL);
+  assert(key < kp->key_infos_cnt);
 
-  if (ki == NULL) {
-    return;
+  if (kp->agg != NULL && KP_AGG_EXTREMUM(kp->agg[key])) {
+    kp_agg_store(kp->values, kp->value_type, key, value, kp->agg[key]);
+  } else {
+    kp_val_store(kp->values, kp->value_type, key, value, 1);
   }
+  kp_idle_touch(kp, key);
+}
 
-  free(ki->key);
-  ki->key = NULL;
+/** Store (or add) values to the given keys (see kp_val_store_many) */
+static void kp_store_many(timeseries_kp_t *kp, const uint32_t *ids,
+                          uint32_t first, const uint64_t *values, uint32_t n,
+                          int add)
+{
+  uint32_t i, id;
 
-  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
-  {
-    backend->kp_ki_free(backend, kp, ki, ki->backend_state[id - 1]);
-    ki->backend_state[id - 1] = NULL;
+  if (n == 0) {
+    return;
   }
 
-  return;
-}
+  if (kp->agg != NULL) {
+    /* aggregation is per key, so this cannot be vectorized */
+    for (i = 0; i < n; i++) {
+      id = (ids != NULL) ? ids[i] : first + i;
+      if (add == 0 || KP_AGG_EXTREMUM(kp->agg[id])) {
+        kp_agg_store(kp->values, kp->value_type, id, values[i], kp->agg[id]);
+      } else {
+        kp_val_store(kp->values, kp->value_type, id, values[i], 1);
+      }
+    }
+  } else {
+    kp_val_store_many(kp->values, kp->value_type, ids, first, values, n, add);
+  }
 
-static void kp_ki_set(timeseries_kp_ki_t *ki, uint64_t value)
-{
-  ki->value = value;
+  if (kp->last_set == NULL) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    kp_idle_touch(kp, (ids != NULL) ? ids[i] : first + i);
+  }
 }
 
-static uint64_t kp_ki_get(timeseries_kp_ki_t *ki)
+#ifndef NDEBUG
+/** Are all of the given IDs keys of the given KP? (used by asserts) */
+static int kp_ids_valid(timeseries_kp_t *kp, const uint32_t *ids, uint32_t n)
 {
-  return ki->value;
-}
+  uint32_t i;
 
-/* ========== PROTECTED FUNCTIONS ========== */
+  for (i = 0; i < n; i++) {
+    if (ids[i] >= kp->key_infos_cnt) {
+      return 0;
+    }
+  }
+  return 1;
+}
+#endif
 
-int timeseries_kp_size(timeseries_kp_t *kp)
+void timeseries_kp_set_many(timeseries_kp_t *kp, const uint32_t *ids,
+                            const uint64_t *values, uint32_t n)
 {
   assert(kp != NULL);
-  return kp->key_infos_cnt;
-}
+  assert(n == 0 || (ids != NULL && values != NULL));
+  assert(kp_ids_valid(kp, ids, n));
 
-int timeseries_kp_enabled_size(timeseries_kp_t *kp)
-{
-  return kp->key_infos_enabled_cnt;
+  kp_store_many(kp, ids, 0, values, n, 0);
 }
 
-timeseries_kp_ki_t *timeseries_kp_get_ki(timeseries_kp_t *kp, int id)
+void timeseries_kp_add_many(timeseries_kp_t *kp, const uint32_t *ids,
+                            const uint64_t *values, uint32_t n)
 {
   assert(kp != NULL);
-  if (id >= 0 && id < kp->key_infos_cnt) {
-    return &kp->key_infos[id];
-  }
-  return NULL;
-}
+  assert(n == 0 || (ids != NULL && values != NULL));
+  assert(kp_ids_valid(kp, ids, n));
 
-const char *timeseries_kp_ki_get_key(timeseries_kp_ki_t *ki)
-{
-  assert(ki != NULL);
-  return ki->key;
+  kp_store_many(kp, ids, 0, values, n, 1);
 }
 
-uint64_t timeseries_kp_ki_get_value(timeseries_kp_ki_t *ki)
+void timeseries_kp_set_range(timeseries_kp_t *kp, uint32_t first_id,
+                             const uint64_t *values, uint32_t n)
 {
-  assert(ki != NULL);
-  return ki->value;
-}
+  assert(kp != NULL);
+  assert(n == 0 || values != NULL);
+  assert((uint64_t)first_id + n <= kp->key_infos_cnt);
 
-int timeseries_kp_ki_enabled(timeseries_kp_ki_t *ki)
-{
-  return !ki->disabled;
+  kp_store_many(kp, NULL, first_id, values, n, 0);
 }
 
-void *timeseries_kp_ki_get_backend_state(timeseries_kp_ki_t *ki,
-                                         timeseries_backend_id_t id)
+void timeseries_kp_add_range(timeseries_kp_t *kp, uint32_t first_id,
+                             const uint64_t *values, uint32_t n)
 {
-  assert(ki != NULL);
-  return ki->backend_state[id - 1];
+  assert(kp != NULL);
+  assert(n == 0 || values != NULL);
+  assert((uint64_t)first_id + n <= kp->key_infos_cnt);
+
+  kp_store_many(kp, NULL, first_id, values, n, 1);
 }
 
-void timeseries_kp_ki_set_backend_state(timeseries_kp_ki_t *ki,
-                                        timeseries_backend_id_t id,
-                                        void *ki_state)
+/* typed accessors that store directly into the value column */
+#define KP_TYPED_ACCESSORS(suffix, ctype, utype, vtype, m)                     \
+  ctype timeseries_kp_get_##suffix(timeseries_kp_t *kp, uint32_t key)          \
+  {                                                                            \
+    assert(kp->value_type == vtype);                                           \
+    return kp->values.m[key];                                                  \
+  }                                                                            \
+                                                                               \
+  void timeseries_kp_set_##suffix(timeseries_kp_t *kp, uint32_t key,           \
+                                  ctype value)                                 \
+  {                                                                            \
+    assert(kp != NULL);                                                        \
+    assert(key < kp->key_infos_cnt);                                           \
+    assert(kp->value_type == vtype);                                           \
+                                                                               \
+    if (kp->agg != NULL) {                                                     \
+      KP_AGG_APPLY(ctype, utype, kp->values.m[key], value, kp->agg[key]);      \
+    } else {                                                                   \
+      kp->values.m[key] = value;                                               \
+    }                                                                          \
+    kp_idle_touch(kp, key);                                                    \
+  }
+
+KP_TYPED_ACCESSORS(u32, uint32_t, uint32_t, TIMESERIES_KP_VALUE_U32, u32)
+KP_TYPED_ACCESSORS(i64, int64_t, uint64_t, TIMESERIES_KP_VALUE_I64, i64)
+KP_TYPED_ACCESSORS(double, double, double, TIMESERIES_KP_VALUE_DOUBLE, d)
+
+timeseries_kp_value_type_t timeseries_kp_get_value_type(timeseries_kp_t *kp)
 {
-  assert(ki != NULL);
-  ki->backend_state[id - 1] = ki_state;
+  return kp->value_type;
 }
 
-/* ========== PUBLIC FUNCTIONS ========== */
-
-timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags)
+int timeseries_kp_resolve(timeseries_kp_t *kp)
 {
-  assert(timeseries != NULL);
-  timeseries_kp_t *kp = NULL;
   int id;
   timeseries_backend_t *backend;
+  timeseries_t *timeseries = kp_get_timeseries(kp);
+  assert(timeseries != NULL);
+  uint32_t first_id = kp->key_infos_resolved_cnt;
+  uint32_t cnt = kp->key_infos_cnt - first_id;
 
-  /* we only need to malloc the Package, keys will be malloc'd on the fly */
-  if ((kp = malloc_zero(sizeof(timeseries_kp_t))) == NULL) {
-    timeseries_log(__func__, "could not malloc key package");
-    return NULL;
-  }
-
-  /* prep the key hash */
-  if ((kp->key_id_hash = kh_init(strint)) == NULL) {
-    timeseries_log(__func__, "could not init key hash");
-    return NULL;
+  /* only the keys added since the last resolve need to be resolved */
+  if (cnt == 0) {
+    return 0;
   }
 
-  /* save the timeseries pointer */
-  kp->timeseries = timeseries;
-
-  /* check the flags */
-  kp->reset = flags & TIMESERIES_KP_RESET;
-  kp->disable = flags & TIMESERIES_KP_DISABLE;
-
-  /* let each backend store some state about this kp, if they like */
+  /* backends skip shared keys that another KP has already resolved */
+  kp_keys_lock(kp);
   TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
   {
-    if (backend->kp_init(backend, kp, &kp->backend_state[id - 1]) != 0) {
-      return NULL;
+    if (backend->kp_ki_update(backend, kp, first_id, cnt) != 0) {
+      /* the range stays unresolved, so the next call will retry it */
+      kp_keys_unlock(kp);
+      return -1;
     }
   }
+  kp_keys_unlock(kp);
 
-  return kp;
+  kp->key_infos_resolved_cnt = first_id + cnt;
+  return 0;
 }
 
-void timeseries_kp_free(timeseries_kp_t **kp_p)
+int timeseries_kp_flush(timeseries_kp_t *kp, uint32_t time)
 {
-  timeseries_kp_t *kp;
-  timeseries_t *timeseries;
-  timeseries_backend_t *backend;
-  int i, id;
-
-  assert(kp_p != NULL);
-  kp = *kp_p;
-  if (kp == NULL) {
-    return;
-  }
-  *kp_p = NULL;
+  /* keep the flushes in order */
+  kp_async_wait(kp);
 
-  /* destroy the key hash */
-  kh_destroy(strint, kp->key_id_hash);
+  /* fold the values written by other threads into the KP */
+  kp_shards_merge(kp);
+  kp_rollup_update(kp);
 
-  for (i = 0; i < kp->key_infos_cnt; i++) {
-    kp_ki_free(&kp->key_infos[i], kp);
+  /* resolve any keys that have been added since the last flush */
+  if (timeseries_kp_resolve(kp) != 0) {
+    return -1;
   }
 
-  free(kp->key_infos);
-  kp->key_infos = NULL;
-  kp->key_infos_cnt = 0;
+  kp_changed_update(kp);
 
-  timeseries = kp_get_timeseries(kp);
-  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
-  {
-    backend->kp_free(backend, kp, kp->backend_state[id - 1]);
-    kp->backend_state[id - 1] = NULL;
+  if (kp_backends_flush(kp, time) != 0) {
+    return -1;
   }
 
-  /* free the actual key package structure */
-  free(kp);
+  kp_changed_clear(kp);
+  kp_reset_disable(kp);
 
-  return;
+  kp->flush_cnt++;
+  if (kp->idle_ttl != 0) {
+    kp_expire_idle(kp);
+  }
+  return 0;
 }
 
-int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key)
+int timeseries_kp_flush_async(timeseries_kp_t *kp, uint32_t time,
+                              timeseries_kp_flush_cb_t *cb, void *cb_user)
 {
   assert(kp != NULL);
-  assert(key != NULL);
-  int ret;
-  khiter_t k;
-  int this_id = kp->key_infos_cnt;
-  timeseries_kp_ki_t *ki = NULL;
+  kp_async_t *async;
+  kp_snapshot_t *snap;
+  kp_values_t values;
+  uint64_t *enabled;
+  uint64_t *changed;
+  uint32_t *live;
+  uint32_t i, id;
+  void *tmp;
+
+  /* remove the keys that expired while earlier snapshots were waiting, if
+     those snapshots have been written */
+  kp_expiring_remove(kp);
 
-  /* first we need to realloc the array of keys */
-  if ((kp->key_infos = realloc(kp->key_infos, sizeof(timeseries_kp_ki_t) *
-                                                (this_id + 1))) == NULL) {
-    timeseries_log(__func__, "could not realloc KP KI array");
+  kp_shards_merge(kp);
+  kp_rollup_update(kp);
+
+  /* resolving must be done by the KP owner, since it adds backend state */
+  if (timeseries_kp_resolve(kp) != 0) {
     return -1;
   }
 
-  ki = &kp->key_infos[this_id];
-  assert(ki != NULL);
+  /* make sure there are columns to swap, even if the KP is empty */
+  if (kp_ki_ensure(kp, 1) != 0) {
+    return -1;
+  }
 
-  if (kp_ki_init(ki, kp, key) != 0) {
+  if (kp->async == NULL && kp_async_init(kp) != 0) {
     return -1;
   }
+  async = kp->async;
+
+  /* wait for a free slot in the queue (this is the only place the caller can
+     block on the backends) */
+  pthread_mutex_lock(&async->mutex);
+  while (async->outstanding >= kp->max_snapshots) {
+    pthread_cond_wait(&async->done_cond, &async->mutex);
+  }
+  snap = async->spare;
+  async->spare = NULL;
+  pthread_mutex_unlock(&async->mutex);
 
-  /* now add a lookup in the hash */
-  k = kh_put(strint, kp->key_id_hash, timeseries_kp_ki_get_key(ki), &ret);
-  if (ret == -1) {
-    timeseries_log(__func__, "could not add key to hash");
+  if (snap == NULL && (snap = malloc_zero(sizeof(kp_snapshot_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc snapshot");
     return -1;
   }
-  kh_val(kp->key_id_hash, k) = this_id;
 
-  kp->key_infos_cnt++;
-  kp->key_infos_enabled_cnt++;
+  /* the snapshot takes the current columns, and the KP carries on with the
+     columns of a previously written snapshot */
+  values = snap->view.values;
+  enabled = snap->view.enabled;
+  changed = snap->view.changed;
+  live = snap->view.live;
+  if (snap->alloc < kp->key_infos_alloc || values.raw == NULL) {
+    if ((tmp = realloc(values.raw, kp->value_size * kp->key_infos_alloc)) !=
+        NULL) {
+      values.raw = tmp;
+      tmp = realloc(enabled,
+                    sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_alloc));
+    }
+    if (tmp != NULL) {
+      enabled = tmp;
+      if (kp->changed_only != 0 &&
+          (tmp = realloc(changed, sizeof(uint64_t) *
+                                    KP_BM_WORDS(kp->key_infos_alloc))) !=
+            NULL) {
+        changed = tmp;
+      }
+    }
+    if (tmp != NULL && kp->sparse != 0 &&
+        (tmp = realloc(live, sizeof(uint32_t) * kp->key_infos_alloc)) !=
+          NULL) {
+      live = tmp;
+      /* start the (sparse) enabled bitmap from scratch */
+      memset(enabled, 0, sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_alloc));
+      snap->view.live_cnt = 0;
+    }
+    if (tmp == NULL) {
+      timeseries_log(__func__, "could not realloc snapshot columns");
+      free(values.raw);
+      free(enabled);
+      free(changed);
+      free(live);
+      free(snap);
+      return -1;
+    }
+  }
 
-  /* backends will need to update their state */
-  kp->dirty = 1;
+  /* the snapshot gets its own copy of the changed bits, since the KP may
+     mark new keys while the snapshot is being written */
+  kp_changed_update(kp);
+  if (kp->changed_only != 0) {
+    memcpy(changed, kp->changed,
+           sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_cnt));
+    kp_changed_clear(kp);
+  }
 
-  return this_id;
+  if (kp->sparse != 0) {
+    /* copy only the live keys into the snapshot, and reset them in place.
+       The snapshot enabled bitmap is only set for the keys in its previous
+       live list, so those are the only bits that need clearing. */
+    for (i = 0; i < snap->view.live_cnt; i++) {
+      enabled[KP_BM_WORD(live[i])] = 0;
+    }
+    snap->view = *kp;
+    snap->view.live_cnt = 0;
+    for (i = 0; i < kp->live_cnt; i++) {
+      id = kp->live[i];
+      if ((kp->enabled[KP_BM_WORD(id)] & KP_BM_BIT(id)) == 0) {
+        continue;
+      }
+      memcpy(KP_VAL_PTR(values, kp->value_size, id),
+             KP_VAL_PTR(kp->values, kp->value_size, id), kp->value_size);
+      enabled[KP_BM_WORD(id)] |= KP_BM_BIT(id);
+      live[snap->view.live_cnt++] = id;
+    }
+    snap->view.values = values;
+    snap->view.enabled = enabled;
+    snap->view.live = live;
+    snap->view.listed = NULL;
+    kp_reset_disable(kp);
+  } else {
+    if (kp->reset != 0) {
+      kp_values_reset(kp, values);
+    } else {
+      memcpy(values.raw, kp->values.raw, kp->value_size * kp->key_infos_cnt);
+    }
+    memset(enabled, 0, sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_alloc));
+    if (kp->disable == 0) {
+      memcpy(enabled, kp->enabled,
+             sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_cnt));
+    }
+
+    snap->view = *kp;
+    kp->values = values;
+    kp->enabled = enabled;
+    if (kp->disable != 0) {
+      kp->key_infos_enabled_cnt = 0;
+    }
+  }
+
+  snap->view.changed = changed;
+  snap->view.prev_values.raw = NULL;
+  snap->view.shards = NULL;
+  snap->view.async = NULL;
+  snap->view.view_lock = &async->grow_lock;
+  snap->view.expiring = NULL;
+  snap->view.expiring_cnt = 0;
+  snap->alloc = kp->key_infos_alloc;
+  snap->time = time;
+  snap->cb = cb;
+  snap->cb_user = cb_user;
+  snap->next = NULL;
+
+  pthread_mutex_lock(&async->mutex);
+  if (async->tail != NULL) {
+    async->tail->next = snap;
+  } else {
+    async->head = snap;
+  }
+  async->tail = snap;
+  async->outstanding++;
+  async->queued++;
+  pthread_cond_signal(&async->work_cond);
+  pthread_mutex_unlock(&async->mutex);
+
+  kp->flush_cnt++;
+  if (kp->idle_ttl != 0) {
+    kp_expire_idle(kp);
+  }
+  return 0;
 }
 
-int timeseries_kp_get_key(timeseries_kp_t *kp, const char *key)
+int timeseries_kp_flush_wait(timeseries_kp_t *kp)
 {
-  khiter_t k;
   assert(kp != NULL);
+  int rc;
 
-  /* just check the hash */
-  if ((k = kh_get(strint, kp->key_id_hash, key)) == kh_end(kp->key_id_hash)) {
-    return -1;
+  if (kp->async == NULL) {
+    return 0;
   }
-  return kh_val(kp->key_id_hash, k);
+
+  kp_async_wait(kp);
+
+  pthread_mutex_lock(&kp->async->mutex);
+  rc = (kp->async->failed != 0) ? -1 : 0;
+  kp->async->failed = 0;
+  pthread_mutex_unlock(&kp->async->mutex);
+
+  return rc;
 }
 
-const char *timeseries_kp_get_key_name(timeseries_kp_t *kp, uint32_t key)
+void timeseries_kp_set_max_snapshots(timeseries_kp_t *kp,
+                                     uint32_t max_snapshots)
 {
-  if (key >= kp->key_infos_cnt) {
-    return NULL;
-  }
-  return kp->key_infos[key].key;
+  assert(kp != NULL);
+  assert(max_snapshots > 0);
+  kp->max_snapshots = max_snapshots;
 }
 
-void timeseries_kp_disable_key(timeseries_kp_t *kp, uint32_t key)
+int timeseries_kp_set_window(timeseries_kp_t *kp, uint32_t slots, uint32_t lag,
+                             timeseries_kp_window_cb_t *cb, void *cb_user)
 {
-  if (kp->key_infos[key].disabled == 0) {
-    kp->key_infos[key].disabled = 1;
-    kp->key_infos_enabled_cnt--;
+  assert(kp != NULL);
+  kp_window_t *window;
+  kp_slot_cols_t *cols;
+  uint64_t words;
+  uint32_t s;
+
+  if (slots == 0 || kp->window != NULL || kp->shards != NULL) {
+    timeseries_log(__func__, "cannot set a window of %" PRIu32 " slots "
+                             "(KPs with shards cannot have a window)",
+                   slots);
+    return -1;
+  }
+
+  /* make sure there are columns to copy, even if the KP is empty */
+  if (kp_ki_ensure(kp, 1) != 0) {
+    return -1;
+  }
+  words = KP_BM_WORDS(kp->key_infos_alloc);
+
+  if ((window = malloc_zero(sizeof(kp_window_t))) == NULL ||
+      (window->slots = malloc_zero(sizeof(kp_slot_t) * slots)) == NULL) {
+    timeseries_log(__func__, "could not malloc window");
+    free(window);
+    return -1;
+  }
+  window->slots_cnt = slots;
+  window->lag = lag;
+  window->cb = cb;
+  window->cb_user = cb_user;
+  kp->window = window;
+
+  /* the current columns become the first slot, and the other slots start
+     out like the KP after a flush */
+  for (s = 1; s < slots; s++) {
+    cols = &window->slots[s].cols;
+    if ((cols->values.raw = malloc(kp->value_size * kp->key_infos_alloc)) ==
+          NULL ||
+        (cols->enabled = malloc_zero(sizeof(uint64_t) * words)) == NULL ||
+        (kp->sparse != 0 &&
+         ((cols->live = malloc(sizeof(uint32_t) * kp->key_infos_alloc)) ==
+            NULL ||
+          (cols->listed = malloc_zero(sizeof(uint64_t) * words)) == NULL))) {
+      timeseries_log(__func__, "could not malloc slot columns");
+      kp_window_free(kp);
+      return -1;
+    }
+    kp_values_reset(kp, cols->values);
+    if (kp->disable == 0) {
+      memcpy(cols->enabled, kp->enabled,
+             sizeof(uint64_t) * KP_BM_WORDS(kp->key_infos_cnt));
+      cols->enabled_cnt = kp->key_infos_enabled_cnt;
+    }
   }
+
+  return 0;
 }
 
-void timeseries_kp_enable_key(timeseries_kp_t *kp, uint32_t key)
+int timeseries_kp_select_time(timeseries_kp_t *kp, uint32_t time)
 {
-  if (kp->key_infos[key].disabled != 0) {
-    kp->key_infos[key].disabled = 0;
-    kp->key_infos_enabled_cnt++;
+  assert(kp != NULL);
+  kp_window_t *window = kp->window;
+  kp_slot_t *slot;
+  uint32_t free_idx = UINT32_MAX;
+  uint32_t oldest = UINT32_MAX;
+  uint32_t s;
+
+  if (window == NULL) {
+    timeseries_log(__func__, "KP does not have a window");
+    return -1;
+  }
+
+  /* advance the watermark, flushing the slots that it passes */
+  if (window->lag != 0 && time > window->newest) {
+    window->newest = time;
+    if (time > window->lag && time - window->lag > window->watermark) {
+      window->watermark = time - window->lag;
+      if (timeseries_kp_flush_until(kp, window->watermark - 1) != 0) {
+        return -1;
+      }
+    }
+  }
+  if (window->lag != 0 && time < window->watermark) {
+    return 1;
+  }
+
+  slot = &window->slots[window->cur];
+  if (slot->used != 0 && slot->time == time) {
+    return 0;
+  }
+
+  for (s = 0; s < window->slots_cnt; s++) {
+    slot = &window->slots[s];
+    if (slot->used == 0) {
+      /* prefer the current slot, which avoids swapping columns */
+      if (free_idx == UINT32_MAX || s == window->cur) {
+        free_idx = s;
+      }
+    } else if (slot->time == time) {
+      kp_window_select(kp, s);
+      return 0;
+    } else if (oldest == UINT32_MAX ||
+               slot->time < window->slots[oldest].time) {
+      oldest = s;
+    }
+  }
+
+  /* all slots are in use, so the oldest is flushed early to make room */
+  if (free_idx == UINT32_MAX) {
+    if (kp_window_flush_slot(kp, oldest) != 0) {
+      return -1;
+    }
+    free_idx = oldest;
   }
+
+  window->slots[free_idx].time = time;
+  window->slots[free_idx].used = 1;
+  kp_window_select(kp, free_idx);
+  return 0;
 }
 
-uint64_t timeseries_kp_get(timeseries_kp_t *kp, uint32_t key)
+int timeseries_kp_flush_until(timeseries_kp_t *kp, uint32_t time)
 {
-  return kp_ki_get(&kp->key_infos[key]);
+  assert(kp != NULL);
+  kp_window_t *window = kp->window;
+  uint32_t oldest;
+  uint32_t s;
+
+  if (window == NULL) {
+    timeseries_log(__func__, "KP does not have a window");
+    return -1;
+  }
+
+  /* slots are flushed in time order */
+  while (1) {
+    oldest = UINT32_MAX;
+    for (s = 0; s < window->slots_cnt; s++) {
+      if (window->slots[s].used != 0 && window->slots[s].time <= time &&
+          (oldest == UINT32_MAX ||
+           window->slots[s].time < window->slots[oldest].time)) {
+        oldest = s;
+      }
+    }
+    if (oldest == UINT32_MAX) {
+      return 0;
+    }
+    if (kp_window_flush_slot(kp, oldest) != 0) {
+      return -1;
+    }
+  }
 }
 
-void timeseries_kp_set(timeseries_kp_t *kp, uint32_t key, uint64_t value)
+timeseries_kp_shard_t *timeseries_kp_shard_init(timeseries_kp_t *kp,
+                                                timeseries_kp_merge_t merge)
 {
   assert(kp != NULL);
-  assert(key < kp->key_infos_cnt);
+  timeseries_kp_shard_t *shard;
+  timeseries_kp_shard_t **tail;
+
+  /* shard values are merged when the KP is flushed, so they cannot be
+     assigned to a time slot */
+  if (kp->window != NULL) {
+    timeseries_log(__func__, "windowed KPs cannot have shards");
+    return NULL;
+  }
+
+  if ((shard = malloc_zero(sizeof(timeseries_kp_shard_t))) == NULL) {
+    timeseries_log(__func__, "could not malloc key package shard");
+    return NULL;
+  }
+  shard->kp = kp;
+  shard->merge = merge;
+
+  if (kp_shard_grow(shard, kp->key_infos_alloc) != 0) {
+    timeseries_log(__func__, "could not malloc shard columns");
+    timeseries_kp_shard_free(&shard);
+    return NULL;
+  }
 
-  kp_ki_set(&kp->key_infos[key], value);
+  for (tail = &kp->shards; *tail != NULL; tail = &(*tail)->next)
+    ;
+  *tail = shard;
+
+  return shard;
 }
 
-int timeseries_kp_resolve(timeseries_kp_t *kp)
+void timeseries_kp_shard_free(timeseries_kp_shard_t **shard_p)
 {
-  int id;
-  timeseries_backend_t *backend;
-  timeseries_t *timeseries = kp_get_timeseries(kp);
-  assert(timeseries != NULL);
+  timeseries_kp_shard_t *shard;
+  timeseries_kp_shard_t **prev;
 
-  /* this is a forced resolve, so we always resolve, but we mark the KP as not
-     dirty */
-  kp->dirty = 0;
+  assert(shard_p != NULL);
+  shard = *shard_p;
+  if (shard == NULL) {
+    return;
+  }
+  *shard_p = NULL;
 
-  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
-  {
-    if (backend->kp_ki_update(backend, kp) != 0) {
-      return -1;
+  for (prev = &shard->kp->shards; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == shard) {
+      *prev = shard->next;
+      break;
     }
   }
 
-  return 0;
+  free(shard->values.raw);
+  free(shard->touched);
+  free(shard);
 }
 
-int timeseries_kp_flush(timeseries_kp_t *kp, uint32_t time)
+/** Write a value to a shard, aggregating it (by the mode of its key) with the
+    values written to the shard for the key since the last merge */
+static void kp_shard_store(timeseries_kp_shard_t *shard, uint32_t key,
+                           uint64_t value, int add)
 {
-  int id;
-  timeseries_backend_t *backend;
-  int dirty;
-  timeseries_t *timeseries = kp_get_timeseries(kp);
-  assert(timeseries != NULL);
+  timeseries_kp_t *kp = shard->kp;
+  timeseries_kp_agg_t agg = TIMESERIES_KP_AGG_LAST;
 
-  dirty = kp->dirty;
-  kp->dirty = 0;
+  if (kp->agg != NULL) {
+    agg = (timeseries_kp_agg_t)kp->agg[key];
+  }
 
-  TIMESERIES_FOREACH_ENABLED_BACKEND(timeseries, backend, id)
-  {
-    if (dirty != 0 && backend->kp_ki_update(backend, kp) != 0) {
-      kp->dirty = 1; /* otherwise the next call won't resolve keys */
-      return -1;
-    }
+  if (agg == TIMESERIES_KP_AGG_LAST || (add != 0 && !KP_AGG_EXTREMUM(agg))) {
+    kp_val_store(shard->values, kp->value_type, key, value, add);
+  } else if ((shard->touched[KP_BM_WORD(key)] & KP_BM_BIT(key)) == 0) {
+    /* untouched keys have no identity to aggregate with, so the first value
+       starts the aggregate */
+    kp_val_store(shard->values, kp->value_type, key,
+                 (agg == TIMESERIES_KP_AGG_COUNT) ? 1 : value, 0);
+  } else {
+    kp_agg_store(shard->values, kp->value_type, key, value, agg);
+  }
+  shard->touched[KP_BM_WORD(key)] |= KP_BM_BIT(key);
+}
 
-    if (backend->kp_flush(backend, kp, time) != 0) {
-      return -1;
-    }
+int timeseries_kp_shard_set(timeseries_kp_shard_t *shard, uint32_t key,
+                            uint64_t value)
+{
+  assert(shard != NULL);
+  assert(key < shard->kp->key_infos_cnt);
+
+  if (key >= shard->alloc && kp_shard_grow(shard, key + 1) != 0) {
+    return -1;
   }
 
-  kp_reset_disable(kp);
+  kp_shard_store(shard, key, value, 0);
+  return 0;
+}
+
+int timeseries_kp_shard_add(timeseries_kp_shard_t *shard, uint32_t key,
+                            uint64_t value)
+{
+  assert(shard != NULL);
+  assert(key < shard->kp->key_infos_cnt);
+
+  if (key >= shard->alloc && kp_shard_grow(shard, key + 1) != 0) {
+    return -1;
+  }
+
+  kp_shard_store(shard, key, value, 1);
   return 0;
 }
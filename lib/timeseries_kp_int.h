@@ -50,9 +50,6 @@
  *
  * @{ */
 
-/** Opaque struct holding state for a timeseries Key Package Key */
-typedef struct timeseries_kp_ki timeseries_kp_ki_t;
-
 /** @} */
 
 /**
@@ -60,59 +57,224 @@ typedef struct timeseries_kp_ki timeseries_kp_ki_t;
  *
  * @{ */
 
+/** A span of the keys of a Key Package that are being flushed
+ *
+ * A span holds the keys that TIMESERIES_KP_FOREACH_CHANGED_KI would visit (at
+ * most TIMESERIES_KP_SPAN_KEYS of them) as parallel arrays, so that backends
+ * can write them in a tight loop without calling back into the KP for each
+ * key. Spans hold disjoint sets of keys.
+ *
+ * The arrays belong to the KP, and are only valid until the backend function
+ * that was given the span returns.
+ */
+typedef struct timeseries_kp_span {
+  /** Number of keys in the span (may be 0 for the last span) */
+  uint32_t cnt;
+
+  /** Is this the last span of the flush? */
+  int last;
+
+  /** IDs of the keys (in ID order, unless the KP was created with
+      TIMESERIES_KP_SPARSE) */
+  const uint32_t *ids;
+
+  /** Key strings (NUL-terminated) */
+  const char *const *keys;
+
+  /** Lengths of the key strings (not including the NUL) */
+  const uint32_t *key_lens;
+
+  /** Values of the keys (an array of the type given by
+      timeseries_kp_get_value_type) */
+  const void *values;
+
+} timeseries_kp_span_t;
+
 /** @} */
 
-#define TIMESERIES_KP_FOREACH_KI(kp, ki, id)                                   \
-  int cnt = timeseries_kp_size(kp);                                            \
-  for (id = 0, (ki = timeseries_kp_get_ki(kp, id)); id < cnt;                  \
-       id++, (ki = timeseries_kp_get_ki(kp, id)))
+/** The maximum number of keys in a timeseries_kp_span_t */
+#define TIMESERIES_KP_SPAN_KEYS 4096
 
-/** Get the Key Info object with the given ID
+/** Iterate over the IDs of all Key Info objects in the given Key Package
  *
- * @param kp            Pointer to the KP to retrieve the Key from
- * @param id            ID of the Key Info object to retrieve
- * @return pointer to the Key Info object with the given ID, NULL if none exists
+ * Key Info (KI) objects are identified by their key ID (as returned by
+ * timeseries_kp_add_key), and their state is accessed using the
+ * timeseries_kp_ki_* functions below.
  */
-timeseries_kp_ki_t *timeseries_kp_get_ki(timeseries_kp_t *kp, int id);
+#define TIMESERIES_KP_FOREACH_KI(kp, id)                                       \
+  for (id = 0; id < timeseries_kp_size(kp); id++)
 
-/** Get the string key from a Key Info object
+/** Iterate over the IDs of the enabled Key Info objects in the given Key
+ * Package
  *
- * @param key           pointer to a Key Package Key Info object
- * @return a pointer to the string representation of the Key Info
+ * The enabled flags are stored as a bitmap, so this skips disabled keys 64 at
+ * a time, and the cost of a loop is proportional to the number of enabled keys
+ * rather than the total number of keys in the KP.
  */
-const char *timeseries_kp_ki_get_key(timeseries_kp_ki_t *ki);
+#define TIMESERIES_KP_FOREACH_ENABLED_KI(kp, id)                               \
+  for (id = timeseries_kp_ki_next_enabled(kp, 0); id < timeseries_kp_size(kp); \
+       id = timeseries_kp_ki_next_enabled(kp, id + 1))
 
-/** Get the value of the given Key Info object
+/** Iterate over the IDs of the live (enabled) Key Info objects in the given
+ * Key Package
+ *
+ * @param kp            pointer to a Key Package
+ * @param pos           uint32_t variable to hold the iteration position
+ * @param id            uint32_t variable to hold the ID of each live KI
+ *
+ * For KPs created with TIMESERIES_KP_SPARSE, this walks the list of keys
+ * enabled since the last flush, so the cost of a loop does not depend on the
+ * total number of keys in the KP at all. Keys are visited in the order they
+ * were enabled (not in ID order). For other KPs this is equivalent to
+ * TIMESERIES_KP_FOREACH_ENABLED_KI.
+ *
+ * Backends that do not depend on the order of the keys should use this
+ * rather than TIMESERIES_KP_FOREACH_ENABLED_KI when flushing.
+ */
+#define TIMESERIES_KP_FOREACH_LIVE_KI(kp, pos, id)                             \
+  for (pos = 0, id = timeseries_kp_ki_next_live(kp, &pos);                     \
+       id < timeseries_kp_size(kp); id = timeseries_kp_ki_next_live(kp, &pos))
+
+/** Iterate over the IDs of the enabled Key Info objects in the given Key
+ * Package whose values have changed since they were last flushed
+ *
+ * Backends that only need to write changed values (i.e. that do not require
+ * a value for every key at every time) should use this rather than
+ * TIMESERIES_KP_FOREACH_ENABLED_KI when flushing. If the KP was not created
+ * with the TIMESERIES_KP_CHANGED flag, this visits all enabled keys.
+ */
+#define TIMESERIES_KP_FOREACH_CHANGED_KI(kp, id)                               \
+  for (id = timeseries_kp_ki_next_changed(kp, 0); id < timeseries_kp_size(kp); \
+       id = timeseries_kp_ki_next_changed(kp, id + 1))
+
+/** Get the string key of a Key Info object
+ *
+ * @param kp            pointer to a Key Package
+ * @param id            ID of the Key Info object
+ * @return a pointer to the string representation of the Key Info, NULL if
+ * the key has been removed
+ *
+ * Removed keys are always disabled, so they are never visited by
+ * TIMESERIES_KP_FOREACH_ENABLED_KI, but backends iterating over all KIs must
+ * skip them.
+ *
+ * The key is copied the first time it is fetched, and the pointer stays valid
+ * until the key is removed or the KP is compacted. Backends that only use the
+ * key while writing it (or copy it themselves) should use
+ * timeseries_kp_ki_decode_key instead, which does not keep a copy.
+ */
+const char *timeseries_kp_ki_get_key(timeseries_kp_t *kp, uint32_t id);
+
+/** Decode the string key of a Key Info object
+ *
+ * @param kp            pointer to a Key Package
+ * @param id            ID of the Key Info object
+ * @return a pointer to the string representation of the Key Info, NULL if
+ * the key has been removed
  *
- * @param key           pointer to a Key Package Key Info object
+ * The key is decoded into a buffer owned by the calling thread, so the
+ * pointer is only valid until the next key is decoded (by any KP) in the same
+ * thread. Decoding keys in ID order (as the FOREACH macros do) only decodes
+ * one entry per key.
+ */
+const char *timeseries_kp_ki_decode_key(timeseries_kp_t *kp, uint32_t id);
+
+/** Get the value of a Key Info object
+ *
+ * @param kp            pointer to a Key Package
+ * @param id            ID of the Key Info object
  * @return current value for the given Key Info
+ *
+ * Values of KPs that are not of type TIMESERIES_KP_VALUE_U64 are converted
+ * to uint64_t. Backends that support other value types should check
+ * timeseries_kp_get_value_type and use the typed accessors below.
  */
-uint64_t timeseries_kp_ki_get_value(timeseries_kp_ki_t *ki);
+uint64_t timeseries_kp_ki_get_value(timeseries_kp_t *kp, uint32_t id);
+
+/** Get the value of a Key Info object in a TIMESERIES_KP_VALUE_U32 KP */
+uint32_t timeseries_kp_ki_get_value_u32(timeseries_kp_t *kp, uint32_t id);
+
+/** Get the value of a Key Info object in a TIMESERIES_KP_VALUE_I64 KP */
+int64_t timeseries_kp_ki_get_value_i64(timeseries_kp_t *kp, uint32_t id);
+
+/** Get the value of a Key Info object in a TIMESERIES_KP_VALUE_DOUBLE KP */
+double timeseries_kp_ki_get_value_double(timeseries_kp_t *kp, uint32_t id);
 
 /** Is this KI enabled?
  *
- * @param ki            pointer to a Key Package Key Info object
+ * @param kp            pointer to a Key Package
+ * @param id            ID of the Key Info object
  * @return 1 if the KI is enabled (should be dumped), 0 otherwise
  */
-int timeseries_kp_ki_enabled(timeseries_kp_ki_t *ki);
+int timeseries_kp_ki_enabled(timeseries_kp_t *kp, uint32_t id);
 
-/** Get the backend state of the given Key Info object
+/** Find the first enabled Key Info object with an ID >= the given ID
  *
- * @param ki            pointer to a Key Package Key Info object
- * @param backend_id    ID of the backend state to retrieve
- * @return pointer to the state for this backend/info pair
+ * @param kp            pointer to a Key Package
+ * @param id            ID to start searching from
+ * @return the ID of the next enabled KI, or timeseries_kp_size(kp) if there
+ * are no more enabled KIs
+ */
+uint32_t timeseries_kp_ki_next_enabled(timeseries_kp_t *kp, uint32_t id);
+
+/** Get the next live Key Info object (see TIMESERIES_KP_FOREACH_LIVE_KI)
+ *
+ * @param kp            pointer to a Key Package
+ * @param[in,out] pos   iteration position (0 to start from the first live
+ *                      KI), updated to the position of the following KI
+ * @return the ID of the next live KI, or timeseries_kp_size(kp) if there are
+ * no more live KIs
+ */
+uint32_t timeseries_kp_ki_next_live(timeseries_kp_t *kp, uint32_t *pos);
+
+/** Is this KI enabled, and has its value changed since it was last flushed?
+ *
+ * @param kp            pointer to a Key Package
+ * @param id            ID of the Key Info object
+ * @return 1 if the KI should be written by change-only backends, 0 otherwise
+ */
+int timeseries_kp_ki_changed(timeseries_kp_t *kp, uint32_t id);
+
+/** Find the first enabled and changed Key Info object with an ID >= the given
+ * ID
+ *
+ * @param kp            pointer to a Key Package
+ * @param id            ID to start searching from
+ * @return the ID of the next changed KI, or timeseries_kp_size(kp) if there
+ * are no more changed KIs
+ */
+uint32_t timeseries_kp_ki_next_changed(timeseries_kp_t *kp, uint32_t id);
+
+/** Flush the given Key Package to a backend, one span at a time
+ *
+ * @param kp            Pointer to a Key Package
+ * @param backend       Pointer to a backend with a kp_flush_span function
+ * @param time          The timestamp to associate the values with
+ * @return 0 if every span was written successfully, -1 otherwise
+ *
+ * This calls the kp_flush_span function of the backend for each span of the
+ * changed keys (see timeseries_kp_span_t), stopping at the first error. It is
+ * always called at least once, with the last span (which may be empty).
+ *
+ * The KP calls this rather than kp_flush for backends that registered a
+ * kp_flush_span function.
  */
-void *timeseries_kp_ki_get_backend_state(timeseries_kp_ki_t *ki,
-                                         timeseries_backend_id_t id);
+int timeseries_kp_flush_spans(timeseries_kp_t *kp,
+                              timeseries_backend_t *backend, uint32_t time);
 
-/** Set the backend state of the given Key Info object
+/** Get the backend state of a Key Info object
+ *
+ * @param kp            pointer to a Key Package
+ * @param id            ID of the Key Info object
+ * @param backend_id    ID of the backend state to retrieve
+ * @return pointer to the state for this backend/info pair (of the size that
+ * the backend registered with timeseries_backend_register_ki_state_size)
  *
- * @param ki            pointer to a Key Package Key Info object
- * @param backend_id    ID of the backend state to store
- * @param ki_state      pointer to the state to store in the KI object
+ * The state is held inline by the KP, and is zeroed when the key is added
+ * (and when it is removed). The pointer is only valid until the next key is
+ * added, or the KP is compacted.
  */
-void timeseries_kp_ki_set_backend_state(timeseries_kp_ki_t *ki,
-                                        timeseries_backend_id_t id,
-                                        void *ki_state);
+void *timeseries_kp_ki_get_backend_state(timeseries_kp_t *kp, uint32_t id,
+                                         timeseries_backend_id_t backend_id);
 
 #endif /* __TIMESERIES_KP_INT_H */
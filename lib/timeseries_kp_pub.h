@@ -54,6 +54,9 @@
 /** Opaque struct holding state for a timeseries key package */
 typedef struct timeseries_kp timeseries_kp_t;
 
+/** Opaque struct holding the values written by one thread to a key package */
+typedef struct timeseries_kp_shard timeseries_kp_shard_t;
+
 /** @} */
 
 /**
@@ -67,8 +70,54 @@ enum {
 
   /** Deactivate all keys after a flush */
   TIMESERIES_KP_DISABLE = 0x2,
+
+  /** Only write keys whose value has changed since they were last flushed
+      (to the backends that support it) */
+  TIMESERIES_KP_CHANGED = 0x4,
+
+  /** Track the keys enabled since the last flush in a list, so that the
+      flush only visits those keys (requires TIMESERIES_KP_DISABLE) */
+  TIMESERIES_KP_SPARSE = 0x8,
+
+  /** Store the keys in the key table of the timeseries instance, which is
+      shared with the other KPs created with this flag */
+  TIMESERIES_KP_SHARED = 0x10,
+
+  /** Add a key for each '.'-separated prefix of the keys that are added,
+      whose value is set to the sum of the enabled keys below it at each
+      flush (see timeseries_kp_add_key). Values set directly on these keys
+      are overwritten by the sum (they are not added to it). */
+  TIMESERIES_KP_ROLLUP = 0x20,
 };
 
+/** The maximum number of tags in the tag set of a tagged key */
+#define TIMESERIES_KP_TAGS_MAX 32
+
+/** Function called when an asynchronous flush of a Key Package completes
+ *
+ * @param kp            Pointer to the KP that was flushed
+ * @param time          The time the values were flushed with
+ * @param status        0 if the values were written to all backends
+ *                      successfully, -1 otherwise
+ * @param user          The user pointer passed to timeseries_kp_flush_async
+ *
+ * @note this is called from the async writer thread of the KP
+ */
+typedef void(timeseries_kp_flush_cb_t)(timeseries_kp_t *kp, uint32_t time,
+                                       int status, void *user);
+
+/** Function called just before a time slot of a windowed Key Package is
+ * flushed
+ *
+ * @param kp            Pointer to the KP being flushed (with the slot
+ *                      selected, so e.g. timeseries_kp_enabled_size gives the
+ *                      number of keys in the slot)
+ * @param time          The time of the slot
+ * @param user          The user pointer passed to timeseries_kp_set_window
+ */
+typedef void(timeseries_kp_window_cb_t)(timeseries_kp_t *kp, uint32_t time,
+                                        void *user);
+
 /** @} */
 
 /**
@@ -76,6 +125,50 @@ enum {
  *
  * @{ */
 
+/** How the values in a Key Package shard are merged into the Key Package */
+typedef enum {
+  /** Add the shard values to the KP values */
+  TIMESERIES_KP_MERGE_SUM = 0,
+
+  /** Replace the KP values with the shard values */
+  TIMESERIES_KP_MERGE_LAST = 1,
+} timeseries_kp_merge_t;
+
+/** The type of the values stored in a Key Package */
+typedef enum {
+  /** Unsigned 64 bit integer values (the default) */
+  TIMESERIES_KP_VALUE_U64 = 0,
+
+  /** Unsigned 32 bit integer values */
+  TIMESERIES_KP_VALUE_U32 = 1,
+
+  /** Signed 64 bit integer values */
+  TIMESERIES_KP_VALUE_I64 = 2,
+
+  /** Double precision floating point values */
+  TIMESERIES_KP_VALUE_DOUBLE = 3,
+} timeseries_kp_value_type_t;
+
+/** How the values set for a key during an interval are aggregated */
+typedef enum {
+  /** Keep the last value set (the default) */
+  TIMESERIES_KP_AGG_LAST = 0,
+
+  /** Add up the values set */
+  TIMESERIES_KP_AGG_SUM = 1,
+
+  /** Keep the smallest value set (only for KPs created with
+      TIMESERIES_KP_DISABLE) */
+  TIMESERIES_KP_AGG_MIN = 2,
+
+  /** Keep the largest value set (only for KPs created with
+      TIMESERIES_KP_DISABLE) */
+  TIMESERIES_KP_AGG_MAX = 3,
+
+  /** Count the number of times a value is set (the values are ignored) */
+  TIMESERIES_KP_AGG_COUNT = 4,
+} timeseries_kp_agg_t;
+
 /** @} */
 
 /** Initialize a Key Package
@@ -99,12 +192,62 @@ enum {
  * If you know you will set a value for every key every interval then setting
  * the _reset_ parameter to 0 will improve performance slightly.
  *
+ * If many keys hold the same value for long periods, setting the
+ * TIMESERIES_KP_CHANGED flag makes the KP remember the last flushed value of
+ * each key, and only hand the keys whose value has changed (and new keys) to
+ * backends that support change-only writes (currently ascii and kafka).
+ * Other backends (e.g. dbats, which needs a value for every key in every
+ * interval) are still given all enabled keys. This costs one extra value
+ * per key.
+ *
+ * If only a small fraction of the keys are enabled in any interval, setting
+ * the TIMESERIES_KP_SPARSE flag (along with TIMESERIES_KP_DISABLE) makes the
+ * KP append keys to a list as they are enabled, so that resetting and
+ * disabling the keys after a flush only touches the keys in the list, rather
+ * than every key in the KP. Note that with this flag, only enabled keys are
+ * reset after a flush: the value of a key that is set but never enabled is
+ * kept. This costs one extra uint32_t per key.
+ *
+ * If several KPs (e.g. one per module, or one per interval) use overlapping
+ * sets of keys, setting the TIMESERIES_KP_SHARED flag on each of them makes
+ * them intern their keys in a key table that belongs to the timeseries
+ * instance, so that each key string is stored once, and is resolved by each
+ * backend (e.g. dbats) only once, no matter how many KPs use it. Each KP
+ * still has its own key IDs, and costs two extra uint32_t per key. A key
+ * stays in the shared table while any shared KP uses it: once it has been
+ * removed from (or expired by) every KP, or those KPs have been freed, its
+ * string is dropped and its slot in the table is reused. Shared KPs can find
+ * keys and flush at the same time (from different threads), but adding keys
+ * to a shared KP waits for the other shared KPs to finish resolving or
+ * flushing.
+ *
  * If not all key names are known during initialization, then the
  * timeseries_kp_add_key function can be used to add keys incrementally.
- * There is currently no mechanism for removing keys.
+ * Keys can be removed with timeseries_kp_remove_key, or expired
+ * automatically using timeseries_kp_set_idle_ttl. The IDs of removed keys
+ * are not reused until timeseries_kp_compact is called.
  */
 timeseries_kp_t *timeseries_kp_init(timeseries_t *timeseries, int flags);
 
+/** Initialize a Key Package that stores values of the given type
+ *
+ * @param timeseries    Pointer to the timeseries instance to associate the key
+ *                      package with
+ * @param flags         Should the values be reset and/or deactivated on flush.
+ * @param type          The type of the values stored in the KP
+ * @return a pointer to a Key Package structure, NULL if an error occurs
+ *
+ * Values are stored in a column of the given type, so a KP of 32 bit
+ * counters uses half the memory of a default (uint64_t) KP. Values can be
+ * written with the typed setters (e.g. timeseries_kp_set_u32), or with the
+ * generic uint64_t timeseries_kp_set, which converts them to the KP type.
+ *
+ * Not all backends support all types: initialization fails if an enabled
+ * backend cannot store values of the given type.
+ */
+timeseries_kp_t *timeseries_kp_init_typed(timeseries_t *timeseries, int flags,
+                                          timeseries_kp_value_type_t type);
+
 /** Free a Key Package
  *
  * @param kp_p          Double pointer to the Key Package to free
@@ -116,9 +259,157 @@ void timeseries_kp_free(timeseries_kp_t **kp_p);
  * @param kp          The Key Package to add the key to
  * @param key         String containing the name of the key to add
  * @return the index of the key that was added, -1 if an error occurred
+ *
+ * If the KP was created with TIMESERIES_KP_ROLLUP, the key up to its last
+ * '.' (e.g. a.b.c for a.b.c.d) is found, or added (in the same way) before
+ * the key, and the key is rolled up into it. At each flush, the value of
+ * every key that other keys are rolled up into is set to the sum of the
+ * enabled keys below it (which replaces any value set for it directly), and
+ * it is enabled if any of them are. Adding a key that other keys are already
+ * rolled up into returns its existing index. Tagged keys are not rolled up.
  */
 int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key);
 
+/** Add a length-delimited key to an existing Key Package
+ *
+ * @param kp          The Key Package to add the key to
+ * @param key         Pointer to the name of the key to add (need not be
+ *                    NUL-terminated)
+ * @param len         Length of the key name
+ * @return the index of the key that was added, -1 if an error occurred
+ */
+int timeseries_kp_add_key_n(timeseries_kp_t *kp, const char *key, size_t len);
+
+/** Add a set of keys to an existing Key Package
+ *
+ * @param kp          The Key Package to add the keys to
+ * @param keys        Array of strings containing the names of the keys to add
+ * @param keys_cnt    Number of keys in the keys array
+ * @param[out] ids    If not NULL, filled with the index of each key added
+ * @return 0 if all keys were added, -1 if an error occurred
+ *
+ * This is equivalent to calling timeseries_kp_reserve followed by
+ * timeseries_kp_add_key for each key, and is the most efficient way to build
+ * a large Key Package.
+ */
+int timeseries_kp_add_keys(timeseries_kp_t *kp, const char *const *keys,
+                           uint32_t keys_cnt, uint32_t *ids);
+
+/** Pre-allocate space for the given number of keys in a Key Package
+ *
+ * @param kp          The Key Package to reserve space in
+ * @param keys_cnt    Total number of keys that the KP should have space for
+ * @return 0 if the space was allocated, -1 if an error occurred
+ *
+ * Keys may be added to the KP without calling this function (space is grown
+ * geometrically as keys are added), but if the number of keys is known in
+ * advance, reserving space avoids re-allocating and re-hashing as the KP
+ * grows.
+ */
+int timeseries_kp_reserve(timeseries_kp_t *kp, uint32_t keys_cnt);
+
+/** Remove the given key from a Key Package
+ *
+ * @param kp          The Key Package to remove the key from
+ * @param key         Index of the key (as returned by kp_add_key) to remove
+ * @return 0 if the key was removed, -1 if no such key exists
+ *
+ * The key is no longer flushed, and can no longer be found using
+ * timeseries_kp_get_key (adding it again will give it a new ID). Any
+ * backend state for the key is freed immediately, but the ID (and the memory
+ * for the key name) is only reclaimed by timeseries_kp_compact.
+ */
+int timeseries_kp_remove_key(timeseries_kp_t *kp, uint32_t key);
+
+/** Automatically remove keys that have not been set for a number of flushes
+ *
+ * @param kp          The Key Package to set the TTL for
+ * @param flushes     Number of flushes that a key may go without being set
+ *                    (or added) before it is removed, 0 to never remove keys
+ * @return 0 if the TTL was set, -1 if an error occurred
+ *
+ * Idle keys are removed at the end of timeseries_kp_flush, as though
+ * timeseries_kp_remove_key had been called for each of them (see
+ * timeseries_kp_flush_async for how they are removed while snapshots are
+ * waiting to be written). This is
+ * intended for long-lived KPs where keys come and go (e.g. tsk-proxy), so
+ * that the number of keys does not grow without bound.
+ *
+ * Keys are kept in one list per interval of the TTL (by the interval they
+ * were last set in), so each flush only visits the keys that have just gone
+ * idle, rather than every key in the KP. This costs three extra uint32_t per
+ * key.
+ */
+int timeseries_kp_set_idle_ttl(timeseries_kp_t *kp, uint32_t flushes);
+
+/** Reclaim the IDs and memory used by removed keys
+ *
+ * @param kp          The Key Package to compact
+ * @return 0 if the KP was compacted, -1 if an error occurred
+ *
+ * Live keys are renumbered (keeping their relative order) so that their IDs
+ * are contiguous, starting from 0. Backends are told about the renumbering,
+ * so keys do not need to be resolved again.
+ *
+ * @warning any key IDs held by the caller are invalid after this call and
+ * must be looked up again using timeseries_kp_get_key.
+ */
+int timeseries_kp_compact(timeseries_kp_t *kp);
+
+/** Freeze the set of keys in a Key Package
+ *
+ * @param kp          The Key Package to freeze
+ * @return 0 if the KP was frozen, -1 if an error occurred
+ *
+ * This is intended for KPs whose keys are all added up front (e.g. at
+ * startup). The key lookup table is replaced by a minimal perfect hash of the
+ * keys, so that timeseries_kp_get_key takes one hash, one fingerprint
+ * compare and one key compare, with no probing, and the spare space in the
+ * key columns is freed. Key lookups then use about 9 bytes per key, rather
+ * than 19 to 29.
+ *
+ * Once frozen, keys can no longer be added to or removed from the KP (and
+ * idle keys do not expire), and the KP cannot be unfrozen. Values are set
+ * and flushed as usual. KPs with removed keys must be compacted before they
+ * are frozen, and shared KPs (see TIMESERIES_KP_SHARED) cannot be frozen.
+ */
+int timeseries_kp_freeze(timeseries_kp_t *kp);
+
+/** Write a checkpoint of the keys in a Key Package to a file
+ *
+ * @param kp          The Key Package to save
+ * @param filename    Name of the file to write the checkpoint to
+ * @return 0 if the checkpoint was written, -1 if an error occurred
+ *
+ * The checkpoint holds the key dictionary (including removed keys, so that
+ * key IDs are preserved), and the state each backend uses to write the keys
+ * (e.g. the DBATS key IDs). Any unresolved keys are resolved first. Values,
+ * and the enabled state of keys, are not saved.
+ *
+ * The checkpoint is written to a temporary file which then replaces the
+ * given file, so an existing checkpoint is never left half-written. The file
+ * is in host byte order, and can only be loaded on a similar host.
+ */
+int timeseries_kp_save(timeseries_kp_t *kp, const char *filename);
+
+/** Load the keys in a checkpoint file into an empty Key Package
+ *
+ * @param kp          The (empty) Key Package to load keys into
+ * @param filename    Name of a file written by timeseries_kp_save
+ * @return 0 if the checkpoint was loaded, -1 if an error occurred
+ *
+ * The file is mapped into memory and the key strings are used in place, so a
+ * large KP is ready to flush without adding and resolving each key again.
+ * Loaded keys have the same IDs they had when the checkpoint was saved, are
+ * enabled, and have a value of 0. If a backend that is enabled for this KP
+ * has no state in the checkpoint, the keys are resolved again at the next
+ * flush.
+ *
+ * If loading fails part-way through, the KP may hold some of the keys, and
+ * should be freed.
+ */
+int timeseries_kp_load(timeseries_kp_t *kp, const char *filename);
+
 /** Get the ID of the given key
  *
  * @param kp            The Key Package to search
@@ -128,12 +419,114 @@ int timeseries_kp_add_key(timeseries_kp_t *kp, const char *key);
  */
 int timeseries_kp_get_key(timeseries_kp_t *kp, const char *key);
 
+/** Get the ID of the given length-delimited key
+ *
+ * @param kp            The Key Package to search
+ * @param key           Pointer to the key name to look for (need not be
+ *                      NUL-terminated)
+ * @param len           Length of the key name
+ * @return the ID of the key (to be used with timeseries_kp_set) if it exists,
+ * -1 otherwise
+ *
+ * This allows keys to be looked up directly from a buffer (e.g. a message
+ * received from the network) without first copying them.
+ */
+int timeseries_kp_get_key_n(timeseries_kp_t *kp, const char *key, size_t len);
+
+/** Get the ID of the given length-delimited key, using a hash that has
+ * already been computed by the caller
+ *
+ * @param kp            The Key Package to search
+ * @param key           Pointer to the key name to look for (need not be
+ *                      NUL-terminated)
+ * @param len           Length of the key name
+ * @param hash          Hash of the key, as returned by timeseries_kp_hash_key
+ * @return the ID of the key (to be used with timeseries_kp_set) if it exists,
+ * -1 otherwise
+ *
+ * This is useful when the same key is looked up in several Key Packages, or
+ * when the hash can be cached alongside the key.
+ *
+ * @warning the hash MUST have been computed using timeseries_kp_hash_key,
+ * otherwise the key will not be found.
+ */
+int timeseries_kp_get_key_hashed(timeseries_kp_t *kp, const char *key,
+                                 size_t len, uint64_t hash);
+
+/** Compute the hash of a key, for use with timeseries_kp_get_key_hashed
+ *
+ * @param key           Pointer to the key name to hash (need not be
+ *                      NUL-terminated)
+ * @param len           Length of the key name
+ * @return the 64 bit hash of the key
+ *
+ * @note the hash value is only stable within a single process (it depends on
+ * the byte order of the host), so it should not be stored persistently.
+ */
+uint64_t timeseries_kp_hash_key(const char *key, size_t len);
+
+/** Get the ID of a tag string (a metric name, tag key or tag value) for use
+ * in the tag sets of tagged keys, interning it if needed
+ *
+ * @param kp            The Key Package to intern the string in
+ * @param str           The tag string (which must not be empty, or contain
+ *                      ';' or '=')
+ * @return the ID of the tag string, -1 if an error occurred
+ *
+ * Tag strings are interned once per KP, and are never removed. Shared KPs
+ * (see TIMESERIES_KP_SHARED) cannot have tagged keys.
+ */
+int timeseries_kp_intern_tag(timeseries_kp_t *kp, const char *str);
+
+/** Add a tagged key (a metric name and a set of tags) to a Key Package
+ *
+ * @param kp            The Key Package to add the key to
+ * @param metric        ID of the metric name (from timeseries_kp_intern_tag)
+ * @param tags          Array of tags_cnt pairs of tag key and tag value IDs
+ *                      (from timeseries_kp_intern_tag), in any order
+ * @param tags_cnt      Number of tags (at most TIMESERIES_KP_TAGS_MAX)
+ * @return the index of the key that was added, -1 if an error occurred
+ *
+ * A tagged key is stored as its (interned) IDs, rather than as a string, so
+ * callers do not need to build a key string for every lookup, and high
+ * cardinality tag values are only stored once. The name of the key is
+ * rendered the first time it is needed (i.e. when the key is first flushed,
+ * or by timeseries_kp_get_key_name), using the Graphite tagged series format
+ * (metric;key=value;key=value, with the tags sorted by string), and is then
+ * kept for later flushes.
+ *
+ * As with timeseries_kp_add_key, the key is always added, even if a key with
+ * the same tag set already exists. Tagged keys can only be found using
+ * timeseries_kp_get_tagged_key, and KPs with tagged keys cannot be saved.
+ */
+int timeseries_kp_add_tagged_key(timeseries_kp_t *kp, uint32_t metric,
+                                 const uint32_t *tags, uint32_t tags_cnt);
+
+/** Get the ID of the tagged key with the given metric name and tag set
+ *
+ * @param kp            The Key Package to search
+ * @param metric        ID of the metric name (from timeseries_kp_intern_tag)
+ * @param tags          Array of tags_cnt pairs of tag key and tag value IDs,
+ *                      in any order
+ * @param tags_cnt      Number of tags
+ * @return the ID of the key (to be used with timeseries_kp_set) if it exists,
+ * -1 otherwise
+ *
+ * The lookup hashes the IDs of the tag set, so no key string is built.
+ */
+int timeseries_kp_get_tagged_key(timeseries_kp_t *kp, uint32_t metric,
+                                 const uint32_t *tags, uint32_t tags_cnt);
+
 /** Get the key name for the given key ID
  *
  * @param kp            The Key Package to search
  * @param key           The key ID to look for
  * @return a borrowed pointer to the key name for the given key ID if it exists,
  * NULL otherwise.
+ *
+ * The name stays valid until the key is removed or the KP is compacted. Keys
+ * are stored prefix-compressed, so the KP keeps a copy of each name from the
+ * first time it is asked for.
  */
 const char *timeseries_kp_get_key_name(timeseries_kp_t *kp, uint32_t key);
 
@@ -161,20 +554,144 @@ void timeseries_kp_enable_key(timeseries_kp_t *kp, uint32_t key);
  */
 uint64_t timeseries_kp_get(timeseries_kp_t *kp, uint32_t key);
 
+/** Get the type of the values stored in a Key Package
+ *
+ * @param kp            Pointer to the KP
+ * @return the value type the KP was initialized with
+ */
+timeseries_kp_value_type_t timeseries_kp_get_value_type(timeseries_kp_t *kp);
+
 /** Set the current value for the given key in a Key Package
  *
  * @param kp            Pointer to the KP to set the value on
  * @param key           Index of the key (as returned by kp_add_key) to
  *                      set the value for
  * @param value         Value to set the key to
+ *
+ * If the key has an aggregation mode (see timeseries_kp_set_agg), the value
+ * is aggregated into the current value instead.
  */
 void timeseries_kp_set(timeseries_kp_t *kp, uint32_t key, uint64_t value);
 
+/** Set the aggregation mode of the given key in a Key Package
+ *
+ * @param kp            Pointer to the KP
+ * @param key           Index of the key (as returned by kp_add_key)
+ * @param agg           How values set for the key are aggregated
+ * @return 0 if the mode was set, -1 if an error occurred
+ *
+ * Once a key has an aggregation mode, each value given to timeseries_kp_set
+ * (and the typed and batched setters) is aggregated into the current value,
+ * which is what the backends see when the KP is flushed. The current value
+ * is reset to the identity of the mode (e.g. the largest possible value for
+ * TIMESERIES_KP_AGG_MIN) when the mode is set. Values are only aggregated per
+ * interval if the KP was created with TIMESERIES_KP_RESET, which resets them
+ * after each flush. Otherwise they keep aggregating across flushes (e.g. a
+ * TIMESERIES_KP_AGG_SUM key holds a running total).
+ *
+ * The identity of TIMESERIES_KP_AGG_MIN and TIMESERIES_KP_AGG_MAX is not a
+ * real value, so they can only be used by KPs created with
+ * TIMESERIES_KP_DISABLE, where keys are only written if they are enabled
+ * (which should be done when they are set).
+ *
+ * The timeseries_kp_add functions add to the current value of keys with a
+ * sum or count mode (so a count key can be counted by more than one), and
+ * aggregate into keys with a min or max mode as if the value had been set.
+ * Values written through shards are aggregated in the same way (see
+ * timeseries_kp_shard_init). Aggregation modes are not saved in checkpoints.
+ */
+int timeseries_kp_set_agg(timeseries_kp_t *kp, uint32_t key,
+                          timeseries_kp_agg_t agg);
+
+/** Get the aggregation mode of the given key in a Key Package
+ *
+ * @param kp            Pointer to the KP
+ * @param key           Index of the key (as returned by kp_add_key)
+ * @return the aggregation mode of the key
+ */
+timeseries_kp_agg_t timeseries_kp_get_agg(timeseries_kp_t *kp, uint32_t key);
+
+/** Set the aggregation mode given to keys that are added to a Key Package
+ *
+ * @param kp            Pointer to the KP
+ * @param agg           Aggregation mode for new keys
+ * @return 0 if the mode was set, -1 if an error occurred
+ *
+ * Existing keys keep their mode (see timeseries_kp_set_agg, which also lists
+ * the modes that each KP can use).
+ */
+int timeseries_kp_set_default_agg(timeseries_kp_t *kp,
+                                  timeseries_kp_agg_t agg);
+
+/** Add to the current value for the given key in a Key Package
+ *
+ * @param kp            Pointer to the KP to update the value in
+ * @param key           Index of the key (as returned by kp_add_key) to
+ *                      add to
+ * @param value         Value to add to the current value of the key
+ *
+ * This is equivalent to (but cheaper than) calling timeseries_kp_set with
+ * the sum of timeseries_kp_get and the value.
+ */
+void timeseries_kp_add(timeseries_kp_t *kp, uint32_t key, uint64_t value);
+
+/**
+ * @name Batched value setters
+ *
+ * Set (or add to) the values of many keys in one call. The values are
+ * converted to the value type of the KP (as timeseries_kp_set does), but the
+ * conversion is chosen once per call rather than once per key, and the range
+ * setters are simple loops over the value column that the compiler can
+ * vectorize.
+ *
+ * The _many functions write values[i] to the key with ID ids[i] (an ID may
+ * appear more than once, in which case the adds accumulate). The _range
+ * functions write values[i] to the key with ID first_id + i.
+ *
+ * @{ */
+
+void timeseries_kp_set_many(timeseries_kp_t *kp, const uint32_t *ids,
+                            const uint64_t *values, uint32_t n);
+void timeseries_kp_add_many(timeseries_kp_t *kp, const uint32_t *ids,
+                            const uint64_t *values, uint32_t n);
+
+void timeseries_kp_set_range(timeseries_kp_t *kp, uint32_t first_id,
+                             const uint64_t *values, uint32_t n);
+void timeseries_kp_add_range(timeseries_kp_t *kp, uint32_t first_id,
+                             const uint64_t *values, uint32_t n);
+
+/** @} */
+
+/**
+ * @name Typed value accessors
+ *
+ * Get and set values in a KP initialized with timeseries_kp_init_typed
+ * without converting them to and from uint64_t. The type of the accessor
+ * must match the type of the KP.
+ *
+ * If the KP is not of the matching type, the behavior is undefined.
+ *
+ * @{ */
+
+uint32_t timeseries_kp_get_u32(timeseries_kp_t *kp, uint32_t key);
+void timeseries_kp_set_u32(timeseries_kp_t *kp, uint32_t key, uint32_t value);
+
+int64_t timeseries_kp_get_i64(timeseries_kp_t *kp, uint32_t key);
+void timeseries_kp_set_i64(timeseries_kp_t *kp, uint32_t key, int64_t value);
+
+double timeseries_kp_get_double(timeseries_kp_t *kp, uint32_t key);
+void timeseries_kp_set_double(timeseries_kp_t *kp, uint32_t key, double value);
+
+/** @} */
+
 /** Force the backends to resolve all keys in the key package (if needed)
  *
  * @param kp            Pointer to the KP to resolve keys for
  * @return 0 if the keys were resolved successfully, -1 otherwise.
  *
+ * Only keys added since the last successful resolve (or flush) are resolved,
+ * so calling this repeatedly as keys are added is cheap.
+ *
  * This can be helpful when creating a key package with a large number
  * of keys and using a backend that is slow to resolve keys
  * (e.g. DBATS). Rather than blocking when performing the first flush,
@@ -193,6 +710,193 @@ int timeseries_kp_resolve(timeseries_kp_t *kp);
  */
 int timeseries_kp_flush(timeseries_kp_t *kp, uint32_t time);
 
+/** Flush the current values in the given Key Package to all enabled backends
+ * from a background thread
+ *
+ * @param kp            Pointer to the KP to flush values for
+ * @param time          The timestamp to associate the values with in the DB
+ * @param cb            Function to call once the values have been written
+ *                      (may be NULL)
+ * @param cb_user       User pointer to pass to the callback
+ * @return 0 if the values were queued for writing, -1 otherwise.
+ *
+ * The current values (and enabled flags) are moved into a snapshot which is
+ * written to the backends by a writer thread owned by the KP, so the caller
+ * can carry on setting values for the next interval immediately. Values are
+ * reset and keys disabled (according to the flags the KP was created with)
+ * just as for timeseries_kp_flush. Any keys added since the last flush are
+ * resolved before this function returns.
+ *
+ * At most timeseries_kp_set_max_snapshots snapshots may be waiting to be
+ * written; if there are already that many, this function blocks until one
+ * has been written. Snapshots are always written in order, and a
+ * synchronous timeseries_kp_flush first waits for all snapshots to be
+ * written.
+ *
+ * Adding keys does not wait for the writer to write a snapshot: at most it
+ * waits for the writer to finish reading one key, if the KI columns need to
+ * grow (timeseries_kp_reserve avoids this). Removing keys and compacting the
+ * KP wait for all outstanding snapshots to be written. Keys expired by an
+ * idle TTL are disabled instead, and removed by a later flush once the
+ * snapshots that may use them have been written (setting or enabling such a
+ * key before then keeps it).
+ */
+int timeseries_kp_flush_async(timeseries_kp_t *kp, uint32_t time,
+                              timeseries_kp_flush_cb_t *cb, void *cb_user);
+
+/** Wait for all outstanding asynchronous flushes of a Key Package to complete
+ *
+ * @param kp            Pointer to the KP to wait for
+ * @return 0 if all asynchronous flushes since the last call succeeded, -1 if
+ * any of them failed
+ */
+int timeseries_kp_flush_wait(timeseries_kp_t *kp);
+
+/** Set the maximum number of asynchronous flush snapshots that may be waiting
+ * to be written
+ *
+ * @param kp            Pointer to the KP to set the limit for
+ * @param max_snapshots Maximum number of snapshots (must be at least 1,
+ *                      defaults to 2)
+ *
+ * Each snapshot holds a copy of the values and enabled flags of the KP, so
+ * this bounds the memory used when the backends cannot keep up.
+ */
+void timeseries_kp_set_max_snapshots(timeseries_kp_t *kp,
+                                     uint32_t max_snapshots);
+
+/** Buffer the values of several intervals in a Key Package
+ *
+ * @param kp            Pointer to the KP to set the window of
+ * @param slots         Number of intervals (time slots) to buffer
+ * @param lag           How far the watermark trails the newest time selected
+ *                      (0 to flush slots only when all slots are in use)
+ * @param cb            Function to call before each slot is flushed (may be
+ *                      NULL)
+ * @param cb_user       User pointer to pass to the callback
+ * @return 0 if the window was set, -1 if an error occurred
+ *
+ * A KP normally holds one value per key, so it must be flushed whenever
+ * values for a new time arrive. With a window, the KP holds a value column
+ * (and enabled flags) for each of up to _slots_ times. Values are written to
+ * the slot chosen by timeseries_kp_select_time, using the usual setters, so
+ * values that arrive out of order are added to the right interval rather
+ * than causing an extra flush.
+ *
+ * A slot is flushed (with its time) once the watermark, which trails the
+ * newest time selected by _lag_, passes it; when a new time is selected and
+ * all slots are in use, the oldest slot is flushed early to make room; or
+ * when timeseries_kp_flush_until is called. Slots without any enabled keys
+ * are not flushed. A window of one slot without a watermark behaves just
+ * like flushing the KP whenever the time changes.
+ *
+ * Each slot costs one value and one bit per key (plus one uint32_t and one
+ * bit per key for sparse KPs). Values are reset and keys disabled according
+ * to the KP flags when each slot is flushed, so a KP that does not set every
+ * enabled key in every interval should be created with TIMESERIES_KP_RESET
+ * (and/or TIMESERIES_KP_DISABLE), otherwise a slot starts each new interval
+ * with the values from the last interval that it held.
+ *
+ * The window must be set after any checkpoint is loaded, and windowed KPs
+ * cannot have shards. They should be flushed with timeseries_kp_flush_until
+ * rather than timeseries_kp_flush.
+ */
+int timeseries_kp_set_window(timeseries_kp_t *kp, uint32_t slots, uint32_t lag,
+                             timeseries_kp_window_cb_t *cb, void *cb_user);
+
+/** Select the time slot that values are written to
+ *
+ * @param kp            Pointer to a windowed KP
+ * @param time          The time of the values that will be written
+ * @return 0 if the slot was selected, 1 if the time is before the watermark
+ * (i.e. its slot has already been flushed, and the values should be
+ * dropped), -1 if an error occurred
+ *
+ * This may flush the slots that the watermark passes, or the oldest slot if
+ * all slots are in use. Selecting the time of the current slot is cheap.
+ */
+int timeseries_kp_select_time(timeseries_kp_t *kp, uint32_t time);
+
+/** Flush all time slots of a windowed KP up to the given time
+ *
+ * @param kp            Pointer to a windowed KP
+ * @param time          Time of the newest slot to flush (UINT32_MAX to
+ *                      flush all slots)
+ * @return 0 if the slots were flushed successfully, -1 otherwise
+ *
+ * Slots are flushed in time order. The watermark is not moved, so values for
+ * the flushed times can still be written (and are flushed again).
+ */
+int timeseries_kp_flush_until(timeseries_kp_t *kp, uint32_t time);
+
+/** Create a value shard for writing to a Key Package from another thread
+ *
+ * @param kp            Pointer to the KP to create a shard for
+ * @param merge         How values in the shard are merged into the KP
+ * @return pointer to the shard created, NULL if an error occurred
+ *
+ * A Key Package can only be used by one thread at a time. To allow several
+ * threads to write values concurrently, each thread should be given its own
+ * shard. Shards share the key dictionary of the KP, but hold their own
+ * values, so writing to a shard requires no locking.
+ *
+ * When the KP is flushed, the values written to each shard since the last
+ * flush are merged into the KP values (in the order that the shards were
+ * created) and the shards are reset. With TIMESERIES_KP_MERGE_SUM, the KP
+ * value becomes the sum of its own value and the shard values; with
+ * TIMESERIES_KP_MERGE_LAST, the value from the last shard that wrote the key
+ * wins. Keys with an aggregation mode other than TIMESERIES_KP_AGG_LAST (see
+ * timeseries_kp_set_agg) ignore the merge mode: values written to a shard are
+ * aggregated by the mode of the key (e.g. a TIMESERIES_KP_AGG_COUNT key counts
+ * the values set through each shard), and the shard aggregates are then added
+ * into sum and count keys, and aggregated into min and max keys. If the KP was
+ * created with TIMESERIES_KP_DISABLE, keys written through a shard are
+ * enabled when they are merged.
+ *
+ * @warning the KP itself is still single-threaded: keys must be added,
+ * removed and looked up, shards created and freed, and the KP flushed by one
+ * thread at a time, and the caller must ensure that no thread is writing to a
+ * shard while the KP is flushed (e.g. by having workers wait at the end of
+ * each interval). Looking up keys concurrently from worker threads is safe as
+ * long as no keys are being added or removed.
+ */
+timeseries_kp_shard_t *timeseries_kp_shard_init(timeseries_kp_t *kp,
+                                                timeseries_kp_merge_t merge);
+
+/** Free a Key Package shard
+ *
+ * @param shard_p       Double pointer to the shard to free
+ *
+ * Any values written to the shard since the last flush are discarded.
+ *
+ * @note shards are freed automatically when their KP is freed
+ */
+void timeseries_kp_shard_free(timeseries_kp_shard_t **shard_p);
+
+/** Set the value for the given key in a Key Package shard
+ *
+ * @param shard         Pointer to the shard to set the value in
+ * @param key           Index of the key (as returned by kp_add_key) to
+ *                      set the value for
+ * @param value         Value to set the key to
+ * @return 0 if the value was set, -1 if the shard could not be grown to hold
+ * the key
+ */
+int timeseries_kp_shard_set(timeseries_kp_shard_t *shard, uint32_t key,
+                            uint64_t value);
+
+/** Add to the value for the given key in a Key Package shard
+ *
+ * @param shard         Pointer to the shard to set the value in
+ * @param key           Index of the key (as returned by kp_add_key) to
+ *                      add to the value of
+ * @param value         Value to add to the shard value of the key
+ * @return 0 if the value was set, -1 if the shard could not be grown to hold
+ * the key
+ */
+int timeseries_kp_shard_add(timeseries_kp_shard_t *shard, uint32_t key,
+                            uint64_t value);
+
 /** Get the number of Keys in the given Key Package
  *
  * @param kp            pointer to a Key Package
@@ -200,6 +904,17 @@ int timeseries_kp_flush(timeseries_kp_t *kp, uint32_t time);
  */
 int timeseries_kp_size(timeseries_kp_t *kp);
 
+/** Get the number of Keys in the given Key Package that have been removed
+ * since it was last compacted
+ *
+ * @param kp            pointer to a Key Package
+ * @return the number of removed keys in the given key package
+ *
+ * Removed keys are still counted by timeseries_kp_size until the KP is
+ * compacted.
+ */
+int timeseries_kp_removed_size(timeseries_kp_t *kp);
+
 /** Get the number of enabled Keys in the given Key Package
  *
  * @param kp            pointer to a Key Package
@@ -57,6 +57,7 @@
 static char *timestamp_str(char *buf, const size_t len)
 {
   struct timeval tv;
+  struct tm tm_buf;
   struct tm *tm;
   int ms;
   time_t t;
@@ -64,7 +65,8 @@ static char *timestamp_str(char *buf, const size_t len)
   buf[0] = '\0';
   gettimeofday_wrap(&tv);
   t = tv.tv_sec;
-  if ((tm = localtime(&t)) == NULL)
+  /* backends may log from worker threads */
+  if ((tm = localtime_r(&t, &tm_buf)) == NULL)
     return buf;
 
   ms = tv.tv_usec / 1000;
@@ -137,6 +137,21 @@ timeseries_backend_t *timeseries_get_backend_by_name(timeseries_t *timeseries,
  */
 timeseries_backend_t **timeseries_get_all_backends(timeseries_t *timeseries);
 
+/** Enable (or disable) concurrent writes to the enabled backends
+ *
+ * @param timeseries    The timeseries object to set the option for
+ * @param enabled       1 to make concurrent writes, 0 to write to each
+ *                      backend in turn (the default)
+ * @return 0 if the option was set successfully, -1 otherwise
+ *
+ * When enabled, a worker thread is started for each backend, and Key Package
+ * flushes (and timeseries_set_single) call all enabled backends at the same
+ * time, so the time taken is that of the slowest backend rather than the sum
+ * of all backends. This only has an effect when more than one backend is
+ * enabled.
+ */
+int timeseries_set_concurrent_backends(timeseries_t *timeseries, int enabled);
+
 /** Write the value for a single key to all enabled backends
  *
  * @param timeseries    Pointer to the timeseries object to write to
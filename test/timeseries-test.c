@@ -0,0 +1,375 @@
+/*
+ * libtimeseries
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012 The Regents of the University of California.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "timeseries.h"
+#include "timeseries_dict_int.h"
+
+/** @file
+ *
+ * @brief Checks for the key dictionary and Key Package checkpoints
+ *
+ * Run by `make check`. Each check prints the line of the first failed
+ * condition, and the program exits with a non-zero status if any check
+ * fails.
+ */
+
+/** The number of keys used by the dictionary checks (enough for many
+    front-coded blocks and removed bitmap words) */
+#define DICT_KEYS_CNT 1000
+
+/** The number of keys used by the checkpoint checks */
+#define CKPT_KEYS_CNT 300
+
+/** Every nth key is removed before compacting or saving */
+#define REMOVE_EVERY 3
+
+/** Fail the current check if the given condition is false */
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "ERROR: %s:%d: check failed: %s\n", __FILE__,            \
+              __LINE__, #cond);                                                \
+      goto err;                                                                \
+    }                                                                          \
+  } while (0)
+
+/** Write the name of the ith generated key into the given buffer */
+static const char *key_name(char *buf, size_t len, uint32_t i)
+{
+  snprintf(buf, len, "test.node%" PRIu32 ".metric%" PRIu32, i / 10, i % 10);
+  return buf;
+}
+
+/** Find a key in a dictionary */
+static int dict_find(timeseries_dict_t *dict, const char *key)
+{
+  size_t len = strlen(key);
+  return timeseries_dict_find(dict, key, len, timeseries_dict_hash(key, len));
+}
+
+/** Check that adding, finding, removing, compacting and freezing keys in a
+    dictionary round-trip */
+static int check_dict(void)
+{
+  timeseries_dict_t *dict = NULL;
+  uint32_t *remap = NULL;
+  const char *key;
+  char buf[64];
+  uint32_t i, new_id = 0;
+  size_t len;
+
+  CHECK((dict = timeseries_dict_init()) != NULL);
+
+  /* keys get dense IDs in insertion order, and can be found and got */
+  for (i = 0; i < DICT_KEYS_CNT; i++) {
+    key = key_name(buf, sizeof(buf), i);
+    len = strlen(key);
+    CHECK(timeseries_dict_add(dict, key, len, timeseries_dict_hash(key, len)) ==
+          (int)i);
+  }
+  CHECK(timeseries_dict_size(dict) == DICT_KEYS_CNT);
+  for (i = 0; i < DICT_KEYS_CNT; i++) {
+    CHECK(dict_find(dict, key_name(buf, sizeof(buf), i)) == (int)i);
+    CHECK((key = timeseries_dict_get(dict, i)) != NULL);
+    CHECK(strcmp(key, key_name(buf, sizeof(buf), i)) == 0);
+  }
+  CHECK(dict_find(dict, "test.missing") == -1);
+
+  /* removed keys are no longer found, but keep their IDs */
+  for (i = 0; i < DICT_KEYS_CNT; i += REMOVE_EVERY) {
+    timeseries_dict_remove(dict, i);
+  }
+  CHECK(timeseries_dict_size(dict) == DICT_KEYS_CNT);
+  for (i = 0; i < DICT_KEYS_CNT; i++) {
+    if (i % REMOVE_EVERY == 0) {
+      CHECK(timeseries_dict_is_removed(dict, i) == 1);
+      CHECK(timeseries_dict_get(dict, i) == NULL);
+      CHECK(dict_find(dict, key_name(buf, sizeof(buf), i)) == -1);
+    } else {
+      CHECK(timeseries_dict_is_removed(dict, i) == 0);
+      CHECK(dict_find(dict, key_name(buf, sizeof(buf), i)) == (int)i);
+    }
+  }
+
+  /* compacting renumbers the live keys in order */
+  CHECK((remap = malloc(sizeof(uint32_t) * DICT_KEYS_CNT)) != NULL);
+  CHECK(timeseries_dict_compact(dict, remap) == 0);
+  for (i = 0; i < DICT_KEYS_CNT; i++) {
+    if (i % REMOVE_EVERY == 0) {
+      CHECK(remap[i] == UINT32_MAX);
+      continue;
+    }
+    CHECK(remap[i] == new_id);
+    CHECK(dict_find(dict, key_name(buf, sizeof(buf), i)) == (int)new_id);
+    CHECK((key = timeseries_dict_get(dict, new_id)) != NULL);
+    CHECK(strcmp(key, key_name(buf, sizeof(buf), i)) == 0);
+    new_id++;
+  }
+  CHECK(timeseries_dict_size(dict) == new_id);
+
+  /* a key added after compacting gets the next ID */
+  key = key_name(buf, sizeof(buf), 0);
+  len = strlen(key);
+  CHECK(timeseries_dict_add(dict, key, len, timeseries_dict_hash(key, len)) ==
+        (int)new_id);
+  new_id++;
+
+  /* a frozen dictionary finds the same keys, and cannot be changed */
+  CHECK(timeseries_dict_freeze(dict) == 0);
+  for (i = 1; i < DICT_KEYS_CNT; i++) {
+    if (i % REMOVE_EVERY != 0) {
+      CHECK(dict_find(dict, key_name(buf, sizeof(buf), i)) == (int)remap[i]);
+    }
+  }
+  CHECK(dict_find(dict, key_name(buf, sizeof(buf), 0)) == (int)new_id - 1);
+  CHECK(dict_find(dict, "test.missing") == -1);
+  CHECK((key = timeseries_dict_get(dict, new_id - 1)) != NULL);
+  CHECK(strcmp(key, key_name(buf, sizeof(buf), 0)) == 0);
+  key = "test.missing";
+  len = strlen(key);
+  CHECK(timeseries_dict_add(dict, key, len, timeseries_dict_hash(key, len)) ==
+        -1);
+  CHECK(timeseries_dict_size(dict) == new_id);
+
+  free(remap);
+  timeseries_dict_free(&dict);
+  return 0;
+
+err:
+  free(remap);
+  timeseries_dict_free(&dict);
+  return -1;
+}
+
+/** Create a Key Package with the null backend enabled */
+static timeseries_kp_t *kp_create(timeseries_t **timeseries)
+{
+  timeseries_backend_t *backend;
+
+  if ((*timeseries = timeseries_init()) == NULL ||
+      (backend = timeseries_get_backend_by_name(*timeseries, "null")) ==
+        NULL ||
+      timeseries_enable_backend(backend, NULL) != 0) {
+    timeseries_free(timeseries);
+    return NULL;
+  }
+  return timeseries_kp_init(*timeseries, 0);
+}
+
+/** Try to load a checkpoint into a fresh Key Package */
+static int kp_load(const char *filename)
+{
+  timeseries_t *timeseries = NULL;
+  timeseries_kp_t *kp;
+  int rc = -1;
+
+  if ((kp = kp_create(&timeseries)) != NULL) {
+    rc = timeseries_kp_load(kp, filename);
+  }
+  timeseries_kp_free(&kp);
+  timeseries_free(&timeseries);
+  return rc;
+}
+
+/** Write the given image to a file */
+static int write_image(const char *filename, const uint8_t *image, size_t len)
+{
+  FILE *fh;
+  int rc = 0;
+
+  if ((fh = fopen(filename, "wb")) == NULL) {
+    return -1;
+  }
+  if (len > 0 && fwrite(image, 1, len, fh) != len) {
+    rc = -1;
+  }
+  if (fclose(fh) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+/** Read a file into a new buffer */
+static uint8_t *read_image(const char *filename, size_t *len)
+{
+  FILE *fh;
+  uint8_t *image = NULL;
+  long size = 0;
+
+  if ((fh = fopen(filename, "rb")) == NULL) {
+    return NULL;
+  }
+  if (fseek(fh, 0, SEEK_END) != 0 || (size = ftell(fh)) <= 0 ||
+      fseek(fh, 0, SEEK_SET) != 0 || (image = malloc(size)) == NULL ||
+      fread(image, 1, size, fh) != (size_t)size) {
+    free(image);
+    image = NULL;
+  }
+  *len = size;
+  fclose(fh);
+  return image;
+}
+
+/** Check that a saved Key Package loads with the same keys, and that a
+    truncated or corrupted checkpoint is rejected */
+static int check_ckpt(const char *filename)
+{
+  timeseries_t *timeseries = NULL;
+  timeseries_kp_t *kp = NULL;
+  uint8_t *image = NULL;
+  uint8_t *bad = NULL;
+  const char *key;
+  char buf[64];
+  size_t len = 0, trunc;
+  uint32_t i;
+
+  /* these offsets are part of the checkpoint format (see timeseries_kp.c):
+     the KP header holds the magic, version and key count, and the
+     dictionary header (which follows it) holds its data length */
+  static const struct {
+    const char *name;
+    size_t offset;
+    size_t len;
+  } corruptions[] = {
+    {"magic", 0, 8},
+    {"version", 8, 4},
+    {"key count", 16, 4},
+    {"dictionary data length", 40, 8},
+  };
+
+  CHECK((kp = kp_create(&timeseries)) != NULL);
+  for (i = 0; i < CKPT_KEYS_CNT; i++) {
+    CHECK(timeseries_kp_add_key(kp, key_name(buf, sizeof(buf), i)) ==
+          (int)i);
+  }
+  for (i = 0; i < CKPT_KEYS_CNT; i += REMOVE_EVERY) {
+    CHECK(timeseries_kp_remove_key(kp, i) == 0);
+  }
+  /* resolve the keys, so that the backend state is saved too */
+  CHECK(timeseries_kp_flush(kp, 0) == 0);
+  CHECK(timeseries_kp_save(kp, filename) == 0);
+  timeseries_kp_free(&kp);
+  timeseries_free(&timeseries);
+
+  /* the loaded keys have the same IDs and names */
+  CHECK((kp = kp_create(&timeseries)) != NULL);
+  CHECK(timeseries_kp_load(kp, filename) == 0);
+  CHECK(timeseries_kp_size(kp) == CKPT_KEYS_CNT);
+  CHECK(timeseries_kp_removed_size(kp) ==
+        (CKPT_KEYS_CNT + REMOVE_EVERY - 1) / REMOVE_EVERY);
+  for (i = 0; i < CKPT_KEYS_CNT; i++) {
+    key_name(buf, sizeof(buf), i);
+    if (i % REMOVE_EVERY == 0) {
+      CHECK(timeseries_kp_get_key(kp, buf) == -1);
+      continue;
+    }
+    CHECK(timeseries_kp_get_key(kp, buf) == (int)i);
+    CHECK((key = timeseries_kp_get_key_name(kp, i)) != NULL);
+    CHECK(strcmp(key, buf) == 0);
+  }
+  CHECK(timeseries_kp_flush(kp, 1) == 0);
+  timeseries_kp_free(&kp);
+  timeseries_free(&timeseries);
+
+  CHECK((image = read_image(filename, &len)) != NULL);
+  CHECK((bad = malloc(len)) != NULL);
+
+  /* every truncated checkpoint is rejected */
+  for (trunc = 0; trunc < len; trunc++) {
+    CHECK(write_image(filename, image, trunc) == 0);
+    if (kp_load(filename) == 0) {
+      fprintf(stderr, "ERROR: checkpoint truncated to %zu bytes was loaded\n",
+              trunc);
+      goto err;
+    }
+  }
+
+  /* as is a checkpoint with a corrupted header */
+  for (i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); i++) {
+    memcpy(bad, image, len);
+    memset(bad + corruptions[i].offset, 0xff, corruptions[i].len);
+    CHECK(write_image(filename, bad, len) == 0);
+    if (kp_load(filename) == 0) {
+      fprintf(stderr, "ERROR: checkpoint with a corrupted %s was loaded\n",
+              corruptions[i].name);
+      goto err;
+    }
+  }
+
+  /* and the original still loads */
+  CHECK(write_image(filename, image, len) == 0);
+  CHECK(kp_load(filename) == 0);
+
+  free(image);
+  free(bad);
+  return 0;
+
+err:
+  timeseries_kp_free(&kp);
+  timeseries_free(&timeseries);
+  free(image);
+  free(bad);
+  return -1;
+}
+
+int main(void)
+{
+  char filename[] = "timeseries-test.XXXXXX";
+  int fd;
+  int rc = 0;
+
+  if ((fd = mkstemp(filename)) < 0) {
+    fprintf(stderr, "ERROR: Could not create a temporary file\n");
+    return -1;
+  }
+  close(fd);
+
+  if (check_dict() != 0) {
+    fprintf(stderr, "FAIL: key dictionary\n");
+    rc = -1;
+  }
+  if (check_ckpt(filename) != 0) {
+    fprintf(stderr, "FAIL: Key Package checkpoints\n");
+    rc = -1;
+  }
+
+  unlink(filename);
+  return rc == 0 ? 0 : 1;
+}
@@ -50,10 +50,15 @@
 
 static timeseries_t *timeseries = NULL;
 static timeseries_kp_t *kp = NULL;
-static int points_pending = 0;
 
 static int batch_mode = 0;
-static int gtime = 0;
+static int window_slots = 1;
+static int window_lag = 0;
+
+static void flush_cb(timeseries_kp_t *flush_kp, uint32_t time, void *user)
+{
+  fprintf(stderr, "Flushing table at time %d\n", time);
+}
 
 static int insert(char *line)
 {
@@ -65,6 +70,7 @@ static int insert(char *line)
   uint32_t time = 0;
 
   int key_id = -1;
+  int rc;
 
   if (line == NULL) {
     return 0;
@@ -114,18 +120,15 @@ static int insert(char *line)
       return -1;
     }
   } else {
-    /* use kp */
-    if (gtime == 0) {
-      gtime = time;
+    /* use kp (this flushes any tables that the new time has passed) */
+    if ((rc = timeseries_kp_select_time(kp, time)) < 0) {
+      fprintf(stderr, "ERROR: Could not flush table\n");
+      return -1;
     }
-    if (gtime != time) {
-      fprintf(stderr, "Flushing table at time %d\n", gtime);
-      if (timeseries_kp_flush(kp, gtime) != 0) {
-        fprintf(stderr, "ERROR: Could not flush table\n");
-        return -1;
-      }
-      gtime = time;
-      points_pending = 0;
+    if (rc == 1) {
+      fprintf(stderr, "WARNING: Dropping late metric for '%s' at time %d\n",
+              key, time);
+      return 0;
     }
 
     /* attempt to get id for this key */
@@ -137,7 +140,6 @@ static int insert(char *line)
     assert(key_id >= 0);
 
     timeseries_kp_set(kp, key_id, value);
-    points_pending++;
   }
 
   return 0;
@@ -173,7 +175,12 @@ static void usage(const char *name)
     "       -b                 Simulate batch insert mode (may be slower)\n"
     "       -f <input-file>    File to read time series data from (default: "
     "stdin)\n"
-    "       -t <ts-backend>    Timeseries backend to use for writing\n",
+    "       -l <lag>           In batch mode, flush a table once a time <lag>\n"
+    "                          seconds newer has been seen (default: only\n"
+    "                          when all tables are in use)\n"
+    "       -t <ts-backend>    Timeseries backend to use for writing\n"
+    "       -w <tables>        In batch mode, number of times to buffer\n"
+    "                          out-of-order data for (default: 1)\n",
     name);
   backend_usage();
 }
@@ -243,7 +250,7 @@ int main(int argc, char **argv)
     return -1;
   }
 
-  while (prevoptind = optind, (opt = getopt(argc, argv, ":bf:t:v?")) >= 0) {
+  while (prevoptind = optind, (opt = getopt(argc, argv, ":bf:l:t:w:v?")) >= 0) {
     if (optind == prevoptind + 2 && (optarg == NULL || *optarg == '-')) {
       opt = ':';
       --optind;
@@ -263,6 +270,10 @@ int main(int argc, char **argv)
       input_file = optarg;
       break;
 
+    case 'l':
+      window_lag = atoi(optarg);
+      break;
+
     case 't':
       if (ts_backend_cnt >= TIMESERIES_BACKEND_ID_LAST - 1) {
         fprintf(stderr, "ERROR: At most %d backends can be enabled\n",
@@ -273,6 +284,10 @@ int main(int argc, char **argv)
       ts_backend[ts_backend_cnt++] = optarg;
       break;
 
+    case 'w':
+      window_slots = atoi(optarg);
+      break;
+
     case '?':
     case 'v':
       fprintf(stderr, "libtimeseries version %d.%d.%d\n",
@@ -312,6 +327,14 @@ int main(int argc, char **argv)
     fprintf(stderr, "INFO: Using batch mode (Key Package)\n");
     if ((kp = timeseries_kp_init(timeseries, 1)) == NULL) {
       fprintf(stderr, "ERROR: Could not create Key Package\n");
+      goto err;
+    }
+    if (window_slots < 1 || window_lag < 0 ||
+        timeseries_kp_set_window(kp, window_slots, window_lag, flush_cb,
+                                 NULL) != 0) {
+      fprintf(stderr, "ERROR: Invalid window (%d tables, lag %d)\n",
+              window_slots, window_lag);
+      goto err;
     }
   }
 
@@ -335,12 +358,9 @@ int main(int argc, char **argv)
     }
   }
 
-  if (batch_mode != 0 && points_pending > 0) {
-    fprintf(stderr, "Flushing final table at time %d\n", gtime);
-    if (timeseries_kp_flush(kp, gtime) != 0) {
-      fprintf(stderr, "ERROR: Could not flush table\n");
-      return -1;
-    }
+  if (batch_mode != 0 && timeseries_kp_flush_until(kp, UINT32_MAX) != 0) {
+    fprintf(stderr, "ERROR: Could not flush table\n");
+    return -1;
   }
 
   /* free the kp */
@@ -116,9 +116,6 @@
 // Timeout for kafka consumer poll in milliseconds.
 #define KAFKA_POLL_TIMEOUT 1 * 1000
 
-// Buffer length to hold key package keys.
-#define KEY_BUF_LEN 1024
-
 // Log levels.  DEBUG is the most verbose and ERROR the most silent.
 #define LOG_LEVEL_ERROR 0
 #define LOG_LEVEL_INFO 1
@@ -130,6 +127,7 @@
 typedef struct tsk_config {
   char *timeseries_backend;
   char *timeseries_dbats_opts;
+  char *timeseries_aggregation;
 
   char *filters[MAX_FILTERS];
   int filter_lens[MAX_FILTERS];
@@ -156,6 +154,16 @@ static timeseries_t *stats_timeseries = NULL;
 static timeseries_kp_t *kp = NULL;
 static timeseries_kp_t *stats_kp = NULL;
 
+// Number of flushes a key may go without being seen before it is dropped from
+// the key package (0 = never drop keys).
+static int key_ttl = 0;
+
+// Number of intervals to buffer out-of-order data for, and how far (in
+// seconds) the flush watermark trails the newest interval (0 = no watermark,
+// intervals are only flushed when all slots are in use).
+static int window_slots = 1;
+static int window_lag = 0;
+
 // Statistics-related variables.
 static char *stats_key_prefix = NULL;
 static int stats_interval = 0;
@@ -212,7 +220,6 @@ char *graphite_safe_node(char *str)
 void inc_stat(const char *stats_key_suffix, const int value)
 {
   int key_id = 0;
-  int old_value = 0;
   char *stats_key = NULL;
 
   assert(value > 0);
@@ -223,8 +230,7 @@ void inc_stat(const char *stats_key_suffix, const int value)
     key_id = timeseries_kp_add_key(stats_kp, stats_key);
   }
 
-  old_value = timeseries_kp_get(stats_kp, key_id);
-  timeseries_kp_set(stats_kp, key_id, value + old_value);
+  timeseries_kp_add(stats_kp, key_id, value);
 
   free(stats_key);
 }
@@ -234,7 +240,7 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
   uint16_t keylen = 0;
   uint64_t value = 0;
   int key_id = 0;
-  char key[KEY_BUF_LEN];
+  const char *key;
   int match;
   int i;
 
@@ -249,9 +255,8 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
     return 1;
   }
 
-  // Get variable-length key.  We have to 0-terminate the key ourselves.
-  memcpy(key, *buf, keylen);
-  key[keylen] = '\0';
+  // Get variable-length key.  It is not 0-terminated, so we use it in place.
+  key = (const char *)*buf;
   *buf += keylen;
   *remain -= keylen;
 
@@ -264,7 +269,7 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
     match = 0;
     for (i = 0; i < cfg->filters_cnt; i++) {
       if (keylen >= cfg->filter_lens[i] &&
-          strncmp(cfg->filters[i], key, cfg->filter_lens[i]) == 0) {
+          memcmp(cfg->filters[i], key, cfg->filter_lens[i]) == 0) {
         match = 1;
         break;
       }
@@ -275,8 +280,8 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
   }
 
   // Write key:val pair to key package.
-  if ((key_id = timeseries_kp_get_key(kp, key)) == -1) {
-    key_id = timeseries_kp_add_key(kp, key);
+  if ((key_id = timeseries_kp_get_key_n(kp, key, keylen)) == -1) {
+    key_id = timeseries_kp_add_key_n(kp, key, keylen);
   } else {
     timeseries_kp_enable_key(kp, key_id);
   }
@@ -286,33 +291,44 @@ int parse_key_value(const tsk_config_t *cfg, uint8_t **buf, ssize_t *remain)
   return 0;
 }
 
+// Called by the key package just before each interval is flushed.
+static void log_flush(timeseries_kp_t *flush_kp, uint32_t time, void *user)
+{
+  LOG_INFO("Flushing key packages at %d with %d keys enabled (%d total).\n",
+           time, timeseries_kp_enabled_size(flush_kp),
+           timeseries_kp_size(flush_kp));
+  inc_stat("flush_cnt", 1);
+  inc_stat("flushed_key_cnt", timeseries_kp_enabled_size(flush_kp));
+}
+
+// Selects the interval that the following values belong to, flushing any
+// intervals that have passed (or all of them, if flush_time is FORCE_FLUSH).
+// Returns 1 if the interval has already been flushed.
 int maybe_flush(const int flush_time)
 {
-  static int current_time = 0;
-
-  if (current_time == 0) {
-    current_time = flush_time;
-  } else if (flush_time == 0 || flush_time != current_time) {
-    assert(!(flush_time == FORCE_FLUSH && current_time == 0));
-
-    if (timeseries_kp_enabled_size(kp) > 0) {
-      LOG_INFO("%sFlushing key packages at %d with %d keys enabled (%d total).\n",
-               (flush_time == FORCE_FLUSH) ? "(Force-)" : "", current_time,
-               timeseries_kp_enabled_size(kp), timeseries_kp_size(kp));
-      inc_stat("flush_cnt", 1);
-      inc_stat("flushed_key_cnt", timeseries_kp_enabled_size(kp));
-
-      if (timeseries_kp_flush(kp, current_time) == -1) {
-        LOG_ERROR("Could not flush key package.\n");
-        return -1;
-      }
+  int rc;
+
+  if (flush_time == FORCE_FLUSH) {
+    rc = timeseries_kp_flush_until(kp, UINT32_MAX);
+  } else {
+    rc = timeseries_kp_select_time(kp, flush_time);
+  }
+  if (rc < 0) {
+    LOG_ERROR("Could not flush key package.\n");
+    return -1;
+  }
 
-      assert(timeseries_kp_enabled_size(kp) == 0);
+  // Reclaim the IDs of expired keys once they make up half the package.
+  if (timeseries_kp_removed_size(kp) > timeseries_kp_size(kp) / 2) {
+    LOG_DEBUG("Compacting key package (%d of %d keys removed).\n",
+              timeseries_kp_removed_size(kp), timeseries_kp_size(kp));
+    if (timeseries_kp_compact(kp) != 0) {
+      LOG_ERROR("Could not compact key package.\n");
+      return -1;
     }
-    current_time = flush_time;
   }
 
-  return 0;
+  return rc;
 }
 
 static void maybe_flush_stats()
@@ -336,6 +352,7 @@ int handle_message(const rd_kafka_message_t *rkmessage, const tsk_config_t *cfg)
   uint16_t chanlen = 0;
   uint8_t *buf = rkmessage->payload;
   ssize_t remain, len;
+  int rc;
   remain = len = rkmessage->len;
 
   if (len < HEADER_LEN) {
@@ -381,12 +398,19 @@ int handle_message(const rd_kafka_message_t *rkmessage, const tsk_config_t *cfg)
   buf += chanlen;
   remain -= chanlen;
 
-  if (maybe_flush(time) != 0) {
+  if ((rc = maybe_flush(time)) < 0) {
     return -1;
   }
   inc_stat("messages_cnt", 1);
   inc_stat("messages_bytes", len);
 
+  // The watermark has already passed this interval, so drop the message.
+  if (rc == 1) {
+    LOG_DEBUG("Dropping late message for %" PRIu32 ".\n", time);
+    inc_stat("late_messages_cnt", 1);
+    return 0;
+  }
+
   while (remain > 0) {
     if (parse_key_value(cfg, &buf, &remain) != 0) {
       // this is an error, but not a fatal one
@@ -467,9 +491,29 @@ error:
   return NULL;
 }
 
+int parse_aggregation(const char *name, timeseries_kp_agg_t *agg)
+{
+  if (strcmp(name, "last") == 0) {
+    *agg = TIMESERIES_KP_AGG_LAST;
+  } else if (strcmp(name, "sum") == 0) {
+    *agg = TIMESERIES_KP_AGG_SUM;
+  } else if (strcmp(name, "min") == 0) {
+    *agg = TIMESERIES_KP_AGG_MIN;
+  } else if (strcmp(name, "max") == 0) {
+    *agg = TIMESERIES_KP_AGG_MAX;
+  } else if (strcmp(name, "count") == 0) {
+    *agg = TIMESERIES_KP_AGG_COUNT;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
 int init_timeseries(const tsk_config_t *cfg)
 {
   timeseries_backend_t *backend = NULL;
+  timeseries_kp_agg_t agg;
+  int kp_flags = TIMESERIES_KP_DISABLE | TIMESERIES_KP_SPARSE;
 
   LOG_INFO("Initializing timeseries.\n");
 
@@ -491,11 +535,44 @@ int init_timeseries(const tsk_config_t *cfg)
     return 1;
   }
 
-  if ((kp = timeseries_kp_init(timeseries, TIMESERIES_KP_DISABLE)) == NULL) {
+  // Aggregate values that arrive for the same key within an interval (so
+  // each interval must start again from the identity of the mode).
+  if (cfg->timeseries_aggregation != NULL) {
+    if (parse_aggregation(cfg->timeseries_aggregation, &agg) != 0) {
+      LOG_ERROR("Invalid timeseries aggregation \"%s\".\n",
+                cfg->timeseries_aggregation);
+      return 1;
+    }
+    kp_flags |= TIMESERIES_KP_RESET;
+  }
+
+  /* only a small fraction of the known keys are set in each interval */
+  if ((kp = timeseries_kp_init(timeseries, kp_flags)) == NULL) {
     LOG_ERROR("Could not create key packages.\n");
     return 1;
   }
 
+  if (key_ttl > 0 && timeseries_kp_set_idle_ttl(kp, key_ttl) != 0) {
+    LOG_ERROR("Could not set key TTL.\n");
+    return 1;
+  }
+
+  // Buffer interleaved partitions so they don't each force a flush.
+  if (window_slots < 1 || window_lag < 0 ||
+      timeseries_kp_set_window(kp, window_slots, window_lag, log_flush,
+                               NULL) != 0) {
+    LOG_ERROR("Invalid timeseries window (%d slots, lag %d).\n", window_slots,
+              window_lag);
+    return 1;
+  }
+
+  if (cfg->timeseries_aggregation != NULL &&
+      timeseries_kp_set_default_agg(kp, agg) != 0) {
+    LOG_ERROR("Could not set timeseries aggregation \"%s\".\n",
+              cfg->timeseries_aggregation);
+    return 1;
+  }
+
   return 0;
 }
 
@@ -678,6 +755,14 @@ tsk_config_t *parse_config_file(const char *filename)
           textp = &(tsk_cfg->timeseries_backend);
         } else if (strcmp(tk, "timeseries-dbats-opts") == 0) {
           textp = &(tsk_cfg->timeseries_dbats_opts);
+        } else if (strcmp(tk, "key-ttl") == 0) {
+          intp = &key_ttl;
+        } else if (strcmp(tk, "timeseries-aggregation") == 0) {
+          textp = &(tsk_cfg->timeseries_aggregation);
+        } else if (strcmp(tk, "timeseries-window-slots") == 0) {
+          intp = &window_slots;
+        } else if (strcmp(tk, "timeseries-window-lag") == 0) {
+          intp = &window_lag;
           // Kafka section.
         } else if (strcmp(tk, "kafka-brokers") == 0) {
           textp = &(tsk_cfg->kafka_brokers);
@@ -782,6 +867,7 @@ void destroy_tsk_config(tsk_config_t *c)
 
   free(c->timeseries_backend);
   free(c->timeseries_dbats_opts);
+  free(c->timeseries_aggregation);
 
   free(c->kafka_brokers);
   free(c->kafka_topic_prefix);